@@ -8,12 +8,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <io/thread.h>
 #include <kcf/archive.h>
 
+#include "walk.h"
+
 char *Program = "KCF";
 
-static int pack(int argc, char **argv);
+enum pack_mode {
+	PACK_CREATE,
+	PACK_APPEND,
+	PACK_UPDATE,
+};
+
+static int pack(int argc, char **argv, enum pack_mode Mode);
 static int unpack(int argc, char **argv);
+static int test(int argc, char **argv);
+static int scan(int argc, char **argv);
+static int repair(int argc, char **argv);
+static int delete_files(int argc, char **argv);
+static int compact(int argc, char **argv);
 
 static int help(void)
 {
@@ -22,15 +46,222 @@ static int help(void)
 	puts("");
 	puts("Usage: ");
 	printf("  %s cmd archive [input1 input2 ... inputN]\n", Program);
+	printf("  %s c [-c] [-d] [-D] [-A] [-z level] [-f size] [-j threads] "
+	       "[-b size] [-s size] [-v size] [-R percent] [-o order] "
+	       "[-w threads] archive [input1 ... inputN]\n",
+	       Program);
+	printf("  %s a [-c] [-d] [-D] [-A] [-z level] [-f size] [-j threads] "
+	       "[-b size] [-s size] [-R percent] [-o order] [-w threads] "
+	       "archive [input1 ... inputN]\n",
+	       Program);
+	printf("  %s u [-c] [-d] [-D] [-A] [-z level] [-f size] [-j threads] "
+	       "[-b size] [-s size] [-R percent] [-o order] [-w threads] "
+	       "archive [input1 ... inputN]\n",
+	       Program);
+	printf("  %s x [-r] [-p] [-j threads] archive\n", Program);
+	printf("  %s t [-p] [-j threads] archive\n", Program);
+	printf("  %s d archive name1 [name2 ... nameN]\n", Program);
+	printf("  %s compact archive\n", Program);
+	puts("");
+	puts("Options:");
+	puts("    -A       write archive on a background thread while files");
+	puts("             are read and compressed");
+	puts("    -b size  add checksums of blocks of given size to large files");
+	puts("    -c       store CRC32 of files; on update, files of the same");
+	puts("             size having one are compared by it, not by time");
+	puts("    -d       store files repeating earlier ones, hard links");
+	puts("             included, as links to them (not with -v)");
+	puts("    -D       write archive with O_DIRECT, not keeping it in");
+	puts("             the page cache");
+	puts("    -f size  compress frames of given size (64k to 64M, 1M by");
+	puts("             default), ranges of files are read frame by frame");
+	puts("    -j n     compress or unpack frames of files with n threads,");
+	puts("             extract volumes of multi-volume archive or test");
+	puts("             files having block checksums with n threads");
+	puts("    -o order pack files of directories sorted by name (name,");
+	puts("             by default) or in the order they are found (found)");
+	puts("    -p       read archive ahead on a background thread while");
+	puts("             files are extracted or tested one by one");
+	puts("    -r       recover files after damaged places of archive");
+	puts("    -R n     add recovery record able to rebuild n% of archive");
+	puts("    -s size  make solid blocks of given size (e.g. 16M)");
+	puts("    -v size  split archive into volumes of given size, named");
+	puts("             archive.001, archive.002 and so on after the first");
+	puts("    -w n     read directories with n threads (8 by default)");
+	puts("    -z n     compress files with deflate at level n (1 to 9)");
 	puts("");
 	puts("Commands:");
-	puts("    c        adds files into archive");
+	puts("    c        adds files and directories with all in them into");
+	puts("             archive");
+	puts("    a        adds files at the end of existing archive");
+	puts("    u        repacks files of archive changed since, adds new");
+	puts("             ones and copies the rest as it is");
 	puts("    x        extracts archive");
+	puts("    t        tests files of archive");
+	puts("    d        marks files of archive deleted");
+	puts("    compact  rewrites archive without deleted files");
+	puts("    scan     lists all archives found inside of a file");
+	puts("    repair   rebuilds damaged archive from its recovery record");
 	puts("");
 
 	return 0;
 }
 
+/* Parses sizes like 4096, 64k, 16M or 1G */
+static bool parse_size(const char *text, uint64_t *size)
+{
+	char *end;
+	unsigned long long value;
+
+	value = strtoull(text, &end, 10);
+	if (end == text)
+		return false;
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		value <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		value <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		value <<= 10;
+		end++;
+		break;
+	}
+
+	if (*end != '\0')
+		return false;
+
+	*size = value;
+	return true;
+}
+
+/* Volumes after the first one are named archive.001, archive.002... */
+static IO *open_volume(void *Context, uint32_t Number, bool ForWriting)
+{
+	char Name[4096];
+
+	/* Another stream of the first volume, for threads reading at once */
+	if (Number == 0)
+		return ForWriting ? NULL : IO_open_cfile(Context, "rb");
+
+	if (snprintf(Name, sizeof(Name), "%s.%03u", (char *)Context,
+	             (unsigned)Number) >= (int)sizeof(Name))
+		return NULL;
+
+	if (ForWriting)
+		printf("Creating volume %s...\n", Name);
+
+	return IO_open_cfile(Name, ForWriting ? "w+b" : "rb");
+}
+
+struct parallel_extract {
+	IO_MUTEX Lock;
+	int Failed;
+};
+
+/* Called by several threads at once */
+static void make_dir(const char *path)
+{
+#ifdef _WIN32
+	_mkdir(path);
+#else
+	mkdir(path, 0777);
+#endif
+}
+
+/* Makes the directories the path goes through, if they aren't there */
+static void make_parents(const char *path)
+{
+	char *Copy = strdup(path), *p;
+
+	if (!Copy)
+		return;
+
+	for (p = Copy + 1; *p; p++) {
+#ifdef _WIN32
+		if (*p != '/' && *p != '\\')
+			continue;
+#else
+		if (*p != '/')
+			continue;
+#endif
+		*p = '\0';
+		make_dir(Copy);
+		*p = '/';
+	}
+
+	free(Copy);
+}
+
+/* Files of directories not extracted as such get them on the way */
+static IO *create_file(const char *path)
+{
+	IO *f = IO_open_cfile(path, "wb");
+
+	if (!f) {
+		make_parents(path);
+		f = IO_open_cfile(path, "wb");
+	}
+
+	return f;
+}
+
+static void extract_directory(const char *path)
+{
+	printf("Creating directory %s...\n", path);
+	make_parents(path);
+	make_dir(path);
+}
+
+static IO *open_output(void *Context, const struct KcfFileInfo *Info)
+{
+	struct parallel_extract *Extract = Context;
+	IO *out_file;
+
+	if (Info->FileType == KCF_FILE_DIRECTORY) {
+		extract_directory(Info->FileName);
+		return NULL;
+	}
+
+	printf("Extracting file %s...\n", Info->FileName);
+	out_file = create_file(Info->FileName);
+	if (!out_file) {
+		printf("%s: failed to create file %s\n", Program,
+		       Info->FileName);
+		IO_mutex_lock(&Extract->Lock);
+		Extract->Failed++;
+		IO_mutex_unlock(&Extract->Lock);
+	}
+
+	return out_file;
+}
+
+static int unpack_parallel(IO *in_file, char *ArchiveName, int Threads)
+{
+	struct parallel_extract Extract = {0};
+	KCFERROR Error;
+
+	if (IO_mutex_init(&Extract.Lock) < 0) {
+		printf("%s: out of memory\n", Program);
+		return 1;
+	}
+
+	puts("Unpacking files...");
+	Error = KCF_extract_volumes_parallel(in_file, open_volume, ArchiveName,
+	                                     open_output, &Extract, Threads);
+	if (Error)
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+
+	IO_mutex_destroy(&Extract.Lock);
+	return Error || Extract.Failed ? 1 : 0;
+}
+
 static int invalid_command(char *cmd)
 {
 	printf("%s: %s: invalid command\n", Program, cmd);
@@ -57,12 +288,26 @@ int main(int argc, char **argv)
 	if (Command[1] == '\0') {
 		switch (Command[0]) {
 		case 'c':
-			return pack(argc, argv);
+			return pack(argc, argv, PACK_CREATE);
+		case 'a':
+			return pack(argc, argv, PACK_APPEND);
+		case 'u':
+			return pack(argc, argv, PACK_UPDATE);
 		case 'x':
 			return unpack(argc, argv);
+		case 't':
+			return test(argc, argv);
+		case 'd':
+			return delete_files(argc, argv);
 		default:
 			return invalid_command(Command);
 		}
+	} else if (strcmp(Command, "scan") == 0) {
+		return scan(argc, argv);
+	} else if (strcmp(Command, "repair") == 0) {
+		return repair(argc, argv);
+	} else if (strcmp(Command, "compact") == 0) {
+		return compact(argc, argv);
 	} else {
 		return invalid_command(Command);
 	}
@@ -70,22 +315,210 @@ int main(int argc, char **argv)
 	return 1;
 }
 
-static KCFERROR pack_file(KCF *archive, char *path)
+/* Files up to that size are packed in batches */
+#define BATCH_FILE_LIMIT 65536
+#define BATCH_MAX_FILES  1024
+#define BATCH_MAX_BYTES  4194304L
+
+struct batch {
+	struct KcfBatchEntry Entries[BATCH_MAX_FILES];
+	size_t Count;
+	size_t Bytes;
+};
+
+static void clear_batch(struct batch *Batch)
+{
+	size_t i;
+
+	for (i = 0; i < Batch->Count; i++) {
+		free((void *)Batch->Entries[i].Data);
+		free(Batch->Entries[i].Info.FileName);
+	}
+	Batch->Count = 0;
+	Batch->Bytes = 0;
+}
+
+static KCFERROR flush_batch(KCF *archive, struct batch *Batch)
+{
+	KCFERROR Error;
+
+	Error = KCF_add_files_batch(archive, Batch->Entries, Batch->Count);
+	clear_batch(Batch);
+
+	return Error;
+}
+
+static KCFERROR batch_file(KCF *archive, struct batch *Batch, IO *f,
+                           const struct KcfFileInfo *info, int64_t file_size)
+{
+	struct KcfBatchEntry *Entry;
+	uint8_t *data = NULL;
+	char *name;
+	KCFERROR Error;
+
+	if (Batch->Count == BATCH_MAX_FILES ||
+	    Batch->Bytes + file_size > BATCH_MAX_BYTES) {
+		if ((Error = flush_batch(archive, Batch)))
+			return Error;
+	}
+
+	/* Names found in directories don't live as long as the batch */
+	name = strdup(info->FileName);
+	if (!name)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	if (file_size > 0) {
+		data = malloc(file_size);
+		if (!data) {
+			free(name);
+			return KCF_ERROR_OUT_OF_MEMORY;
+		}
+		if (IO_read(f, data, file_size) != file_size) {
+			free(data);
+			free(name);
+			return KCF_ERROR_READ;
+		}
+	}
+
+	Entry = &Batch->Entries[Batch->Count++];
+	memset(Entry, 0, sizeof(*Entry));
+	Entry->Info          = *info;
+	Entry->Info.FileName = name;
+	Entry->Data          = data;
+	Entry->Size          = file_size;
+	Batch->Bytes += file_size;
+
+	return KCF_ERROR_OK;
+}
+
+/* Files with several hard links, packed under their first name */
+struct inode_entry {
+	uint64_t Device;
+	uint64_t Inode;
+	uint64_t HeaderOffset;
+	bool IsUsed;
+	bool IsPacked;
+};
+
+struct inode_table {
+	struct inode_entry *Entries;
+	size_t Count;
+	size_t Capacity;
+};
+
+static size_t inode_slot(struct inode_table *Table, uint64_t Device,
+                         uint64_t Inode)
+{
+	size_t i = (size_t)((Inode * 0x9E3779B97F4A7C15ULL) ^ Device) &
+	           (Table->Capacity - 1);
+
+	while (Table->Entries[i].IsUsed &&
+	       (Table->Entries[i].Device != Device ||
+	        Table->Entries[i].Inode != Inode))
+		i = (i + 1) & (Table->Capacity - 1);
+
+	return i;
+}
+
+/* Returns the entry of the file, a new one if it hasn't been seen */
+static struct inode_entry *find_inode(struct inode_table *Table,
+                                      uint64_t Device, uint64_t Inode)
+{
+	struct inode_entry *Old = Table->Entries, *Entry;
+	size_t OldCapacity      = Table->Capacity, i;
+
+	if (2 * (Table->Count + 1) > Table->Capacity) {
+		Table->Capacity = OldCapacity ? 2 * OldCapacity : 256;
+		Table->Entries  = calloc(Table->Capacity, sizeof(*Entry));
+		if (!Table->Entries) {
+			Table->Entries  = Old;
+			Table->Capacity = OldCapacity;
+			return NULL;
+		}
+
+		for (i = 0; i < OldCapacity; i++)
+			if (Old[i].IsUsed)
+				Table->Entries[inode_slot(Table, Old[i].Device,
+				                          Old[i].Inode)] = Old[i];
+		free(Old);
+	}
+
+	Entry = &Table->Entries[inode_slot(Table, Device, Inode)];
+	if (!Entry->IsUsed) {
+		Entry->Device = Device;
+		Entry->Inode  = Inode;
+		Entry->IsUsed = true;
+		Table->Count++;
+	}
+
+	return Entry;
+}
+
+/* Entry of a regular file having other hard links, NULL for the rest */
+static struct inode_entry *hard_link(struct inode_table *Inodes,
+                                     const struct walk_entry *File)
+{
+	if (Inodes && !File->IsDirectory && File->Links > 1)
+		return find_inode(Inodes, File->Device, File->Inode);
+	return NULL;
+}
+
+static KCFERROR pack_file(KCF *archive, struct batch *Batch,
+                          struct inode_table *Inodes,
+                          const struct walk_entry *File)
 {
 	struct KcfFileInfo info = {0};
+	struct inode_entry *Link;
+	char *path = File->Path;
 	IO *f;
-	uint8_t buffer[4096];
-	size_t to_read, n_read;
 	int64_t file_size;
 	KCFERROR Error;
 
+	/* Compared by the next update */
+	info.FileName     = path;
+	info.HasTimeStamp = true;
+	info.TimeStamp    = File->Time;
+
+	if (File->IsDirectory) {
+		info.FileType = KCF_FILE_DIRECTORY;
+		return batch_file(archive, Batch, NULL, &info, 0);
+	}
+
+	/* Other names of a file packed before aren't read at all */
+	Link = hard_link(Inodes, File);
+	if (Link && Link->IsPacked) {
+		if ((Error = flush_batch(archive, Batch)))
+			return Error;
+
+		info.FileType = KCF_FILE_HARD_LINK;
+		Error = KCF_add_link(archive, &info, Link->HeaderOffset);
+		if (Error != KCF_ERROR_FILE_NOT_FOUND)
+			return Error;
+	}
+
+	info.FileType = KCF_FILE_REGULAR;
+
 	f = IO_open_cfile(path, "rb");
 	if (!f) {
 		return KCF_ERROR_FILE_NOT_FOUND;
 	}
 
-	info.FileType = KCF_FILE_REGULAR;
-	info.FileName = path;
+	file_size = IO_seek(f, 0, IO_SEEK_END);
+	if (file_size < 0 || IO_seek(f, 0, IO_SEEK_SET) < 0) {
+		Error = KCF_ERROR_READ;
+		goto cleanup;
+	}
+
+	/* Where the header of a batched file goes is not known here */
+	if (file_size <= BATCH_FILE_LIMIT && !Link) {
+		Error = batch_file(archive, Batch, f, &info, file_size);
+		goto cleanup;
+	}
+
+	/* Keep the order of files */
+	if ((Error = flush_batch(archive, Batch)))
+		goto cleanup;
+
 	info.HasUnpackedSize = true;
 	if (file_size > 2147483647L)
 		info.HasUnpackedSize8 = true;
@@ -100,95 +533,1260 @@ static KCFERROR pack_file(KCF *archive, char *path)
 	if ((Error = KCF_end_file(archive)))
 		goto cleanup;
 
+	if (Link && !Link->IsPacked &&
+	    KCF_get_file_offset(archive, &Link->HeaderOffset) == KCF_ERROR_OK)
+		Link->IsPacked = true;
+
 cleanup:
 	IO_close(f);
 	return Error;
 }
 
-static int pack(int argc, char **argv)
+/* How directories given to pack are gone through */
+struct walk_options {
+	enum walk_order Order;
+	int Threads;
+};
+
+/* Returns false to stop, Path of Entry is freed after the call */
+typedef bool (*entry_handler)(void *Context, struct walk_entry *Entry);
+
+/*
+ * Calls Handler for every input and, for directories, for everything
+ * under them. Returns false if Handler does, or if something can't be
+ * found or read.
+ */
+static bool for_each_entry(char **Inputs, int Count,
+                           const struct walk_options *Options,
+                           entry_handler Handler, void *Context)
 {
-	char *OutputName, *InputName;
-	IO *out_file;
-	KCF *archive;
+	struct walk_entry Entry;
+	struct walker *Walker;
+	bool result = true;
+	size_t Length;
+	int i;
+
+	for (i = 0; result && i < Count; i++) {
+		/* "dir/" is stored as "dir" */
+		Length = strlen(Inputs[i]);
+		while (Length > 1 && Inputs[i][Length - 1] == '/')
+			Inputs[i][--Length] = '\0';
+
+		if (!walk_stat(Inputs[i], &Entry)) {
+			printf("%s: failed to pack file %s: %s\n", Program,
+			       Inputs[i],
+			       kcf_error_string(KCF_ERROR_FILE_NOT_FOUND));
+			return false;
+		}
+		result = Handler(Context, &Entry);
+		if (!result || !Entry.IsDirectory)
+			continue;
+
+		Walker = walk_start(Inputs[i], Options->Threads, Options->Order);
+		if (!Walker) {
+			printf("%s: failed to read directory %s\n", Program,
+			       Inputs[i]);
+			return false;
+		}
+		while (result && walk_next(Walker, &Entry)) {
+			result = Handler(Context, &Entry);
+			free(Entry.Path);
+		}
+		if (walk_finish(Walker))
+			result = false;
+	}
+
+	return result;
+}
+
+struct pack_context {
+	KCF *Archive;
+	struct batch *Batch;
+	struct inode_table *Inodes;
+};
+
+static bool pack_entry(void *Context, struct walk_entry *Entry)
+{
+	struct pack_context *Pack = Context;
 	KCFERROR Error;
 
-	OutputName = argv[0];
-	argc--;
-	argv++;
+	printf("Packing %s %s...\n", Entry->IsDirectory ? "directory" : "file",
+	       Entry->Path);
+	Error = pack_file(Pack->Archive, Pack->Batch, Pack->Inodes, Entry);
+	if (Error)
+		printf("%s: failed to pack file %s: %s\n", Program,
+		       Entry->Path, kcf_error_string(Error));
+	return !Error;
+}
 
-	out_file = IO_open_cfile(OutputName, "w+b");
-	if (!out_file) {
-		printf("%s: failed to create archive %s: %s\n", Program,
-		       OutputName, kcf_error_string(Error));
-		return 1;
+/* Files to update, collected before anything is written */
+struct entry_list {
+	struct walk_entry *Entries;
+	size_t Count;
+	size_t Capacity;
+};
+
+static bool collect_entry(void *Context, struct walk_entry *Entry)
+{
+	struct entry_list *List = Context;
+	struct walk_entry *Entries;
+	size_t Capacity;
+
+	if (List->Count == List->Capacity) {
+		Capacity = List->Capacity ? 2 * List->Capacity : 256;
+		Entries  = realloc(List->Entries, Capacity * sizeof(*Entries));
+		if (!Entries) {
+			printf("%s: out of memory\n", Program);
+			return false;
+		}
+		List->Entries  = Entries;
+		List->Capacity = Capacity;
 	}
 
-	Error = KCF_create(out_file, &archive);
-	if (Error) {
-		printf("%s: failed to create archive %s: %s\n", Program,
-		       OutputName, kcf_error_string(Error));
-		return 1;
+	List->Entries[List->Count]      = *Entry;
+	List->Entries[List->Count].Path = strdup(Entry->Path);
+	if (!List->Entries[List->Count].Path) {
+		printf("%s: out of memory\n", Program);
+		return false;
 	}
+	List->Count++;
+	return true;
+}
 
-	printf("Creating archive %s...\n", OutputName);
+static void clear_entries(struct entry_list *List)
+{
+	size_t i;
 
-	KCF_init_archive(archive);
+	for (i = 0; i < List->Count; i++)
+		free(List->Entries[i].Path);
+	free(List->Entries);
+	memset(List, 0, sizeof(*List));
+}
 
-	for (InputName = *argv; InputName; argv++, argc--, InputName = *argv) {
-		printf("Packing file %s...\n", InputName);
-		Error = pack_file(archive, InputName);
-		if (Error) {
-			printf("%s: failed to pack file %s: %s\n", Program,
-			       InputName, kcf_error_string(Error));
-			return 1;
+/* Files of the archive being updated, by name and then by offset */
+struct member {
+	struct KcfFileInfo Info;
+	uint64_t HeaderOffset;
+};
+
+struct member_list {
+	struct member *Entries;
+	size_t Count;
+	size_t Capacity;
+};
+
+static void clear_members(struct member_list *List)
+{
+	size_t i;
+
+	for (i = 0; i < List->Count; i++)
+		file_info_clear(&List->Entries[i].Info);
+	free(List->Entries);
+	memset(List, 0, sizeof(*List));
+}
+
+static int compare_members(const void *a, const void *b)
+{
+	const struct member *x = a, *y = b;
+	int result = strcmp(x->Info.FileName, y->Info.FileName);
+
+	if (result)
+		return result;
+	return (x->HeaderOffset > y->HeaderOffset) -
+	       (x->HeaderOffset < y->HeaderOffset);
+}
+
+static KCFERROR read_members(IO *file, struct member_list *List)
+{
+	struct member *Entries;
+	KCF *archive;
+	KCFERROR Error;
+	size_t Capacity;
+
+	Error = KCF_create(file, &archive);
+	if (Error)
+		return Error;
+
+	Error = KCF_open_archive(archive);
+	while (!Error) {
+		if (List->Count == List->Capacity) {
+			Capacity = List->Capacity ? 2 * List->Capacity : 256;
+			Entries  = realloc(List->Entries,
+			                   Capacity * sizeof(*Entries));
+			if (!Entries) {
+				Error = KCF_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			List->Entries  = Entries;
+			List->Capacity = Capacity;
 		}
+
+		Entries = &List->Entries[List->Count];
+		memset(Entries, 0, sizeof(*Entries));
+		Error = KCF_get_current_file_info(archive, &Entries->Info);
+		if (Error)
+			break;
+		List->Count++;
+
+		Error = KCF_get_file_offset(archive, &Entries->HeaderOffset);
+		if (!Error)
+			Error = KCF_skip_file(archive);
 	}
 
 	KCF_close(archive);
+	if (Error != KCF_ERROR_EOF)
+		return Error;
 
-	return 0;
+	qsort(List->Entries, List->Count, sizeof(struct member),
+	      compare_members);
+	return KCF_ERROR_OK;
 }
 
-static int unpack(int argc, char **argv)
+/* First member having the name, NULL if there is none */
+static struct member *first_member(struct member_list *List,
+                                   const char *Name)
+{
+	size_t Low = 0, High = List->Count, Middle;
+
+	while (Low < High) {
+		Middle = Low + (High - Low) / 2;
+		if (strcmp(List->Entries[Middle].Info.FileName, Name) < 0)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (Low == List->Count ||
+	    strcmp(List->Entries[Low].Info.FileName, Name) != 0)
+		return NULL;
+	return &List->Entries[Low];
+}
+
+#define CRC_BUFFER_SIZE 1048576
+
+static bool file_crc(const char *path, uint32_t *CRC)
+{
+	uint8_t *Buffer;
+	int64_t BytesRead;
+	IO *f;
+
+	f = IO_open_cfile(path, "rb");
+	if (!f)
+		return false;
+	Buffer = malloc(CRC_BUFFER_SIZE);
+
+	*CRC = 0;
+	while (Buffer && (BytesRead = IO_read(f, Buffer, CRC_BUFFER_SIZE)) > 0)
+		*CRC = KCF_file_crc32(*CRC, Buffer, (size_t)BytesRead);
+
+	IO_close(f);
+	free(Buffer);
+	return Buffer && BytesRead == 0;
+}
+
+static bool is_unchanged(const struct KcfFileInfo *Info,
+                         const struct walk_entry *File, bool CompareCRC)
+{
+	uint32_t CRC;
+
+	/* Time of a directory changes with what is in it */
+	if (File->IsDirectory || Info->FileType == KCF_FILE_DIRECTORY)
+		return File->IsDirectory &&
+		       Info->FileType == KCF_FILE_DIRECTORY;
+
+	if (!Info->HasUnpackedSize || Info->UnpackedSize != File->Size)
+		return false;
+
+	/* Files touched without changing their data aren't repacked */
+	if (CompareCRC && Info->HasFileCRC32)
+		return file_crc(File->Path, &CRC) && CRC == Info->FileCRC32;
+
+	return Info->HasTimeStamp && Info->TimeStamp == File->Time;
+}
+
+/*
+ * Leaves in Files only those which are new or have changed since they
+ * were packed, the headers of all their copies in the archive go to
+ * Excluded.
+ */
+static void find_changes(struct member_list *Members,
+                         struct entry_list *Files, bool CompareCRC,
+                         uint64_t *Excluded, size_t *ExcludedCount)
+{
+	struct member *Member, *Last, *End = Members->Entries + Members->Count;
+	struct walk_entry *File;
+	size_t i, Changed = 0;
+
+	for (i = 0; i < Files->Count; i++) {
+		File   = &Files->Entries[i];
+		Member = first_member(Members, File->Path);
+		Last   = Member;
+		while (Last && Last + 1 < End &&
+		       strcmp(Last[1].Info.FileName, File->Path) == 0)
+			Last++;
+
+		/* The copy added last is the one extracted over the others */
+		if (Last && is_unchanged(&Last->Info, File, CompareCRC)) {
+			free(File->Path);
+			continue;
+		}
+
+		for (; Member && Member <= Last; Member++) {
+			if (*ExcludedCount == Members->Count)
+				break;
+			Excluded[(*ExcludedCount)++] = Member->HeaderOffset;
+		}
+		Files->Entries[Changed++] = *File;
+	}
+
+	Files->Count = Changed;
+}
+
+/*
+ * Copies the archive to TempName without the old copies of Files which
+ * have changed, leaving only those in Files. Nothing is written if all
+ * of them are the same.
+ */
+static int prepare_update(const char *ArchiveName, const char *TempName,
+                          struct entry_list *Files, bool CompareCRC)
 {
-	char *ArchiveName, *OutputName;
-	HKCF Archive;
+	struct member_list Members = {0};
+	struct KcfCompactInfo Info;
+	uint64_t *Excluded   = NULL;
+	size_t ExcludedCount = 0, Count;
+	IO *in_file, *out_file;
 	KCFERROR Error;
-	struct KcfArchiveHeader Header;
-	struct KcfRecord Record;
 
-	ArchiveName = *argv;
-	argc--;
-	argv++;
+	/* A file given twice, or inside a directory given, is packed once */
+	Files->Count = walk_unique(Files->Entries, Files->Count);
+	Count        = Files->Count;
 
-	Error = CreateArchive(ArchiveName, KCF_MODE_READ, &Archive);
-	if (Error) {
-		printf("%s: failed to create archive %s: %s\n", Program,
-		       ArchiveName, GetKcfErrorString(Error));
+	in_file = IO_open_cfile(ArchiveName, "rb");
+	if (!in_file) {
+		printf("%s: failed to open archive %s\n", Program, ArchiveName);
 		return 1;
 	}
 
-	ScanArchiveForMarker(Archive);
-	ReadRecord(Archive, &Record);
-	Error = RecordToArchiveHeader(&Record, &Header);
+	Error = read_members(in_file, &Members);
+	if (!Error && Members.Count) {
+		Excluded = malloc(Members.Count * sizeof(uint64_t));
+		if (!Excluded)
+			Error = KCF_ERROR_OUT_OF_MEMORY;
+	}
+	if (!Error) {
+		find_changes(&Members, Files, CompareCRC, Excluded,
+		             &ExcludedCount);
+		printf("%llu file(s) unchanged\n",
+		       (unsigned long long)(Count - Files->Count));
+	}
+
+	if (!Error && Files->Count) {
+		out_file = IO_open_cfile(TempName, "wb");
+		if (!out_file) {
+			Error = KCF_ERROR_WRITE;
+		} else {
+			Error = KCF_compact_excluding(in_file, out_file, Excluded,
+			                              ExcludedCount, &Info);
+			if (IO_close(out_file) < 0 && !Error)
+				Error = KCF_ERROR_WRITE;
+			if (Error)
+				remove(TempName);
+		}
+	}
+
+	IO_close(in_file);
+	clear_members(&Members);
+	free(Excluded);
+
 	if (Error) {
 		printf("%s: %s: %s\n", Program, ArchiveName,
-		       GetKcfErrorString(Error));
+		       kcf_error_string(Error));
 		return 1;
 	}
+	return 0;
+}
 
-	puts("Unpacking files...");
-	while (!Error) {
-		Error = UnpackCurrentFile(Archive);
-	}
+static char *temp_name(const char *ArchiveName)
+{
+	size_t Length = strlen(ArchiveName) + sizeof(".tmp");
+	char *Name    = malloc(Length);
+
+	if (Name)
+		snprintf(Name, Length, "%s.tmp", ArchiveName);
+	return Name;
+}
+
+/* Puts the complete copy of the archive in place of the original */
+static bool replace_archive(const char *TempName, const char *ArchiveName)
+{
+#ifdef _WIN32
+	remove(ArchiveName);
+#endif
+	return rename(TempName, ArchiveName) == 0;
+}
+
+/* Archive written with O_DIRECT, see IO_create_fd_direct() */
+static IO *open_direct(const char *path, enum pack_mode Mode)
+{
+	int flags = Mode == PACK_CREATE ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+	IO *f;
+	int fd;
+
+#ifdef O_BINARY
+	flags |= O_BINARY;
+#endif
+	fd = open(path, flags, 0666);
+	if (fd < 0)
+		return NULL;
+
+	f = IO_create_fd_direct(fd, 1);
+	if (!f)
+		close(fd);
+
+	return f;
+}
+
+static int pack(int argc, char **argv, enum pack_mode Mode)
+{
+	char *OutputName, *TempName = NULL;
+	IO *out_file;
+	KCF *archive;
+	struct batch *Batch;
+	struct inode_table Inodes = {0};
+	struct entry_list Files   = {0};
+	struct walk_options Walk  = {WALK_SORTED, 8};
+	struct pack_context Pack;
+	KCFERROR Error;
+	uint64_t SolidBlockSize  = 0;
+	uint64_t VolumeSize      = 0;
+	uint64_t RecoveryPercent = 0;
+	uint64_t ChecksumBlock   = 0;
+	uint64_t Level           = 0;
+	uint64_t FrameSize       = 0;
+	uint64_t Threads         = 1;
+	uint64_t WalkThreads     = 8;
+	uint64_t *Size;
+	bool Dedup         = false;
+	bool FileChecksums = false;
+	bool Direct        = false;
+	bool AsyncWriting  = false;
+	bool Packed;
+	size_t i;
+	int result = 1;
+
+	while (argc > 1 && argv[0][0] == '-') {
+		if (strcmp(argv[0], "-d") == 0) {
+			Dedup = true;
+			argc--;
+			argv++;
+			continue;
+		}
+		if (strcmp(argv[0], "-c") == 0) {
+			FileChecksums = true;
+			argc--;
+			argv++;
+			continue;
+		}
+		if (strcmp(argv[0], "-D") == 0) {
+			Direct = true;
+			argc--;
+			argv++;
+			continue;
+		}
+		if (strcmp(argv[0], "-A") == 0) {
+			AsyncWriting = true;
+			argc--;
+			argv++;
+			continue;
+		}
+		if (strcmp(argv[0], "-o") == 0) {
+			if (strcmp(argv[1], "name") == 0) {
+				Walk.Order = WALK_SORTED;
+			} else if (strcmp(argv[1], "found") == 0) {
+				Walk.Order = WALK_FOUND;
+			} else {
+				printf("%s: %s: invalid order\n", Program,
+				       argv[1]);
+				return 1;
+			}
+			argc -= 2;
+			argv += 2;
+			continue;
+		}
+
+		if (strcmp(argv[0], "-s") == 0)
+			Size = &SolidBlockSize;
+		else if (strcmp(argv[0], "-v") == 0)
+			Size = &VolumeSize;
+		else if (strcmp(argv[0], "-R") == 0)
+			Size = &RecoveryPercent;
+		else if (strcmp(argv[0], "-b") == 0)
+			Size = &ChecksumBlock;
+		else if (strcmp(argv[0], "-z") == 0)
+			Size = &Level;
+		else if (strcmp(argv[0], "-f") == 0)
+			Size = &FrameSize;
+		else if (strcmp(argv[0], "-j") == 0)
+			Size = &Threads;
+		else if (strcmp(argv[0], "-w") == 0)
+			Size = &WalkThreads;
+		else
+			break;
+
+		if (!parse_size(argv[1], Size)) {
+			printf("%s: %s: invalid size\n", Program, argv[1]);
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc < 1)
+		return help();
+
+	if (RecoveryPercent > 100) {
+		printf("%s: recovery record can't be over 100%%\n", Program);
+		return 1;
+	}
+	/* Checked before anything is packed, the record comes last */
+	if (RecoveryPercent && VolumeSize) {
+		printf("%s: can't add recovery record to multi-volume "
+		       "archive\n",
+		       Program);
+		return 1;
+	}
+	/* Links can't point into another volume */
+	if (Dedup && VolumeSize) {
+		printf("%s: can't deduplicate files of multi-volume archive\n",
+		       Program);
+		return 1;
+	}
+	if (Mode != PACK_CREATE && VolumeSize) {
+		printf("%s: can't add files to multi-volume archive\n",
+		       Program);
+		return 1;
+	}
+	if (WalkThreads < 1 || WalkThreads > 256) {
+		printf("%s: invalid number of threads\n", Program);
+		return 1;
+	}
+	Walk.Threads = (int)WalkThreads;
+
+	OutputName = argv[0];
+	argc--;
+	argv++;
+
+	/* Unchanged files are copied to a new archive, the rest appended */
+	if (Mode == PACK_UPDATE) {
+		TempName = temp_name(OutputName);
+		if (!TempName) {
+			printf("%s: out of memory\n", Program);
+			return 1;
+		}
+		if (!for_each_entry(argv, argc, &Walk, collect_entry, &Files) ||
+		    prepare_update(OutputName, TempName, &Files,
+		                   FileChecksums)) {
+			clear_entries(&Files);
+			free(TempName);
+			return 1;
+		}
+		if (Files.Count == 0) {
+			printf("Archive %s is up to date\n", OutputName);
+			clear_entries(&Files);
+			free(TempName);
+			return 0;
+		}
+	}
+
+	if (Direct)
+		out_file = open_direct(TempName ? TempName : OutputName, Mode);
+	else
+		out_file = IO_open_cfile(TempName ? TempName : OutputName,
+		                         Mode == PACK_CREATE ? "w+b" : "r+b");
+	if (!out_file) {
+		printf("%s: failed to %s archive %s\n", Program,
+		       Mode == PACK_CREATE ? "create" : "open", OutputName);
+		clear_entries(&Files);
+		free(TempName);
+		return 1;
+	}
+
+	Batch = calloc(1, sizeof(struct batch));
+	if (!Batch) {
+		printf("%s: out of memory\n", Program);
+		IO_close(out_file);
+		clear_entries(&Files);
+		free(TempName);
+		return 1;
+	}
+
+	Error = KCF_create(out_file, &archive);
+	if (Error) {
+		printf("%s: failed to create archive %s: %s\n", Program,
+		       OutputName, kcf_error_string(Error));
+		free(Batch);
+		IO_close(out_file);
+		clear_entries(&Files);
+		free(TempName);
+		return 1;
+	}
+
+	printf("%s archive %s...\n",
+	       Mode == PACK_CREATE ? "Creating" : "Updating", OutputName);
+
+	KCF_set_solid_block_size(archive, SolidBlockSize);
+
+	if (ChecksumBlock > UINT32_MAX ||
+	    KCF_set_block_checksums(archive, (uint32_t)ChecksumBlock)) {
+		printf("%s: invalid checksum block size\n", Program);
+		goto cleanup;
+	}
+
+	if (Level > 9 || FrameSize > UINT32_MAX ||
+	    KCF_set_compression(archive,
+	                        Level ? KCF_METHOD_DEFLATE : KCF_METHOD_STORE,
+	                        (int)Level, (uint32_t)FrameSize)) {
+		printf("%s: invalid compression level or frame size\n", Program);
+		goto cleanup;
+	}
+
+	if (Threads < 1 || Threads > 64 ||
+	    KCF_set_compression_threads(archive, (int)Threads)) {
+		printf("%s: invalid number of threads\n", Program);
+		goto cleanup;
+	}
+
+	KCF_set_deduplication(archive, Dedup);
+	KCF_set_file_checksums(archive, FileChecksums);
+
+	if (AsyncWriting && (Error = KCF_enable_async_writing(archive, 0))) {
+		printf("%s: %s: %s\n", Program, OutputName,
+		       kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	if (VolumeSize) {
+		Error = KCF_set_volumes(archive, VolumeSize, open_volume,
+		                        OutputName);
+		if (Error) {
+			printf("%s: %s: invalid volume size\n", Program,
+			       OutputName);
+			goto cleanup;
+		}
+	}
+
+	Error = Mode == PACK_CREATE ? KCF_init_archive(archive)
+	                            : KCF_append_archive(archive);
+	if (Error) {
+		printf("%s: failed to %s archive %s: %s\n", Program,
+		       Mode == PACK_CREATE ? "create" : "open", OutputName,
+		       kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	Pack.Archive = archive;
+	Pack.Batch   = Batch;
+	Pack.Inodes  = Dedup ? &Inodes : NULL;
+
+	/* Directories are read while the files found so far are packed */
+	if (Mode == PACK_UPDATE) {
+		Packed = true;
+		for (i = 0; Packed && i < Files.Count; i++)
+			Packed = pack_entry(&Pack, &Files.Entries[i]);
+	} else {
+		Packed = for_each_entry(argv, argc, &Walk, pack_entry, &Pack);
+	}
+	if (!Packed)
+		goto cleanup;
+
+	Error = flush_batch(archive, Batch);
+	if (Error) {
+		printf("%s: failed to write archive %s: %s\n", Program,
+		       OutputName, kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	if (RecoveryPercent) {
+		puts("Adding recovery record...");
+		Error = KCF_add_recovery_record(archive,
+		                                (unsigned)RecoveryPercent, 0);
+		if (Error) {
+			printf("%s: failed to add recovery record to %s: %s\n",
+			       Program, OutputName, kcf_error_string(Error));
+			goto cleanup;
+		}
+	}
+
+	result = 0;
+
+cleanup:
+	clear_batch(Batch);
+	free(Batch);
+	free(Inodes.Entries);
+	clear_entries(&Files);
+	if (KCF_close(archive) != KCF_ERROR_OK)
+		result = 1;
+	if (IO_close(out_file) < 0)
+		result = 1;
+
+	/* The original stays as it was unless all went well */
+	if (TempName) {
+		if (!result && !replace_archive(TempName, OutputName)) {
+			printf("%s: failed to replace archive %s\n", Program,
+			       OutputName);
+			result = 1;
+		}
+		if (result)
+			remove(TempName);
+		free(TempName);
+	}
+
+	return result;
+}
+
+/* Files extracted so far by the offset of their headers, for links */
+struct extracted_file {
+	uint64_t HeaderOffset;
+	char *Name;
+};
+
+struct extracted_table {
+	struct extracted_file *Files;
+	size_t Count;
+	size_t Capacity;
+};
+
+/* Headers come in order, so the table stays sorted */
+static void note_extracted(KCF *archive, struct extracted_table *Table,
+                           const char *Name)
+{
+	struct extracted_file *Files;
+	size_t Capacity;
+	uint64_t Offset;
+
+	if (KCF_get_file_offset(archive, &Offset))
+		return;
+
+	if (Table->Count == Table->Capacity) {
+		Capacity = Table->Capacity ? 2 * Table->Capacity : 256;
+		Files    = realloc(Table->Files, Capacity * sizeof(*Files));
+		if (!Files)
+			return;
+		Table->Files    = Files;
+		Table->Capacity = Capacity;
+	}
+
+	Table->Files[Table->Count].HeaderOffset = Offset;
+	Table->Files[Table->Count].Name         = strdup(Name);
+	if (Table->Files[Table->Count].Name)
+		Table->Count++;
+}
+
+static const char *find_extracted(struct extracted_table *Table,
+                                  uint64_t Offset)
+{
+	size_t Low = 0, High = Table->Count, Middle;
+
+	while (Low < High) {
+		Middle = Low + (High - Low) / 2;
+		if (Table->Files[Middle].HeaderOffset < Offset)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (Low == Table->Count || Table->Files[Low].HeaderOffset != Offset)
+		return NULL;
+	return Table->Files[Low].Name;
+}
+
+static void clear_extracted(struct extracted_table *Table)
+{
+	size_t i;
+
+	for (i = 0; i < Table->Count; i++)
+		free(Table->Files[i].Name);
+	free(Table->Files);
+}
+
+/*
+ * Makes the current file another hard link of the extracted file its
+ * link points at. Copies are made where that fails.
+ */
+static bool link_extracted(KCF *archive, struct extracted_table *Table,
+                           const char *Name)
+{
+#ifndef _WIN32
+	const char *Target;
+	uint64_t Offset;
+
+	if (KCF_get_link_target(archive, &Offset))
+		return false;
+
+	Target = find_extracted(Table, Offset);
+	if (!Target)
+		return false;
+
+	remove(Name);
+	return link(Target, Name) == 0;
+#else
+	return false;
+#endif
+}
+
+/* Context counts the damaged places skipped */
+static void report_skipped(void *Context, uint32_t Volume, uint64_t Offset,
+                           uint64_t Size)
+{
+	int *Skipped = Context;
+
+	fprintf(stderr,
+	        "%s: damaged place at offset %llu of volume %u, "
+	        "%llu bytes skipped\n",
+	        Program, (unsigned long long)Offset, (unsigned)Volume + 1,
+	        (unsigned long long)Size);
+	(*Skipped)++;
+}
+
+static int unpack(int argc, char **argv)
+{
+	char *ArchiveName;
+	IO *in_file, *out_file;
+	KCF *archive;
+	KCFERROR Error;
+	struct KcfFileInfo info         = {0};
+	struct extracted_table Extracted = {0};
+	bool Recover  = false;
+	bool Prefetch = false;
+	bool IsLinked, IsDirectory;
+	int Failed   = 0;
+	int Skipped  = 0;
+	int Threads  = 1;
+	int result;
+
+	while (argc > 0 && argv[0][0] == '-') {
+		if (strcmp(argv[0], "-r") == 0) {
+			Recover = true;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-p") == 0) {
+			Prefetch = true;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-j") == 0 && argc > 1) {
+			Threads = atoi(argv[1]);
+			if (Threads < 1) {
+				printf("%s: %s: invalid number of threads\n",
+				       Program, argv[1]);
+				return 1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else {
+			break;
+		}
+	}
+
+	if (argc < 1)
+		return help();
+
+	ArchiveName = *argv;
+	argc--;
+	argv++;
+
+	in_file = IO_open_cfile(ArchiveName, "rb");
+	if (!in_file) {
+		printf("%s: failed to open archive %s\n", Program, ArchiveName);
+		return 1;
+	}
+
+	/* Recovery goes through the archive record by record */
+	if (Threads > 1 && !Recover) {
+		result = unpack_parallel(in_file, ArchiveName, Threads);
+		IO_close(in_file);
+		return result;
+	}
+
+	Error = KCF_create(in_file, &archive);
+	if (Error) {
+		printf("%s: failed to open archive %s: %s\n", Program,
+		       ArchiveName, kcf_error_string(Error));
+		IO_close(in_file);
+		return 1;
+	}
+
+	KCF_set_access_pattern(archive, KCF_ACCESS_SEQUENTIAL);
+	KCF_set_recovery_mode(archive, Recover);
+	KCF_set_skip_callback(archive, report_skipped, &Skipped);
+	KCF_set_volumes(archive, 0, open_volume, ArchiveName);
+
+	if (Prefetch && (Error = KCF_enable_prefetch(archive, 0, 0))) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	Error = KCF_open_archive(archive);
+	if (Error) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	puts("Unpacking files...");
+	for (;;) {
+		Error = KCF_get_current_file_info(archive, &info);
+		if (Error == KCF_ERROR_EOF) {
+			Error = KCF_ERROR_OK;
+			break;
+		}
+		if (Error) {
+			printf("%s: %s: %s\n", Program, ArchiveName,
+			       kcf_error_string(Error));
+			break;
+		}
+
+		IsDirectory = info.FileType == KCF_FILE_DIRECTORY;
+		if (!IsDirectory)
+			printf("Extracting file %s...\n", info.FileName);
+		IsLinked = info.FileType == KCF_FILE_HARD_LINK &&
+		           link_extracted(archive, &Extracted, info.FileName);
+		out_file = NULL;
+		if (IsLinked) {
+			/* The data is there under another name already */
+			Error = KCF_skip_file(archive);
+		} else if (IsDirectory) {
+			extract_directory(info.FileName);
+			Error = KCF_skip_file(archive);
+		} else if (!(out_file = create_file(info.FileName))) {
+			printf("%s: failed to create file %s\n", Program,
+			       info.FileName);
+			Error = KCF_skip_file(archive);
+		} else {
+			Error = KCF_extract(archive, out_file);
+			IO_close(out_file);
+			if (Error)
+				printf("%s: %s: %s\n", Program, info.FileName,
+				       kcf_error_string(Error));
+			else if (!(info.CompressionInfo & KCF_COMPRESSION_LINK))
+				note_extracted(archive, &Extracted,
+				               info.FileName);
+		}
+		file_info_clear(&info);
+
+		if ((!IsLinked && !IsDirectory && !out_file) || Error) {
+			Failed++;
+			if (!Recover)
+				break;
+			Error = KCF_ERROR_OK;
+		}
+	}
+
+cleanup:
+	clear_extracted(&Extracted);
+	KCF_close(archive);
+	IO_close(in_file);
+
+	if (Skipped)
+		fprintf(stderr, "%s: %s: %d damaged places skipped\n", Program,
+		        ArchiveName, Skipped);
+	if (Error || Failed || Skipped)
+		return 1;
+
+	return 0;
+}
+
+static int test(int argc, char **argv)
+{
+	char *ArchiveName;
+	IO *in_file;
+	KCF *archive;
+	KCFERROR Error;
+	struct KcfFileInfo info = {0};
+	bool Prefetch = false;
+	int Failed    = 0;
+	int Threads   = 1;
+
+	while (argc > 0 && argv[0][0] == '-') {
+		if (strcmp(argv[0], "-p") == 0) {
+			Prefetch = true;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-j") == 0 && argc > 1) {
+			Threads = atoi(argv[1]);
+			if (Threads < 1) {
+				printf("%s: %s: invalid number of threads\n",
+				       Program, argv[1]);
+				return 1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else {
+			break;
+		}
+	}
+
+	if (argc < 1)
+		return help();
+
+	ArchiveName = argv[0];
+	in_file     = IO_open_cfile(ArchiveName, "rb");
+	if (!in_file) {
+		printf("%s: failed to open archive %s\n", Program, ArchiveName);
+		return 1;
+	}
+
+	Error = KCF_create(in_file, &archive);
+	if (Error) {
+		printf("%s: failed to open archive %s: %s\n", Program,
+		       ArchiveName, kcf_error_string(Error));
+		IO_close(in_file);
+		return 1;
+	}
+
+	KCF_set_access_pattern(archive, KCF_ACCESS_SEQUENTIAL);
+	KCF_set_volumes(archive, 0, open_volume, ArchiveName);
+
+	if (Prefetch && (Error = KCF_enable_prefetch(archive, 0, 0))) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	Error = KCF_open_archive(archive);
+	if (Error) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		goto cleanup;
+	}
+
+	printf("Testing %s...\n", ArchiveName);
+	for (;;) {
+		Error = KCF_get_current_file_info(archive, &info);
+		if (Error == KCF_ERROR_EOF) {
+			Error = KCF_ERROR_OK;
+			break;
+		}
+		if (Error) {
+			printf("%s: %s: %s\n", Program, ArchiveName,
+			       kcf_error_string(Error));
+			break;
+		}
+
+		Error = KCF_verify_file(archive, Threads, open_volume,
+		                        ArchiveName);
+		printf("%-60s %s\n", info.FileName,
+		       Error ? kcf_error_string(Error) : "OK");
+		file_info_clear(&info);
+
+		/* Damaged data doesn't stop us from testing the rest */
+		if (Error == KCF_ERROR_INVALID_DATA) {
+			Failed++;
+			Error = KCF_ERROR_OK;
+		} else if (Error) {
+			break;
+		}
+	}
+
+cleanup:
+	KCF_close(archive);
+	IO_close(in_file);
+
+	if (Failed)
+		printf("%d damaged file(s)\n", Failed);
+
+	return Error || Failed ? 1 : 0;
+}
+
+static bool print_marker(void *Context, const struct KcfMarkerInfo *Info)
+{
+	unsigned long long *Count = Context;
+
+	if (Info->HasValidHeader)
+		printf("%20llu  archive, format version %u\n",
+		       (unsigned long long)Info->Offset, Info->ArchiveVersion);
+	else
+		printf("%20llu  marker, damaged archive header\n",
+		       (unsigned long long)Info->Offset);
+
+	(*Count)++;
+	return true;
+}
+
+static int scan(int argc, char **argv)
+{
+	char *InputName;
+	IO *in_file;
+	KCFERROR Error;
+	unsigned long long Count = 0;
+
+	if (argc < 1)
+		return help();
+
+	InputName = argv[0];
+	in_file   = IO_open_cfile(InputName, "rb");
+	if (!in_file) {
+		printf("%s: failed to open %s\n", Program, InputName);
+		return 1;
+	}
+
+	printf("Scanning %s...\n", InputName);
+	Error = KCF_scan_all_markers(in_file, print_marker, &Count);
+	IO_close(in_file);
+
+	if (Error) {
+		printf("%s: %s: %s\n", Program, InputName,
+		       kcf_error_string(Error));
+		return 1;
+	}
+
+	printf("%llu marker(s) found\n", Count);
+	return 0;
+}
+
+static int repair(int argc, char **argv)
+{
+	struct KcfRepairInfo Info;
+	char *ArchiveName;
+	IO *file;
+	KCFERROR Error;
+
+	if (argc < 1)
+		return help();
+
+	ArchiveName = argv[0];
+	file        = IO_open_cfile(ArchiveName, "r+b");
+	if (!file) {
+		printf("%s: failed to open archive %s\n", Program, ArchiveName);
+		return 1;
+	}
+
+	printf("Repairing %s...\n", ArchiveName);
+	Error = KCF_repair(file, &Info);
+	if (IO_close(file) < 0 && !Error)
+		Error = KCF_ERROR_WRITE;
+
+	if (Error == KCF_ERROR_OK || Error == KCF_ERROR_INVALID_DATA)
+		printf("%llu damaged block(s), %llu repaired\n",
+		       (unsigned long long)Info.DamagedBlocks,
+		       (unsigned long long)Info.RepairedBlocks);
+	if (Error) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int delete_files(int argc, char **argv)
+{
+	char *ArchiveName;
+	uint64_t Header;
+	IO *file;
+	KCF *archive;
+	KCFERROR Error;
+	int result = 0;
+
+	if (argc < 2)
+		return help();
+
+	ArchiveName = argv[0];
+	argc--;
+	argv++;
+
+	file = IO_open_cfile(ArchiveName, "r+b");
+	if (!file) {
+		printf("%s: failed to open archive %s\n", Program, ArchiveName);
+		return 1;
+	}
+
+	Error = KCF_create(file, &archive);
+	if (Error) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		IO_close(file);
+		return 1;
+	}
+
+	Error = KCF_open_archive(archive);
+	if (Error) {
+		printf("%s: %s: %s\n", Program, ArchiveName,
+		       kcf_error_string(Error));
+		result = 1;
+	}
+
+	for (; !Error && argc > 0; argc--, argv++) {
+		printf("Deleting file %s...\n", *argv);
+		if (KCF_find_member(archive, *argv, &Header, NULL) ||
+		    KCF_delete_member(archive, Header)) {
+			printf("%s: failed to delete file %s\n", Program,
+			       *argv);
+			result = 1;
+		}
+	}
+
+	KCF_close(archive);
+	if (IO_close(file) < 0)
+		result = 1;
+
+	return result;
+}
+
+/* The compacted archive replaces the original once it is complete */
+static int compact(int argc, char **argv)
+{
+	struct KcfCompactInfo Info;
+	char *ArchiveName, *TempName;
+	IO *in_file, *out_file;
+	KCFERROR Error;
+
+	if (argc < 1)
+		return help();
+
+	ArchiveName = argv[0];
+	TempName    = temp_name(ArchiveName);
+	if (!TempName) {
+		printf("%s: out of memory\n", Program);
+		return 1;
+	}
+
+	in_file = IO_open_cfile(ArchiveName, "rb");
+	if (!in_file) {
+		printf("%s: failed to open archive %s\n", Program, ArchiveName);
+		free(TempName);
+		return 1;
+	}
+	out_file = IO_open_cfile(TempName, "wb");
+	if (!out_file) {
+		printf("%s: failed to create %s\n", Program, TempName);
+		IO_close(in_file);
+		free(TempName);
+		return 1;
+	}
+
+	printf("Compacting %s...\n", ArchiveName);
+	Error = KCF_compact(in_file, out_file, &Info);
+	IO_close(in_file);
+	if (IO_close(out_file) < 0 && !Error)
+		Error = KCF_ERROR_WRITE;
 
-	CloseArchive(Archive);
+	if (!Error && !replace_archive(TempName, ArchiveName))
+		Error = KCF_ERROR_WRITE;
 
 	if (Error) {
 		printf("%s: %s: %s\n", Program, ArchiveName,
-		       GetKcfErrorString(Error));
+		       kcf_error_string(Error));
+		remove(TempName);
+		free(TempName);
 		return 1;
 	}
 
+	printf("%llu file(s) left, %llu deleted file(s) removed, "
+	       "%llu bytes freed\n",
+	       (unsigned long long)Info.Files,
+	       (unsigned long long)Info.DeletedFiles,
+	       (unsigned long long)Info.RemovedBytes);
+	free(TempName);
 	return 0;
 }
@@ -0,0 +1,660 @@
+#ifdef _FILE_OFFSET_BITS
+#undef _FILE_OFFSET_BITS
+#endif
+#define _FILE_OFFSET_BITS 64
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <io/thread.h>
+
+#include "walk.h"
+
+/*
+ * Directory trees are walked by a pool of threads, each of them taking
+ * the next directory nobody lists yet. A directory is read with readdir(),
+ * which fetches entries with getdents() in large chunks on Linux, and its
+ * entries are looked at with fstatat() relative to the open directory, so
+ * paths aren't resolved again for each of them. On Windows
+ * FindFirstFileEx() with FIND_FIRST_EX_LARGE_FETCH returns sizes and times
+ * along with the names. On network filesystems every call waits for the
+ * server, which is why many directories are listed at once.
+ *
+ * Files found are either handed out through a bounded queue as soon as
+ * a directory is listed, or kept in the tree of listed directories which
+ * the caller goes through in order of names. Directories to list are
+ * taken last in, first out, so listing runs ahead of the caller along
+ * the path it takes. Once the tree holds as many entries not taken as
+ * the queue would, only the directory the caller waits for is listed.
+ */
+
+extern char *Program;
+
+/* Entries found, but not taken by the caller yet */
+#define WALK_QUEUE_SIZE 4096
+
+#ifdef _WIN32
+#define IS_SEPARATOR(c) ((c) == '/' || (c) == '\\')
+#else
+#define IS_SEPARATOR(c) ((c) == '/')
+#endif
+
+struct walk_dir;
+
+struct walk_item {
+	struct walk_entry Entry;
+	struct walk_dir *Dir;
+};
+
+struct walk_dir {
+	char *Path;
+
+	/* Next directory to list */
+	struct walk_dir *Next;
+
+	/* Entries by name, the ones before Current are taken */
+	struct walk_item *Items;
+	size_t Count;
+	size_t Current;
+	bool IsListed;
+};
+
+struct walker {
+	enum walk_order Order;
+	IO_THREAD *Threads;
+	int ThreadCount;
+
+	IO_MUTEX Lock;
+	IO_COND Work;
+	IO_COND Found;
+	IO_COND Room;
+
+	/* Directories to list, and those being listed */
+	struct walk_dir *Pending;
+	size_t Busy;
+	int Idle;
+	bool Stop;
+
+	/* Entries found, for WALK_FOUND */
+	struct walk_entry *Queue;
+	size_t Head;
+	size_t Used;
+
+	/* Directories the caller is in, for WALK_SORTED */
+	struct walk_dir **Stack;
+	size_t Depth;
+	size_t Capacity;
+
+	/* Entries listed but not taken, and the directory waited for */
+	size_t Listed;
+	struct walk_dir *Wanted;
+
+	int Errors;
+};
+
+static struct walk_dir *new_dir(const char *Path)
+{
+	struct walk_dir *Dir = calloc(1, sizeof(*Dir));
+
+	if (Dir && !(Dir->Path = strdup(Path))) {
+		free(Dir);
+		Dir = NULL;
+	}
+	return Dir;
+}
+
+/* Frees the directory with whatever is left of its entries */
+static void free_dir(struct walk_dir *Dir)
+{
+	size_t i;
+
+	if (!Dir)
+		return;
+
+	for (i = Dir->Current; i < Dir->Count; i++) {
+		free(Dir->Items[i].Entry.Path);
+		free_dir(Dir->Items[i].Dir);
+	}
+	free(Dir->Items);
+	free(Dir->Path);
+	free(Dir);
+}
+
+static int compare_items(const void *a, const void *b)
+{
+	const struct walk_item *x = a, *y = b;
+
+	return strcmp(x->Entry.Path, y->Entry.Path);
+}
+
+static char *join_path(const char *Directory, const char *Name)
+{
+	size_t Length = strlen(Directory);
+	char *Path    = malloc(Length + strlen(Name) + 2);
+
+	if (!Path)
+		return NULL;
+
+	/* The root may be "/" */
+	memcpy(Path, Directory, Length);
+	if (Length == 0 || !IS_SEPARATOR(Directory[Length - 1]))
+		Path[Length++] = '/';
+	strcpy(Path + Length, Name);
+	return Path;
+}
+
+static void walk_error(struct walker *Walker, const char *Directory,
+                       const char *Name)
+{
+	IO_mutex_lock(&Walker->Lock);
+	printf("%s: failed to read %s%s%s\n", Program, Directory,
+	       Name ? "/" : "", Name ? Name : "");
+	Walker->Errors++;
+	IO_mutex_unlock(&Walker->Lock);
+}
+
+/* Appends Found, named Name in Directory, false if out of memory */
+static bool add_item(struct walk_item **Items, size_t *Count,
+                     size_t *Capacity, const char *Directory,
+                     const char *Name, const struct walk_entry *Found)
+{
+	struct walk_item *Grown;
+	char *Path;
+
+	if (*Count == *Capacity) {
+		*Capacity = *Capacity ? 2 * *Capacity : 64;
+		Grown     = realloc(*Items, *Capacity * sizeof(**Items));
+		if (!Grown)
+			return false;
+		*Items = Grown;
+	}
+
+	Path = join_path(Directory, Name);
+	if (!Path)
+		return false;
+
+	(*Items)[*Count].Entry      = *Found;
+	(*Items)[*Count].Entry.Path = Path;
+	(*Items)[*Count].Dir        = Found->IsDirectory ? new_dir(Path) : NULL;
+	if (Found->IsDirectory && !(*Items)[*Count].Dir) {
+		free(Path);
+		return false;
+	}
+	(*Count)++;
+	return true;
+}
+
+#ifdef _WIN32
+
+/* Large fetches came with Windows 7 */
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+
+/* 100 ns intervals from 1601 to 1970 */
+#define FILETIME_UNIX_EPOCH 116444736000000000LL
+
+bool walk_stat(const char *Path, struct walk_entry *Entry)
+{
+	struct _stat64 st;
+
+	if (_stat64(Path, &st) != 0)
+		return false;
+
+	memset(Entry, 0, sizeof(*Entry));
+	Entry->Path        = (char *)Path;
+	Entry->Size        = (uint64_t)st.st_size;
+	Entry->Time        = (uint64_t)(int64_t)st.st_mtime;
+	Entry->Links       = 1;
+	Entry->IsDirectory = (st.st_mode & _S_IFMT) == _S_IFDIR;
+	return true;
+}
+
+static void fill_entry(struct walk_entry *Entry, const WIN32_FIND_DATAA *fd)
+{
+	int64_t Time;
+
+	Time = (int64_t)((uint64_t)fd->ftLastWriteTime.dwHighDateTime << 32 |
+	                 fd->ftLastWriteTime.dwLowDateTime);
+
+	/* Same as walk_stat(), which can't tell hard links either */
+	memset(Entry, 0, sizeof(*Entry));
+	Entry->Size  = (uint64_t)fd->nFileSizeHigh << 32 | fd->nFileSizeLow;
+	Entry->Time  = (uint64_t)((Time - FILETIME_UNIX_EPOCH) / 10000000);
+	Entry->Links = 1;
+	Entry->IsDirectory =
+	    (fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+}
+
+static struct walk_item *list_dir(struct walker *Walker,
+                                  struct walk_dir *Dir, size_t *Count)
+{
+	struct walk_item *Items = NULL;
+	struct walk_entry Found;
+	WIN32_FIND_DATAA fd;
+	size_t Capacity = 0;
+	bool Failed     = false;
+	char *Pattern;
+	HANDLE h;
+
+	*Count = 0;
+
+	Pattern = join_path(Dir->Path, "*");
+	if (!Pattern) {
+		walk_error(Walker, Dir->Path, NULL);
+		return NULL;
+	}
+	h = FindFirstFileExA(Pattern, FindExInfoBasic, &fd,
+	                     FindExSearchNameMatch, NULL,
+	                     FIND_FIRST_EX_LARGE_FETCH);
+	free(Pattern);
+	if (h == INVALID_HANDLE_VALUE) {
+		/* Only the root of an empty drive has no "." */
+		if (GetLastError() != ERROR_FILE_NOT_FOUND)
+			walk_error(Walker, Dir->Path, NULL);
+		return NULL;
+	}
+
+	do {
+		if (strcmp(fd.cFileName, ".") == 0 ||
+		    strcmp(fd.cFileName, "..") == 0)
+			continue;
+
+		/* Links and junctions are left out like symbolic links */
+		if (fd.dwFileAttributes &
+		    (FILE_ATTRIBUTE_REPARSE_POINT | FILE_ATTRIBUTE_DEVICE))
+			continue;
+
+		fill_entry(&Found, &fd);
+		if (!add_item(&Items, Count, &Capacity, Dir->Path,
+		              fd.cFileName, &Found)) {
+			Failed = true;
+			break;
+		}
+	} while (FindNextFileA(h, &fd));
+
+	if (Failed || GetLastError() != ERROR_NO_MORE_FILES)
+		walk_error(Walker, Dir->Path, NULL);
+	FindClose(h);
+	return Items;
+}
+
+#else
+
+static void fill_entry(struct walk_entry *Entry, char *Path,
+                       const struct stat *st)
+{
+	Entry->Path        = Path;
+	Entry->Size        = (uint64_t)st->st_size;
+	Entry->Time        = (uint64_t)(int64_t)st->st_mtime;
+	Entry->Device      = (uint64_t)st->st_dev;
+	Entry->Inode       = (uint64_t)st->st_ino;
+	Entry->Links       = (uint64_t)st->st_nlink;
+	Entry->IsDirectory = S_ISDIR(st->st_mode);
+}
+
+bool walk_stat(const char *Path, struct walk_entry *Entry)
+{
+	struct stat st;
+
+	if (stat(Path, &st) != 0)
+		return false;
+
+	fill_entry(Entry, (char *)Path, &st);
+	return true;
+}
+
+static struct walk_item *list_dir(struct walker *Walker,
+                                  struct walk_dir *Dir, size_t *Count)
+{
+	struct walk_item *Items = NULL;
+	struct walk_entry Found;
+	struct dirent *de;
+	struct stat st;
+	size_t Capacity = 0;
+	DIR *d;
+	int fd;
+
+	*Count = 0;
+
+	fd = open(Dir->Path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || !(d = fdopendir(fd))) {
+		if (fd >= 0)
+			close(fd);
+		walk_error(Walker, Dir->Path, NULL);
+		return NULL;
+	}
+
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (fstatat(dirfd(d), de->d_name, &st,
+		            AT_SYMLINK_NOFOLLOW) != 0) {
+			walk_error(Walker, Dir->Path, de->d_name);
+			continue;
+		}
+
+		/* Only regular files and directories are stored */
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+
+		fill_entry(&Found, NULL, &st);
+		if (!add_item(&Items, Count, &Capacity, Dir->Path, de->d_name,
+		              &Found))
+			break;
+	}
+
+	if (de)
+		walk_error(Walker, Dir->Path, NULL);
+	closedir(d);
+	return Items;
+}
+
+#endif
+
+/* Hands the entries to the caller, waiting for room in the queue */
+static void queue_items(struct walker *Walker, struct walk_item *Items,
+                        size_t Count)
+{
+	size_t i;
+
+	for (i = 0; i < Count; i++) {
+		while (Walker->Used == WALK_QUEUE_SIZE && !Walker->Stop)
+			IO_cond_wait(&Walker->Room, &Walker->Lock);
+		if (Walker->Stop)
+			break;
+
+		Walker->Queue[(Walker->Head + Walker->Used) % WALK_QUEUE_SIZE] =
+		    Items[i].Entry;
+		Walker->Used++;
+		IO_cond_signal(&Walker->Found);
+	}
+
+	/* Whatever the caller won't take any more */
+	for (; i < Count; i++)
+		free(Items[i].Entry.Path);
+}
+
+/* Next directory to list, NULL if none may be listed now */
+static struct walk_dir *take_dir(struct walker *Walker)
+{
+	struct walk_dir **Link = &Walker->Pending, *Dir;
+
+	/* Sorted listing runs ahead only so far, but the directory the
+	 * caller waits for is listed anyway */
+	if (Walker->Order == WALK_SORTED && Walker->Listed >= WALK_QUEUE_SIZE) {
+		if (!Walker->Wanted)
+			return NULL;
+		while (*Link && *Link != Walker->Wanted)
+			Link = &(*Link)->Next;
+	}
+
+	Dir = *Link;
+	if (Dir)
+		*Link = Dir->Next;
+	return Dir;
+}
+
+static void *walk_thread(void *arg)
+{
+	struct walker *Walker = arg;
+	struct walk_item *Items;
+	struct walk_dir *Dir;
+	size_t Count, i;
+
+	IO_mutex_lock(&Walker->Lock);
+	while (!Walker->Stop) {
+		Dir = take_dir(Walker);
+		if (!Dir) {
+			/* Nothing left to list and nobody lists more */
+			if (!Walker->Pending && !Walker->Busy)
+				break;
+			Walker->Idle++;
+			IO_cond_wait(&Walker->Work, &Walker->Lock);
+			Walker->Idle--;
+			continue;
+		}
+
+		Walker->Busy++;
+		IO_mutex_unlock(&Walker->Lock);
+
+		Items = list_dir(Walker, Dir, &Count);
+		if (Walker->Order == WALK_SORTED && Count)
+			qsort(Items, Count, sizeof(*Items), compare_items);
+
+		IO_mutex_lock(&Walker->Lock);
+		if (Walker->Order == WALK_FOUND)
+			queue_items(Walker, Items, Count);
+
+		/* The first subdirectory by name is listed first */
+		for (i = Count; i > 0; i--) {
+			if (!Items[i - 1].Dir)
+				continue;
+			if (Walker->Stop && Walker->Order == WALK_FOUND) {
+				free_dir(Items[i - 1].Dir);
+				continue;
+			}
+			Items[i - 1].Dir->Next = Walker->Pending;
+			Walker->Pending        = Items[i - 1].Dir;
+		}
+
+		if (Walker->Order == WALK_SORTED) {
+			Dir->Items      = Items;
+			Dir->Count      = Count;
+			Dir->IsListed   = true;
+			Walker->Listed += Count;
+		} else {
+			free(Items);
+			free_dir(Dir);
+		}
+
+		Walker->Busy--;
+		IO_cond_broadcast(&Walker->Work);
+		IO_cond_broadcast(&Walker->Found);
+	}
+
+	/* Nothing left to list, which wakes the others too */
+	IO_cond_broadcast(&Walker->Work);
+	IO_cond_broadcast(&Walker->Found);
+	IO_mutex_unlock(&Walker->Lock);
+	return NULL;
+}
+
+struct walker *walk_start(const char *Root, int Threads,
+                          enum walk_order Order)
+{
+	struct walker *Walker;
+	struct walk_dir *Dir;
+
+	Walker = calloc(1, sizeof(*Walker));
+	if (!Walker)
+		return NULL;
+
+	Walker->Order   = Order;
+	Walker->Threads = calloc(Threads, sizeof(IO_THREAD));
+	Walker->Queue   = malloc(WALK_QUEUE_SIZE * sizeof(struct walk_entry));
+	Walker->Stack   = malloc(64 * sizeof(struct walk_dir *));
+	Dir             = new_dir(Root);
+	if (!Walker->Threads || !Walker->Queue || !Walker->Stack || !Dir) {
+		free(Walker->Threads);
+		free(Walker->Queue);
+		free(Walker->Stack);
+		free_dir(Dir);
+		free(Walker);
+		return NULL;
+	}
+	Walker->Capacity = 64;
+	Walker->Pending  = Dir;
+	if (Order == WALK_SORTED)
+		Walker->Stack[Walker->Depth++] = Dir;
+
+	IO_mutex_init(&Walker->Lock);
+	IO_cond_init(&Walker->Work);
+	IO_cond_init(&Walker->Found);
+	IO_cond_init(&Walker->Room);
+
+	for (; Walker->ThreadCount < Threads; Walker->ThreadCount++)
+		if (IO_thread_create(&Walker->Threads[Walker->ThreadCount],
+		                     walk_thread, Walker) < 0)
+			break;
+
+	if (!Walker->ThreadCount) {
+		walk_finish(Walker);
+		return NULL;
+	}
+
+	return Walker;
+}
+
+static bool next_found(struct walker *Walker, struct walk_entry *Entry)
+{
+	while (!Walker->Used && (Walker->Pending || Walker->Busy))
+		IO_cond_wait(&Walker->Found, &Walker->Lock);
+	if (!Walker->Used)
+		return false;
+
+	*Entry       = Walker->Queue[Walker->Head];
+	Walker->Head = (Walker->Head + 1) % WALK_QUEUE_SIZE;
+	Walker->Used--;
+	IO_cond_signal(&Walker->Room);
+	return true;
+}
+
+static bool next_sorted(struct walker *Walker, struct walk_entry *Entry)
+{
+	struct walk_dir *Dir, **Stack;
+	struct walk_item *Item;
+
+	while (Walker->Depth) {
+		Dir = Walker->Stack[Walker->Depth - 1];
+		while (!Dir->IsListed) {
+			Walker->Wanted = Dir;
+			IO_cond_broadcast(&Walker->Work);
+			IO_cond_wait(&Walker->Found, &Walker->Lock);
+		}
+		Walker->Wanted = NULL;
+
+		if (Dir->Current == Dir->Count) {
+			Walker->Depth--;
+			free_dir(Dir);
+			continue;
+		}
+
+		if (Walker->Depth == Walker->Capacity) {
+			Stack = realloc(Walker->Stack, 2 * Walker->Capacity *
+			                                   sizeof(*Stack));
+			if (!Stack) {
+				Walker->Errors++;
+				return false;
+			}
+			Walker->Stack     = Stack;
+			Walker->Capacity *= 2;
+		}
+
+		/* The directory comes before its contents */
+		Item   = &Dir->Items[Dir->Current++];
+		*Entry = Item->Entry;
+		if (Item->Dir)
+			Walker->Stack[Walker->Depth++] = Item->Dir;
+
+		/* Listing held back by the limit may go on */
+		Walker->Listed--;
+		if (Walker->Idle && Walker->Pending &&
+		    Walker->Listed < WALK_QUEUE_SIZE)
+			IO_cond_signal(&Walker->Work);
+		return true;
+	}
+
+	return false;
+}
+
+bool walk_next(struct walker *Walker, struct walk_entry *Entry)
+{
+	bool result;
+
+	IO_mutex_lock(&Walker->Lock);
+	if (Walker->Order == WALK_SORTED)
+		result = next_sorted(Walker, Entry);
+	else
+		result = next_found(Walker, Entry);
+	IO_mutex_unlock(&Walker->Lock);
+
+	return result;
+}
+
+int walk_finish(struct walker *Walker)
+{
+	struct walk_dir *Dir;
+	int i, Errors;
+
+	IO_mutex_lock(&Walker->Lock);
+	Walker->Stop = true;
+	IO_cond_broadcast(&Walker->Work);
+	IO_cond_broadcast(&Walker->Room);
+	IO_mutex_unlock(&Walker->Lock);
+
+	for (i = 0; i < Walker->ThreadCount; i++)
+		IO_thread_join(&Walker->Threads[i], NULL);
+
+	/* Directories not listed belong to the tree in sorted order */
+	if (Walker->Order == WALK_FOUND) {
+		while ((Dir = Walker->Pending)) {
+			Walker->Pending = Dir->Next;
+			free_dir(Dir);
+		}
+		for (; Walker->Used; Walker->Used--) {
+			free(Walker->Queue[Walker->Head].Path);
+			Walker->Head = (Walker->Head + 1) % WALK_QUEUE_SIZE;
+		}
+	}
+	while (Walker->Depth)
+		free_dir(Walker->Stack[--Walker->Depth]);
+
+	IO_cond_destroy(&Walker->Room);
+	IO_cond_destroy(&Walker->Found);
+	IO_cond_destroy(&Walker->Work);
+	IO_mutex_destroy(&Walker->Lock);
+
+	Errors = Walker->Errors;
+	free(Walker->Threads);
+	free(Walker->Queue);
+	free(Walker->Stack);
+	free(Walker);
+	return Errors;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct walk_entry *x = a, *y = b;
+
+	return strcmp(x->Path, y->Path);
+}
+
+size_t walk_unique(struct walk_entry *Entries, size_t Count)
+{
+	size_t i, Unique = 0;
+
+	if (Count == 0)
+		return 0;
+	qsort(Entries, Count, sizeof(struct walk_entry), compare_entries);
+
+	for (i = 1; i < Count; i++) {
+		if (strcmp(Entries[i].Path, Entries[Unique].Path) == 0)
+			free(Entries[i].Path);
+		else
+			Entries[++Unique] = Entries[i];
+	}
+	return Unique + 1;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef _KCF_WALK_H_
+#define _KCF_WALK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Order in which the files of a directory tree come out */
+enum walk_order {
+	/* Names sorted, each directory followed by its contents */
+	WALK_SORTED,
+
+	/* As threads find them, the same tree may come out differently */
+	WALK_FOUND,
+};
+
+struct walk_entry {
+	char *Path;
+	uint64_t Size;
+	uint64_t Time;
+	uint64_t Device;
+	uint64_t Inode;
+	uint64_t Links;
+	bool IsDirectory;
+};
+
+struct walker;
+
+/**
+ * \brief Fills Entry for the file at Path, Path itself is not copied.
+ * Returns false if there is no such file.
+ */
+bool walk_stat(const char *Path, struct walk_entry *Entry);
+
+/**
+ * \brief Starts going through the tree under the directory Root with
+ * Threads threads, which list directories ahead of the caller. Returns
+ * NULL if threads can't be started or walking isn't supported.
+ */
+struct walker *walk_start(const char *Root, int Threads,
+                          enum walk_order Order);
+
+/**
+ * \brief Returns the next regular file or directory under the root,
+ * false at the end. The caller frees Path of the entry.
+ */
+bool walk_next(struct walker *Walker, struct walk_entry *Entry);
+
+/**
+ * \brief Stops the threads and frees the walker. Returns the number of
+ * files and directories which couldn't be read.
+ */
+int walk_finish(struct walker *Walker);
+
+/**
+ * \brief Sorts Entries by path and frees the paths repeated, as when the
+ * same file is given twice or inside a directory given too. Returns the
+ * number of entries left.
+ */
+size_t walk_unique(struct walk_entry *Entries, size_t Count);
+
+#endif
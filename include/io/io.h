@@ -15,10 +15,21 @@ enum {
 	IO_CFILE = 1,
 	IO_POSIX = 2,
 	IO_WIN32 = 3,
+	IO_POSIX_DIRECT = 4,
+	IO_PREFETCH = 5,
+	IO_ASYNC_WRITER = 6,
 };
 
 enum { IO_SEEK_SET, IO_SEEK_CUR, IO_SEEK_END };
 
+enum {
+	IO_ADVICE_NORMAL,
+	IO_ADVICE_SEQUENTIAL,
+	IO_ADVICE_RANDOM,
+	IO_ADVICE_WILLNEED,
+	IO_ADVICE_DONTNEED,
+};
+
 IO *IO_create(const IO_METHOD *method);
 int IO_close(IO *io);
 
@@ -27,11 +38,19 @@ int64_t IO_write(IO *io, const void *buffer, int64_t size);
 int64_t IO_seek(IO *io, int64_t offset, int whence);
 int64_t IO_tell(IO *io);
 int     IO_flush(IO *io);
+int     IO_advise(IO *io, int64_t offset, int64_t length, int advice);
+int     IO_truncate(IO *io, int64_t size);
+int64_t IO_copy(IO *from, IO *to, int64_t size);
 
 IO *IO_create_fp(FILE *f, int should_close);
 IO *IO_open_cfile(const char *path, const char *mode);
 
 IO *IO_create_fd(int fd, int should_close);
+IO *IO_create_fd_direct(int fd, int should_close);
+
+IO *IO_create_prefetch(IO *source, int64_t block_size, int blocks,
+                       int should_close);
+IO *IO_create_async_writer(IO *sink, int64_t buffer_size, int should_close);
 
 #ifdef _WIN32
 #include <windows.h>
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef _IO_THREAD_H_
+#define _IO_THREAD_H_
+
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef struct io_thread_st {
+	HANDLE handle;
+	void *(*start)(void *);
+	void *arg;
+	void *result;
+} IO_THREAD;
+
+typedef CRITICAL_SECTION IO_MUTEX;
+typedef CONDITION_VARIABLE IO_COND;
+#else
+#include <pthread.h>
+
+typedef struct io_thread_st {
+	pthread_t handle;
+} IO_THREAD;
+
+typedef pthread_mutex_t IO_MUTEX;
+typedef pthread_cond_t IO_COND;
+#endif
+
+int IO_thread_create(IO_THREAD *thread, void *(*start)(void *), void *arg);
+int IO_thread_join(IO_THREAD *thread, void **result);
+
+int IO_mutex_init(IO_MUTEX *mutex);
+void IO_mutex_destroy(IO_MUTEX *mutex);
+void IO_mutex_lock(IO_MUTEX *mutex);
+void IO_mutex_unlock(IO_MUTEX *mutex);
+
+int IO_cond_init(IO_COND *cond);
+void IO_cond_destroy(IO_COND *cond);
+void IO_cond_wait(IO_COND *cond, IO_MUTEX *mutex);
+void IO_cond_signal(IO_COND *cond);
+void IO_cond_broadcast(IO_COND *cond);
+
+#endif
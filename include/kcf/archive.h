@@ -16,7 +16,7 @@ typedef struct kcf_st KCF;
 #define KCF_MODE_MODIFY 0x03
 
 KCFERROR KCF_create(IO *stream, KCF **pkcf);
-void KCF_close(KCF *kcf);
+KCFERROR KCF_close(KCF *kcf);
 
 /* Write/read mode functions */
 
@@ -38,11 +38,149 @@ KCFERROR KCF_start_reading(KCF *kcf);
  */
 KCFERROR KCF_init_archive(KCF *kcf);
 
+/**
+ * Finds the archive marker and reads the archive header, after that
+ * files can be read from the archive.
+ */
+KCFERROR KCF_open_archive(KCF *kcf);
+
+/**
+ * Opens an existing archive to add files at its end (KCF_MODE_MODIFY),
+ * the stream must be readable, writable and seekable. Nothing before
+ * the end is rewritten. A record or a file left incomplete by an
+ * interrupted write is cut off, which needs a stream that can be
+ * truncated. Added files start a new solid block and aren't
+ * deduplicated against files already in the archive. Multi-volume
+ * archives are not supported.
+ *
+ * Returns `KCF_ERROR_INVALID_DATA` if a damaged record is found before
+ * the end, the archive should be repaired first.
+ */
+KCFERROR KCF_append_archive(KCF *kcf);
+
+enum KcfAccessPattern {
+	KCF_ACCESS_NORMAL,
+	KCF_ACCESS_SEQUENTIAL,
+	KCF_ACCESS_RANDOM,
+};
+
+/**
+ * Tells the underlying IO stream how the archive is going to be read:
+ * sequentially (extraction of all files) or randomly (lookup of
+ * separate files). In random mode contents of each record are read
+ * ahead explicitly since the system stops doing it by itself.
+ */
+KCFERROR KCF_set_access_pattern(KCF *kcf, enum KcfAccessPattern Pattern);
+
+/**
+ * Starts a background thread which reads the archive ahead of the
+ * reader, \p Blocks blocks of \p BlockSize bytes at most. Zero values
+ * select the defaults. Only for archives which are not written.
+ */
+KCFERROR KCF_enable_prefetch(KCF *kcf, size_t BlockSize, int Blocks);
+
+/**
+ * Makes writes asynchronous: added data is collected in one of two
+ * buffers of \p BufferSize bytes while a background thread writes
+ * the other one. Write errors are reported by the next call which has
+ * to wait for the thread, at the latest by `KCF_end_file` (when the
+ * header is backpatched) or `KCF_close`.
+ */
+KCFERROR KCF_enable_async_writing(KCF *kcf, size_t BufferSize);
+
+/* Recovery API */
+
+struct KcfMarkerInfo {
+	uint64_t Offset;
+	uint16_t ArchiveVersion;
+	bool HasValidHeader : 1;
+};
+
+/**
+ * Called for every marker found, return false to stop the scan.
+ */
+typedef bool (*KcfMarkerCallback)(void *Context,
+                                  const struct KcfMarkerInfo *Info);
+
+/**
+ * Reads \p Stream up to its end and reports every archive marker in
+ * it. Offsets are counted from the current position of the stream. The
+ * archive header following each marker is checked so that archives
+ * can be told from random occurences of the marker bytes.
+ */
+KCFERROR KCF_scan_all_markers(IO *Stream, KcfMarkerCallback Callback,
+                              void *Context);
+
+/**
+ * In recovery mode a record with invalid HeadCRC doesn't stop reading:
+ * the reader skips forward to the next valid record and goes on from
+ * there. A file damaged this way fails with `KCF_ERROR_INVALID_DATA`,
+ * the following files can still be read.
+ */
+KCFERROR KCF_set_recovery_mode(KCF *kcf, bool Enabled);
+
+/**
+ * Called in recovery mode for every damaged place skipped: \p Size bytes
+ * from \p Offset of volume \p Volume (0 for the first one). Data
+ * fragments left without their file header are reported as well.
+ */
+typedef void (*KcfSkipCallback)(void *Context, uint32_t Volume,
+                                uint64_t Offset, uint64_t Size);
+
+KCFERROR KCF_set_skip_callback(KCF *kcf, KcfSkipCallback Callback,
+                               void *Context);
+
+/**
+ * Appends a recovery record with Reed-Solomon parity of everything
+ * written so far. \p Percent is the share of damaged blocks of
+ * \p BlockSize bytes (0 for the default) which can be rebuilt. The
+ * stream has to be readable. Files added after it are not protected.
+ * Multi-volume archives get `KCF_ERROR_NOT_IMPLEMENTED`.
+ */
+KCFERROR KCF_add_recovery_record(KCF *kcf, unsigned Percent,
+                                 uint32_t BlockSize);
+
+struct KcfRepairInfo {
+	uint64_t ProtectedSize;
+	uint64_t DamagedBlocks;
+	uint64_t RepairedBlocks;
+};
+
+/**
+ * Finds the recovery record in \p Stream and rewrites the damaged blocks
+ * before it in place. Returns `KCF_ERROR_INVALID_DATA` if some of them
+ * can't be rebuilt and `KCF_ERROR_INVALID_FORMAT` if there is no
+ * recovery record.
+ */
+KCFERROR KCF_repair(IO *Stream, struct KcfRepairInfo *Info);
+
+/**
+ * Opens volume Number of a multi-volume archive, the first volume is the
+ * stream given to `KCF_create` and has number 0. Returned streams are
+ * owned by the library and closed when no longer needed. NULL means
+ * there is no such volume (or it can't be created).
+ */
+typedef IO *(*KcfVolumeOpener)(void *Context, uint32_t Number,
+                               bool ForWriting);
+
+/**
+ * Sets up multi-volume archive. When writing, VolumeSize is the size
+ * at which the writer goes on to the next volume; a file crossing it is
+ * continued in the next volume with a data fragment. Must be called
+ * before `KCF_init_archive`. When reading, VolumeSize is ignored and the
+ * next volumes are opened when the reader gets to them.
+ */
+KCFERROR KCF_set_volumes(KCF *kcf, uint64_t VolumeSize,
+                         KcfVolumeOpener Opener, void *Context);
+
 /* File inserting API */
 
 enum KcfFileType {
 	KCF_FILE_REGULAR   = 'R',
 	KCF_FILE_DIRECTORY = 'd',
+
+	/* Another name of the file a link points at, see `KCF_add_link` */
+	KCF_FILE_HARD_LINK = 'h',
 };
 
 struct KcfFileInfo {
@@ -58,6 +196,15 @@ struct KcfFileInfo {
 	bool HasUnpackedSize8 : 1;
 };
 
+/* CompressionInfo fields */
+#define KCF_COMPRESSION_METHOD_MASK 0x000000FF
+#define KCF_COMPRESSION_LINK        0x10000000
+#define KCF_COMPRESSION_SOLID       0x20000000
+
+/* Compression methods */
+#define KCF_METHOD_STORE   0x00
+#define KCF_METHOD_DEFLATE 0x01
+
 bool file_info_copy(struct KcfFileInfo *Dest, struct KcfFileInfo *Src);
 void file_info_clear(struct KcfFileInfo *info);
 
@@ -65,8 +212,228 @@ KCFERROR KCF_get_current_file_info(KCF *kcf, struct KcfFileInfo *FileInfo);
 KCFERROR KCF_skip_file(KCF *kcf);
 KCFERROR KCF_extract(KCF *kcf, IO *Output);
 
+/**
+ * Same as `KCF_extract`, but frames of a compressed file are decoded by
+ * up to \p Threads threads while the calling one reads them. Each frame
+ * is written at its own offset as soon as it is decoded, so \p Output
+ * has to be seekable; if it is not, the file is extracted by the
+ * calling thread alone.
+ */
+KCFERROR KCF_extract_parallel(KCF *kcf, IO *Output, int Threads);
+
+/**
+ * Checks the data of the current file against its CRCs without writing
+ * it anywhere and goes on to the next file like `KCF_skip_file`. A file
+ * with a block checksum table (see `KCF_set_block_checksums`) is checked
+ * by up to \p Threads threads, each of them but the calling one reads
+ * the archive through its own stream which \p Opener returns as volume
+ * 0. Opener is called from several threads at once and may be NULL.
+ * Frames of a compressed file are decoded by up to \p Threads threads.
+ * Returns `KCF_ERROR_INVALID_DATA` if the file is damaged.
+ */
+KCFERROR KCF_verify_file(KCF *kcf, int Threads, KcfVolumeOpener Opener,
+                         void *Context);
+
+/* Random access API, for seekable archives of one volume */
+
+/**
+ * Finds the file named \p Name and returns the offset of its header for
+ * `KCF_read_member_range` and the size of its data in \p Size (which
+ * may be NULL). Returns `KCF_ERROR_FILE_NOT_FOUND` if there is no such
+ * file. The first call goes through the whole archive and indexes the
+ * names of all files, later calls only look them up. Sequential reading
+ * goes on where it stopped.
+ */
+KCFERROR KCF_find_member(KCF *kcf, const char *Name, uint64_t *HeaderOffset,
+                         uint64_t *Size);
+
+/**
+ * Returns the offset of the header of the current file when reading, or
+ * of the file last added by `KCF_begin_file` or `KCF_add_link` when
+ * writing.
+ */
+KCFERROR KCF_get_file_offset(KCF *kcf, uint64_t *HeaderOffset);
+
+/**
+ * Returns the offset of the header of the file whose data the current
+ * file, a link (`KCF_COMPRESSION_LINK`), has. Extraction of the current
+ * file is not affected.
+ */
+KCFERROR KCF_get_link_target(KCF *kcf, uint64_t *TargetOffset);
+
+/**
+ * Reads \p Size bytes of the data of the file whose header is at
+ * \p HeaderOffset, from \p Offset on, seeking right to them. Frames of
+ * compressed files the range touches are unpacked. If a stored file has
+ * block checksums, the blocks the range touches are checked; otherwise
+ * nothing is, as the CRC of a fragment can only be checked by reading
+ * all of it. The places of the file's data are kept for the next call
+ * with the same file. Sequential reading goes on where it stopped.
+ * Returns `KCF_ERROR_NOT_IMPLEMENTED` for a range in the first frame of
+ * a compressed solid file.
+ */
+KCFERROR KCF_read_member_range(KCF *kcf, uint64_t HeaderOffset,
+                               uint64_t Offset, void *Buffer, size_t Size);
+
+/* Deleting API */
+
+/**
+ * Marks the file whose header is at \p HeaderOffset (see
+ * `KCF_find_member`) deleted by rewriting three bytes of the header in
+ * place, the stream must be writable. Readers skip the file from then
+ * on; links to it still get its data, and so do the solid files after it
+ * in its block, as readers unpack a deleted compressed file for them.
+ * The space is given back by `KCF_compact`. A recovery record added
+ * before doesn't know about the change, repairing the archive with it
+ * brings the file back.
+ */
+KCFERROR KCF_delete_member(KCF *kcf, uint64_t HeaderOffset);
+
+struct KcfCompactInfo {
+	uint64_t Files;
+	uint64_t DeletedFiles;
+	uint64_t RemovedBytes;
+};
+
+/**
+ * Copies the archive in \p Source to \p Destination without deleted
+ * files, at the current position of Destination. Adjacent records are
+ * copied in one go, by the kernel where both streams are files. Links
+ * are pointed at the new place of their targets; deleted files which
+ * links or compressed solid files left refer to are kept. Recovery
+ * records are left out, as they don't fit the new layout. Only archives
+ * of one volume are supported.
+ */
+KCFERROR KCF_compact(IO *Source, IO *Destination,
+                     struct KcfCompactInfo *Info);
+
+/**
+ * Same as `KCF_compact`, but the files whose headers are at
+ * \p HeaderOffsets are left out as well, as if they had been deleted.
+ * Those which links point at are written as deleted files. Source isn't
+ * changed, so newer copies of the files can be added to Destination
+ * afterwards (see `KCF_append_archive`) without touching the original.
+ */
+KCFERROR KCF_compact_excluding(IO *Source, IO *Destination,
+                               const uint64_t *HeaderOffsets, size_t Count,
+                               struct KcfCompactInfo *Info);
+
+/**
+ * Returns the stream to extract the file into, it is closed by the
+ * library. NULL skips the file.
+ */
+typedef IO *(*KcfOutputOpener)(void *Context,
+                               const struct KcfFileInfo *Info);
+
+/**
+ * Extracts all files of a multi-volume archive with up to \p Threads
+ * threads, each of them taking the next volume which nobody reads yet.
+ * A file is extracted by the thread of the volume its header is in,
+ * which follows it into the next volumes if needed. \p FirstVolume is
+ * volume 0. Both callbacks are called from several threads at once.
+ * Solid archives can't be read this way. An archive of one volume is
+ * extracted with `KCF_extract_parallel`. Returns the first error.
+ */
+KCFERROR KCF_extract_volumes_parallel(IO *FirstVolume,
+                                      KcfVolumeOpener VolumeOpener,
+                                      void *VolumeContext,
+                                      KcfOutputOpener OutputOpener,
+                                      void *OutputContext, int Threads);
+
+/**
+ * Enables solid mode for the files added after this call: consecutive
+ * files share one compression stream until the block holds at least
+ * BlockSize bytes of file data. A file in the middle of a block can only
+ * be unpacked after the files before it, so the block size bounds the
+ * cost of random access. With compression, the first frame of such a
+ * file refers back to the last 32 KiB of the files before it, so small
+ * similar files pack much better. Compressed files in the middle of a
+ * block are never targets of links. Zero turns solid mode off.
+ */
+KCFERROR KCF_set_solid_block_size(KCF *kcf, uint64_t BlockSize);
+
+/**
+ * Makes the files added after this call carry CRC32C of every
+ * \p BlockSize bytes of their data (1 MiB is a good choice) in a record
+ * after the data. Parts of such a file can be checked without reading
+ * the rest of it, so one large file can be checked by many threads.
+ * Files no larger than one block get no table. Zero turns it off.
+ */
+KCFERROR KCF_set_block_checksums(KCF *kcf, uint32_t BlockSize);
+
+/**
+ * Makes the files added after this call carry `FileCRC32`, CRC32C of
+ * their whole data (see `KCF_file_crc32`). Files streamed into
+ * multi-volume archives get none, as their headers can't be backpatched.
+ */
+KCFERROR KCF_set_file_checksums(KCF *kcf, bool Enabled);
+
+/**
+ * Updates \p CRC, zero at first, with \p Size bytes of \p Data the way
+ * `FileCRC32` is calculated.
+ */
+uint32_t KCF_file_crc32(uint32_t CRC, const void *Data, size_t Size);
+
+/**
+ * Compresses the files added after this call with \p Method at \p Level
+ * (as the codec understands it, -1 for its default). Files are cut into
+ * frames of \p FrameSize bytes compressed independently, a power of two
+ * from 64 KiB to 64 MiB, 0 for 1 MiB, so a range of a file can be read
+ * without unpacking all of it. The files added after this call start a
+ * new solid block. `KCF_METHOD_STORE` turns compression off.
+ */
+KCFERROR KCF_set_compression(KCF *kcf, int Method, int Level,
+                             uint32_t FrameSize);
+
+/**
+ * Compresses frames of the files being added with up to \p Threads
+ * threads while the calling one reads the input and writes the frames
+ * in order. One, the default, compresses in the calling thread.
+ */
+KCFERROR KCF_set_compression_threads(KCF *kcf, int Threads);
+
+/**
+ * Writes files added after this call whose data repeats a file written
+ * before as links to that file (`KCF_COMPRESSION_LINK`) instead of
+ * another copy. Data is compared byte by byte, so the stream must be
+ * readable and seekable. Files read through `KCF_insert_file_data` are
+ * read twice if their input is seekable, and never linked otherwise.
+ * Has no effect on multi-volume archives.
+ */
+KCFERROR KCF_set_deduplication(KCF *kcf, bool Enabled);
+
+/**
+ * Adds a file with the data of the file whose header is at
+ * \p TargetOffset (see `KCF_get_file_offset`) as a link to it, without
+ * reading the data again, e.g. for another name of a hard link
+ * (`KCF_FILE_HARD_LINK`, other types are extracted as copies). The
+ * target must have been added while deduplication was on, otherwise
+ * `KCF_ERROR_FILE_NOT_FOUND` is returned.
+ */
+KCFERROR KCF_add_link(KCF *kcf, struct KcfFileInfo *FileInfo,
+                      uint64_t TargetOffset);
+
 KCFERROR KCF_begin_file(KCF *kcf, struct KcfFileInfo *FileInfo);
 KCFERROR KCF_insert_file_data(KCF *kcf, IO *Input);
 KCFERROR KCF_end_file(KCF *kcf);
 
+/**
+ * File with its data in memory, for `KCF_add_files_batch`. Unpacked size
+ * in Info is taken from Size.
+ */
+struct KcfBatchEntry {
+	struct KcfFileInfo Info;
+	const uint8_t *Data;
+	size_t Size;
+};
+
+/**
+ * Adds complete files whose data is already in memory. Records of the
+ * whole batch are serialized into one buffer and written at once, which
+ * is much cheaper than `KCF_begin_file` and friends for lots of tiny
+ * files.
+ */
+KCFERROR KCF_add_files_batch(KCF *kcf, struct KcfBatchEntry *Entries,
+                             size_t Count);
+
 #endif
@@ -0,0 +1,324 @@
+#include <io/io.h>
+#include <io/thread.h>
+
+#include "io_local.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Double-buffered writer. The caller fills one buffer while a
+ * background thread writes the other one into the sink. Write errors
+ * of the thread are sticky and reported by the next call which has
+ * to wait for it (write of a full buffer, seek, flush, close).
+ */
+
+#define ASYNC_DEFAULT_BUFFER_SIZE 4194304L
+
+struct async_io {
+	IO *sink;
+	bool close_sink;
+
+	IO_THREAD thread;
+	IO_MUTEX lock;
+	IO_COND cond;
+
+	uint8_t *buffers[2];
+	int64_t lengths[2];
+	int64_t buffer_size;
+	int fill;
+
+	/* Protected by lock */
+	bool pending;
+	bool error;
+	bool stop;
+
+	int64_t position;
+};
+
+static int64_t _async_read(IO *io, void *buffer, int64_t size);
+static int64_t _async_write(IO *io, const void *buffer, int64_t size);
+static int64_t _async_seek(IO *io, int64_t offset, int whence);
+static int64_t _async_tell(IO *io);
+static int _async_flush(IO *io);
+static int _async_close(IO *io);
+static int _async_advise(IO *io, int64_t offset, int64_t length, int advice);
+
+static const IO_METHOD _async_method = {
+	IO_ASYNC_WRITER,
+	_async_read,
+	_async_write,
+	_async_seek,
+	_async_tell,
+	_async_flush,
+	_async_close,
+	_async_advise,
+	NULL,
+};
+
+static void *_async_thread(void *arg)
+{
+	struct async_io *a = arg;
+	int index;
+	int64_t ret;
+
+	IO_mutex_lock(&a->lock);
+	for (;;) {
+		while (!a->pending && !a->stop)
+			IO_cond_wait(&a->cond, &a->lock);
+		if (!a->pending)
+			break;
+
+		/* The flushed buffer is the one not being filled */
+		index = a->fill ^ 1;
+		IO_mutex_unlock(&a->lock);
+
+		ret = IO_write(a->sink, a->buffers[index], a->lengths[index]);
+
+		IO_mutex_lock(&a->lock);
+		if (ret < a->lengths[index])
+			a->error = true;
+		a->lengths[index] = 0;
+		a->pending        = false;
+		IO_cond_broadcast(&a->cond);
+	}
+	IO_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+/* Waits until the thread is idle */
+static int _async_wait(struct async_io *a)
+{
+	bool error;
+
+	IO_mutex_lock(&a->lock);
+	while (a->pending)
+		IO_cond_wait(&a->cond, &a->lock);
+	error = a->error;
+	IO_mutex_unlock(&a->lock);
+
+	return error ? -1 : 0;
+}
+
+/* Hands the filled buffer over to the thread */
+static int _async_swap(struct async_io *a)
+{
+	if (_async_wait(a) < 0)
+		return -1;
+
+	IO_mutex_lock(&a->lock);
+	a->pending = true;
+	a->fill ^= 1;
+	IO_cond_broadcast(&a->cond);
+	IO_mutex_unlock(&a->lock);
+
+	return 0;
+}
+
+/* Writes everything out and waits for it */
+static int _async_drain(struct async_io *a)
+{
+	if (a->lengths[a->fill] > 0 && _async_swap(a) < 0)
+		return -1;
+
+	return _async_wait(a);
+}
+
+static int64_t _async_read(IO *io, void *buffer, int64_t size)
+{
+	struct async_io *a;
+	int64_t ret;
+
+	assert(io);
+	assert(io->ptr);
+	a = (struct async_io *)io->ptr;
+
+	if (_async_drain(a) < 0)
+		return -1;
+
+	ret = IO_read(a->sink, buffer, size);
+	if (ret > 0)
+		a->position += ret;
+	return ret;
+}
+
+static int64_t _async_write(IO *io, const void *buffer, int64_t size)
+{
+	struct async_io *a;
+	const uint8_t *src = buffer;
+	int64_t written    = 0;
+	int64_t n;
+
+	assert(io);
+	assert(io->ptr);
+	a = (struct async_io *)io->ptr;
+
+	while (written < size) {
+		n = a->buffer_size - a->lengths[a->fill];
+		if (n > size - written)
+			n = size - written;
+
+		memcpy(a->buffers[a->fill] + a->lengths[a->fill],
+		       src + written, n);
+		a->lengths[a->fill] += n;
+		written += n;
+
+		if (a->lengths[a->fill] == a->buffer_size &&
+		    _async_swap(a) < 0)
+			return -1;
+	}
+
+	a->position += written;
+	return written;
+}
+
+static int64_t _async_seek(IO *io, int64_t offset, int whence)
+{
+	struct async_io *a;
+	int64_t ret;
+
+	assert(io);
+	assert(io->ptr);
+	a = (struct async_io *)io->ptr;
+
+	if (_async_drain(a) < 0)
+		return -1;
+
+	switch (whence) {
+	case IO_SEEK_SET:
+		ret = IO_seek(a->sink, offset, IO_SEEK_SET);
+		break;
+	case IO_SEEK_CUR:
+		ret = IO_seek(a->sink, a->position + offset, IO_SEEK_SET);
+		break;
+	case IO_SEEK_END:
+		ret = IO_seek(a->sink, offset, IO_SEEK_END);
+		break;
+	default:
+		return -1;
+	}
+
+	if (ret >= 0)
+		a->position = ret;
+	return ret;
+}
+
+static int64_t _async_tell(IO *io)
+{
+	assert(io);
+	assert(io->ptr);
+	return ((struct async_io *)io->ptr)->position;
+}
+
+static int _async_flush(IO *io)
+{
+	struct async_io *a;
+
+	assert(io);
+	assert(io->ptr);
+	a = (struct async_io *)io->ptr;
+
+	if (_async_drain(a) < 0)
+		return -1;
+
+	return IO_flush(a->sink);
+}
+
+static int _async_advise(IO *io, int64_t offset, int64_t length, int advice)
+{
+	assert(io);
+	assert(io->ptr);
+	return IO_advise(((struct async_io *)io->ptr)->sink, offset, length,
+	                 advice);
+}
+
+static void _async_free(struct async_io *a)
+{
+	free(a->buffers[0]);
+	free(a->buffers[1]);
+	free(a);
+}
+
+static int _async_close(IO *io)
+{
+	struct async_io *a;
+	int ret;
+
+	assert(io);
+	if (!io->ptr)
+		return 0;
+	a = (struct async_io *)io->ptr;
+
+	ret = _async_drain(a);
+
+	IO_mutex_lock(&a->lock);
+	a->stop = true;
+	IO_cond_broadcast(&a->cond);
+	IO_mutex_unlock(&a->lock);
+	IO_thread_join(&a->thread, NULL);
+
+	IO_cond_destroy(&a->cond);
+	IO_mutex_destroy(&a->lock);
+
+	if (IO_flush(a->sink) < 0)
+		ret = -1;
+	if (a->close_sink && IO_close(a->sink) < 0)
+		ret = -1;
+
+	_async_free(a);
+	io->ptr = NULL;
+	return ret;
+}
+
+IO *IO_create_async_writer(IO *sink, int64_t buffer_size, int should_close)
+{
+	IO *result;
+	struct async_io *a;
+
+	if (!sink)
+		return NULL;
+	if (buffer_size <= 0)
+		buffer_size = ASYNC_DEFAULT_BUFFER_SIZE;
+
+	a = calloc(1, sizeof(struct async_io));
+	if (!a)
+		return NULL;
+
+	a->sink        = sink;
+	a->close_sink  = !!should_close;
+	a->buffer_size = buffer_size;
+	a->position    = IO_tell(sink);
+	if (a->position < 0)
+		a->position = 0;
+
+	a->buffers[0] = malloc(buffer_size);
+	a->buffers[1] = malloc(buffer_size);
+	if (!a->buffers[0] || !a->buffers[1])
+		goto fail0;
+
+	result = IO_create(&_async_method);
+	if (!result)
+		goto fail0;
+	result->ptr = a;
+
+	if (IO_mutex_init(&a->lock) < 0)
+		goto fail1;
+	if (IO_cond_init(&a->cond) < 0)
+		goto fail2;
+	if (IO_thread_create(&a->thread, _async_thread, a) < 0)
+		goto fail3;
+
+	return result;
+
+fail3:
+	IO_cond_destroy(&a->cond);
+fail2:
+	IO_mutex_destroy(&a->lock);
+fail1:
+	free(result);
+fail0:
+	_async_free(a);
+	return NULL;
+}
@@ -7,12 +7,20 @@
 #include <limits.h>
 #include <stdio.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 static int64_t _cfile_read(IO *io, void *buffer, int64_t size);
 static int64_t _cfile_write(IO *io, const void *buffer, int64_t size);
 static int64_t _cfile_seek(IO *io, int64_t offset, int whence);
 static int64_t _cfile_tell(IO *io);
 static int _cfile_flush(IO *io);
 static int _cfile_close(IO *io);
+static int _cfile_advise(IO *io, int64_t offset, int64_t length, int advice);
+static int _cfile_truncate(IO *io, int64_t size);
 
 static const IO_METHOD _cfile_method = {
     IO_CFILE, 
@@ -22,6 +30,8 @@ static const IO_METHOD _cfile_method = {
     _cfile_tell, 
     _cfile_flush,
     _cfile_close,
+    _cfile_advise,
+    _cfile_truncate,
 };
 
 #define CHUNK_SIZE 1073741824L
@@ -120,6 +130,8 @@ static int64_t _cfile_seek(IO *io, int64_t offset, int whence)
 	}
 
 	ret = _cfseek(file, offset, std_whence);
+	if (ret == 0)
+		ret = _cftell(file);
 
 	return ret;
 }
@@ -172,6 +184,34 @@ static int _cfile_close(IO *io)
 	return ret;
 }
 
+static int _cfile_advise(IO *io, int64_t offset, int64_t length, int advice)
+{
+#ifdef _WIN32
+	return -2;
+#else
+	assert(io);
+	assert(io->ptr);
+	return _io_fd_advise(fileno((FILE *)io->ptr), offset, length, advice);
+#endif
+}
+
+static int _cfile_truncate(IO *io, int64_t size)
+{
+	FILE *file;
+
+	assert(io);
+	assert(io->ptr);
+	file = (FILE *)io->ptr;
+
+	if (fflush(file) == EOF)
+		return -1;
+#ifdef _WIN32
+	return _chsize_s(_fileno(file), size) == 0 ? 0 : -1;
+#else
+	return ftruncate(fileno(file), (off_t)size) == 0 ? 0 : -1;
+#endif
+}
+
 IO *IO_create_fp(FILE *f, int should_close)
 {
 	IO *result;
@@ -189,7 +229,7 @@ IO *IO_create_fp(FILE *f, int should_close)
 	return result;
 }
 
-IO *IO_create_cfile(const char *path, const char *mode)
+IO *IO_open_cfile(const char *path, const char *mode)
 {
 	IO *result;
 	FILE *f;
@@ -0,0 +1,373 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <io/io.h>
+
+#include "io_local.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && defined(O_DIRECT)
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Write-mostly backend for huge archives. Data is collected in an
+ * aligned buffer and written with O_DIRECT in whole aligned blocks so
+ * that archive contents never go through the page cache. Everything
+ * that can't be written that way (unaligned tail of the archive,
+ * backpatched headers which have already left the buffer, reads) goes
+ * through the ordinary path with O_DIRECT temporarily switched off.
+ */
+
+#define DIRECT_ALIGNMENT   4096
+#define DIRECT_BUFFER_SIZE 1048576L
+
+struct direct_io {
+	int fd;
+	int fd_flags;
+	bool direct;
+
+	uint8_t *buffer;
+	int64_t buffer_offset;
+	int64_t buffer_length;
+
+	int64_t position;
+	int64_t advised;
+};
+
+static int64_t _direct_read(IO *io, void *buffer, int64_t size);
+static int64_t _direct_write(IO *io, const void *buffer, int64_t size);
+static int64_t _direct_seek(IO *io, int64_t offset, int whence);
+static int64_t _direct_tell(IO *io);
+static int _direct_flush(IO *io);
+static int _direct_close(IO *io);
+static int _direct_advise(IO *io, int64_t offset, int64_t length,
+                          int advice);
+
+static const IO_METHOD _direct_method = {
+	IO_POSIX_DIRECT,
+	_direct_read,
+	_direct_write,
+	_direct_seek,
+	_direct_tell,
+	_direct_flush,
+	_direct_close,
+	_direct_advise,
+	NULL,
+};
+
+static int _direct_set_mode(struct direct_io *d, bool direct)
+{
+	int flags;
+
+	if (!d->direct)
+		return 0;
+
+	flags = d->fd_flags;
+	if (direct)
+		flags |= O_DIRECT;
+	else
+		flags &= ~O_DIRECT;
+
+	return fcntl(d->fd, F_SETFL, flags);
+}
+
+static int64_t _direct_pwrite(int fd, const uint8_t *buffer, int64_t size,
+                              int64_t offset)
+{
+	ssize_t ret;
+	int64_t written = 0;
+
+	while (written < size) {
+		ret = pwrite(fd, buffer + written, size - written,
+		             offset + written);
+		if (ret < 0)
+			return -1;
+		written += ret;
+	}
+
+	return written;
+}
+
+/* Writes data bypassing the aligned buffer */
+static int64_t _direct_slow_write(struct direct_io *d, const uint8_t *buffer,
+                                  int64_t size, int64_t offset)
+{
+	int64_t ret;
+
+	if (_direct_set_mode(d, false) < 0)
+		return -1;
+	ret = _direct_pwrite(d->fd, buffer, size, offset);
+	if (_direct_set_mode(d, true) < 0)
+		return -1;
+
+	return ret;
+}
+
+static void _direct_drop_cache(struct direct_io *d, int64_t end)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (end > d->advised) {
+		posix_fadvise(d->fd, d->advised, end - d->advised,
+		              POSIX_FADV_DONTNEED);
+		d->advised = end;
+	}
+#endif
+}
+
+/* Writes the whole buffer out, including its unaligned tail */
+static int _direct_drain(struct direct_io *d)
+{
+	int64_t aligned, tail;
+
+	if (d->buffer_length == 0)
+		return 0;
+
+	aligned = d->buffer_length & ~(int64_t)(DIRECT_ALIGNMENT - 1);
+	tail    = d->buffer_length - aligned;
+
+	if (aligned > 0 && _direct_pwrite(d->fd, d->buffer, aligned,
+	                                  d->buffer_offset) < 0)
+		return -1;
+
+	if (tail > 0 && _direct_slow_write(d, d->buffer + aligned, tail,
+	                                   d->buffer_offset + aligned) < 0)
+		return -1;
+
+	_direct_drop_cache(d, d->buffer_offset + d->buffer_length);
+	d->buffer_offset += d->buffer_length;
+	d->buffer_length = 0;
+	return 0;
+}
+
+static int64_t _direct_read(IO *io, void *buffer, int64_t size)
+{
+	struct direct_io *d;
+	ssize_t ret;
+
+	assert(io);
+	assert(io->ptr);
+	d = (struct direct_io *)io->ptr;
+
+	if (_direct_drain(d) < 0)
+		return -1;
+
+	if (_direct_set_mode(d, false) < 0)
+		return -1;
+	ret = pread(d->fd, buffer, size, d->position);
+	if (_direct_set_mode(d, true) < 0)
+		return -1;
+
+	if (ret > 0)
+		d->position += ret;
+	return ret;
+}
+
+static int64_t _direct_write(IO *io, const void *buffer, int64_t size)
+{
+	struct direct_io *d;
+	const uint8_t *src = buffer;
+	int64_t written    = 0;
+	int64_t n, window_end;
+
+	assert(io);
+	assert(io->ptr);
+	d = (struct direct_io *)io->ptr;
+
+	while (written < size) {
+		if (d->buffer_length == 0 &&
+		    (d->position % DIRECT_ALIGNMENT) == 0)
+			d->buffer_offset = d->position;
+
+		window_end = d->buffer_offset + DIRECT_BUFFER_SIZE;
+		if (d->position >= d->buffer_offset &&
+		    d->position <= d->buffer_offset + d->buffer_length &&
+		    d->position < window_end &&
+		    (d->buffer_length > 0 ||
+		     d->position % DIRECT_ALIGNMENT == 0)) {
+			/* Inside of the buffered window */
+			n = window_end - d->position;
+			if (n > size - written)
+				n = size - written;
+
+			memcpy(d->buffer + (d->position - d->buffer_offset),
+			       src + written, n);
+			if (d->position + n - d->buffer_offset >
+			    d->buffer_length)
+				d->buffer_length =
+				    d->position + n - d->buffer_offset;
+
+			if (d->buffer_length == DIRECT_BUFFER_SIZE &&
+			    _direct_drain(d) < 0)
+				return -1;
+		} else if (d->buffer_length > 0 &&
+		           d->position < d->buffer_offset) {
+			/* Backpatching of data which left the buffer */
+			n = d->buffer_offset - d->position;
+			if (n > size - written)
+				n = size - written;
+
+			if (_direct_slow_write(d, src + written, n,
+			                       d->position) < 0)
+				return -1;
+		} else if (d->buffer_length > 0) {
+			/* Jump past the buffered data */
+			if (_direct_drain(d) < 0)
+				return -1;
+			continue;
+		} else {
+			/* Unaligned start, write up to the next boundary */
+			n = DIRECT_ALIGNMENT - d->position % DIRECT_ALIGNMENT;
+			if (n > size - written)
+				n = size - written;
+
+			if (_direct_slow_write(d, src + written, n,
+			                       d->position) < 0)
+				return -1;
+		}
+
+		d->position += n;
+		written += n;
+	}
+
+	return written;
+}
+
+static int64_t _direct_seek(IO *io, int64_t offset, int whence)
+{
+	struct direct_io *d;
+	struct stat st;
+	int64_t end;
+
+	assert(io);
+	assert(io->ptr);
+	d = (struct direct_io *)io->ptr;
+
+	switch (whence) {
+	case IO_SEEK_SET:
+		d->position = offset;
+		break;
+	case IO_SEEK_CUR:
+		d->position += offset;
+		break;
+	case IO_SEEK_END:
+		if (fstat(d->fd, &st) < 0)
+			return -1;
+		end = st.st_size;
+		if (d->buffer_offset + d->buffer_length > end)
+			end = d->buffer_offset + d->buffer_length;
+		d->position = end + offset;
+		break;
+	default:
+		return -1;
+	}
+
+	return d->position;
+}
+
+static int64_t _direct_tell(IO *io)
+{
+	assert(io);
+	assert(io->ptr);
+	return ((struct direct_io *)io->ptr)->position;
+}
+
+static int _direct_flush(IO *io)
+{
+	assert(io);
+	assert(io->ptr);
+	return _direct_drain((struct direct_io *)io->ptr);
+}
+
+static int _direct_close(IO *io)
+{
+	struct direct_io *d;
+	int ret;
+
+	assert(io);
+	if (!io->ptr)
+		return 0;
+
+	d   = (struct direct_io *)io->ptr;
+	ret = _direct_drain(d);
+
+	/* The descriptor may be used on without the aligned buffer */
+	if (_direct_set_mode(d, false) < 0)
+		ret = -1;
+
+	if ((io->flags & IO_FLAG_CLOSE) && close(d->fd) < 0)
+		ret = -1;
+
+	free(d->buffer);
+	free(d);
+	io->ptr = NULL;
+	return ret;
+}
+
+static int _direct_advise(IO *io, int64_t offset, int64_t length,
+                          int advice)
+{
+	assert(io);
+	assert(io->ptr);
+	return _io_fd_advise(((struct direct_io *)io->ptr)->fd, offset, length,
+	                     advice);
+}
+
+IO *IO_create_fd_direct(int fd, int should_close)
+{
+	IO *result;
+	struct direct_io *d;
+	off_t position;
+
+	position = lseek(fd, 0, SEEK_CUR);
+	if (position < 0)
+		return NULL;
+
+	d = calloc(1, sizeof(struct direct_io));
+	if (!d)
+		return NULL;
+
+	if (posix_memalign((void **)&d->buffer, DIRECT_ALIGNMENT,
+	                   DIRECT_BUFFER_SIZE) != 0) {
+		free(d);
+		return NULL;
+	}
+
+	d->fd            = fd;
+	d->position      = position;
+	d->buffer_offset = position;
+	d->advised       = position & ~(int64_t)(DIRECT_ALIGNMENT - 1);
+	d->fd_flags      = fcntl(fd, F_GETFL) & ~O_DIRECT;
+
+	/* Some file systems (e.g. tmpfs) refuse O_DIRECT, the buffering
+	 * and cache dropping still work there */
+	d->direct = fcntl(fd, F_SETFL, d->fd_flags | O_DIRECT) == 0;
+
+	result = IO_create(&_direct_method);
+	if (!result) {
+		free(d->buffer);
+		free(d);
+		return NULL;
+	}
+
+	result->ptr = d;
+	if (should_close)
+		result->flags |= IO_FLAG_CLOSE;
+
+	return result;
+}
+
+#else
+
+IO *IO_create_fd_direct(int fd, int should_close)
+{
+	return IO_create_fd(fd, should_close);
+}
+
+#endif
@@ -1,4 +1,7 @@
 #define _CRT_SECURE_NO_WARNINGS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <io/io.h>
 
@@ -23,6 +26,8 @@ static int _fd_flush(IO *io)
 }
 
 static int _fd_close(IO *io);
+static int _fd_advise(IO *io, int64_t offset, int64_t length, int advice);
+static int _fd_truncate(IO *io, int64_t size);
 
 static const IO_METHOD _fd_method = {
 	IO_POSIX,
@@ -31,7 +36,9 @@ static const IO_METHOD _fd_method = {
 	_fd_seek,
 	_fd_tell,
 	_fd_flush,
-	_fd_close
+	_fd_close,
+	_fd_advise,
+	_fd_truncate,
 };
 
 #define CHUNK_SIZE 1073741824L
@@ -183,6 +190,84 @@ static int _fd_close(IO *io)
 	return ret;
 }
 
+int _io_fd_advise(int fd, int64_t offset, int64_t length, int advice)
+{
+#if defined(_WIN32) || !defined(POSIX_FADV_NORMAL)
+	return -2;
+#else
+	int fadv;
+
+	switch (advice) {
+	case IO_ADVICE_NORMAL:
+		fadv = POSIX_FADV_NORMAL;
+		break;
+	case IO_ADVICE_SEQUENTIAL:
+		fadv = POSIX_FADV_SEQUENTIAL;
+		break;
+	case IO_ADVICE_RANDOM:
+		fadv = POSIX_FADV_RANDOM;
+		break;
+	case IO_ADVICE_WILLNEED:
+#ifdef __linux__
+		/* Unlike fadvise, readahead() is not capped by the
+		 * device readahead window */
+		if (length > 0)
+			return readahead(fd, offset, length);
+#endif
+		fadv = POSIX_FADV_WILLNEED;
+		break;
+	case IO_ADVICE_DONTNEED:
+		fadv = POSIX_FADV_DONTNEED;
+		break;
+	default:
+		return -1;
+	}
+
+	return posix_fadvise(fd, offset, length, fadv) == 0 ? 0 : -1;
+#endif
+}
+
+int64_t _io_fd_copy(int in_fd, int64_t *in_offset, int out_fd,
+                    int64_t *out_offset, int64_t size)
+{
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	off64_t in_off = *in_offset, out_off = *out_offset;
+	int64_t copied = 0;
+	ssize_t ret;
+
+	while (copied < size) {
+		ret = copy_file_range(in_fd, &in_off, out_fd, &out_off,
+		                      size - copied, 0);
+		if (ret <= 0)
+			break;
+		copied += ret;
+	}
+
+	*in_offset  = in_off;
+	*out_offset = out_off;
+	return copied;
+#else
+	return 0;
+#endif
+}
+
+static int _fd_advise(IO *io, int64_t offset, int64_t length, int advice)
+{
+	assert(io);
+	return _io_fd_advise(io->handle, offset, length, advice);
+}
+
+static int _fd_truncate(IO *io, int64_t size)
+{
+	assert(io);
+#ifdef _WIN32
+	return _chsize_s((int)io->handle, size) == 0 ? 0 : -1;
+#else
+	return ftruncate((int)io->handle, (off_t)size) == 0 ? 0 : -1;
+#endif
+}
+
 IO *IO_create_fd(int fd, int should_close)
 {
 	IO *result;
@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 
+#define COPY_BUFFER_SIZE 1048576
+
 IO *IO_create(const IO_METHOD *method)
 {
 	IO *result;
@@ -105,3 +107,99 @@ int IO_flush(IO *io)
 
 	return ret;
 }
+
+int IO_advise(IO *io, int64_t offset, int64_t length, int advice)
+{
+	int ret;
+
+	if (!io)
+		return -1;
+
+	if (io->method->advise)
+		ret = io->method->advise(io, offset, length, advice);
+	else
+		ret = -2;
+
+	return ret;
+}
+
+int IO_truncate(IO *io, int64_t size)
+{
+	int ret;
+
+	if (!io || size < 0)
+		return -1;
+
+	if (io->method->truncate)
+		ret = io->method->truncate(io, size);
+	else
+		ret = -2;
+
+	return ret;
+}
+
+/* Descriptor of streams which are plain files, -1 for others */
+static int _io_copy_fd(IO *io)
+{
+	switch (io->method->type) {
+	case IO_POSIX:
+		return (int)io->handle;
+#ifndef _WIN32
+	case IO_CFILE:
+		return fileno((FILE *)io->ptr);
+#endif
+	default:
+		return -1;
+	}
+}
+
+int64_t IO_copy(IO *from, IO *to, int64_t size)
+{
+	int64_t copied = 0, in, out, n;
+	int in_fd, out_fd;
+	char *buffer;
+
+	if (!from || !to || size < 0)
+		return -1;
+
+	/* Files are copied by the kernel, without going through buffers */
+	in_fd  = _io_copy_fd(from);
+	out_fd = _io_copy_fd(to);
+	if (in_fd >= 0 && out_fd >= 0 && IO_flush(to) == 0) {
+		in  = IO_tell(from);
+		out = IO_tell(to);
+		if (in >= 0 && out >= 0)
+			copied = _io_fd_copy(in_fd, &in, out_fd, &out, size);
+		if (copied > 0 && (IO_seek(from, in, IO_SEEK_SET) < 0 ||
+		                   IO_seek(to, out, IO_SEEK_SET) < 0))
+			return -1;
+	}
+	if (copied == size)
+		return copied;
+
+	buffer = malloc(COPY_BUFFER_SIZE);
+	if (!buffer)
+		return -1;
+
+	while (copied < size) {
+		n = size - copied;
+		if (n > COPY_BUFFER_SIZE)
+			n = COPY_BUFFER_SIZE;
+
+		n = IO_read(from, buffer, n);
+		if (n < 0) {
+			copied = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		if (IO_write(to, buffer, n) != n) {
+			copied = -1;
+			break;
+		}
+		copied += n;
+	}
+
+	free(buffer);
+	return copied;
+}
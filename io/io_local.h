@@ -29,6 +29,14 @@ struct io_method_st {
 	int64_t (*tell)(IO *io);
 	int (*flush)(IO *io);
 	int (*close)(IO *io);
+	int (*advise)(IO *io, int64_t offset, int64_t length, int advice);
+	int (*truncate)(IO *io, int64_t size);
 };
 
+int _io_fd_advise(int fd, int64_t offset, int64_t length, int advice);
+
+/* Copies within the kernel where it can, returns the bytes copied */
+int64_t _io_fd_copy(int in_fd, int64_t *in_offset, int out_fd,
+                    int64_t *out_offset, int64_t size);
+
 #endif
@@ -0,0 +1,371 @@
+#include <io/io.h>
+#include <io/thread.h>
+
+#include "io_local.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Read-only wrapper which keeps reading the source stream in a
+ * background thread into a ring of blocks, so the consumer finds the
+ * next records already in memory while it is busy with the current one.
+ */
+
+#define PREFETCH_DEFAULT_BLOCK_SIZE 1048576L
+#define PREFETCH_DEFAULT_BLOCKS     8
+
+struct prefetch_slot {
+	uint8_t *data;
+	int64_t length;
+};
+
+struct prefetch_io {
+	IO *source;
+	bool close_source;
+
+	IO_THREAD thread;
+	IO_MUTEX lock;
+	IO_COND cond;
+
+	struct prefetch_slot *slots;
+	int blocks;
+	int64_t block_size;
+
+	/* Protected by lock */
+	int head;
+	int tail;
+	int filled;
+	bool eof;
+	bool error;
+	bool stop;
+	bool paused;
+	bool busy;
+
+	/* Owned by the consumer */
+	int64_t consumed;
+	int64_t position;
+};
+
+static int64_t _prefetch_read(IO *io, void *buffer, int64_t size);
+static int64_t _prefetch_seek(IO *io, int64_t offset, int whence);
+static int64_t _prefetch_tell(IO *io);
+static int _prefetch_flush(IO *io);
+static int _prefetch_close(IO *io);
+static int _prefetch_advise(IO *io, int64_t offset, int64_t length,
+                            int advice);
+
+static const IO_METHOD _prefetch_method = {
+	IO_PREFETCH,
+	_prefetch_read,
+	NULL,
+	_prefetch_seek,
+	_prefetch_tell,
+	_prefetch_flush,
+	_prefetch_close,
+	_prefetch_advise,
+	NULL,
+};
+
+static void *_prefetch_thread(void *arg)
+{
+	struct prefetch_io *p = arg;
+	struct prefetch_slot *slot;
+	int64_t n_read;
+
+	IO_mutex_lock(&p->lock);
+	while (!p->stop) {
+		if (p->paused || p->eof || p->error || p->filled == p->blocks) {
+			IO_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		slot    = &p->slots[p->tail];
+		p->busy = true;
+		IO_mutex_unlock(&p->lock);
+
+		n_read = IO_read(p->source, slot->data, p->block_size);
+
+		IO_mutex_lock(&p->lock);
+		p->busy = false;
+		if (p->paused) {
+			/* The stream has been repositioned meanwhile */
+			IO_cond_broadcast(&p->cond);
+			continue;
+		}
+
+		if (n_read < 0) {
+			p->error = true;
+		} else if (n_read == 0) {
+			p->eof = true;
+		} else {
+			slot->length = n_read;
+			p->tail      = (p->tail + 1) % p->blocks;
+			p->filled++;
+		}
+		IO_cond_broadcast(&p->cond);
+	}
+	IO_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static int64_t _prefetch_read(IO *io, void *buffer, int64_t size)
+{
+	struct prefetch_io *p;
+	struct prefetch_slot *slot;
+	uint8_t *dst      = buffer;
+	int64_t total     = 0;
+	int64_t n;
+	bool error;
+
+	assert(io);
+	assert(io->ptr);
+	p = (struct prefetch_io *)io->ptr;
+
+	while (total < size) {
+		IO_mutex_lock(&p->lock);
+		while (p->filled == 0 && !p->eof && !p->error)
+			IO_cond_wait(&p->cond, &p->lock);
+		error = p->error;
+		if (p->filled == 0) {
+			IO_mutex_unlock(&p->lock);
+			if (total == 0 && error)
+				return -1;
+			break;
+		}
+		slot = &p->slots[p->head];
+		IO_mutex_unlock(&p->lock);
+
+		/* The head slot is never touched by the thread while filled */
+		n = slot->length - p->consumed;
+		if (n > size - total)
+			n = size - total;
+		memcpy(dst + total, slot->data + p->consumed, n);
+		p->consumed += n;
+		total += n;
+
+		if (p->consumed == slot->length) {
+			IO_mutex_lock(&p->lock);
+			p->head = (p->head + 1) % p->blocks;
+			p->filled--;
+			p->consumed = 0;
+			IO_cond_broadcast(&p->cond);
+			IO_mutex_unlock(&p->lock);
+		}
+	}
+
+	p->position += total;
+	return total;
+}
+
+/* Must be called with the lock held */
+static int64_t _prefetch_buffered(struct prefetch_io *p)
+{
+	int64_t result = -p->consumed;
+	int i, slot;
+
+	for (i = 0; i < p->filled; i++) {
+		slot = (p->head + i) % p->blocks;
+		result += p->slots[slot].length;
+	}
+
+	return result;
+}
+
+static int64_t _prefetch_seek(IO *io, int64_t offset, int whence)
+{
+	struct prefetch_io *p;
+	int64_t target, ret, skip;
+	struct prefetch_slot *slot;
+
+	assert(io);
+	assert(io->ptr);
+	p = (struct prefetch_io *)io->ptr;
+
+	switch (whence) {
+	case IO_SEEK_SET:
+		target = offset;
+		break;
+	case IO_SEEK_CUR:
+		target = p->position + offset;
+		break;
+	case IO_SEEK_END:
+		target = -1;
+		break;
+	default:
+		return -1;
+	}
+
+	IO_mutex_lock(&p->lock);
+
+	/* Short forward jumps (skipped records) stay inside the ring */
+	if (target >= p->position &&
+	    target - p->position <= _prefetch_buffered(p)) {
+		skip = target - p->position;
+		while (skip > 0) {
+			slot = &p->slots[p->head];
+			if (slot->length - p->consumed > skip) {
+				p->consumed += skip;
+				break;
+			}
+
+			skip -= slot->length - p->consumed;
+			p->head     = (p->head + 1) % p->blocks;
+			p->consumed = 0;
+			p->filled--;
+		}
+		IO_cond_broadcast(&p->cond);
+		IO_mutex_unlock(&p->lock);
+
+		p->position = target;
+		return target;
+	}
+
+	p->paused = true;
+	while (p->busy)
+		IO_cond_wait(&p->cond, &p->lock);
+
+	if (whence == IO_SEEK_END)
+		ret = IO_seek(p->source, offset, IO_SEEK_END);
+	else
+		ret = IO_seek(p->source, target, IO_SEEK_SET);
+
+	if (ret >= 0) {
+		p->head     = 0;
+		p->tail     = 0;
+		p->filled   = 0;
+		p->consumed = 0;
+		p->eof      = false;
+		p->error    = false;
+		p->position = ret;
+	}
+
+	p->paused = false;
+	IO_cond_broadcast(&p->cond);
+	IO_mutex_unlock(&p->lock);
+
+	return ret;
+}
+
+static int64_t _prefetch_tell(IO *io)
+{
+	assert(io);
+	assert(io->ptr);
+	return ((struct prefetch_io *)io->ptr)->position;
+}
+
+static int _prefetch_flush(IO *io)
+{
+	(void)io;
+	return 0;
+}
+
+static int _prefetch_advise(IO *io, int64_t offset, int64_t length,
+                            int advice)
+{
+	assert(io);
+	assert(io->ptr);
+	return IO_advise(((struct prefetch_io *)io->ptr)->source, offset,
+	                 length, advice);
+}
+
+static void _prefetch_free(struct prefetch_io *p)
+{
+	int i;
+
+	if (p->slots) {
+		for (i = 0; i < p->blocks; i++)
+			free(p->slots[i].data);
+		free(p->slots);
+	}
+	free(p);
+}
+
+static int _prefetch_close(IO *io)
+{
+	struct prefetch_io *p;
+	int ret = 0;
+
+	assert(io);
+	if (!io->ptr)
+		return 0;
+	p = (struct prefetch_io *)io->ptr;
+
+	IO_mutex_lock(&p->lock);
+	p->stop = true;
+	IO_cond_broadcast(&p->cond);
+	IO_mutex_unlock(&p->lock);
+	IO_thread_join(&p->thread, NULL);
+
+	IO_cond_destroy(&p->cond);
+	IO_mutex_destroy(&p->lock);
+
+	if (p->close_source)
+		ret = IO_close(p->source);
+
+	_prefetch_free(p);
+	io->ptr = NULL;
+	return ret;
+}
+
+IO *IO_create_prefetch(IO *source, int64_t block_size, int blocks,
+                       int should_close)
+{
+	IO *result;
+	struct prefetch_io *p;
+	int i;
+
+	if (!source)
+		return NULL;
+	if (block_size <= 0)
+		block_size = PREFETCH_DEFAULT_BLOCK_SIZE;
+	if (blocks <= 0)
+		blocks = PREFETCH_DEFAULT_BLOCKS;
+
+	p = calloc(1, sizeof(struct prefetch_io));
+	if (!p)
+		return NULL;
+
+	p->source       = source;
+	p->close_source = !!should_close;
+	p->block_size   = block_size;
+	p->blocks       = blocks;
+	p->position     = IO_tell(source);
+	if (p->position < 0)
+		p->position = 0;
+
+	p->slots = calloc(blocks, sizeof(struct prefetch_slot));
+	if (!p->slots)
+		goto fail0;
+	for (i = 0; i < blocks; i++) {
+		p->slots[i].data = malloc(block_size);
+		if (!p->slots[i].data)
+			goto fail0;
+	}
+
+	result = IO_create(&_prefetch_method);
+	if (!result)
+		goto fail0;
+	result->ptr = p;
+
+	if (IO_mutex_init(&p->lock) < 0)
+		goto fail1;
+	if (IO_cond_init(&p->cond) < 0)
+		goto fail2;
+	if (IO_thread_create(&p->thread, _prefetch_thread, p) < 0)
+		goto fail3;
+
+	return result;
+
+fail3:
+	IO_cond_destroy(&p->cond);
+fail2:
+	IO_mutex_destroy(&p->lock);
+fail1:
+	free(result);
+fail0:
+	_prefetch_free(p);
+	return NULL;
+}
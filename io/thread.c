@@ -0,0 +1,149 @@
+#include <io/thread.h>
+
+#include <assert.h>
+
+#ifdef _WIN32
+
+static DWORD WINAPI _thread_start(LPVOID param)
+{
+	IO_THREAD *thread = (IO_THREAD *)param;
+
+	thread->result = thread->start(thread->arg);
+	return 0;
+}
+
+int IO_thread_create(IO_THREAD *thread, void *(*start)(void *), void *arg)
+{
+	assert(thread);
+
+	thread->start  = start;
+	thread->arg    = arg;
+	thread->result = NULL;
+	thread->handle = CreateThread(NULL, 0, _thread_start, thread, 0, NULL);
+	if (!thread->handle)
+		return -1;
+
+	return 0;
+}
+
+int IO_thread_join(IO_THREAD *thread, void **result)
+{
+	assert(thread);
+
+	if (WaitForSingleObject(thread->handle, INFINITE) != WAIT_OBJECT_0)
+		return -1;
+	CloseHandle(thread->handle);
+	thread->handle = NULL;
+
+	if (result)
+		*result = thread->result;
+	return 0;
+}
+
+int IO_mutex_init(IO_MUTEX *mutex)
+{
+	InitializeCriticalSection(mutex);
+	return 0;
+}
+
+void IO_mutex_destroy(IO_MUTEX *mutex)
+{
+	DeleteCriticalSection(mutex);
+}
+
+void IO_mutex_lock(IO_MUTEX *mutex)
+{
+	EnterCriticalSection(mutex);
+}
+
+void IO_mutex_unlock(IO_MUTEX *mutex)
+{
+	LeaveCriticalSection(mutex);
+}
+
+int IO_cond_init(IO_COND *cond)
+{
+	InitializeConditionVariable(cond);
+	return 0;
+}
+
+void IO_cond_destroy(IO_COND *cond)
+{
+	(void)cond;
+}
+
+void IO_cond_wait(IO_COND *cond, IO_MUTEX *mutex)
+{
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+void IO_cond_signal(IO_COND *cond)
+{
+	WakeConditionVariable(cond);
+}
+
+void IO_cond_broadcast(IO_COND *cond)
+{
+	WakeAllConditionVariable(cond);
+}
+
+#else
+
+int IO_thread_create(IO_THREAD *thread, void *(*start)(void *), void *arg)
+{
+	assert(thread);
+	return pthread_create(&thread->handle, NULL, start, arg) == 0 ? 0 : -1;
+}
+
+int IO_thread_join(IO_THREAD *thread, void **result)
+{
+	assert(thread);
+	return pthread_join(thread->handle, result) == 0 ? 0 : -1;
+}
+
+int IO_mutex_init(IO_MUTEX *mutex)
+{
+	return pthread_mutex_init(mutex, NULL) == 0 ? 0 : -1;
+}
+
+void IO_mutex_destroy(IO_MUTEX *mutex)
+{
+	pthread_mutex_destroy(mutex);
+}
+
+void IO_mutex_lock(IO_MUTEX *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void IO_mutex_unlock(IO_MUTEX *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+int IO_cond_init(IO_COND *cond)
+{
+	return pthread_cond_init(cond, NULL) == 0 ? 0 : -1;
+}
+
+void IO_cond_destroy(IO_COND *cond)
+{
+	pthread_cond_destroy(cond);
+}
+
+void IO_cond_wait(IO_COND *cond, IO_MUTEX *mutex)
+{
+	pthread_cond_wait(cond, mutex);
+}
+
+void IO_cond_signal(IO_COND *cond)
+{
+	pthread_cond_signal(cond);
+}
+
+void IO_cond_broadcast(IO_COND *cond)
+{
+	pthread_cond_broadcast(cond);
+}
+
+#endif
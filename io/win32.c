@@ -11,6 +11,7 @@ static int64_t _w32_seek(IO *io, int64_t offset, int whence);
 static int64_t _w32_tell(IO *io);
 static int _w32_flush(IO *io);
 static int _w32_close(IO *io);
+static int _w32_truncate(IO *io, int64_t size);
 
 static const IO_METHOD _w32_method = {
 	IO_WIN32,
@@ -20,6 +21,8 @@ static const IO_METHOD _w32_method = {
 	_w32_tell,
 	_w32_flush,
 	_w32_close,
+	NULL,
+	_w32_truncate,
 };
 
 #define CHUNK_SIZE 1073741824L
@@ -168,6 +171,24 @@ static int _w32_close(IO *io)
 	return 0;
 }
 
+/* Moves the file pointer to the new end as well */
+static int _w32_truncate(IO *io, int64_t size)
+{
+	HANDLE hFile;
+	LARGE_INTEGER distance;
+
+	assert(io);
+	hFile = (HANDLE)io->handle;
+
+	distance.QuadPart = size;
+	if (!SetFilePointerEx(hFile, distance, NULL, FILE_BEGIN))
+		return -1;
+	if (!SetEndOfFile(hFile))
+		return -1;
+
+	return 0;
+}
+
 IO *IO_create_handle(HANDLE hFile, int should_close)
 {
 	IO *result;
@@ -0,0 +1,166 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+
+#include "kcf_impl.h"
+
+/*
+ * Appending to an existing archive: new files are written where the
+ * last complete record ends, nothing before it is rewritten. Every
+ * file carries its own tables, so there is no index to update. The end
+ * is found from the tail of the stream when the last record ends right
+ * at its end, otherwise by walking the record headers from the archive
+ * header on. A record cut short by an interrupted write, and a file
+ * whose data fragments didn't all make it, are cut off the stream.
+ */
+
+/* The last record is looked for in that many bytes at the end */
+#define TAIL_SCAN_SIZE (1 << 20)
+
+/* True if a complete record which finishes a file ends at Size */
+static KCFERROR scan_tail(IO *Stream, int64_t Start, int64_t Size,
+                          bool *Found)
+{
+	uint8_t *Buffer;
+	size_t Length, Position;
+	uint64_t RecordSize;
+	int64_t Offset;
+
+	*Found = false;
+
+	Offset = Size - TAIL_SCAN_SIZE;
+	if (Offset < Start)
+		Offset = Start;
+	Length = (size_t)(Size - Offset);
+
+	Buffer = malloc(Length);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	if (IO_seek(Stream, Offset, IO_SEEK_SET) < 0 ||
+	    IO_read(Stream, Buffer, Length) < (int64_t)Length) {
+		free(Buffer);
+		return KCF_ERROR_READ;
+	}
+
+	for (Position = 0; Position + KCF_MIN_HEADER_SIZE <= Length;
+	     Position++) {
+		RecordSize = rec_plausible_size(Buffer + Position,
+		                                Length - Position);
+		if (RecordSize != Length - Position)
+			continue;
+
+		*Found = !(Buffer[Position + 3] & KCF_HAS_CONTINUATION);
+		break;
+	}
+
+	free(Buffer);
+	return KCF_ERROR_OK;
+}
+
+/*
+ * Goes through the records after the archive header up to Size. A file
+ * header whose added size is still 0 followed by something which is not
+ * a record is the header of a file whose writing was interrupted, it
+ * would have been patched at the end of the file.
+ */
+static KCFERROR walk_records(KCF *kcf, int64_t Size, uint64_t *End)
+{
+	struct KcfRecord Record = {0};
+	uint64_t Next, FileStart = 0, Unpatched = 0;
+	KCFERROR Error;
+
+	for (;;) {
+		Error = KCF_read_record(kcf, &Record);
+		if (!Error && !rec_validate(&Record))
+			Error = KCF_ERROR_INVALID_DATA;
+		if (Unpatched && (Error == KCF_ERROR_INVALID_DATA ||
+		                  Error == KCF_ERROR_PREMATURE_EOF)) {
+			FileStart = Unpatched;
+			Error     = KCF_ERROR_OK;
+			break;
+		}
+		if (Error == KCF_ERROR_EOF || Error == KCF_ERROR_PREMATURE_EOF) {
+			Error = KCF_ERROR_OK;
+			break;
+		}
+		if (Error)
+			goto cleanup;
+
+		Next = kcf->RecordOffset + Record.HeadSize + Record.AddedSize;
+		if (Next > (uint64_t)Size) {
+			if (Unpatched)
+				FileStart = Unpatched;
+			break;
+		}
+
+		/* Data fragments follow the header while it has the flag */
+		if (!(Record.HeadFlags & KCF_HAS_CONTINUATION))
+			FileStart = 0;
+		else if (Record.HeadType == KCF_FILE_HEADER ||
+		         Record.HeadType == KCF_DELETED_FILE)
+			FileStart = kcf->RecordOffset;
+
+		Unpatched = 0;
+		if (Record.HeadType == KCF_FILE_HEADER &&
+		    rec_has_added_size(&Record) && Record.AddedSize == 0)
+			Unpatched = kcf->RecordOffset;
+
+		rec_clear(&Record);
+		if (IO_seek(kcf->Stream, Next, IO_SEEK_SET) < 0) {
+			Error = KCF_ERROR_READ;
+			goto cleanup;
+		}
+		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+	}
+
+	*End = FileStart ? FileStart : kcf->RecordOffset;
+
+cleanup:
+	rec_clear(&Record);
+	return Error;
+}
+
+KCFERROR KCF_append_archive(KCF *kcf)
+{
+	int64_t Start, Size;
+	uint64_t End;
+	bool AtEnd;
+	KCFERROR Error;
+
+	if ((Error = KCF_open_archive(kcf)))
+		return Error;
+	if (kcf->IsMultiVolume)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	Start = IO_tell(kcf->Stream);
+	Size  = IO_seek(kcf->Stream, 0, IO_SEEK_END);
+	if (Start < 0 || Size < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	End   = (uint64_t)Size;
+	AtEnd = Start == Size;
+	if (!AtEnd && (Error = scan_tail(kcf->Stream, Start, Size, &AtEnd)))
+		return Error;
+
+	if (!AtEnd) {
+		if (IO_seek(kcf->Stream, Start, IO_SEEK_SET) < 0)
+			return KCF_ERROR_READ;
+		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+		if ((Error = walk_records(kcf, Size, &End)))
+			return Error;
+	}
+
+	/* Readers would take what is left of it for records */
+	if (End < (uint64_t)Size && IO_truncate(kcf->Stream, End) < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	if (IO_seek(kcf->Stream, End, IO_SEEK_SET) < 0)
+		return KCF_ERROR_WRITE;
+
+	kcf->RecordOffset = End;
+	kcf->ParserState  = KCF_PSTATE_WRITE_RECORD;
+	kcf->PackerState  = KCF_PKSTATE_IDLE;
+	return KCF_ERROR_OK;
+}
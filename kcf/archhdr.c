@@ -9,6 +9,8 @@
 KCFERROR rec_to_archive_header(struct KcfRecord *Record,
                                struct KcfArchiveHeader *Header)
 {
+	ptrdiff_t Offset = 0;
+
 	if (!Record)
 		return KCF_ERROR_INVALID_PARAMETER;
 	if (!Header)
@@ -21,20 +23,40 @@ KCFERROR rec_to_archive_header(struct KcfRecord *Record,
 	if (Record->HeadSize < 8)
 		return KCF_ERROR_INVALID_DATA;
 
-	ReadU16LE(Record->Data, Record->DataSize, NULL,
+	ahdr_clear(Header);
+	ReadU16LE(Record->Data, Record->DataSize, &Offset,
 	          &Header->ArchiveVersion);
+
+	/* Optional, present in volumes of multi-volume archives */
+	if (ReadU16LE(Record->Data, Record->DataSize, &Offset,
+	              &Header->ArchiveFlags))
+		ReadU32LE(Record->Data, Record->DataSize, &Offset,
+		          &Header->VolumeNumber);
+
 	return KCF_ERROR_OK;
 }
 
 KCFERROR rec_from_archive_header(struct KcfArchiveHeader *Header,
                                  struct KcfRecord *Record)
 {
+	ptrdiff_t Offset = 0;
+	size_t Size;
+
 	if (!Record || !Header)
 		return KCF_ERROR_INVALID_PARAMETER;
 
-	Record->Data = malloc(2);
-	WriteU16LE(Record->Data, 2, NULL, Header->ArchiveVersion);
-	Record->DataSize  = 2;
+	Size = Header->ArchiveFlags ? 8 : 2;
+
+	Record->Data = malloc(Size);
+	if (!Record->Data)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	WriteU16LE(Record->Data, Size, &Offset, Header->ArchiveVersion);
+	if (Header->ArchiveFlags) {
+		WriteU16LE(Record->Data, Size, &Offset, Header->ArchiveFlags);
+		WriteU32LE(Record->Data, Size, &Offset, Header->VolumeNumber);
+	}
+	Record->DataSize  = Size;
 	Record->HeadFlags = 0;
 	Record->HeadType  = KCF_ARCHIVE_HEADER;
 	rec_fix(Record);
@@ -16,15 +16,39 @@ KCFERROR KCF_create(IO *stream, KCF **pkcf)
 		return KCF_ERROR_OUT_OF_MEMORY;
 	}
 
-	result->Stream = stream;
+	result->Stream     = stream;
+	result->BaseStream = stream;
 
 	*pkcf = result;
 	return KCF_ERROR_OK;
 }
 
-void KCF_close(KCF *kcf)
+KCFERROR KCF_close(KCF *kcf)
 {
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	if (kcf->ParserState == KCF_PSTATE_WRITE_ADDED_DATA)
+		Error = KCF_finish_added_data(kcf);
+
+	/* Wrappers created by the library itself */
+	if (kcf->Stream != kcf->BaseStream) {
+		if (IO_close(kcf->Stream) < 0 && !Error)
+			Error = KCF_ERROR_WRITE;
+	}
+
+	block_crcs_free(&kcf->BlockCRCs);
+	frames_free(&kcf->Frames);
+	solid_window_free(&kcf->SolidWindow);
+	dedup_free(&kcf->Dedup);
+	member_map_clear(&kcf->RangeMap);
+	member_index_clear(&kcf->Members);
+	rec_clear(&kcf->LastRecord);
+	file_info_clear(&kcf->CurrentFile);
 	free(kcf);
+	return Error;
 }
 
 KCFERROR KCF_start_reading(KCF *kcf)
@@ -96,3 +120,117 @@ KCFERROR KCF_init_archive(KCF *kcf)
 
 	return KCF_ERROR_OK;
 }
+
+KCFERROR KCF_open_archive(KCF *kcf)
+{
+	struct KcfRecord Record = {0};
+	struct KcfArchiveHeader Header;
+	KCFERROR Error;
+
+	if ((Error = KCF_start_reading(kcf)))
+		return Error;
+
+	if ((Error = KCF_find_marker(kcf)))
+		return Error;
+
+	Error = KCF_read_record(kcf, &Record);
+	if (!Error)
+		Error = rec_to_archive_header(&Record, &Header);
+	rec_clear(&Record);
+	if (Error)
+		return Error;
+
+	kcf->IsMultiVolume = !!(Header.ArchiveFlags & KCF_ARCHIVE_MULTIVOLUME);
+	kcf->VolumeNumber  = Header.VolumeNumber;
+
+	kcf->UnpackerState     = KCF_UPSTATE_FILE_HEADER;
+	kcf->IsSolidChainValid = true;
+	kcf->HasDeletedFiles   = false;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_set_recovery_mode(KCF *kcf, bool Enabled)
+{
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	kcf->IsRecovering = Enabled;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_set_skip_callback(KCF *kcf, KcfSkipCallback Callback,
+                               void *Context)
+{
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	kcf->SkipCallback = Callback;
+	kcf->SkipContext  = Context;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_set_access_pattern(KCF *kcf, enum KcfAccessPattern Pattern)
+{
+	int advice;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	switch (Pattern) {
+	case KCF_ACCESS_NORMAL:
+		advice = IO_ADVICE_NORMAL;
+		break;
+	case KCF_ACCESS_SEQUENTIAL:
+		advice = IO_ADVICE_SEQUENTIAL;
+		break;
+	case KCF_ACCESS_RANDOM:
+		advice = IO_ADVICE_RANDOM;
+		break;
+	default:
+		return KCF_ERROR_INVALID_PARAMETER;
+	}
+
+	/* Only a hint, streams which don't support it are fine */
+	IO_advise(kcf->Stream, 0, 0, advice);
+	kcf->AccessPattern = Pattern;
+
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_enable_prefetch(KCF *kcf, size_t BlockSize, int Blocks)
+{
+	IO *Prefetcher;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (KCF_PSTATE_IS_WRITING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+	if (kcf->Stream != kcf->BaseStream)
+		return KCF_ERROR_INVALID_STATE;
+
+	Prefetcher = IO_create_prefetch(kcf->Stream, BlockSize, Blocks, 0);
+	if (!Prefetcher)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	kcf->Stream = Prefetcher;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_enable_async_writing(KCF *kcf, size_t BufferSize)
+{
+	IO *Writer;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->ParserState == KCF_PSTATE_WRITE_ADDED_DATA)
+		return KCF_ERROR_INVALID_STATE;
+	if (kcf->Stream != kcf->BaseStream)
+		return KCF_ERROR_INVALID_STATE;
+
+	Writer = IO_create_async_writer(kcf->Stream, BufferSize, 0);
+	if (!Writer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	kcf->Stream = Writer;
+	return KCF_ERROR_OK;
+}
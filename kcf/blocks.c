@@ -0,0 +1,449 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <io/thread.h>
+
+#include "crc32c.h"
+#include "kcf_impl.h"
+
+/*
+ * Block checksum table: record 'B' right after the data of a file with
+ * CRC32C of every BlockSize bytes of it. Unlike the CRC of a whole
+ * fragment, a block can be checked without reading anything else, so
+ * one large file can be checked by many threads at once.
+ */
+
+/* Ranges are read and checked in pieces of that size */
+#define CHECK_BUFFER_SIZE 1048576L
+
+#define MAX_CHECK_THREADS 64
+
+KCFERROR KCF_set_block_checksums(KCF *kcf, uint32_t BlockSize)
+{
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (BlockSize && BlockSize < KCF_MIN_CHECKSUM_BLOCK_SIZE)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->PackerState == KCF_PKSTATE_FILE_DATA ||
+	    kcf->PackerState == KCF_PKSTATE_AFTER_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	block_crcs_reset(&kcf->BlockCRCs, BlockSize);
+	return KCF_ERROR_OK;
+}
+
+void block_crcs_reset(struct block_crcs *Table, uint32_t BlockSize)
+{
+	Table->Count       = 0;
+	Table->DataSize    = 0;
+	Table->BlockSize   = BlockSize;
+	Table->Current     = 0;
+	Table->CurrentSize = 0;
+}
+
+static bool push_crc(struct block_crcs *Table, uint32_t CRC)
+{
+	uint32_t *CRCs;
+	uint64_t Capacity;
+
+	if (Table->Count == Table->Capacity) {
+		Capacity = Table->Capacity ? Table->Capacity * 2 : 64;
+		CRCs     = realloc(Table->CRCs, Capacity * sizeof(uint32_t));
+		if (!CRCs)
+			return false;
+		Table->CRCs     = CRCs;
+		Table->Capacity = Capacity;
+	}
+
+	Table->CRCs[Table->Count++] = CRC;
+	return true;
+}
+
+bool block_crcs_update(struct block_crcs *Table, const uint8_t *Data,
+                       size_t Size)
+{
+	size_t Length;
+
+	if (!Table->BlockSize)
+		return true;
+
+	Table->DataSize += Size;
+	while (Size > 0) {
+		Length = Table->BlockSize - Table->CurrentSize;
+		if (Length > Size)
+			Length = Size;
+
+		Table->Current = crc32c(Table->Current, Data, Length);
+		Table->CurrentSize += Length;
+		Data += Length;
+		Size -= Length;
+
+		if (Table->CurrentSize == Table->BlockSize) {
+			if (!push_crc(Table, Table->Current))
+				return false;
+			Table->Current     = 0;
+			Table->CurrentSize = 0;
+		}
+	}
+
+	return true;
+}
+
+void block_crcs_free(struct block_crcs *Table)
+{
+	free(Table->CRCs);
+	Table->CRCs     = NULL;
+	Table->Capacity = 0;
+	block_crcs_reset(Table, Table->BlockSize);
+}
+
+KCFERROR KCF_write_block_table(KCF *kcf)
+{
+	struct block_crcs *Table = &kcf->BlockCRCs;
+	struct KcfRecord Record  = {0};
+	uint8_t Data[4], *Buffer;
+	uint64_t i;
+	KCFERROR Error;
+
+	/* The CRC of the fragment does the same job */
+	if (!Table->BlockSize || Table->DataSize <= Table->BlockSize)
+		goto done;
+
+	if (Table->CurrentSize && !push_crc(Table, Table->Current))
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	Buffer = malloc(Table->Count * 4);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < Table->Count; i++)
+		StoreU32LE(Buffer + 4 * i, Table->CRCs[i]);
+	StoreU32LE(Data, Table->BlockSize);
+
+	Record.HeadType  = KCF_BLOCK_TABLE;
+	Record.HeadFlags = KCF_HAS_ADDED_DATA_CRC32;
+	Record.Data      = Data;
+	Record.DataSize  = sizeof(Data);
+
+	Error = KCF_write_record_with_added_data(kcf, &Record, Buffer,
+	                                         Table->Count * 4);
+	free(Buffer);
+	if (Error)
+		return Error;
+
+done:
+	block_crcs_reset(Table, Table->BlockSize);
+	return KCF_ERROR_OK;
+}
+
+/* Reading */
+
+void member_map_clear(struct member_map *Map)
+{
+	free(Map->Fragments);
+	free(Map->BlockCRCs);
+	free(Map->FrameOffsets);
+	Map->Fragments    = NULL;
+	Map->BlockCRCs    = NULL;
+	Map->FrameOffsets = NULL;
+	Map->Codec        = NULL;
+	Map->Count        = 0;
+	Map->Size         = 0;
+	Map->Blocks       = 0;
+	Map->BlockSize    = 0;
+	Map->Frames       = 0;
+	Map->FrameSize    = 0;
+	Map->UnpackedSize = 0;
+}
+
+uint64_t member_map_size(const struct member_map *Map)
+{
+	return Map->Codec ? Map->UnpackedSize : Map->Size;
+}
+
+void member_map_set_table(struct member_map *Map, const uint8_t *Data,
+                          size_t DataSize, const uint8_t *Table,
+                          uint64_t TableSize)
+{
+	uint32_t BlockSize;
+	uint64_t Blocks, i;
+
+	if (DataSize < 4)
+		return;
+
+	BlockSize = LoadU32LE(Data);
+	if (BlockSize < KCF_MIN_CHECKSUM_BLOCK_SIZE)
+		return;
+
+	Blocks = (Map->Size + BlockSize - 1) / BlockSize;
+	if (TableSize != Blocks * 4 || Blocks == 0)
+		return;
+
+	Map->BlockCRCs = malloc(Blocks * sizeof(uint32_t));
+	if (!Map->BlockCRCs)
+		return;
+
+	for (i = 0; i < Blocks; i++)
+		Map->BlockCRCs[i] = LoadU32LE(Table + 4 * i);
+	Map->Blocks    = Blocks;
+	Map->BlockSize = BlockSize;
+}
+
+/* The last fragment starting at or before FileOffset */
+static size_t find_fragment(const struct member_map *Map,
+                            uint64_t FileOffset)
+{
+	size_t Low = 0, High = Map->Count, Middle;
+
+	while (High - Low > 1) {
+		Middle = Low + (High - Low) / 2;
+		if (Map->Fragments[Middle].FileOffset <= FileOffset)
+			Low = Middle;
+		else
+			High = Middle;
+	}
+
+	return Low;
+}
+
+KCFERROR member_map_read(IO *Stream, const struct member_map *Map,
+                         uint64_t FileOffset, void *Buffer, size_t Size)
+{
+	const struct data_fragment *Fragment;
+	uint8_t *Destination = Buffer;
+	uint64_t Skip, Length;
+	size_t i;
+
+	if (FileOffset > Map->Size || Size > Map->Size - FileOffset)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	for (i = find_fragment(Map, FileOffset); Size > 0; i++) {
+		Fragment = &Map->Fragments[i];
+		Skip     = FileOffset - Fragment->FileOffset;
+		if (Skip >= Fragment->Size)
+			continue;
+
+		Length = Fragment->Size - Skip;
+		if (Length > Size)
+			Length = Size;
+
+		if (IO_seek(Stream, Fragment->Offset + Skip, IO_SEEK_SET) < 0)
+			return KCF_ERROR_READ;
+		if (IO_read(Stream, Destination, Length) < (int64_t)Length)
+			return KCF_ERROR_PREMATURE_EOF;
+
+		Destination += Length;
+		FileOffset += Length;
+		Size -= Length;
+	}
+
+	return KCF_ERROR_OK;
+}
+
+KCFERROR member_map_read_checked(IO *Stream, const struct member_map *Map,
+                                 uint64_t FileOffset, void *Buffer,
+                                 size_t Size)
+{
+	uint8_t *Destination = Buffer, *Block = NULL;
+	uint64_t Index, Start, Length, Skip, Copied;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (FileOffset > Map->Size || Size > Map->Size - FileOffset)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	for (Index = FileOffset / Map->BlockSize; Size > 0; Index++) {
+		Start  = Index * Map->BlockSize;
+		Length = Map->Size - Start;
+		if (Length > Map->BlockSize)
+			Length = Map->BlockSize;
+		Skip   = FileOffset - Start;
+		Copied = Length - Skip;
+		if (Copied > Size)
+			Copied = Size;
+
+		/* Whole blocks go straight to the caller */
+		if (Skip == 0 && Copied == Length) {
+			Error = member_map_read(Stream, Map, Start, Destination,
+			                        Length);
+			if (!Error && crc32c(0, Destination, Length) !=
+			                  Map->BlockCRCs[Index])
+				Error = KCF_ERROR_INVALID_DATA;
+		} else {
+			if (!Block)
+				Block = malloc(Map->BlockSize);
+			if (!Block) {
+				Error = KCF_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+
+			Error = member_map_read(Stream, Map, Start, Block, Length);
+			if (!Error &&
+			    crc32c(0, Block, Length) != Map->BlockCRCs[Index])
+				Error = KCF_ERROR_INVALID_DATA;
+			if (!Error)
+				memcpy(Destination, Block + Skip, Copied);
+		}
+		if (Error)
+			break;
+
+		Destination += Copied;
+		FileOffset += Copied;
+		Size -= Copied;
+	}
+
+	free(Block);
+	return Error;
+}
+
+/* Blocks are handed out to threads one by one */
+struct check_job {
+	const struct member_map *Map;
+	KcfVolumeOpener Opener;
+	void *Context;
+
+	/* Protected by Lock */
+	IO_MUTEX Lock;
+	uint64_t NextUnit;
+	uint64_t Units;
+	KCFERROR Error;
+};
+
+/* Unit Index is a block if there is a table and a fragment otherwise */
+static bool get_unit(const struct member_map *Map, uint64_t Index,
+                     uint64_t *Start, uint64_t *Size, uint32_t *CRC)
+{
+	const struct data_fragment *Fragment;
+
+	if (Map->BlockCRCs) {
+		*Start = Index * Map->BlockSize;
+		*Size  = Map->Size - *Start;
+		if (*Size > Map->BlockSize)
+			*Size = Map->BlockSize;
+		*CRC = Map->BlockCRCs[Index];
+		return true;
+	}
+
+	Fragment = &Map->Fragments[Index];
+	*Start   = Fragment->FileOffset;
+	*Size    = Fragment->Size;
+	*CRC     = Fragment->CRC;
+	return Fragment->HasCRC;
+}
+
+static KCFERROR check_unit(IO *Stream, const struct member_map *Map,
+                           uint64_t Index, uint8_t *Buffer)
+{
+	uint64_t Start, Size, Done, Length;
+	uint32_t CRC, Actual = 0;
+	KCFERROR Error;
+
+	if (!get_unit(Map, Index, &Start, &Size, &CRC))
+		return KCF_ERROR_OK;
+
+	for (Done = 0; Done < Size; Done += Length) {
+		Length = Size - Done;
+		if (Length > CHECK_BUFFER_SIZE)
+			Length = CHECK_BUFFER_SIZE;
+
+		Error = member_map_read(Stream, Map, Start + Done, Buffer, Length);
+		if (Error)
+			return Error;
+		Actual = crc32c(Actual, Buffer, Length);
+	}
+
+	return Actual == CRC ? KCF_ERROR_OK : KCF_ERROR_INVALID_DATA;
+}
+
+static void set_error(struct check_job *Job, KCFERROR Error)
+{
+	IO_mutex_lock(&Job->Lock);
+	if (!Job->Error)
+		Job->Error = Error;
+	IO_mutex_unlock(&Job->Lock);
+}
+
+static void check_units(struct check_job *Job, IO *Stream)
+{
+	uint64_t Index;
+	uint8_t *Buffer;
+	KCFERROR Error;
+
+	Buffer = malloc(CHECK_BUFFER_SIZE);
+	if (!Buffer) {
+		set_error(Job, KCF_ERROR_OUT_OF_MEMORY);
+		return;
+	}
+
+	for (;;) {
+		IO_mutex_lock(&Job->Lock);
+		if (Job->Error || Job->NextUnit == Job->Units) {
+			IO_mutex_unlock(&Job->Lock);
+			break;
+		}
+		Index = Job->NextUnit++;
+		IO_mutex_unlock(&Job->Lock);
+
+		Error = check_unit(Stream, Job->Map, Index, Buffer);
+		if (Error)
+			set_error(Job, Error);
+	}
+
+	free(Buffer);
+}
+
+static void *check_worker(void *Arg)
+{
+	struct check_job *Job = Arg;
+	IO *Stream;
+
+	/* Without a stream of its own the thread leaves its share to others */
+	Stream = Job->Opener(Job->Context, 0, false);
+	if (!Stream)
+		return NULL;
+
+	check_units(Job, Stream);
+	IO_close(Stream);
+	return NULL;
+}
+
+KCFERROR member_map_check(IO *Stream, const struct member_map *Map,
+                          int Threads, KcfVolumeOpener Opener,
+                          void *Context)
+{
+	struct check_job Job = {0};
+	IO_THREAD Workers[MAX_CHECK_THREADS];
+	int i, Started = 0;
+
+	Job.Map     = Map;
+	Job.Opener  = Opener;
+	Job.Context = Context;
+	Job.Units   = Map->BlockCRCs ? Map->Blocks : Map->Count;
+
+	if (!Opener || Threads < 1)
+		Threads = 1;
+	if (Threads > MAX_CHECK_THREADS)
+		Threads = MAX_CHECK_THREADS;
+	if ((uint64_t)Threads > Job.Units)
+		Threads = (int)Job.Units;
+	if (Threads == 0)
+		return KCF_ERROR_OK;
+
+	if (IO_mutex_init(&Job.Lock) < 0)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < Threads; i++) {
+		if (IO_thread_create(&Workers[Started], check_worker, &Job) < 0)
+			break;
+		Started++;
+	}
+	check_units(&Job, Stream);
+
+	for (i = 0; i < Started; i++)
+		IO_thread_join(&Workers[i], NULL);
+
+	IO_mutex_destroy(&Job.Lock);
+	return Job.Error;
+}
@@ -0,0 +1,144 @@
+/**
+ * \file blocks.h
+ *
+ * Block checksum tables of files and maps of the places in the archive
+ * where data of a file lies, for checking and reading ranges of a file
+ * without going through all of it.
+ */
+
+#pragma once
+#ifndef _BLOCKS_H_
+#define _BLOCKS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <kcf/archive.h>
+
+/* Smaller blocks would make the table a noticeable part of the file */
+#define KCF_MIN_CHECKSUM_BLOCK_SIZE 4096
+
+/* CRC32C of every BlockSize bytes of the file being written */
+struct block_crcs {
+	uint32_t *CRCs;
+	uint64_t Count;
+	uint64_t Capacity;
+	uint64_t DataSize;
+	uint32_t BlockSize;
+
+	/* Block being filled */
+	uint32_t Current;
+	uint32_t CurrentSize;
+};
+
+/**
+ * \brief Starts the table of the next file, 0 BlockSize disables it.
+ */
+void block_crcs_reset(struct block_crcs *Table, uint32_t BlockSize);
+bool block_crcs_update(struct block_crcs *Table, const uint8_t *Data,
+                       size_t Size);
+void block_crcs_free(struct block_crcs *Table);
+
+/**
+ * \brief Writes the block checksum table of the file which has just been
+ * finished, if the file is larger than one block.
+ */
+KCFERROR KCF_write_block_table(KCF *kcf);
+
+struct kcf_codec;
+
+/* Data of one F or D record */
+struct data_fragment {
+	uint64_t Offset;
+	uint64_t FileOffset;
+	uint64_t Size;
+	uint32_t CRC;
+	bool HasCRC;
+};
+
+struct member_map {
+	struct data_fragment *Fragments;
+	size_t Count;
+	uint64_t Size;
+
+	/* NULL if the file has no valid block checksum table */
+	uint32_t *BlockCRCs;
+	uint64_t Blocks;
+	uint32_t BlockSize;
+
+	/* Frames of a compressed file, NULL Codec for stored ones */
+	const struct kcf_codec *Codec;
+	uint64_t *FrameOffsets;
+	uint64_t Frames;
+	uint32_t FrameSize;
+	uint64_t UnpackedSize;
+
+	/* The first frame refers back to the files before it */
+	bool IsSolid;
+
+	/* Where the record after the file starts */
+	uint64_t EndOffset;
+};
+
+void member_map_clear(struct member_map *Map);
+
+/* Header of a file by its name */
+struct member_name {
+	char *Name;
+	uint64_t HeaderOffset;
+};
+
+/* Names of all files of an archive, built by one pass over it */
+struct member_index {
+	/* Sorted by name, files of the same name by HeaderOffset */
+	struct member_name *Names;
+	size_t Count;
+	size_t Capacity;
+	bool IsBuilt;
+};
+
+void member_index_clear(struct member_index *Index);
+
+/**
+ * \brief Drops the file whose header is at HeaderOffset from the index.
+ */
+void member_index_remove(struct member_index *Index, uint64_t HeaderOffset);
+
+/**
+ * \brief Size of the file data, unpacked size for compressed files.
+ */
+uint64_t member_map_size(const struct member_map *Map);
+
+/**
+ * \brief Parses the block checksum table of the file described by Map,
+ * Data is the record data, Table its added data. Leaves Map without a
+ * table if it doesn't fit the file.
+ */
+void member_map_set_table(struct member_map *Map, const uint8_t *Data,
+                          size_t DataSize, const uint8_t *Table,
+                          uint64_t TableSize);
+
+/**
+ * \brief Reads Size bytes of the file from FileOffset on.
+ */
+KCFERROR member_map_read(IO *Stream, const struct member_map *Map,
+                         uint64_t FileOffset, void *Buffer, size_t Size);
+
+/**
+ * \brief Same as `member_map_read`, but checks every block the range
+ * touches against the table.
+ */
+KCFERROR member_map_read_checked(IO *Stream, const struct member_map *Map,
+                                 uint64_t FileOffset, void *Buffer,
+                                 size_t Size);
+
+/**
+ * \brief Checks the file against its block checksums, or the CRCs of its
+ * fragments if it has no table, with up to Threads threads. Threads
+ * other than the calling one read through streams from Opener.
+ */
+KCFERROR member_map_check(IO *Stream, const struct member_map *Map,
+                          int Threads, KcfVolumeOpener Opener,
+                          void *Context);
+
+#endif
@@ -2,18 +2,206 @@
 #ifndef _BYTEPACK_H_
 #define _BYTEPACK_H_
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-bool ReadU64LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint64_t *Out);
-bool ReadU32LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint32_t *Out);
-bool ReadU16LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint16_t *Out);
-bool ReadU8(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint8_t *Out);
+/*
+ * Everything is little-endian on disk. On little-endian hosts loads and
+ * stores are plain memcpy(), which compilers turn into single moves.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BYTEPACK_LE16(x) (x)
+#define BYTEPACK_LE32(x) (x)
+#define BYTEPACK_LE64(x) (x)
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BYTEPACK_LE16(x) __builtin_bswap16(x)
+#define BYTEPACK_LE32(x) __builtin_bswap32(x)
+#define BYTEPACK_LE64(x) __builtin_bswap64(x)
+#else
+#error "Unrecognized byte order"
+#endif
+
+/* Loads and stores at a fixed offset, the caller has checked the size */
+
+static inline uint16_t LoadU16LE(const uint8_t *Buffer)
+{
+	uint16_t Value;
+
+	memcpy(&Value, Buffer, sizeof(Value));
+	return BYTEPACK_LE16(Value);
+}
+
+static inline uint32_t LoadU32LE(const uint8_t *Buffer)
+{
+	uint32_t Value;
+
+	memcpy(&Value, Buffer, sizeof(Value));
+	return BYTEPACK_LE32(Value);
+}
+
+static inline uint64_t LoadU64LE(const uint8_t *Buffer)
+{
+	uint64_t Value;
+
+	memcpy(&Value, Buffer, sizeof(Value));
+	return BYTEPACK_LE64(Value);
+}
+
+static inline void StoreU16LE(uint8_t *Buffer, uint16_t Value)
+{
+	Value = BYTEPACK_LE16(Value);
+	memcpy(Buffer, &Value, sizeof(Value));
+}
+
+static inline void StoreU32LE(uint8_t *Buffer, uint32_t Value)
+{
+	Value = BYTEPACK_LE32(Value);
+	memcpy(Buffer, &Value, sizeof(Value));
+}
+
+static inline void StoreU64LE(uint8_t *Buffer, uint64_t Value)
+{
+	Value = BYTEPACK_LE64(Value);
+	memcpy(Buffer, &Value, sizeof(Value));
+}
+
+/*
+ * Bounds-checked reads and writes at *Offset, which is moved past the
+ * field on success. Offset may be NULL for the start of the buffer.
+ */
+
+static inline bool _bytepack_fits(size_t Size, ptrdiff_t Offset,
+                                  size_t Length)
+{
+	return Offset >= 0 && (size_t)Offset <= Size &&
+	       Length <= Size - (size_t)Offset;
+}
+
+static inline bool ReadU64LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                             uint64_t *Out)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+	assert(Out);
+
+	if (!_bytepack_fits(Size, Start, 8))
+		return false;
+	*Out = LoadU64LE(Buffer + Start);
+	if (Offset)
+		*Offset = Start + 8;
+	return true;
+}
+
+static inline bool ReadU32LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                             uint32_t *Out)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+	assert(Out);
+
+	if (!_bytepack_fits(Size, Start, 4))
+		return false;
+	*Out = LoadU32LE(Buffer + Start);
+	if (Offset)
+		*Offset = Start + 4;
+	return true;
+}
+
+static inline bool ReadU16LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                             uint16_t *Out)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+	assert(Out);
+
+	if (!_bytepack_fits(Size, Start, 2))
+		return false;
+	*Out = LoadU16LE(Buffer + Start);
+	if (Offset)
+		*Offset = Start + 2;
+	return true;
+}
+
+static inline bool ReadU8(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                          uint8_t *Out)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+	assert(Out);
+
+	if (!_bytepack_fits(Size, Start, 1))
+		return false;
+	*Out = Buffer[Start];
+	if (Offset)
+		*Offset = Start + 1;
+	return true;
+}
+
+static inline bool WriteU64LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                              uint64_t In)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+
+	if (!_bytepack_fits(Size, Start, 8))
+		return false;
+	StoreU64LE(Buffer + Start, In);
+	if (Offset)
+		*Offset = Start + 8;
+	return true;
+}
+
+static inline bool WriteU32LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                              uint32_t In)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+
+	if (!_bytepack_fits(Size, Start, 4))
+		return false;
+	StoreU32LE(Buffer + Start, In);
+	if (Offset)
+		*Offset = Start + 4;
+	return true;
+}
+
+static inline bool WriteU16LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                              uint16_t In)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
+
+	if (!_bytepack_fits(Size, Start, 2))
+		return false;
+	StoreU16LE(Buffer + Start, In);
+	if (Offset)
+		*Offset = Start + 2;
+	return true;
+}
+
+static inline bool WriteU8(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset,
+                           uint8_t In)
+{
+	ptrdiff_t Start = Offset ? *Offset : 0;
+
+	assert(Buffer);
 
-bool WriteU64LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint64_t In);
-bool WriteU32LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint32_t In);
-bool WriteU16LE(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint16_t In);
-bool WriteU8(uint8_t *Buffer, size_t Size, ptrdiff_t *Offset, uint8_t In);
+	if (!_bytepack_fits(Size, Start, 1))
+		return false;
+	Buffer[Start] = In;
+	if (Offset)
+		*Offset = Start + 1;
+	return true;
+}
 
 #endif
@@ -0,0 +1,91 @@
+#include <kcf/archive.h>
+
+#include <zlib.h>
+
+#include "codec.h"
+
+static size_t deflate_bound(size_t Size)
+{
+	return compressBound(Size);
+}
+
+/* zlib data with a dictionary carries its Adler-32 in the header */
+static bool deflate_compress(int Level, const uint8_t *Dictionary,
+                             size_t DictionarySize, const uint8_t *Src,
+                             size_t SrcSize, uint8_t *Dst, size_t *DstSize)
+{
+	z_stream Stream = {0};
+	uLongf Size     = *DstSize;
+	int Result;
+
+	if (!DictionarySize) {
+		if (compress2(Dst, &Size, Src, SrcSize, Level) != Z_OK)
+			return false;
+
+		*DstSize = Size;
+		return true;
+	}
+
+	if (deflateInit(&Stream, Level) != Z_OK)
+		return false;
+
+	Stream.next_in   = (Bytef *)Src;
+	Stream.avail_in  = (uInt)SrcSize;
+	Stream.next_out  = Dst;
+	Stream.avail_out = (uInt)*DstSize;
+
+	Result = deflateSetDictionary(&Stream, Dictionary,
+	                              (uInt)DictionarySize);
+	if (Result == Z_OK)
+		Result = deflate(&Stream, Z_FINISH);
+
+	*DstSize = Stream.total_out;
+	deflateEnd(&Stream);
+	return Result == Z_STREAM_END;
+}
+
+/* Data compressed with a dictionary can't be unpacked without it */
+static bool deflate_decompress(const uint8_t *Dictionary,
+                               size_t DictionarySize, const uint8_t *Src,
+                               size_t SrcSize, uint8_t *Dst, size_t DstSize)
+{
+	z_stream Stream = {0};
+	int Result;
+
+	if (inflateInit(&Stream) != Z_OK)
+		return false;
+
+	Stream.next_in   = (Bytef *)Src;
+	Stream.avail_in  = (uInt)SrcSize;
+	Stream.next_out  = Dst;
+	Stream.avail_out = (uInt)DstSize;
+
+	Result = inflate(&Stream, Z_FINISH);
+	if (Result == Z_NEED_DICT)
+		Result = DictionarySize
+		             ? inflateSetDictionary(&Stream, Dictionary,
+		                                    (uInt)DictionarySize)
+		             : Z_DATA_ERROR;
+	if (Result == Z_OK)
+		Result = inflate(&Stream, Z_FINISH);
+
+	inflateEnd(&Stream);
+	return Result == Z_STREAM_END && Stream.total_out == DstSize;
+}
+
+static const struct kcf_codec Codecs[] = {
+	{KCF_METHOD_DEFLATE, "deflate", deflate_bound, deflate_compress,
+	 deflate_decompress},
+};
+
+const struct kcf_codec *codec_find(int Method)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(Codecs) / sizeof(Codecs[0]); i++) {
+		if (Codecs[i].Method == Method)
+			return &Codecs[i];
+	}
+
+	return NULL;
+}
@@ -0,0 +1,43 @@
+/**
+ * \file codec.h
+ *
+ * Compression methods of file data, numbered as the low byte of
+ * CompressionInfo.
+ */
+
+#pragma once
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct kcf_codec {
+	int Method;
+	const char *Name;
+
+	/* Largest compressed size of Size bytes */
+	size_t (*Bound)(size_t Size);
+
+	/*
+	 * DstSize holds the size of Dst and gets the compressed size. Src
+	 * may refer back to the dictionary, data which came before it.
+	 */
+	bool (*Compress)(int Level, const uint8_t *Dictionary,
+	                 size_t DictionarySize, const uint8_t *Src,
+	                 size_t SrcSize, uint8_t *Dst, size_t *DstSize);
+
+	/* Fails unless Src unpacks into exactly DstSize bytes */
+	bool (*Decompress)(const uint8_t *Dictionary, size_t DictionarySize,
+	                   const uint8_t *Src, size_t SrcSize, uint8_t *Dst,
+	                   size_t DstSize);
+};
+
+/**
+ * \brief Returns the codec of the method, NULL for unknown methods and
+ * for stored data.
+ */
+const struct kcf_codec *codec_find(int Method);
+
+#endif
@@ -244,8 +244,8 @@ static uint32_t crc32c_hw(uint32_t crc, void const *buf, size_t len) {
                     : "m"(*next));
 #else
             crc0 = _mm_crc32_u64(crc0, *(unsigned long long*)next);
-            next += 8;
 #endif
+            next += 8;
         }
         len &= 7;
     }
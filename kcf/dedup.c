@@ -0,0 +1,410 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kcf_impl.h"
+
+/*
+ * Deduplication of whole files: files are indexed by size and CRC32C of
+ * their data. A file matching an earlier one is compared with it byte by
+ * byte, read back from the archive, and then written as a header without
+ * data and a link record pointing at the header of the earlier file.
+ * Links never point at other links. Callers knowing that two files are
+ * the same, e.g. hard links, link them by the header offset without
+ * reading the data again.
+ */
+
+/* Data is compared in pieces of that size */
+#define COMPARE_BUFFER_SIZE 65536
+
+#define MIN_INDEX_CAPACITY 1024
+
+KCFERROR KCF_set_deduplication(KCF *kcf, bool Enabled)
+{
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->PackerState == KCF_PKSTATE_FILE_DATA ||
+	    kcf->PackerState == KCF_PKSTATE_AFTER_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	/* Files written so far stay in the index */
+	kcf->Dedup.Enabled = Enabled;
+	return KCF_ERROR_OK;
+}
+
+bool dedup_enabled(KCF *kcf)
+{
+	/* Links can't point into another volume */
+	return kcf->Dedup.Enabled && !kcf->VolumeSize;
+}
+
+void dedup_free(struct dedup_index *Index)
+{
+	free(Index->Files);
+	free(Index->Slots);
+	Index->Files     = NULL;
+	Index->Count     = 0;
+	Index->Capacity  = 0;
+	Index->Slots     = NULL;
+	Index->SlotCount = 0;
+	Index->Hashed    = 0;
+}
+
+static size_t first_slot(const struct dedup_index *Index, uint64_t Size,
+                         uint32_t CRC)
+{
+	return (CRC ^ (size_t)(Size * 0x9E3779B97F4A7C15ULL >> 32)) &
+	       (Index->SlotCount - 1);
+}
+
+static void put_slot(struct dedup_index *Index, size_t File)
+{
+	const struct dedup_file *Entry = &Index->Files[File];
+	size_t i = first_slot(Index, Entry->Size, Entry->CRC);
+
+	while (Index->Slots[i])
+		i = (i + 1) & (Index->SlotCount - 1);
+
+	Index->Slots[i] = File + 1;
+	Index->Hashed++;
+}
+
+/* Keeps the slots at most half full */
+static bool grow_slots(struct dedup_index *Index)
+{
+	size_t *Old     = Index->Slots;
+	size_t OldCount = Index->SlotCount;
+	size_t Count, i;
+
+	Count = OldCount ? 2 * OldCount : MIN_INDEX_CAPACITY;
+	Index->Slots = calloc(Count, sizeof(size_t));
+	if (!Index->Slots) {
+		Index->Slots = Old;
+		return false;
+	}
+
+	Index->SlotCount = Count;
+	Index->Hashed    = 0;
+	for (i = 0; i < OldCount; i++)
+		if (Old[i])
+			put_slot(Index, Old[i] - 1);
+
+	free(Old);
+	return true;
+}
+
+bool dedup_add(struct dedup_index *Index, uint64_t Size, uint32_t CRC,
+               uint64_t HeaderOffset, uint64_t TargetOffset)
+{
+	struct dedup_file *Entry;
+	size_t Capacity;
+
+	if (Size == 0)
+		return true;
+
+	if (Index->Count == Index->Capacity) {
+		Capacity = Index->Capacity ? 2 * Index->Capacity
+		                           : MIN_INDEX_CAPACITY;
+		Entry    = realloc(Index->Files,
+		                   Capacity * sizeof(struct dedup_file));
+		if (!Entry)
+			return false;
+		Index->Files    = Entry;
+		Index->Capacity = Capacity;
+	}
+
+	/* Smaller files are only linked to by KCF_add_link() */
+	if (HeaderOffset == TargetOffset && Size >= KCF_MIN_DEDUP_SIZE &&
+	    2 * (Index->Hashed + 1) > Index->SlotCount && !grow_slots(Index))
+		return false;
+
+	Entry               = &Index->Files[Index->Count++];
+	Entry->HeaderOffset = HeaderOffset;
+	Entry->TargetOffset = TargetOffset;
+	Entry->Size         = Size;
+	Entry->CRC          = CRC;
+
+	if (HeaderOffset == TargetOffset && Size >= KCF_MIN_DEDUP_SIZE)
+		put_slot(Index, Index->Count - 1);
+	return true;
+}
+
+bool dedup_has(const struct dedup_index *Index, uint64_t Size, uint32_t CRC)
+{
+	const struct dedup_file *Entry;
+	size_t i;
+
+	if (!Index->Hashed)
+		return false;
+
+	for (i = first_slot(Index, Size, CRC); Index->Slots[i];
+	     i = (i + 1) & (Index->SlotCount - 1)) {
+		Entry = &Index->Files[Index->Slots[i] - 1];
+		if (Entry->Size == Size && Entry->CRC == CRC)
+			return true;
+	}
+
+	return false;
+}
+
+const struct dedup_file *dedup_get(const struct dedup_index *Index,
+                                   uint64_t HeaderOffset)
+{
+	size_t Low = 0, High = Index->Count, Middle;
+
+	while (Low < High) {
+		Middle = Low + (High - Low) / 2;
+		if (Index->Files[Middle].HeaderOffset < HeaderOffset)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (Low == Index->Count || Index->Files[Low].HeaderOffset != HeaderOffset)
+		return NULL;
+	return &Index->Files[Low];
+}
+
+KCFERROR KCF_add_link(KCF *kcf, struct KcfFileInfo *FileInfo,
+                      uint64_t TargetOffset)
+{
+	const struct dedup_file *Target;
+	struct KcfFileInfo Info;
+	uint64_t Offset;
+	uint32_t CRC;
+	KCFERROR Error;
+
+	if (!kcf || !FileInfo)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_WRITING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+	if (kcf->PackerState != KCF_PKSTATE_IDLE &&
+	    kcf->PackerState != KCF_PKSTATE_FILE_HEADER)
+		return KCF_ERROR_INVALID_STATE;
+
+	Target = dedup_get(&kcf->Dedup, TargetOffset);
+	if (!Target)
+		return KCF_ERROR_FILE_NOT_FOUND;
+
+	/* Noting the link moves the files around */
+	Offset = Target->TargetOffset;
+	CRC    = Target->CRC;
+
+	Info                  = *FileInfo;
+	Info.HasUnpackedSize  = true;
+	Info.HasUnpackedSize8 = Target->Size > UINT32_MAX;
+	Info.UnpackedSize     = Target->Size;
+
+	Error = KCF_write_link(kcf, &Info, Offset, CRC);
+	if (!Error)
+		kcf->PackerState = KCF_PKSTATE_FILE_HEADER;
+	return Error;
+}
+
+/*
+ * Compares the file whose header is at HeaderOffset with Data or Input.
+ * Buffer holds two pieces, the second one for Input.
+ */
+static KCFERROR compare_file(KCF *kcf, uint64_t HeaderOffset, uint64_t Size,
+                             const uint8_t *Data, IO *Input, uint8_t *Buffer,
+                             bool *Equal)
+{
+	uint8_t *Other = Buffer + COMPARE_BUFFER_SIZE;
+	uint64_t Offset;
+	size_t Length;
+	KCFERROR Error;
+
+	*Equal = false;
+
+	Error = KCF_load_range_map(kcf, HeaderOffset);
+	if (Error || member_map_size(&kcf->RangeMap) != Size)
+		return Error;
+
+	for (Offset = 0; Offset < Size; Offset += Length) {
+		Length = Size - Offset < COMPARE_BUFFER_SIZE
+		             ? (size_t)(Size - Offset)
+		             : COMPARE_BUFFER_SIZE;
+
+		Error = KCF_read_range_map(kcf, Offset, Buffer, Length);
+		if (Error)
+			return Error;
+
+		if (!Data) {
+			if (IO_read(Input, Other, Length) != (int64_t)Length)
+				return KCF_ERROR_READ;
+		} else {
+			Other = (uint8_t *)Data + Offset;
+		}
+
+		if (memcmp(Buffer, Other, Length) != 0)
+			return KCF_ERROR_OK;
+	}
+
+	*Equal = true;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR dedup_find(KCF *kcf, uint64_t Size, uint32_t CRC,
+                    const uint8_t *Data, IO *Input, uint64_t *HeaderOffset)
+{
+	struct dedup_index *Index = &kcf->Dedup;
+	const struct dedup_file *Entry;
+	int64_t Position, InputStart = 0;
+	uint8_t *Buffer;
+	size_t i;
+	bool Equal;
+	KCFERROR Error, Result = KCF_ERROR_FILE_NOT_FOUND;
+
+	if (!dedup_has(Index, Size, CRC))
+		return KCF_ERROR_FILE_NOT_FOUND;
+
+	/* Earlier files are read back, so all of them must be written */
+	if (IO_flush(kcf->Stream) < 0)
+		return KCF_ERROR_WRITE;
+
+	Position = IO_tell(kcf->Stream);
+	if (Input)
+		InputStart = IO_tell(Input);
+	if (Position < 0 || InputStart < 0)
+		return KCF_ERROR_FILE_NOT_FOUND;
+
+	Buffer = malloc(2 * COMPARE_BUFFER_SIZE);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	for (i = first_slot(Index, Size, CRC); Index->Slots[i];
+	     i = (i + 1) & (Index->SlotCount - 1)) {
+		Entry = &Index->Files[Index->Slots[i] - 1];
+		if (Entry->Size != Size || Entry->CRC != CRC)
+			continue;
+
+		Error = compare_file(kcf, Entry->HeaderOffset, Size, Data,
+		                     Input, Buffer, &Equal);
+		if (!Data && IO_seek(Input, InputStart, IO_SEEK_SET) < 0) {
+			Result = KCF_ERROR_READ;
+			break;
+		}
+
+		/* A file which can't be read back is no copy */
+		if (Error == KCF_ERROR_OUT_OF_MEMORY) {
+			Result = Error;
+			break;
+		}
+		if (!Error && Equal) {
+			*HeaderOffset = Entry->HeaderOffset;
+			Result        = KCF_ERROR_OK;
+			break;
+		}
+	}
+
+	free(Buffer);
+
+	if (IO_seek(kcf->Stream, Position, IO_SEEK_SET) < 0)
+		return KCF_ERROR_WRITE;
+	return Result;
+}
+
+KCFERROR KCF_write_link(KCF *kcf, struct KcfFileInfo *Info,
+                        uint64_t TargetOffset, uint32_t CRC)
+{
+	struct KcfRecord Record = {0};
+	uint8_t Data[KCF_LINK_DATA_SIZE];
+	KCFERROR Error;
+
+	Info->CompressionInfo = KCF_COMPRESSION_LINK;
+	if (kcf->HasFileChecksums) {
+		Info->HasFileCRC32 = true;
+		Info->FileCRC32    = CRC;
+	}
+
+	Error = file_info_to_record(Info, &Record);
+	if (!Error)
+		Error = KCF_write_record(kcf, &Record);
+	rec_clear(&Record);
+	if (Error)
+		return Error;
+
+	kcf->FileOffset = kcf->RecordOffset;
+
+	StoreU64LE(Data, TargetOffset);
+	StoreU32LE(Data + 8, CRC);
+
+	Record.HeadType = KCF_LINK_RECORD;
+	Record.Data     = Data;
+	Record.DataSize = sizeof(Data);
+	Error = KCF_write_record(kcf, &Record);
+	if (Error)
+		return Error;
+
+	/* Other links to the file point right at the data too */
+	if (!dedup_add(&kcf->Dedup, Info->UnpackedSize, CRC, kcf->FileOffset,
+	               TargetOffset))
+		return KCF_ERROR_OUT_OF_MEMORY;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_read_link(KCF *kcf, uint64_t *TargetOffset, uint32_t *CRC)
+{
+	struct KcfRecord Record = {0};
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (KCF_is_added_data_available(kcf))
+		Error = KCF_skip_record(kcf);
+	if (!Error)
+		Error = KCF_read_record(kcf, &Record);
+	if (Error == KCF_ERROR_EOF)
+		return KCF_ERROR_PREMATURE_EOF;
+	if (Error)
+		return Error;
+
+	/* Whatever came instead is left for the next file */
+	if (Record.HeadType != KCF_LINK_RECORD ||
+	    Record.DataSize < KCF_LINK_DATA_SIZE) {
+		rec_clear(&Record);
+		if (IO_seek(kcf->Stream, kcf->RecordOffset, IO_SEEK_SET) >= 0)
+			kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+		return KCF_ERROR_INVALID_DATA;
+	}
+
+	*TargetOffset = LoadU64LE(Record.Data);
+	*CRC          = LoadU32LE(Record.Data + 8);
+	rec_clear(&Record);
+
+	if (KCF_is_added_data_available(kcf))
+		Error = KCF_skip_record(kcf);
+	return Error;
+}
+
+KCFERROR KCF_get_link_target(KCF *kcf, uint64_t *TargetOffset)
+{
+	uint64_t RecordOffset;
+	int64_t Position;
+	uint32_t CRC;
+	int ParserState;
+	KCFERROR Error;
+
+	if (!kcf || !TargetOffset)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState) ||
+	    kcf->UnpackerState != KCF_UPSTATE_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+	if (!(kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_LINK))
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	Position = IO_tell(kcf->Stream);
+	if (Position < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	ParserState  = kcf->ParserState;
+	RecordOffset = kcf->RecordOffset;
+	Error        = KCF_read_link(kcf, TargetOffset, &CRC);
+
+	/* The link is read again when the file is extracted */
+	if (IO_seek(kcf->Stream, Position, IO_SEEK_SET) < 0 && !Error)
+		Error = KCF_ERROR_READ;
+	kcf->ParserState  = ParserState;
+	kcf->RecordOffset = RecordOffset;
+	return Error;
+}
@@ -0,0 +1,98 @@
+/**
+ * \file dedup.h
+ *
+ * Index of the data of the files written so far, so a file repeating
+ * one of them is written as a link to it instead of a copy.
+ */
+
+#pragma once
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <kcf/archive.h>
+
+/* Smaller files cost less than their links */
+#define KCF_MIN_DEDUP_SIZE 64
+
+/* TargetOffset, DataCRC32 */
+#define KCF_LINK_DATA_SIZE 12
+
+/* File written while deduplication was on */
+struct dedup_file {
+	uint64_t HeaderOffset;
+
+	/* Header of the file holding the data, HeaderOffset but for links */
+	uint64_t TargetOffset;
+	uint64_t Size;
+	uint32_t CRC;
+};
+
+struct dedup_index {
+	/* In the order they are written, so by HeaderOffset */
+	struct dedup_file *Files;
+	size_t Count;
+	size_t Capacity;
+
+	/*
+	 * Open addressing by size and CRC over files with data, holding
+	 * their index in Files plus one. SlotCount is a power of two.
+	 */
+	size_t *Slots;
+	size_t SlotCount;
+	size_t Hashed;
+	bool Enabled;
+
+	/* File being written */
+	uint64_t DataSize;
+	uint32_t DataCRC;
+	bool IsHeaderDeferred;
+	bool IsLink;
+};
+
+/**
+ * \brief Tells whether files written to kcf are deduplicated.
+ */
+bool dedup_enabled(KCF *kcf);
+
+void dedup_free(struct dedup_index *Index);
+
+/**
+ * \brief Notes a file written after the ones noted before, a link if
+ * TargetOffset isn't its HeaderOffset.
+ */
+bool dedup_add(struct dedup_index *Index, uint64_t Size, uint32_t CRC,
+               uint64_t HeaderOffset, uint64_t TargetOffset);
+bool dedup_has(const struct dedup_index *Index, uint64_t Size, uint32_t CRC);
+
+/**
+ * \brief Returns the noted file whose header is at HeaderOffset, NULL if
+ * there is none.
+ */
+const struct dedup_file *dedup_get(const struct dedup_index *Index,
+                                   uint64_t HeaderOffset);
+
+/**
+ * \brief Looks for an earlier file with the same Size bytes of data as
+ * Data, or as Input from its current position if Data is NULL. Returns
+ * `KCF_ERROR_FILE_NOT_FOUND` if there is none. The streams are left
+ * where they were.
+ */
+KCFERROR dedup_find(KCF *kcf, uint64_t Size, uint32_t CRC,
+                    const uint8_t *Data, IO *Input, uint64_t *HeaderOffset);
+
+/**
+ * \brief Writes the header of a file with the data of the file whose
+ * header is at TargetOffset and the link record after it, and notes it.
+ */
+KCFERROR KCF_write_link(KCF *kcf, struct KcfFileInfo *Info,
+                        uint64_t TargetOffset, uint32_t CRC);
+
+/**
+ * \brief Reads the link record after the header of the current file.
+ */
+KCFERROR KCF_read_link(KCF *kcf, uint64_t *TargetOffset, uint32_t *CRC);
+
+#endif
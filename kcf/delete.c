@@ -0,0 +1,524 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kcf_impl.h"
+
+/*
+ * Deleting files: the type of the file header is changed in place to
+ * 'X', which takes a write of three bytes and leaves every offset in the
+ * archive as it was. Readers skip deleted files together with their
+ * data fragments and tables. Links to a deleted file still get its data.
+ *
+ * Compaction copies an archive into another stream without deleted
+ * files, in runs of adjacent records as long as possible. Deleted files
+ * which links point at are kept, and the targets of links are moved to
+ * where the files went. Files left out on request are handled as if they
+ * had been deleted before, those which links point at are written as
+ * deleted ones. So are compressed files of a solid block which the next
+ * files in it refer back to.
+ */
+
+static int compare_offsets(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+KCFERROR KCF_delete_member(KCF *kcf, uint64_t HeaderOffset)
+{
+	struct KcfRecord Record = {0};
+	uint8_t Buffer[3];
+	int64_t Position;
+	KCF *Reader;
+	KCFERROR Error;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+	if (kcf->IsMultiVolume)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	Position = IO_tell(kcf->Stream);
+	if (Position < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+	if (IO_seek(kcf->Stream, HeaderOffset, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+
+	Error = KCF_create(kcf->Stream, &Reader);
+	if (!Error) {
+		Reader->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+		Error = KCF_read_record(Reader, &Record);
+		KCF_close(Reader);
+	}
+	if (!Error && (Record.HeadType != KCF_FILE_HEADER ||
+	               !rec_validate(&Record)))
+		Error = KCF_ERROR_INVALID_PARAMETER;
+	if (Error)
+		goto cleanup;
+
+	/* HeadCRC and HeadType, the rest of the header stays */
+	Record.HeadType = KCF_DELETED_FILE;
+	StoreU16LE(Buffer, rec_calculate_CRC(&Record));
+	Buffer[2] = Record.HeadType;
+
+	if (IO_seek(kcf->Stream, HeaderOffset, IO_SEEK_SET) < 0 ||
+	    IO_write(kcf->Stream, Buffer, sizeof(Buffer)) != sizeof(Buffer) ||
+	    IO_flush(kcf->Stream) < 0)
+		Error = KCF_ERROR_WRITE;
+
+	if (kcf->HasRangeMap && kcf->RangeMapOffset == HeaderOffset) {
+		member_map_clear(&kcf->RangeMap);
+		kcf->HasRangeMap = false;
+	}
+	if (!Error)
+		member_index_remove(&kcf->Members, HeaderOffset);
+
+cleanup:
+	rec_clear(&Record);
+	if (IO_seek(kcf->Stream, Position, IO_SEEK_SET) < 0 && !Error)
+		Error = KCF_ERROR_READ;
+	return Error;
+}
+
+struct compaction {
+	IO *Source;
+	IO *Destination;
+	KCF *Reader;
+	int64_t Size;
+
+	/* Headers of files to leave out, sorted */
+	uint64_t *Excluded;
+	size_t ExcludedCount;
+
+	/* Headers the links of files left point at, sorted */
+	uint64_t *Targets;
+	size_t TargetCount;
+	size_t TargetCapacity;
+
+	/* Compressed files of the solid block no file left needs yet */
+	uint64_t *Block;
+	size_t BlockCount;
+	size_t BlockCapacity;
+
+	/* Headers copied, where they were and where they are now */
+	uint64_t *Old;
+	uint64_t *New;
+	size_t Count;
+	size_t Capacity;
+
+	/* Source records not written yet */
+	uint64_t RunStart;
+	uint64_t RunLength;
+
+	uint64_t Written;
+	struct KcfCompactInfo Info;
+};
+
+/* Reads the next record, KCF_ERROR_EOF at the end of the source */
+static KCFERROR next_record(struct compaction *State,
+                            struct KcfRecord *Record, uint64_t *Next)
+{
+	KCF *Reader = State->Reader;
+	KCFERROR Error;
+
+	rec_clear(Record);
+	Reader->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+	Error = KCF_read_record(Reader, Record);
+
+	/* A record cut short by an interrupted write is dropped */
+	if (Error == KCF_ERROR_PREMATURE_EOF)
+		return KCF_ERROR_EOF;
+	if (!Error && !rec_validate(Record))
+		Error = KCF_ERROR_INVALID_DATA;
+	if (Error)
+		return Error;
+
+	*Next = Reader->RecordOffset + Record->HeadSize + Record->AddedSize;
+	if (*Next > (uint64_t)State->Size)
+		return KCF_ERROR_EOF;
+	return KCF_ERROR_OK;
+}
+
+static bool is_excluded(const struct compaction *State, uint64_t Offset)
+{
+	return State->ExcludedCount &&
+	       bsearch(&Offset, State->Excluded, State->ExcludedCount,
+	               sizeof(uint64_t), compare_offsets) != NULL;
+}
+
+static bool push_offset(uint64_t **Offsets, size_t *Count, size_t *Capacity,
+                        uint64_t Offset)
+{
+	uint64_t *Grown;
+	size_t Size;
+
+	if (*Count == *Capacity) {
+		Size  = *Capacity ? 2 * *Capacity : 256;
+		Grown = realloc(*Offsets, Size * sizeof(*Grown));
+		if (!Grown)
+			return false;
+		*Offsets  = Grown;
+		*Capacity = Size;
+	}
+
+	(*Offsets)[(*Count)++] = Offset;
+	return true;
+}
+
+static bool add_target(struct compaction *State, uint64_t Offset)
+{
+	return push_offset(&State->Targets, &State->TargetCount,
+	                   &State->TargetCapacity, Offset);
+}
+
+/*
+ * Notes the file whose header is in Record. A compressed solid file left
+ * needs all compressed files of its block before it, as their data is
+ * where its first frame refers back to.
+ */
+static bool add_block_file(struct compaction *State, struct KcfRecord *Record,
+                           bool Live)
+{
+	struct KcfFileInfo Info = {0};
+	uint32_t Compression    = 0;
+	size_t i;
+
+	if (record_to_file_info(Record, &Info) == KCF_ERROR_OK)
+		Compression = Info.CompressionInfo;
+	file_info_clear(&Info);
+
+	/* Links have no data and stay out of blocks */
+	if (Compression & KCF_COMPRESSION_LINK)
+		return true;
+	if (!(Compression & KCF_COMPRESSION_SOLID))
+		State->BlockCount = 0;
+	if (!(Compression & KCF_COMPRESSION_METHOD_MASK))
+		return true;
+
+	if (Live && (Compression & KCF_COMPRESSION_SOLID)) {
+		for (i = 0; i < State->BlockCount; i++) {
+			if (!add_target(State, State->Block[i]))
+				return false;
+		}
+		State->BlockCount = 0;
+	}
+
+	return push_offset(&State->Block, &State->BlockCount,
+	                   &State->BlockCapacity, State->Reader->RecordOffset);
+}
+
+/* First pass, finds the files which files left link to or depend on */
+static KCFERROR find_targets(struct compaction *State, int64_t Start)
+{
+	struct KcfRecord Record = {0};
+	uint64_t Next;
+	bool Live = false;
+	KCFERROR Error;
+
+	for (;;) {
+		Error = next_record(State, &Record, &Next);
+		if (Error)
+			break;
+
+		if (Record.HeadType == KCF_FILE_HEADER)
+			Live = !is_excluded(State, State->Reader->RecordOffset);
+		else if (Record.HeadType == KCF_DELETED_FILE)
+			Live = false;
+		else if (Record.HeadType == KCF_LINK_RECORD && Live &&
+		         Record.DataSize >= KCF_LINK_DATA_SIZE &&
+		         !add_target(State, LoadU64LE(Record.Data))) {
+			Error = KCF_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+
+		if ((Record.HeadType == KCF_FILE_HEADER ||
+		     Record.HeadType == KCF_DELETED_FILE) &&
+		    !add_block_file(State, &Record, Live)) {
+			Error = KCF_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+
+		if (IO_seek(State->Source, Next, IO_SEEK_SET) < 0) {
+			Error = KCF_ERROR_READ;
+			break;
+		}
+	}
+
+	rec_clear(&Record);
+	if (Error != KCF_ERROR_EOF)
+		return Error;
+
+	if (State->TargetCount)
+		qsort(State->Targets, State->TargetCount, sizeof(uint64_t),
+		      compare_offsets);
+	return IO_seek(State->Source, Start, IO_SEEK_SET) < 0
+	           ? KCF_ERROR_READ
+	           : KCF_ERROR_OK;
+}
+
+static bool is_target(const struct compaction *State, uint64_t Offset)
+{
+	return State->TargetCount &&
+	       bsearch(&Offset, State->Targets, State->TargetCount,
+	               sizeof(uint64_t), compare_offsets) != NULL;
+}
+
+static bool add_header(struct compaction *State, uint64_t Offset)
+{
+	uint64_t *Old, *New;
+	size_t Capacity;
+
+	if (State->Count == State->Capacity) {
+		Capacity = State->Capacity ? 2 * State->Capacity : 1024;
+		Old      = realloc(State->Old, Capacity * sizeof(*Old));
+		if (!Old)
+			return false;
+		State->Old = Old;
+		New        = realloc(State->New, Capacity * sizeof(*New));
+		if (!New)
+			return false;
+		State->New      = New;
+		State->Capacity = Capacity;
+	}
+
+	/* Headers come in order, so Old stays sorted */
+	State->Old[State->Count] = Offset;
+	State->New[State->Count] = State->Written;
+	State->Count++;
+	return true;
+}
+
+/* Copies the records of the current run in one go */
+static KCFERROR flush_run(struct compaction *State)
+{
+	int64_t Length = (int64_t)State->RunLength;
+
+	if (!Length)
+		return KCF_ERROR_OK;
+
+	if (IO_seek(State->Source, State->RunStart, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+	if (IO_copy(State->Source, State->Destination, Length) != Length)
+		return KCF_ERROR_WRITE;
+
+	State->RunLength = 0;
+	return KCF_ERROR_OK;
+}
+
+static KCFERROR copy_record(struct compaction *State, uint64_t Offset,
+                            uint64_t Length)
+{
+	KCFERROR Error;
+
+	if (State->RunLength &&
+	    State->RunStart + State->RunLength != Offset &&
+	    (Error = flush_run(State)))
+		return Error;
+
+	if (!State->RunLength)
+		State->RunStart = Offset;
+	State->RunLength += Length;
+	State->Written += Length;
+	return KCF_ERROR_OK;
+}
+
+/* Writes a changed record header and copies its added data after it */
+static KCFERROR write_record(struct compaction *State, struct KcfRecord *Record,
+                             uint64_t Offset)
+{
+	uint8_t *Buffer;
+	int64_t Added = (int64_t)Record->AddedSize;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if ((Error = flush_run(State)))
+		return Error;
+
+	Record->HeadCRC = rec_calculate_CRC(Record);
+	Buffer          = malloc(Record->HeadSize);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+	rec_to_buffer(Record, Buffer, Record->HeadSize);
+	if (IO_write(State->Destination, Buffer, Record->HeadSize) !=
+	    Record->HeadSize)
+		Error = KCF_ERROR_WRITE;
+	free(Buffer);
+
+	if (!Error && Added > 0 &&
+	    (IO_seek(State->Source, Offset + Record->HeadSize,
+	             IO_SEEK_SET) < 0 ||
+	     IO_copy(State->Source, State->Destination, Added) != Added))
+		Error = KCF_ERROR_WRITE;
+
+	State->Written += Record->HeadSize + Added;
+	return Error;
+}
+
+/* Link records get the new offset of their target */
+static KCFERROR copy_link(struct compaction *State, struct KcfRecord *Record,
+                          uint64_t Offset)
+{
+	uint64_t Target, *Found;
+
+	if (Record->DataSize < KCF_LINK_DATA_SIZE)
+		return KCF_ERROR_INVALID_DATA;
+
+	Target = LoadU64LE(Record->Data);
+	Found  = bsearch(&Target, State->Old, State->Count, sizeof(uint64_t),
+	                 compare_offsets);
+	if (!Found)
+		return KCF_ERROR_INVALID_DATA;
+
+	StoreU64LE(Record->Data, State->New[Found - State->Old]);
+	return write_record(State, Record, Offset);
+}
+
+/* Second pass, copies the records of files left */
+static KCFERROR copy_records(struct compaction *State)
+{
+	struct KcfRecord Record = {0};
+	uint64_t Offset, Next;
+	bool Keep = true, Excluded = false;
+	KCFERROR Error;
+
+	for (;;) {
+		Error = next_record(State, &Record, &Next);
+		if (Error)
+			break;
+		Offset = State->Reader->RecordOffset;
+
+		/* Tables and fragments go with the file before them */
+		switch (Record.HeadType) {
+		case KCF_FILE_HEADER:
+			Excluded = is_excluded(State, Offset);
+			Keep     = !Excluded || is_target(State, Offset);
+			if (!Excluded)
+				State->Info.Files++;
+			else if (!Keep)
+				State->Info.DeletedFiles++;
+			break;
+		case KCF_DELETED_FILE:
+			Excluded = false;
+			Keep     = is_target(State, Offset);
+			if (!Keep)
+				State->Info.DeletedFiles++;
+			break;
+		}
+
+		if (!Keep || Record.HeadType == KCF_RECOVERY_RECORD) {
+			/* Parity of the old layout is of no use */
+			State->Info.RemovedBytes += Next - Offset;
+		} else if (Record.HeadType == KCF_LINK_RECORD) {
+			Error = copy_link(State, &Record, Offset);
+		} else if (Record.HeadType == KCF_FILE_HEADER && Excluded) {
+			/* Only links get the data of the file from now on */
+			Record.HeadType = KCF_DELETED_FILE;
+			if (!add_header(State, Offset))
+				Error = KCF_ERROR_OUT_OF_MEMORY;
+			if (!Error)
+				Error = write_record(State, &Record, Offset);
+		} else {
+			if ((Record.HeadType == KCF_FILE_HEADER ||
+			     Record.HeadType == KCF_DELETED_FILE) &&
+			    !add_header(State, Offset))
+				Error = KCF_ERROR_OUT_OF_MEMORY;
+			if (!Error)
+				Error = copy_record(State, Offset, Next - Offset);
+		}
+
+		if (!Error && IO_seek(State->Source, Next, IO_SEEK_SET) < 0)
+			Error = KCF_ERROR_READ;
+		if (Error)
+			break;
+	}
+
+	rec_clear(&Record);
+	if (Error != KCF_ERROR_EOF)
+		return Error;
+
+	return flush_run(State);
+}
+
+KCFERROR KCF_compact(IO *Source, IO *Destination,
+                     struct KcfCompactInfo *Info)
+{
+	return KCF_compact_excluding(Source, Destination, NULL, 0, Info);
+}
+
+KCFERROR KCF_compact_excluding(IO *Source, IO *Destination,
+                               const uint64_t *HeaderOffsets, size_t Count,
+                               struct KcfCompactInfo *Info)
+{
+	struct compaction State = {0};
+	int64_t Start, Base;
+	KCFERROR Error;
+
+	if (!Source || !Destination || (!HeaderOffsets && Count > 0))
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (Info)
+		memset(Info, 0, sizeof(*Info));
+
+	State.Source      = Source;
+	State.Destination = Destination;
+
+	if (Count > 0) {
+		State.Excluded = malloc(Count * sizeof(uint64_t));
+		if (!State.Excluded)
+			return KCF_ERROR_OUT_OF_MEMORY;
+		memcpy(State.Excluded, HeaderOffsets, Count * sizeof(uint64_t));
+		qsort(State.Excluded, Count, sizeof(uint64_t), compare_offsets);
+		State.ExcludedCount = Count;
+	}
+
+	if (IO_seek(Source, 0, IO_SEEK_SET) < 0) {
+		Error = KCF_ERROR_READ;
+		goto cleanup;
+	}
+	Error = KCF_create(Source, &State.Reader);
+	if (Error)
+		goto cleanup;
+
+	Error = KCF_open_archive(State.Reader);
+	if (!Error && State.Reader->IsMultiVolume)
+		Error = KCF_ERROR_NOT_IMPLEMENTED;
+	if (Error)
+		goto cleanup;
+
+	Start      = IO_tell(Source);
+	State.Size = IO_seek(Source, 0, IO_SEEK_END);
+	Base       = IO_tell(Destination);
+	if (Start < 0 || State.Size < 0 || Base < 0 ||
+	    IO_seek(Source, Start, IO_SEEK_SET) < 0) {
+		Error = KCF_ERROR_NOT_IMPLEMENTED;
+		goto cleanup;
+	}
+
+	Error = find_targets(&State, Start);
+	if (Error)
+		goto cleanup;
+
+	/* Whatever is before the first file, the archive header included */
+	State.RunStart  = 0;
+	State.RunLength = Start;
+	State.Written   = Base + Start;
+
+	Error = copy_records(&State);
+	if (!Error && IO_flush(Destination) < 0)
+		Error = KCF_ERROR_WRITE;
+
+	if (!Error && Info)
+		*Info = State.Info;
+
+cleanup:
+	KCF_close(State.Reader);
+	free(State.Excluded);
+	free(State.Targets);
+	free(State.Block);
+	free(State.Old);
+	free(State.New);
+	return Error;
+}
@@ -1,13 +1,21 @@
 #include <kcf/archive.h>
 
 #include <assert.h>
+#include <stdlib.h>
 
+#include <io/thread.h>
+
+#include "crc32c.h"
 #include "kcf_impl.h"
 
-static KCFERROR read_file_info(KCF *kcf, struct KcfFileInfo *FileInfo);
+#define EXTRACT_BUFFER_SIZE 65536
+
+static KCFERROR read_file_info(KCF *kcf);
 
 KCFERROR KCF_get_current_file_info(KCF *kcf, struct KcfFileInfo *FileInfo)
 {
+	KCFERROR Error;
+
 	if (!kcf)
 		return KCF_ERROR_INVALID_PARAMETER;
 	if (!FileInfo)
@@ -15,140 +23,990 @@ KCFERROR KCF_get_current_file_info(KCF *kcf, struct KcfFileInfo *FileInfo)
 
 	switch (kcf->UnpackerState) {
 	case KCF_UPSTATE_FILE_HEADER:
-		return read_file_info(kcf, FileInfo);
+		Error = read_file_info(kcf);
+		if (Error)
+			return Error;
+		/* fall through */
 	case KCF_UPSTATE_FILE_DATA:
 	case KCF_UPSTATE_AFTER_FILE_DATA:
-		return file_info_copy(FileInfo, &kcf->CurrentFile);
+		if (!file_info_copy(FileInfo, &kcf->CurrentFile))
+			return KCF_ERROR_OUT_OF_MEMORY;
+		return KCF_ERROR_OK;
 	default:
 		return KCF_ERROR_INVALID_STATE;
 	}
 }
 
+/* Reads the next data fragment of the current file into LastRecord */
+static KCFERROR read_next_fragment(KCF *kcf)
+{
+	KCFERROR Error;
+
+	rec_clear(&kcf->LastRecord);
+	Error = KCF_read_record(kcf, &kcf->LastRecord);
+	if (Error == KCF_ERROR_EOF)
+		return KCF_ERROR_PREMATURE_EOF;
+	if (Error)
+		return Error;
+
+	/* Fragments behind the damaged place belong to nobody */
+	if (kcf->HasResynced)
+		return KCF_ERROR_INVALID_DATA;
+
+	if (kcf->LastRecord.HeadType != KCF_DATA_FRAGMENT) {
+		/* Leave it for the next call, it may start the next file */
+		if (IO_seek(kcf->Stream, kcf->RecordOffset, IO_SEEK_SET) >= 0)
+			kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+		return KCF_ERROR_INVALID_FORMAT;
+	}
+
+	return KCF_ERROR_OK;
+}
+
+/*
+ * Decoded tells whether the whole data of the file went through the
+ * decoder, so the next file of a solid block can continue from there.
+ */
+static void finish_file(KCF *kcf, bool Decoded)
+{
+	file_info_clear(&kcf->CurrentFile);
+	rec_clear(&kcf->LastRecord);
+	kcf->UnpackerState     = KCF_UPSTATE_FILE_HEADER;
+	kcf->IsSolidChainValid = Decoded;
+}
+
+static bool is_solid_file(KCF *kcf)
+{
+	return !!(kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_SOLID);
+}
+
+static bool is_compressed_file(KCF *kcf)
+{
+	uint32_t Info = kcf->CurrentFile.CompressionInfo;
+
+	return (Info & KCF_COMPRESSION_METHOD_MASK) &&
+	       !(Info & KCF_COMPRESSION_LINK);
+}
+
+/* A file which is neither solid nor a link starts a new solid block */
+static void begin_block(KCF *kcf)
+{
+	if (!(kcf->CurrentFile.CompressionInfo &
+	      (KCF_COMPRESSION_SOLID | KCF_COMPRESSION_LINK))) {
+		kcf->SolidWindow.Size = 0;
+		kcf->HasDeletedFiles  = false;
+	}
+}
+
 KCFERROR KCF_skip_file(KCF *kcf)
 {
-	struct KcfRecord Record     = {0};
-	struct KcfFileInfo FileInfo = {0};
-	KCFERROR Error              = KCF_ERROR_OK;
+	KCFERROR Error = KCF_ERROR_OK;
+	int Method;
 
 	if (!kcf)
 		return KCF_ERROR_INVALID_PARAMETER;
-	if (kcf->IsWriting)
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState))
 		return KCF_ERROR_INVALID_STATE;
 
-	do {
-		Error = KCF_read_record(kcf, &Record);
+	if (kcf->UnpackerState == KCF_UPSTATE_FILE_HEADER) {
+		Error = read_file_info(kcf);
+		if (Error)
+			return Error;
+	}
+	if (kcf->UnpackerState != KCF_UPSTATE_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	/* Stored data has no decoder state to carry to the next file */
+	Method = kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_METHOD_MASK;
+	if (kcf->LastRecord.AddedSize == 0 &&
+	    !(kcf->LastRecord.HeadFlags & KCF_HAS_CONTINUATION))
+		Method = 0;
+	if (is_solid_file(kcf) && !kcf->IsSolidChainValid)
+		Method = -1;
+
+	for (;;) {
+		if (KCF_is_added_data_available(kcf)) {
+			Error = KCF_skip_record(kcf);
+			if (Error)
+				break;
+		}
+
+		if (!(kcf->LastRecord.HeadFlags & KCF_HAS_CONTINUATION))
+			break;
+
+		Error = read_next_fragment(kcf);
+		if (Error)
+			break;
+	}
+
+	finish_file(kcf, !Error && Method == 0);
+	return Error;
+}
+
+/*
+ * Reads up to Size bytes of the data of the current file, going on to
+ * the next fragment when one ends. BytesRead is less than Size only at
+ * the end of the data.
+ */
+static KCFERROR read_packed(KCF *kcf, uint8_t *Buffer, size_t Size,
+                            size_t *BytesRead)
+{
+	size_t Length;
+	KCFERROR Error;
+
+	*BytesRead = 0;
+	while (Size > 0) {
+		if (KCF_is_added_data_available(kcf)) {
+			Error = KCF_read_added_data(kcf, Buffer, Size, &Length);
+			if (Error)
+				return Error;
+
+			Buffer += Length;
+			Size -= Length;
+			*BytesRead += Length;
+			continue;
+		}
+
+		if (rec_has_added_data_CRC(&kcf->LastRecord) &&
+		    kcf->ActualAddedDataCRC32 != kcf->AddedDataCRC32)
+			return KCF_ERROR_INVALID_DATA;
+
+		if (!(kcf->LastRecord.HeadFlags & KCF_HAS_CONTINUATION))
+			break;
+
+		Error = read_next_fragment(kcf);
+		if (Error)
+			return Error;
+	}
+
+	return KCF_ERROR_OK;
+}
+
+/*
+ * Decodes the frames of a compressed file one by one. The first frame of
+ * a solid file refers back to the window, every frame goes into it.
+ */
+static KCFERROR unpack_frames(KCF *kcf, IO *Output)
+{
+	const struct kcf_codec *Codec;
+	struct frame_header Header;
+	uint8_t *Packed = NULL, *Frame = NULL;
+	uint64_t Unpacked = 0;
+	uint32_t FrameSize;
+	size_t BytesRead, DictionarySize = 0;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	Codec = frame_codec(kcf->CurrentFile.CompressionInfo, &FrameSize);
+	if (!Codec)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+	if (is_solid_file(kcf))
+		DictionarySize = kcf->SolidWindow.Size;
+
+	Packed = malloc(frame_bound(Codec, FrameSize));
+	Frame  = malloc(FrameSize);
+	if (!Packed || !Frame) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+
+	for (;;) {
+		Error = read_packed(kcf, Packed, KCF_FRAME_HEADER_SIZE,
+		                    &BytesRead);
+		if (Error || BytesRead == 0)
+			break;
+
+		frame_header_load(Packed, &Header);
+		if (BytesRead < KCF_FRAME_HEADER_SIZE ||
+		    !frame_header_valid(Codec, &Header, FrameSize)) {
+			Error = KCF_ERROR_INVALID_DATA;
+			break;
+		}
+
+		Error = read_packed(kcf, Packed, Header.PackedSize, &BytesRead);
+		if (!Error &&
+		    (BytesRead < Header.PackedSize ||
+		     !frame_decode(Codec, &Header, kcf->SolidWindow.Data,
+		                   DictionarySize, Packed, Frame)))
+			Error = KCF_ERROR_INVALID_DATA;
+		if (!Error && !solid_window_add(&kcf->SolidWindow, Frame,
+		                                Header.UnpackedSize))
+			Error = KCF_ERROR_OUT_OF_MEMORY;
+		if (Error)
+			break;
+		DictionarySize = 0;
+
+		if (Output && IO_write(Output, Frame, Header.UnpackedSize) < 0) {
+			Error = KCF_ERROR_WRITE;
+			break;
+		}
+		Unpacked += Header.UnpackedSize;
+	}
+
+	if (!Error && kcf->CurrentFile.HasUnpackedSize &&
+	    Unpacked != kcf->CurrentFile.UnpackedSize)
+		Error = KCF_ERROR_INVALID_DATA;
+
+cleanup:
+	free(Frame);
+	free(Packed);
+	return Error;
+}
+
+/*
+ * Parallel decoding: the calling thread reads frames into a ring of
+ * slots, workers decode them and write each one at its own place in
+ * Output, so frames may finish in any order. IO has no positional
+ * writes, a seek and a write under WriteLock do the same.
+ */
+
+struct decode_slot {
+	uint8_t *Packed;
+	uint8_t *Frame;
+	struct frame_header Header;
+	uint64_t Offset;
+
+	/* Protected by Lock */
+	bool Busy;
+};
+
+struct decode_job {
+	const struct kcf_codec *Codec;
+	IO *Output;
+	int64_t Base;
+	struct decode_slot *Slots;
+	unsigned Count;
+
+	/* For the first frame, the window doesn't change until the end */
+	const uint8_t *Dictionary;
+	size_t DictionarySize;
+
+	/* Frames read so far, frame i goes to slot i % Count */
+	uint64_t Frames;
+
+	IO_MUTEX WriteLock;
+	IO_MUTEX Lock;
+	IO_COND JobCond;
+	IO_COND FreeCond;
+
+	/* Protected by Lock */
+	unsigned NextJob;
+	unsigned Jobs;
+	bool Stop;
+	KCFERROR Error;
+};
+
+static KCFERROR decode_slot(struct decode_job *Job, struct decode_slot *Slot)
+{
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!frame_decode(Job->Codec, &Slot->Header, Job->Dictionary,
+	                  Slot->Offset ? 0 : Job->DictionarySize, Slot->Packed,
+	                  Slot->Frame))
+		return KCF_ERROR_INVALID_DATA;
+	if (!Job->Output)
+		return KCF_ERROR_OK;
+
+	IO_mutex_lock(&Job->WriteLock);
+	if (IO_seek(Job->Output, Job->Base + Slot->Offset, IO_SEEK_SET) < 0 ||
+	    IO_write(Job->Output, Slot->Frame, Slot->Header.UnpackedSize) < 0)
+		Error = KCF_ERROR_WRITE;
+	IO_mutex_unlock(&Job->WriteLock);
+
+	return Error;
+}
+
+static void *decode_worker(void *Arg)
+{
+	struct decode_job *Job = Arg;
+	struct decode_slot *Slot;
+	KCFERROR Error;
+	bool Failed;
+
+	IO_mutex_lock(&Job->Lock);
+	for (;;) {
+		while (Job->Jobs == 0 && !Job->Stop)
+			IO_cond_wait(&Job->JobCond, &Job->Lock);
+		if (Job->Jobs == 0)
+			break;
+
+		Slot         = &Job->Slots[Job->NextJob];
+		Job->NextJob = (Job->NextJob + 1) % Job->Count;
+		Job->Jobs--;
+		Failed = Job->Error != KCF_ERROR_OK;
+		IO_mutex_unlock(&Job->Lock);
+
+		/* Frames after an error only have to be dropped */
+		Error = Failed ? KCF_ERROR_OK : decode_slot(Job, Slot);
+
+		IO_mutex_lock(&Job->Lock);
+		if (Error && !Job->Error)
+			Job->Error = Error;
+		Slot->Busy = false;
+		IO_cond_broadcast(&Job->FreeCond);
+	}
+	IO_mutex_unlock(&Job->Lock);
+
+	return NULL;
+}
+
+/* Reads frames and hands them out until the data or the job fails */
+static KCFERROR read_frames(KCF *kcf, struct decode_job *Job,
+                            uint32_t FrameSize, uint64_t *Unpacked)
+{
+	struct decode_slot *Slot;
+	struct frame_header Header;
+	unsigned Tail = 0;
+	size_t BytesRead;
+	KCFERROR Error;
+
+	for (;;) {
+		Slot = &Job->Slots[Tail];
+
+		IO_mutex_lock(&Job->Lock);
+		while (Slot->Busy && !Job->Error)
+			IO_cond_wait(&Job->FreeCond, &Job->Lock);
+		Error = Job->Error;
+		IO_mutex_unlock(&Job->Lock);
+		if (Error)
+			return KCF_ERROR_OK;
+
+		Error = read_packed(kcf, Slot->Packed, KCF_FRAME_HEADER_SIZE,
+		                    &BytesRead);
+		if (Error || BytesRead == 0)
+			return Error;
+
+		frame_header_load(Slot->Packed, &Header);
+		if (BytesRead < KCF_FRAME_HEADER_SIZE ||
+		    !frame_header_valid(Job->Codec, &Header, FrameSize))
+			return KCF_ERROR_INVALID_DATA;
+
+		Error = read_packed(kcf, Slot->Packed, Header.PackedSize,
+		                    &BytesRead);
+		if (!Error && BytesRead < Header.PackedSize)
+			Error = KCF_ERROR_INVALID_DATA;
 		if (Error)
+			return Error;
+
+		Slot->Header = Header;
+		Slot->Offset = *Unpacked;
+		*Unpacked += Header.UnpackedSize;
+		Job->Frames++;
+
+		IO_mutex_lock(&Job->Lock);
+		Slot->Busy = true;
+		Job->Jobs++;
+		IO_cond_signal(&Job->JobCond);
+		IO_mutex_unlock(&Job->Lock);
+
+		Tail = (Tail + 1) % Job->Count;
+	}
+}
+
+/* The last two frames are more than the window holds */
+static KCFERROR add_last_frames(KCF *kcf, const struct decode_job *Job)
+{
+	const struct decode_slot *Slot;
+	uint64_t i;
+
+	for (i = Job->Frames > 2 ? Job->Frames - 2 : 0; i < Job->Frames; i++) {
+		Slot = &Job->Slots[i % Job->Count];
+		if (!solid_window_add(&kcf->SolidWindow, Slot->Frame,
+		                      Slot->Header.UnpackedSize))
+			return KCF_ERROR_OUT_OF_MEMORY;
+	}
+
+	return KCF_ERROR_OK;
+}
+
+static KCFERROR unpack_frames_parallel(KCF *kcf, IO *Output, int Threads)
+{
+	struct decode_job Job = {0};
+	IO_THREAD Workers[KCF_MAX_FRAME_THREADS];
+	uint64_t Unpacked = 0;
+	uint32_t FrameSize;
+	unsigned i;
+	int Started = 0;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (Threads > KCF_MAX_FRAME_THREADS)
+		Threads = KCF_MAX_FRAME_THREADS;
+
+	Job.Codec  = frame_codec(kcf->CurrentFile.CompressionInfo, &FrameSize);
+	Job.Output = Output;
+	Job.Base   = Output ? IO_tell(Output) : 0;
+	Job.Count  = 2 * Threads;
+	Job.Slots  = calloc(Job.Count, sizeof(struct decode_slot));
+	if (is_solid_file(kcf)) {
+		Job.Dictionary     = kcf->SolidWindow.Data;
+		Job.DictionarySize = kcf->SolidWindow.Size;
+	}
+	if (!Job.Slots)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0; i < Job.Count; i++) {
+		Job.Slots[i].Packed = malloc(frame_bound(Job.Codec, FrameSize));
+		Job.Slots[i].Frame  = malloc(FrameSize);
+		if (!Job.Slots[i].Packed || !Job.Slots[i].Frame) {
+			Error = KCF_ERROR_OUT_OF_MEMORY;
 			goto cleanup;
+		}
+	}
 
-		switch (kcf->UnpackerState) {
-		case KCF_UPSTATE_FILE_HEADER:
-			kcf->UnpackerState = KCF_UPSTATE_FILE_DATA;
-			if (rec_has_added_size(&Record))
-				KCF_skip_record(kcf);
+	if (IO_mutex_init(&Job.WriteLock) < 0) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	if (IO_mutex_init(&Job.Lock) < 0) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto destroy_write_lock;
+	}
+	if (IO_cond_init(&Job.JobCond) < 0) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto destroy_lock;
+	}
+	if (IO_cond_init(&Job.FreeCond) < 0) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto destroy_job_cond;
+	}
+
+	for (i = 0; i < (unsigned)Threads; i++) {
+		if (IO_thread_create(&Workers[Started], decode_worker, &Job) < 0)
 			break;
-		case KCF_UPSTATE_FILE_DATA:
-			if (Record.HeadType != KCF_DATA_FRAGMENT) {
-				Error = KCF_ERROR_INVALID_DATA;
-				goto cleanup;
-			}
+		Started++;
+	}
+
+	/* Frames are read by the calling thread */
+	if (Started)
+		Error = read_frames(kcf, &Job, FrameSize, &Unpacked);
+	else
+		Error = unpack_frames(kcf, Output);
+
+	IO_mutex_lock(&Job.Lock);
+	Job.Stop = true;
+	IO_cond_broadcast(&Job.JobCond);
+	IO_mutex_unlock(&Job.Lock);
+	for (i = 0; i < (unsigned)Started; i++)
+		IO_thread_join(&Workers[i], NULL);
+
+	if (!Error)
+		Error = Job.Error;
+	if (!Error && Started && kcf->CurrentFile.HasUnpackedSize &&
+	    Unpacked != kcf->CurrentFile.UnpackedSize)
+		Error = KCF_ERROR_INVALID_DATA;
+	if (!Error && Started && Output &&
+	    IO_seek(Output, Job.Base + Unpacked, IO_SEEK_SET) < 0)
+		Error = KCF_ERROR_WRITE;
+	if (!Error && Started)
+		Error = add_last_frames(kcf, &Job);
+
+	IO_cond_destroy(&Job.FreeCond);
+destroy_job_cond:
+	IO_cond_destroy(&Job.JobCond);
+destroy_lock:
+	IO_mutex_destroy(&Job.Lock);
+destroy_write_lock:
+	IO_mutex_destroy(&Job.WriteLock);
+cleanup:
+	for (i = 0; i < Job.Count; i++) {
+		free(Job.Slots[i].Packed);
+		free(Job.Slots[i].Frame);
+	}
+	free(Job.Slots);
+	return Error;
+}
+
+/*
+ * Copies the data of the file the current one links to, read through its
+ * map. Links are followed within one seekable volume.
+ */
+static KCFERROR unpack_link(KCF *kcf, IO *Output, uint8_t *Buffer)
+{
+	uint64_t Target, Offset, Size;
+	uint32_t CRC, ActualCRC = 0;
+	int64_t Position;
+	size_t Length;
+	KCFERROR Error;
+
+	Error = KCF_read_link(kcf, &Target, &CRC);
+	if (Error)
+		return Error;
 
-			if (rec_has_added_size(&Record))
-				KCF_skip_record(kcf);
+	Position = IO_tell(kcf->Stream);
+	if (kcf->IsMultiVolume || Position < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	Error = KCF_load_range_map(kcf, Target);
+	Size  = member_map_size(&kcf->RangeMap);
+	if (!Error && kcf->CurrentFile.HasUnpackedSize &&
+	    kcf->CurrentFile.UnpackedSize != Size)
+		Error = KCF_ERROR_INVALID_DATA;
+
+	for (Offset = 0; !Error && Offset < Size; Offset += Length) {
+		Length = Size - Offset < EXTRACT_BUFFER_SIZE
+		             ? (size_t)(Size - Offset)
+		             : EXTRACT_BUFFER_SIZE;
+
+		Error = KCF_read_range_map(kcf, Offset, Buffer, Length);
+		if (Error)
+			break;
+
+		ActualCRC = crc32c(ActualCRC, Buffer, Length);
+		if (Output && IO_write(Output, Buffer, Length) < 0)
+			Error = KCF_ERROR_WRITE;
+	}
+	if (!Error && ActualCRC != CRC)
+		Error = KCF_ERROR_INVALID_DATA;
+
+	if (IO_seek(kcf->Stream, Position, IO_SEEK_SET) < 0 && !Error)
+		Error = KCF_ERROR_READ;
+	kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+	return Error;
+}
+
+/*
+ * Reads the data of the current file into Output, NULL only checks it.
+ * Frames of compressed files are decoded by Threads threads unless
+ * Output can't seek.
+ */
+static KCFERROR unpack_file(KCF *kcf, IO *Output, int Threads)
+{
+	KCFERROR Error = KCF_ERROR_OK;
+	uint8_t Buffer[EXTRACT_BUFFER_SIZE];
+	uint32_t FrameSize;
+	size_t BytesRead;
+
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+
+	if (kcf->UnpackerState == KCF_UPSTATE_FILE_HEADER) {
+		Error = read_file_info(kcf);
+		if (Error)
+			return Error;
+	}
+	if (kcf->UnpackerState != KCF_UPSTATE_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	/* Files before it in the solid block have been lost */
+	if (is_solid_file(kcf) && !kcf->IsSolidChainValid) {
+		KCF_skip_file(kcf);
+		return KCF_ERROR_INVALID_DATA;
+	}
+
+	if (kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_LINK) {
+		Error = unpack_link(kcf, Output, Buffer);
+		goto cleanup;
+	}
+
+	if (kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_METHOD_MASK) {
+		if (!frame_codec(kcf->CurrentFile.CompressionInfo, &FrameSize)) {
+			KCF_skip_file(kcf);
+			return KCF_ERROR_NOT_IMPLEMENTED;
+		}
+
+		/* Damaged frames leave the rest of the data behind */
+		if (Threads > 1 && (!Output || IO_tell(Output) >= 0))
+			Error = unpack_frames_parallel(kcf, Output, Threads);
+		else
+			Error = unpack_frames(kcf, Output);
+		if (Error == KCF_ERROR_INVALID_DATA) {
+			KCF_skip_file(kcf);
+			return Error;
+		}
+		goto cleanup;
+	}
+
+	for (;;) {
+		Error = read_packed(kcf, Buffer, sizeof(Buffer), &BytesRead);
+		if (Error || BytesRead == 0)
+			break;
+
+		if (Output && IO_write(Output, Buffer, BytesRead) < 0) {
+			Error = KCF_ERROR_WRITE;
 			break;
-		default:
-			return KCF_ERROR_INVALID_STATE;
 		}
-	} while (Record.HeadFlags & 0x01);
+	}
 
-	kcf->UnpackerState = KCF_UPSTATE_FILE_HEADER;
 cleanup:
-	file_info_clear(&FileInfo);
-	rec_clear(&Record);
+	finish_file(kcf, !Error);
 	return Error;
 }
 
 KCFERROR KCF_extract(KCF *kcf, IO *Output)
 {
-	KCFERROR Error = KCF_ERROR_OK;
-	uint8_t Buffer[4096];
-	size_t ToRead, BytesRead, BytesWritten, Remaining;
-	int ret;
+	if (!kcf || !Output)
+		return KCF_ERROR_INVALID_PARAMETER;
 
+	return unpack_file(kcf, Output, 1);
+}
+
+KCFERROR KCF_extract_parallel(KCF *kcf, IO *Output, int Threads)
+{
 	if (!kcf || !Output)
 		return KCF_ERROR_INVALID_PARAMETER;
-	if (kcf->IsWriting || kcf->UnpackerState != KCF_UPSTATE_FILE_HEADER)
-		return KCF_ERROR_INVALID_STATE;
 
-	Error = KCF_read_record(kcf, &kcf->LastRecord);
-	if (Error)
-		goto cleanup0;
+	return unpack_file(kcf, Output, Threads);
+}
+
+/* Reads a block checksum or frame table of the file into Map */
+static KCFERROR read_table(KCF *kcf, struct KcfRecord *Record,
+                           struct member_map *Map)
+{
+	uint8_t *Table;
+	uint64_t Limit;
+	size_t BytesRead;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	/* Frames carry CRCs of their own, blocks are for stored files */
+	if (Record->HeadType == KCF_BLOCK_TABLE && !Map->Codec)
+		Limit = Map->Size / KCF_MIN_CHECKSUM_BLOCK_SIZE * 4 + 4;
+	else if (Record->HeadType == KCF_FRAME_TABLE && Map->Codec)
+		Limit = Map->Size / KCF_FRAME_HEADER_SIZE * 8;
+	else
+		Limit = 0;
 
-	if (kcf->LastRecord.HeadType != KCF_FILE_HEADER) {
-		Error = KCF_ERROR_INVALID_FORMAT;
-		goto cleanup1;
+	/* A table not matching the file is as good as none */
+	if (Record->AddedSize == 0 || Record->AddedSize > Limit) {
+		if (KCF_is_added_data_available(kcf))
+			Error = KCF_skip_record(kcf);
+		return Error;
 	}
 
-	Error = record_to_file_info(&kcf->LastRecord, &kcf->CurrentFile);
-	if (Error)
-		goto cleanup1;
-
-	/* TODO compression! */
-	do {
-		Remaining = kcf->LastRecord.AddedSize;
-		ToRead    = 4096;
-		while (KCF_is_added_data_available(kcf)) {
-			if (ToRead > Remaining)
-				ToRead = Remaining;
-
-			Error = KCF_read_added_data(kcf, Buffer, ToRead,
-			                            &BytesRead);
-			if (Error)
-				goto cleanup2;
+	Table = malloc(Record->AddedSize);
+	if (!Table)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	if (KCF_is_added_data_available(kcf))
+		Error = KCF_read_added_data(kcf, Table, Record->AddedSize,
+		                            &BytesRead);
+	if (!Error && (!rec_has_added_data_CRC(Record) ||
+	               kcf->ActualAddedDataCRC32 == kcf->AddedDataCRC32)) {
+		if (Record->HeadType == KCF_BLOCK_TABLE)
+			member_map_set_table(Map, Record->Data, Record->DataSize,
+			                     Table, Record->AddedSize);
+		else
+			member_map_set_frames(Map, Record->Data, Record->DataSize,
+			                      Table, Record->AddedSize);
+	}
+
+	free(Table);
+	return Error;
+}
+
+KCFERROR KCF_read_member_map(KCF *kcf, struct member_map *Map)
+{
+	struct KcfRecord Record = {0};
+	struct data_fragment *Fragment;
+	size_t Capacity = 0;
+	int64_t Offset;
+	KCFERROR Error;
 
-			ret = IO_write(Output, Buffer, BytesRead);
-			if (ret < 0) {
-				Error = KCF_ERROR_WRITE;
-				goto cleanup2;
-			}
+	if (kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_METHOD_MASK) {
+		Map->Codec = frame_codec(kcf->CurrentFile.CompressionInfo,
+		                         &Map->FrameSize);
+		if (!Map->Codec)
+			return KCF_ERROR_NOT_IMPLEMENTED;
+		Map->IsSolid = is_solid_file(kcf);
+	}
+
+	for (;;) {
+		Offset = IO_tell(kcf->Stream);
+		if (Offset < 0)
+			return KCF_ERROR_NOT_IMPLEMENTED;
+
+		if (Map->Count == Capacity) {
+			Capacity = Capacity ? Capacity * 2 : 4;
+			Fragment = realloc(Map->Fragments,
+			                   Capacity * sizeof(*Fragment));
+			if (!Fragment)
+				return KCF_ERROR_OUT_OF_MEMORY;
+			Map->Fragments = Fragment;
 		}
 
-		if (kcf->LastRecord.HeadFlags & 0x01) {
-			Error = KCF_read_record(kcf, &kcf->LastRecord);
+		Fragment             = &Map->Fragments[Map->Count++];
+		Fragment->Offset     = Offset;
+		Fragment->FileOffset = Map->Size;
+		Fragment->Size       = kcf->AvailableAddedData;
+		Fragment->CRC        = kcf->LastRecord.AddedDataCRC32;
+		Fragment->HasCRC     = rec_has_added_data_CRC(&kcf->LastRecord);
+		Map->Size += Fragment->Size;
+
+		if (KCF_is_added_data_available(kcf)) {
+			Error = KCF_skip_record(kcf);
 			if (Error)
-				goto cleanup2;
+				return Error;
+		}
+
+		if (!(kcf->LastRecord.HeadFlags & KCF_HAS_CONTINUATION))
+			break;
+
+		Error = read_next_fragment(kcf);
+		if (Error)
+			return Error;
+	}
 
-			if (kcf->LastRecord.HeadType != KCF_DATA_FRAGMENT) {
-				Error = KCF_ERROR_INVALID_FORMAT;
-				goto cleanup2;
-			}
+	/* Tables follow the data in any order */
+	for (;;) {
+		Error = KCF_read_record(kcf, &Record);
+		if (Error == KCF_ERROR_EOF) {
+			Map->EndOffset = kcf->RecordOffset;
+			Error          = KCF_ERROR_OK;
+			break;
 		}
-	} while (kcf->LastRecord.HeadFlags & 0x01);
+		if (Error)
+			break;
+
+		/* Leave the next file for the next call */
+		if (Record.HeadType != KCF_BLOCK_TABLE &&
+		    Record.HeadType != KCF_FRAME_TABLE) {
+			Map->EndOffset = kcf->RecordOffset;
+			break;
+		}
+
+		Error = read_table(kcf, &Record, Map);
+		if (Error)
+			break;
+		Map->EndOffset = IO_tell(kcf->Stream);
+		rec_clear(&Record);
+	}
+	rec_clear(&Record);
+
+	/* Older writers or a damaged table, the frames tell it themselves */
+	if (!Error && Map->Codec && !Map->FrameOffsets) {
+		Error = member_map_index_frames(kcf->Stream, Map);
+		if (IO_seek(kcf->Stream, Map->EndOffset, IO_SEEK_SET) < 0 &&
+		    !Error)
+			Error = KCF_ERROR_READ;
+	}
 
-cleanup2:
-	file_info_clear(&kcf->CurrentFile);
-cleanup1:
-	rec_clear(&kcf->LastRecord);
-cleanup0:
 	return Error;
 }
 
-static KCFERROR read_file_info(KCF *kcf, struct KcfFileInfo *FileInfo)
+KCFERROR KCF_verify_file(KCF *kcf, int Threads, KcfVolumeOpener Opener,
+                         void *Context)
 {
-	struct KcfRecord Record = {0};
-	KCFERROR Error          = KCF_ERROR_OK;
+	struct member_map Map = {0};
+	KCFERROR Error;
 
-	Error = KCF_read_record(kcf, &Record);
-	if (Error)
-		return Error;
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
 
-	Error = record_to_file_info(&Record, FileInfo);
-	if (Error)
-		goto cleanup;
+	if (kcf->UnpackerState == KCF_UPSTATE_FILE_HEADER) {
+		Error = read_file_info(kcf);
+		if (Error)
+			return Error;
+	}
+	if (kcf->UnpackerState != KCF_UPSTATE_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	/* Frames are decoded in parallel as they are read */
+	if (kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_METHOD_MASK)
+		return unpack_file(kcf, NULL, Threads);
+	if (kcf->CurrentFile.CompressionInfo & KCF_COMPRESSION_LINK)
+		return unpack_file(kcf, NULL, 1);
+
+	/* Only stored data in one volume can be checked in place */
+	if ((is_solid_file(kcf) && !kcf->IsSolidChainValid) ||
+	    kcf->IsMultiVolume || kcf->AddedDataAlreadyRead > 0 ||
+	    IO_tell(kcf->Stream) < 0)
+		return unpack_file(kcf, NULL, 1);
+
+	Error = KCF_read_member_map(kcf, &Map);
+	if (!Error) {
+		Error = member_map_check(kcf->Stream, &Map, Threads, Opener,
+		                         Context);
+		if (IO_seek(kcf->Stream, Map.EndOffset, IO_SEEK_SET) < 0 &&
+		    !Error)
+			Error = KCF_ERROR_READ;
+		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+	}
+
+	member_map_clear(&Map);
+	finish_file(kcf, !Error);
+	return Error;
+}
+
+/*
+ * Goes through a deleted file whose header is in CurrentFile like through
+ * any other, as the files after it in its solid block need its data.
+ */
+static KCFERROR pass_deleted_file(KCF *kcf)
+{
+	KCFERROR Error;
 
-	Error              = file_info_copy(&kcf->CurrentFile, FileInfo);
+	begin_block(kcf);
 	kcf->UnpackerState = KCF_UPSTATE_FILE_DATA;
+	if (is_compressed_file(kcf))
+		Error = unpack_file(kcf, NULL, 1);
+	else
+		Error = KCF_skip_file(kcf);
 
-cleanup:
-	rec_clear(&Record);
+	/* The file is gone, but the solid files after it can't be unpacked */
+	if (Error == KCF_ERROR_INVALID_DATA ||
+	    Error == KCF_ERROR_NOT_IMPLEMENTED) {
+		kcf->IsSolidChainValid = false;
+		Error                  = KCF_ERROR_OK;
+	}
 	return Error;
 }
+
+/*
+ * Skips a deleted file whose header is in CurrentFile, noting where the
+ * first compressed one since the last file read is. Its data is only
+ * unpacked if a solid file comes next, or here if the stream can't seek.
+ */
+static KCFERROR skip_deleted_file(KCF *kcf)
+{
+	if (is_compressed_file(kcf) &&
+	    (kcf->IsMultiVolume || IO_tell(kcf->Stream) < 0))
+		return pass_deleted_file(kcf);
+
+	if (is_compressed_file(kcf) &&
+	    (!kcf->HasDeletedFiles || !is_solid_file(kcf))) {
+		kcf->HasDeletedFiles   = true;
+		kcf->DeletedChainValid = kcf->IsSolidChainValid;
+		kcf->DeletedOffset     = kcf->RecordOffset;
+	}
+
+	kcf->UnpackerState = KCF_UPSTATE_FILE_DATA;
+	return KCF_skip_file(kcf);
+}
+
+/*
+ * Goes back to the deleted files noted by skip_deleted_file() for the
+ * solid file whose header is in LastRecord, then reads the header again.
+ */
+static KCFERROR pass_deleted_files(KCF *kcf)
+{
+	uint64_t HeaderOffset = kcf->RecordOffset;
+	KCFERROR Error;
+
+	kcf->HasDeletedFiles   = false;
+	kcf->IsSolidChainValid = kcf->DeletedChainValid;
+	if (IO_seek(kcf->Stream, kcf->DeletedOffset, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+	kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+
+	for (;;) {
+		file_info_clear(&kcf->CurrentFile);
+		rec_clear(&kcf->LastRecord);
+		Error = KCF_read_record(kcf, &kcf->LastRecord);
+		if (Error == KCF_ERROR_EOF)
+			return KCF_ERROR_PREMATURE_EOF;
+		if (Error)
+			return Error;
+
+		if (kcf->HasResynced)
+			kcf->IsSolidChainValid = false;
+		if (kcf->RecordOffset >= HeaderOffset)
+			break;
+
+		if (kcf->LastRecord.HeadType == KCF_DELETED_FILE &&
+		    record_to_file_info(&kcf->LastRecord, &kcf->CurrentFile) ==
+		        KCF_ERROR_OK) {
+			Error = pass_deleted_file(kcf);
+			if (Error)
+				return Error;
+		} else if (KCF_is_added_data_available(kcf)) {
+			Error = KCF_skip_record(kcf);
+			if (Error)
+				return Error;
+		}
+	}
+
+	/* Damaged records may have hidden the header read before */
+	if (kcf->RecordOffset != HeaderOffset ||
+	    kcf->LastRecord.HeadType != KCF_FILE_HEADER)
+		return KCF_ERROR_INVALID_DATA;
+	return KCF_ERROR_OK;
+}
+
+/*
+ * Reads file header of the next file into LastRecord and CurrentFile.
+ * Records which don't start a file (e.g. orphaned fragments) and deleted
+ * files are skipped.
+ */
+static KCFERROR read_file_info(KCF *kcf)
+{
+	KCFERROR Error = KCF_ERROR_OK;
+	bool Deleted   = false;
+
+	for (;;) {
+		rec_clear(&kcf->LastRecord);
+		Error = KCF_read_record(kcf, &kcf->LastRecord);
+		if (Error)
+			return Error;
+
+		/* Something has been lost in between */
+		if (kcf->HasResynced)
+			kcf->IsSolidChainValid = false;
+
+		if (kcf->LastRecord.HeadType == KCF_FILE_HEADER)
+			break;
+
+		if (kcf->LastRecord.HeadType == KCF_DELETED_FILE &&
+		    record_to_file_info(&kcf->LastRecord, &kcf->CurrentFile) ==
+		        KCF_ERROR_OK) {
+			Error = skip_deleted_file(kcf);
+			if (Error)
+				return Error;
+			Deleted = false;
+			continue;
+		}
+		file_info_clear(&kcf->CurrentFile);
+
+		/* Data fragments of a deleted file go with it */
+		if (kcf->LastRecord.HeadType == KCF_DELETED_FILE ||
+		    (Deleted &&
+		     kcf->LastRecord.HeadType == KCF_DATA_FRAGMENT)) {
+			Deleted = !!(kcf->LastRecord.HeadFlags &
+			             KCF_HAS_CONTINUATION);
+		} else {
+			Deleted = false;
+
+			/* Data whose file header has been lost is skipped too */
+			if (kcf->IsRecovering &&
+			    kcf->LastRecord.HeadType == KCF_DATA_FRAGMENT)
+				KCF_report_skipped(kcf, kcf->RecordOffset,
+				                   kcf->LastRecord.HeadSize +
+				                       kcf->LastRecord.AddedSize);
+
+			if (kcf->LastRecord.HeadType != KCF_ARCHIVE_HEADER &&
+			    kcf->LastRecord.HeadType != KCF_BLOCK_TABLE &&
+			    kcf->LastRecord.HeadType != KCF_FRAME_TABLE &&
+			    kcf->LastRecord.HeadType != KCF_LINK_RECORD &&
+			    kcf->LastRecord.HeadType != KCF_RECOVERY_RECORD)
+				kcf->IsSolidChainValid = false;
+		}
+
+		if (KCF_is_added_data_available(kcf)) {
+			Error = KCF_skip_record(kcf);
+			if (Error)
+				return Error;
+		}
+	}
+
+	file_info_clear(&kcf->CurrentFile);
+	Error = record_to_file_info(&kcf->LastRecord, &kcf->CurrentFile);
+
+	/* The window needs the deleted files of the block before this one */
+	if (!Error && kcf->HasDeletedFiles && is_solid_file(kcf) &&
+	    is_compressed_file(kcf)) {
+		Error = pass_deleted_files(kcf);
+		file_info_clear(&kcf->CurrentFile);
+		if (!Error)
+			Error = record_to_file_info(&kcf->LastRecord,
+			                            &kcf->CurrentFile);
+	}
+	if (Error) {
+		rec_clear(&kcf->LastRecord);
+		return Error;
+	}
+
+	kcf->FileOffset = kcf->RecordOffset;
+	begin_block(kcf);
+
+	kcf->UnpackerState = KCF_UPSTATE_FILE_DATA;
+	return KCF_ERROR_OK;
+}
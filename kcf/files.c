@@ -49,7 +49,7 @@ static int get_file_info_data_size(struct KcfFileInfo *Info)
  * compromising the system.
  */
 KCFERROR
-file_info_to_record(struct KcfFileInfo *Info, struct KcfRecord *Record)
+record_to_file_info(struct KcfRecord *Record, struct KcfFileInfo *Info)
 {
 	ptrdiff_t Offset = 0;
 	size_t Size;
@@ -63,14 +63,18 @@ file_info_to_record(struct KcfFileInfo *Info, struct KcfRecord *Record)
 
 	if (!rec_validate(Record))
 		return KCF_ERROR_INVALID_DATA;
-	if (Record->HeadType != KCF_FILE_HEADER)
+	/* Links still get the file they point at after it is deleted */
+	if (Record->HeadType != KCF_FILE_HEADER &&
+	    Record->HeadType != KCF_DELETED_FILE)
 		return KCF_ERROR_INVALID_DATA;
 
 	pbuf = Record->Data;
 	Size = Record->DataSize;
-	ReadU8(pbuf, Size, &Offset, &flags);
-	ReadU8(pbuf, Size, &Offset, &type);
+	if (!ReadU8(pbuf, Size, &Offset, &flags) ||
+	    !ReadU8(pbuf, Size, &Offset, &type))
+		return KCF_ERROR_INVALID_DATA;
 
+	Info->FileType        = type;
 	Info->HasTimeStamp    = !!(flags & KCF_FILE_HAS_TIMESTAMP);
 	Info->HasFileCRC32    = !!(flags & KCF_FILE_HAS_FILE_CRC32);
 	Info->HasUnpackedSize = !!(flags & KCF_FILE_HAS_UNPACKED_4);
@@ -79,25 +83,34 @@ file_info_to_record(struct KcfFileInfo *Info, struct KcfRecord *Record)
 
 	switch (flags & KCF_FILE_HAS_UNPACKED_8) {
 	case KCF_FILE_HAS_UNPACKED_8:
-		ReadU64LE(pbuf, Size, &Offset, &Info->UnpackedSize);
+		if (!ReadU64LE(pbuf, Size, &Offset, &Info->UnpackedSize))
+			return KCF_ERROR_INVALID_DATA;
 		break;
 	case KCF_FILE_HAS_UNPACKED_4:
-		ReadU32LE(pbuf, Size, &Offset, &tmp4);
+		if (!ReadU32LE(pbuf, Size, &Offset, &tmp4))
+			return KCF_ERROR_INVALID_DATA;
 		Info->UnpackedSize = tmp4;
 		break;
 	}
 
-	if (Info->HasFileCRC32) {
-		ReadU32LE(pbuf, Size, &Offset, &Info->FileCRC32);
-	}
+	if (Info->HasFileCRC32 &&
+	    !ReadU32LE(pbuf, Size, &Offset, &Info->FileCRC32))
+		return KCF_ERROR_INVALID_DATA;
 
-	ReadU32LE(pbuf, Size, &Offset, &Info->CompressionInfo);
+	if (!ReadU32LE(pbuf, Size, &Offset, &Info->CompressionInfo))
+		return KCF_ERROR_INVALID_DATA;
 
-	if (Info->HasTimeStamp) {
-		ReadU64LE(pbuf, Size, &Offset, &Info->TimeStamp);
-	}
+	if (Info->HasTimeStamp &&
+	    !ReadU64LE(pbuf, Size, &Offset, &Info->TimeStamp))
+		return KCF_ERROR_INVALID_DATA;
+
+	if (!ReadU16LE(pbuf, Size, &Offset, &file_name_size))
+		return KCF_ERROR_INVALID_DATA;
+
+	/* The name must be in the record, not in memory after it */
+	if (file_name_size > Size - (size_t)Offset)
+		return KCF_ERROR_INVALID_DATA;
 
-	ReadU16LE(pbuf, Size, &Offset, &file_name_size);
 	Info->FileName = malloc(file_name_size + 1);
 	if (!Info->FileName) {
 		return KCF_ERROR_OUT_OF_MEMORY;
@@ -109,7 +122,7 @@ file_info_to_record(struct KcfFileInfo *Info, struct KcfRecord *Record)
 }
 
 KCFERROR
-record_to_file_info(struct KcfRecord *Record, struct KcfFileInfo *Info)
+file_info_to_record(struct KcfFileInfo *Info, struct KcfRecord *Record)
 {
 	int size;
 	ptrdiff_t offset = 0;
@@ -0,0 +1,798 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <io/thread.h>
+
+#include "crc32c.h"
+#include "kcf_impl.h"
+
+/*
+ * Frame: header of KCF_FRAME_HEADER_SIZE bytes and the payload, which
+ * is the data compressed by the codec of the file, or the data itself
+ * if PackedSize equals UnpackedSize. Frame table: record 'T' after the
+ * data of the file with the offset of every frame in its packed data.
+ * Files of a solid block leave their last data in a window, which the
+ * first frame of the next file in the block is compressed against.
+ */
+
+/* UnpackedSize of the file */
+#define FRAME_TABLE_DATA_SIZE 8
+
+static void pool_destroy(struct frame_writer *Writer);
+
+KCFERROR KCF_set_compression(KCF *kcf, int Method, int Level,
+                             uint32_t FrameSize)
+{
+	struct frame_writer *Writer;
+	const struct kcf_codec *Codec = NULL;
+	unsigned Shift = KCF_DEFAULT_FRAME_SHIFT;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->PackerState == KCF_PKSTATE_FILE_DATA ||
+	    kcf->PackerState == KCF_PKSTATE_AFTER_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	if (Method != KCF_METHOD_STORE) {
+		Codec = codec_find(Method);
+		if (!Codec)
+			return KCF_ERROR_NOT_IMPLEMENTED;
+	}
+
+	if (FrameSize) {
+		for (Shift = KCF_MIN_FRAME_SHIFT; Shift <= KCF_MAX_FRAME_SHIFT;
+		     Shift++) {
+			if ((1UL << Shift) == FrameSize)
+				break;
+		}
+		if (Shift > KCF_MAX_FRAME_SHIFT)
+			return KCF_ERROR_INVALID_PARAMETER;
+	}
+
+	/* The pool is made for the settings of the first frame */
+	Writer = &kcf->Frames;
+	pool_destroy(Writer);
+
+	/* Files of a solid block are all compressed the same way */
+	kcf->HasSolidBlock = false;
+
+	Writer->Codec = Codec;
+	Writer->Level = Level;
+	Writer->Shift = Shift;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_set_compression_threads(KCF *kcf, int Threads)
+{
+	if (!kcf || Threads < 1)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->PackerState == KCF_PKSTATE_FILE_DATA ||
+	    kcf->PackerState == KCF_PKSTATE_AFTER_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	if (Threads > KCF_MAX_FRAME_THREADS)
+		Threads = KCF_MAX_FRAME_THREADS;
+
+	pool_destroy(&kcf->Frames);
+	kcf->Frames.Threads = Threads;
+	return KCF_ERROR_OK;
+}
+
+size_t frame_bound(const struct kcf_codec *Codec, size_t Size)
+{
+	size_t Bound = Codec->Bound(Size);
+
+	return KCF_FRAME_HEADER_SIZE + (Bound > Size ? Bound : Size);
+}
+
+size_t frame_encode(const struct kcf_codec *Codec, int Level,
+                    const uint8_t *Dictionary, size_t DictionarySize,
+                    const uint8_t *Src, size_t Size, uint8_t *Dst)
+{
+	size_t Packed = frame_bound(Codec, Size) - KCF_FRAME_HEADER_SIZE;
+
+	if (!Codec->Compress(Level, Dictionary, DictionarySize, Src, Size,
+	                     Dst + KCF_FRAME_HEADER_SIZE, &Packed) ||
+	    Packed >= Size) {
+		memcpy(Dst + KCF_FRAME_HEADER_SIZE, Src, Size);
+		Packed = Size;
+	}
+
+	StoreU32LE(Dst, Packed);
+	StoreU32LE(Dst + 4, Size);
+	StoreU32LE(Dst + 8, crc32c(0, Src, Size));
+	return KCF_FRAME_HEADER_SIZE + Packed;
+}
+
+void frame_header_load(const uint8_t *Buffer, struct frame_header *Header)
+{
+	Header->PackedSize   = LoadU32LE(Buffer);
+	Header->UnpackedSize = LoadU32LE(Buffer + 4);
+	Header->CRC          = LoadU32LE(Buffer + 8);
+}
+
+bool frame_header_valid(const struct kcf_codec *Codec,
+                        const struct frame_header *Header,
+                        uint32_t FrameSize)
+{
+	if (Header->UnpackedSize == 0 || Header->UnpackedSize > FrameSize)
+		return false;
+	if (Header->PackedSize == 0)
+		return false;
+
+	return Header->PackedSize <= frame_bound(Codec, Header->UnpackedSize) -
+	                                 KCF_FRAME_HEADER_SIZE;
+}
+
+bool solid_window_add(struct solid_window *Window, const uint8_t *Data,
+                      size_t Size)
+{
+	size_t Keep;
+
+	if (!Window->Data) {
+		Window->Data = malloc(KCF_SOLID_WINDOW_SIZE);
+		if (!Window->Data)
+			return false;
+	}
+
+	if (Size >= KCF_SOLID_WINDOW_SIZE) {
+		memcpy(Window->Data, Data + Size - KCF_SOLID_WINDOW_SIZE,
+		       KCF_SOLID_WINDOW_SIZE);
+		Window->Size = KCF_SOLID_WINDOW_SIZE;
+		return true;
+	}
+
+	/* The newest data of the window moves to the front */
+	Keep = KCF_SOLID_WINDOW_SIZE - Size;
+	if (Keep > Window->Size)
+		Keep = Window->Size;
+	memmove(Window->Data, Window->Data + Window->Size - Keep, Keep);
+	memcpy(Window->Data + Keep, Data, Size);
+	Window->Size = Keep + Size;
+	return true;
+}
+
+void solid_window_free(struct solid_window *Window)
+{
+	free(Window->Data);
+	Window->Data = NULL;
+	Window->Size = 0;
+}
+
+bool frame_decode(const struct kcf_codec *Codec,
+                  const struct frame_header *Header,
+                  const uint8_t *Dictionary, size_t DictionarySize,
+                  const uint8_t *Payload, uint8_t *Dst)
+{
+	if (Header->PackedSize == Header->UnpackedSize)
+		memcpy(Dst, Payload, Header->UnpackedSize);
+	else if (!Codec->Decompress(Dictionary, DictionarySize, Payload,
+	                            Header->PackedSize, Dst,
+	                            Header->UnpackedSize))
+		return false;
+
+	return crc32c(0, Dst, Header->UnpackedSize) == Header->CRC;
+}
+
+const struct kcf_codec *frame_codec(uint32_t CompressionInfo,
+                                    uint32_t *FrameSize)
+{
+	unsigned Shift = KCF_FRAME_SHIFT(CompressionInfo);
+
+	if (Shift < KCF_MIN_FRAME_SHIFT || Shift > KCF_MAX_FRAME_SHIFT)
+		return NULL;
+
+	*FrameSize = 1UL << Shift;
+	return codec_find(CompressionInfo & KCF_COMPRESSION_METHOD_MASK);
+}
+
+/*
+ * Frames of the file being written go through a ring of slots: the
+ * writer fills the slot at Tail, workers encode submitted slots in
+ * order of submission and the writer writes them out from Head, so the
+ * frames keep their order whichever thread encodes them. Without
+ * workers the writer encodes every slot itself.
+ */
+
+struct frame_slot {
+	uint8_t *Input;
+	size_t InputSize;
+	uint8_t *Output;
+	size_t OutputSize;
+
+	/* Copy of the window for the first frame of a solid file */
+	uint8_t *Dictionary;
+	size_t DictionarySize;
+
+	/* Protected by Lock of the pool */
+	bool Done;
+};
+
+struct frame_pool {
+	const struct kcf_codec *Codec;
+	int Level;
+
+	IO_THREAD Workers[KCF_MAX_FRAME_THREADS];
+	int Started;
+	IO_MUTEX Lock;
+	IO_COND JobCond;
+	IO_COND DoneCond;
+
+	struct frame_slot *Slots;
+	unsigned Count;
+
+	/* Used by the writer only */
+	unsigned Head;
+	unsigned Tail;
+	unsigned InFlight;
+
+	/* Protected by Lock */
+	unsigned NextJob;
+	unsigned Jobs;
+	bool Stop;
+};
+
+static void encode_slot(struct frame_pool *Pool, struct frame_slot *Slot)
+{
+	Slot->OutputSize = frame_encode(Pool->Codec, Pool->Level,
+	                                Slot->Dictionary, Slot->DictionarySize,
+	                                Slot->Input, Slot->InputSize,
+	                                Slot->Output);
+}
+
+static void *frame_worker(void *Arg)
+{
+	struct frame_pool *Pool = Arg;
+	struct frame_slot *Slot;
+
+	IO_mutex_lock(&Pool->Lock);
+	for (;;) {
+		while (Pool->Jobs == 0 && !Pool->Stop)
+			IO_cond_wait(&Pool->JobCond, &Pool->Lock);
+		if (Pool->Jobs == 0)
+			break;
+
+		Slot          = &Pool->Slots[Pool->NextJob];
+		Pool->NextJob = (Pool->NextJob + 1) % Pool->Count;
+		Pool->Jobs--;
+		IO_mutex_unlock(&Pool->Lock);
+
+		encode_slot(Pool, Slot);
+
+		IO_mutex_lock(&Pool->Lock);
+		Slot->Done = true;
+		IO_cond_broadcast(&Pool->DoneCond);
+	}
+	IO_mutex_unlock(&Pool->Lock);
+
+	return NULL;
+}
+
+static void pool_free(struct frame_pool *Pool)
+{
+	unsigned i;
+
+	for (i = 0; i < Pool->Count; i++) {
+		free(Pool->Slots[i].Input);
+		free(Pool->Slots[i].Output);
+		free(Pool->Slots[i].Dictionary);
+	}
+	free(Pool->Slots);
+	free(Pool);
+}
+
+static struct frame_pool *pool_create(struct frame_writer *Writer)
+{
+	struct frame_pool *Pool;
+	size_t FrameSize = (size_t)1 << Writer->Shift;
+	unsigned i;
+	int Threads = Writer->Threads > 1 ? Writer->Threads : 0;
+
+	Pool = calloc(1, sizeof(*Pool));
+	if (!Pool)
+		return NULL;
+
+	/* Two frames per thread keep workers busy while one is written */
+	Pool->Codec = Writer->Codec;
+	Pool->Level = Writer->Level;
+	Pool->Count = Threads ? 2 * Threads : 1;
+	Pool->Slots = calloc(Pool->Count, sizeof(struct frame_slot));
+	if (!Pool->Slots) {
+		free(Pool);
+		return NULL;
+	}
+
+	for (i = 0; i < Pool->Count; i++) {
+		Pool->Slots[i].Input  = malloc(FrameSize);
+		Pool->Slots[i].Output = malloc(frame_bound(Pool->Codec, FrameSize));
+		if (!Pool->Slots[i].Input || !Pool->Slots[i].Output) {
+			pool_free(Pool);
+			return NULL;
+		}
+	}
+
+	if (!Threads)
+		return Pool;
+
+	if (IO_mutex_init(&Pool->Lock) < 0) {
+		pool_free(Pool);
+		return NULL;
+	}
+	if (IO_cond_init(&Pool->JobCond) < 0) {
+		IO_mutex_destroy(&Pool->Lock);
+		pool_free(Pool);
+		return NULL;
+	}
+	if (IO_cond_init(&Pool->DoneCond) < 0) {
+		IO_cond_destroy(&Pool->JobCond);
+		IO_mutex_destroy(&Pool->Lock);
+		pool_free(Pool);
+		return NULL;
+	}
+
+	/* Fewer workers only make it slower */
+	for (i = 0; i < (unsigned)Threads; i++) {
+		if (IO_thread_create(&Pool->Workers[Pool->Started], frame_worker,
+		                     Pool) < 0)
+			break;
+		Pool->Started++;
+	}
+
+	return Pool;
+}
+
+/* Hands the slot at Tail over to the workers */
+static void pool_submit(struct frame_pool *Pool)
+{
+	struct frame_slot *Slot = &Pool->Slots[Pool->Tail];
+
+	Pool->Tail = (Pool->Tail + 1) % Pool->Count;
+	Pool->InFlight++;
+
+	if (!Pool->Started) {
+		encode_slot(Pool, Slot);
+		Slot->Done = true;
+		return;
+	}
+
+	IO_mutex_lock(&Pool->Lock);
+	Slot->Done = false;
+	Pool->Jobs++;
+	IO_cond_signal(&Pool->JobCond);
+	IO_mutex_unlock(&Pool->Lock);
+}
+
+/* Drops frames of a file which has failed to be written */
+static void pool_reset(struct frame_pool *Pool)
+{
+	unsigned i;
+
+	if (!Pool)
+		return;
+
+	if (Pool->Started) {
+		IO_mutex_lock(&Pool->Lock);
+		for (i = 0; i < Pool->InFlight; i++) {
+			while (!Pool->Slots[(Pool->Head + i) % Pool->Count].Done)
+				IO_cond_wait(&Pool->DoneCond, &Pool->Lock);
+		}
+		Pool->NextJob = 0;
+		IO_mutex_unlock(&Pool->Lock);
+	}
+
+	for (i = 0; i < Pool->Count; i++)
+		Pool->Slots[i].InputSize = 0;
+	Pool->Head     = 0;
+	Pool->Tail     = 0;
+	Pool->InFlight = 0;
+}
+
+static void pool_destroy(struct frame_writer *Writer)
+{
+	struct frame_pool *Pool = Writer->Pool;
+	int i;
+
+	if (!Pool)
+		return;
+
+	if (Pool->Started) {
+		IO_mutex_lock(&Pool->Lock);
+		Pool->Stop = true;
+		IO_cond_broadcast(&Pool->JobCond);
+		IO_mutex_unlock(&Pool->Lock);
+
+		for (i = 0; i < Pool->Started; i++)
+			IO_thread_join(&Pool->Workers[i], NULL);
+	}
+
+	/* Pools for several threads have the lock even if none started */
+	if (Pool->Count > 1) {
+		IO_cond_destroy(&Pool->DoneCond);
+		IO_cond_destroy(&Pool->JobCond);
+		IO_mutex_destroy(&Pool->Lock);
+	}
+
+	pool_free(Pool);
+	Writer->Pool = NULL;
+}
+
+/* Writing */
+
+uint32_t frames_compression_info(const struct frame_writer *Writer)
+{
+	if (!Writer->Codec)
+		return 0;
+
+	return Writer->Codec->Method | Writer->Shift << 8;
+}
+
+void frames_begin(struct frame_writer *Writer)
+{
+	pool_reset(Writer->Pool);
+	Writer->Count        = 0;
+	Writer->PackedSize   = 0;
+	Writer->UnpackedSize = 0;
+}
+
+void frames_free(struct frame_writer *Writer)
+{
+	pool_destroy(Writer);
+	solid_window_free(&Writer->Window);
+	free(Writer->Offsets);
+	Writer->Offsets  = NULL;
+	Writer->Capacity = 0;
+	frames_begin(Writer);
+}
+
+static bool push_offset(struct frame_writer *Writer, uint64_t Offset)
+{
+	uint64_t *Offsets, Capacity;
+
+	if (Writer->Count == Writer->Capacity) {
+		Capacity = Writer->Capacity ? Writer->Capacity * 2 : 64;
+		Offsets  = realloc(Writer->Offsets, Capacity * sizeof(uint64_t));
+		if (!Offsets)
+			return false;
+		Writer->Offsets  = Offsets;
+		Writer->Capacity = Capacity;
+	}
+
+	Writer->Offsets[Writer->Count++] = Offset;
+	return true;
+}
+
+static KCFERROR write_slot(KCF *kcf, struct frame_slot *Slot)
+{
+	struct frame_writer *Writer = &kcf->Frames;
+	KCFERROR Error;
+
+	if (!push_offset(Writer, Writer->PackedSize))
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	Error = KCF_write_added_data(kcf, Slot->Output, Slot->OutputSize);
+	if (Error)
+		return Error;
+
+	Writer->PackedSize += Slot->OutputSize;
+	Writer->UnpackedSize += Slot->InputSize;
+	return KCF_ERROR_OK;
+}
+
+/*
+ * Writes encoded frames in order. Waits for them while more than Limit
+ * frames are in flight, the ones already done are written anyway.
+ */
+static KCFERROR write_frames(KCF *kcf, unsigned Limit)
+{
+	struct frame_pool *Pool = kcf->Frames.Pool;
+	struct frame_slot *Slot;
+	KCFERROR Error;
+	bool Done;
+
+	while (Pool->InFlight > 0) {
+		Slot = &Pool->Slots[Pool->Head];
+
+		if (Pool->Started) {
+			IO_mutex_lock(&Pool->Lock);
+			while (!Slot->Done && Pool->InFlight > Limit)
+				IO_cond_wait(&Pool->DoneCond, &Pool->Lock);
+			Done = Slot->Done;
+			IO_mutex_unlock(&Pool->Lock);
+		} else {
+			Done = Slot->Done;
+		}
+		if (!Done)
+			break;
+
+		Error = write_slot(kcf, Slot);
+		if (Error)
+			return Error;
+
+		Slot->InputSize = 0;
+		Pool->Head = (Pool->Head + 1) % Pool->Count;
+		Pool->InFlight--;
+	}
+
+	return KCF_ERROR_OK;
+}
+
+/*
+ * Hands the frame being filled over to be encoded. Its data goes to the
+ * window of the solid block, which a file starting a block empties.
+ */
+static KCFERROR submit_frame(struct frame_writer *Writer)
+{
+	struct frame_pool *Pool = Writer->Pool;
+	struct frame_slot *Slot = &Pool->Slots[Pool->Tail];
+	bool IsFirst            = Writer->Count + Pool->InFlight == 0;
+
+	Slot->DictionarySize = 0;
+	if (IsFirst && Writer->IsSolid && Writer->Window.Size) {
+		if (!Slot->Dictionary)
+			Slot->Dictionary = malloc(KCF_SOLID_WINDOW_SIZE);
+		if (!Slot->Dictionary)
+			return KCF_ERROR_OUT_OF_MEMORY;
+		memcpy(Slot->Dictionary, Writer->Window.Data,
+		       Writer->Window.Size);
+		Slot->DictionarySize = Writer->Window.Size;
+	}
+
+	if (Writer->HasWindow) {
+		if (IsFirst && !Writer->IsSolid)
+			Writer->Window.Size = 0;
+		if (!solid_window_add(&Writer->Window, Slot->Input,
+		                      Slot->InputSize))
+			return KCF_ERROR_OUT_OF_MEMORY;
+	}
+
+	pool_submit(Pool);
+	return KCF_ERROR_OK;
+}
+
+KCFERROR frames_write(KCF *kcf, const uint8_t *Data, size_t Size)
+{
+	struct frame_writer *Writer = &kcf->Frames;
+	size_t FrameSize            = (size_t)1 << Writer->Shift;
+	struct frame_slot *Slot;
+	struct frame_pool *Pool;
+	size_t Length;
+	KCFERROR Error;
+
+	if (!Writer->Pool) {
+		Writer->Pool = pool_create(Writer);
+		if (!Writer->Pool)
+			return KCF_ERROR_OUT_OF_MEMORY;
+	}
+	Pool = Writer->Pool;
+
+	while (Size > 0) {
+		Slot   = &Pool->Slots[Pool->Tail];
+		Length = FrameSize - Slot->InputSize;
+		if (Length > Size)
+			Length = Size;
+
+		memcpy(Slot->Input + Slot->InputSize, Data, Length);
+		Slot->InputSize += Length;
+		Data += Length;
+		Size -= Length;
+
+		/* The next frame needs a free slot */
+		if (Slot->InputSize == FrameSize) {
+			Error = submit_frame(Writer);
+			if (!Error)
+				Error = write_frames(kcf, Pool->Count - 1);
+			if (Error)
+				return Error;
+		}
+	}
+
+	return KCF_ERROR_OK;
+}
+
+KCFERROR frames_flush(KCF *kcf)
+{
+	struct frame_writer *Writer = &kcf->Frames;
+	struct frame_pool *Pool     = Writer->Pool;
+	KCFERROR Error              = KCF_ERROR_OK;
+
+	if (Pool && Pool->Slots[Pool->Tail].InputSize > 0)
+		Error = submit_frame(Writer);
+	if (!Error && Pool)
+		Error = write_frames(kcf, 0);
+
+	/* An empty file starting a block has no frame to empty the window */
+	if (!Error && !Writer->IsSolid && Writer->Count == 0)
+		Writer->Window.Size = 0;
+	return Error;
+}
+
+KCFERROR KCF_write_frame_table(KCF *kcf)
+{
+	struct frame_writer *Writer = &kcf->Frames;
+	struct KcfRecord Record     = {0};
+	uint8_t Data[FRAME_TABLE_DATA_SIZE], *Buffer;
+	uint64_t i;
+	KCFERROR Error;
+
+	/* The only frame is at the start of the data */
+	if (!Writer->Codec || Writer->Count < 2)
+		return KCF_ERROR_OK;
+
+	Buffer = malloc(Writer->Count * 8);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < Writer->Count; i++)
+		StoreU64LE(Buffer + 8 * i, Writer->Offsets[i]);
+	StoreU64LE(Data, Writer->UnpackedSize);
+
+	Record.HeadType  = KCF_FRAME_TABLE;
+	Record.HeadFlags = KCF_HAS_ADDED_DATA_CRC32;
+	Record.Data      = Data;
+	Record.DataSize  = sizeof(Data);
+
+	Error = KCF_write_record_with_added_data(kcf, &Record, Buffer,
+	                                         Writer->Count * 8);
+	free(Buffer);
+	return Error;
+}
+
+/* Reading */
+
+void member_map_set_frames(struct member_map *Map, const uint8_t *Data,
+                           size_t DataSize, const uint8_t *Table,
+                           uint64_t TableSize)
+{
+	uint64_t UnpackedSize, Frames, *Offsets, i;
+
+	if (!Map->Codec || DataSize < FRAME_TABLE_DATA_SIZE || TableSize % 8)
+		return;
+
+	UnpackedSize = LoadU64LE(Data);
+	Frames       = TableSize / 8;
+	if (Frames == 0 ||
+	    Frames != (UnpackedSize + Map->FrameSize - 1) / Map->FrameSize)
+		return;
+
+	Offsets = malloc(Frames * sizeof(uint64_t));
+	if (!Offsets)
+		return;
+
+	/* Every frame has at least its header */
+	for (i = 0; i < Frames; i++) {
+		Offsets[i] = LoadU64LE(Table + 8 * i);
+		if ((i == 0 && Offsets[i] != 0) ||
+		    (i > 0 &&
+		     Offsets[i] < Offsets[i - 1] + KCF_FRAME_HEADER_SIZE) ||
+		    Offsets[i] + KCF_FRAME_HEADER_SIZE > Map->Size) {
+			free(Offsets);
+			return;
+		}
+	}
+
+	free(Map->FrameOffsets);
+	Map->FrameOffsets = Offsets;
+	Map->Frames       = Frames;
+	Map->UnpackedSize = UnpackedSize;
+}
+
+KCFERROR member_map_index_frames(IO *Stream, struct member_map *Map)
+{
+	struct frame_header Header = {0};
+	uint8_t Buffer[KCF_FRAME_HEADER_SIZE];
+	uint64_t Offset = 0, Unpacked = 0, Capacity = 0, *Offsets;
+	KCFERROR Error;
+
+	while (Offset < Map->Size) {
+		/* Only the last frame may be shorter */
+		if (Header.UnpackedSize && Header.UnpackedSize != Map->FrameSize)
+			return KCF_ERROR_INVALID_DATA;
+		if (Map->Size - Offset < KCF_FRAME_HEADER_SIZE)
+			return KCF_ERROR_INVALID_DATA;
+
+		Error = member_map_read(Stream, Map, Offset, Buffer,
+		                        KCF_FRAME_HEADER_SIZE);
+		if (Error)
+			return Error;
+		frame_header_load(Buffer, &Header);
+		if (!frame_header_valid(Map->Codec, &Header, Map->FrameSize))
+			return KCF_ERROR_INVALID_DATA;
+
+		if (Map->Frames == Capacity) {
+			Capacity = Capacity ? Capacity * 2 : 64;
+			Offsets  = realloc(Map->FrameOffsets,
+			                   Capacity * sizeof(uint64_t));
+			if (!Offsets)
+				return KCF_ERROR_OUT_OF_MEMORY;
+			Map->FrameOffsets = Offsets;
+		}
+
+		Map->FrameOffsets[Map->Frames++] = Offset;
+		Offset += KCF_FRAME_HEADER_SIZE + Header.PackedSize;
+		Unpacked += Header.UnpackedSize;
+	}
+
+	Map->UnpackedSize = Unpacked;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR member_map_read_frames(IO *Stream, const struct member_map *Map,
+                                uint64_t FileOffset, void *Buffer,
+                                size_t Size)
+{
+	struct frame_header Header;
+	uint8_t *Destination = Buffer, *Packed, *Frame, *Target;
+	uint64_t Index, Start, Length, Skip, Copied;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (FileOffset > Map->UnpackedSize ||
+	    Size > Map->UnpackedSize - FileOffset)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	Packed = malloc(frame_bound(Map->Codec, Map->FrameSize));
+	Frame  = malloc(Map->FrameSize);
+	if (!Packed || !Frame) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+
+	for (Index = FileOffset / Map->FrameSize; Size > 0; Index++) {
+		Start  = Index * Map->FrameSize;
+		Length = Map->UnpackedSize - Start;
+		if (Length > Map->FrameSize)
+			Length = Map->FrameSize;
+
+		Error = member_map_read(Stream, Map, Map->FrameOffsets[Index],
+		                        Packed, KCF_FRAME_HEADER_SIZE);
+		if (Error)
+			break;
+		frame_header_load(Packed, &Header);
+		if (!frame_header_valid(Map->Codec, &Header, Map->FrameSize) ||
+		    Header.UnpackedSize != Length ||
+		    Map->FrameOffsets[Index] + KCF_FRAME_HEADER_SIZE +
+		            Header.PackedSize > Map->Size) {
+			Error = KCF_ERROR_INVALID_DATA;
+			break;
+		}
+
+		/* Only the files before it in the solid block can unpack it */
+		if (Index == 0 && Map->IsSolid &&
+		    Header.PackedSize != Header.UnpackedSize) {
+			Error = KCF_ERROR_NOT_IMPLEMENTED;
+			break;
+		}
+
+		Error = member_map_read(Stream, Map,
+		                        Map->FrameOffsets[Index] +
+		                            KCF_FRAME_HEADER_SIZE,
+		                        Packed, Header.PackedSize);
+		if (Error)
+			break;
+
+		Skip   = FileOffset - Start;
+		Copied = Length - Skip;
+		if (Copied > Size)
+			Copied = Size;
+
+		/* Whole frames are unpacked straight to the caller */
+		Target = Skip == 0 && Copied == Length ? Destination : Frame;
+		if (!frame_decode(Map->Codec, &Header, NULL, 0, Packed,
+		                  Target)) {
+			Error = KCF_ERROR_INVALID_DATA;
+			break;
+		}
+		if (Target == Frame)
+			memcpy(Destination, Frame + Skip, Copied);
+
+		Destination += Copied;
+		FileOffset += Copied;
+		Size -= Copied;
+	}
+
+cleanup:
+	free(Frame);
+	free(Packed);
+	return Error;
+}
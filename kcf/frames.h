@@ -0,0 +1,162 @@
+/**
+ * \file frames.h
+ *
+ * Compressed files are cut into frames of FrameSize unpacked bytes (the
+ * last one may be shorter) compressed each on its own, so any part of a
+ * file can be unpacked without the frames before it. The first frame of
+ * a solid file is the exception: it is compressed with the last data of
+ * the files before it in the solid block as the dictionary.
+ */
+
+#pragma once
+#ifndef _FRAMES_H_
+#define _FRAMES_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <kcf/archive.h>
+
+#include "codec.h"
+
+/* PackedSize, UnpackedSize, CRC32C of the unpacked data */
+#define KCF_FRAME_HEADER_SIZE 12
+
+/* CompressionInfo bits 8 to 15 hold log2 of the frame size */
+#define KCF_FRAME_SHIFT(Info)   (((Info) >> 8) & 0xFF)
+#define KCF_MIN_FRAME_SHIFT     16
+#define KCF_MAX_FRAME_SHIFT     26
+#define KCF_DEFAULT_FRAME_SHIFT 20
+
+struct frame_header {
+	uint32_t PackedSize;
+	uint32_t UnpackedSize;
+	uint32_t CRC;
+};
+
+/* Deflate refers back no further than that */
+#define KCF_SOLID_WINDOW_SIZE 32768
+
+/* Last unpacked data of the solid block, up to KCF_SOLID_WINDOW_SIZE */
+struct solid_window {
+	uint8_t *Data;
+	size_t Size;
+};
+
+bool solid_window_add(struct solid_window *Window, const uint8_t *Data,
+                      size_t Size);
+void solid_window_free(struct solid_window *Window);
+
+/* Frames are encoded by up to that many threads */
+#define KCF_MAX_FRAME_THREADS 64
+
+struct frame_pool;
+
+/* Compression settings and frames of the file being written */
+struct frame_writer {
+	const struct kcf_codec *Codec;
+	int Level;
+	unsigned Shift;
+	int Threads;
+
+	/* Frames being filled and encoded, made with the first frame */
+	struct frame_pool *Pool;
+
+	/* Data of the solid block so far, kept in solid mode only */
+	struct solid_window Window;
+	bool HasWindow;
+	bool IsSolid;
+
+	uint64_t *Offsets;
+	uint64_t Count;
+	uint64_t Capacity;
+	uint64_t PackedSize;
+	uint64_t UnpackedSize;
+};
+
+/**
+ * \brief Largest frame of Size unpacked bytes, header included.
+ */
+size_t frame_bound(const struct kcf_codec *Codec, size_t Size);
+
+/**
+ * \brief Encodes Size bytes into a frame at Dst and returns its size.
+ * Data which doesn't get smaller is stored as is. The dictionary may be
+ * empty.
+ */
+size_t frame_encode(const struct kcf_codec *Codec, int Level,
+                    const uint8_t *Dictionary, size_t DictionarySize,
+                    const uint8_t *Src, size_t Size, uint8_t *Dst);
+
+void frame_header_load(const uint8_t *Buffer, struct frame_header *Header);
+bool frame_header_valid(const struct kcf_codec *Codec,
+                        const struct frame_header *Header,
+                        uint32_t FrameSize);
+
+/**
+ * \brief Unpacks the payload of a frame into Dst and checks its CRC.
+ */
+bool frame_decode(const struct kcf_codec *Codec,
+                  const struct frame_header *Header,
+                  const uint8_t *Dictionary, size_t DictionarySize,
+                  const uint8_t *Payload, uint8_t *Dst);
+
+/**
+ * \brief Returns the codec and frame size of a compressed file, NULL
+ * if the method or the frame size is unknown.
+ */
+const struct kcf_codec *frame_codec(uint32_t CompressionInfo,
+                                    uint32_t *FrameSize);
+
+/* Writing */
+
+uint32_t frames_compression_info(const struct frame_writer *Writer);
+void frames_begin(struct frame_writer *Writer);
+void frames_free(struct frame_writer *Writer);
+
+/**
+ * \brief Adds file data. Complete frames are encoded by the threads of
+ * the writer and written in order as added data of the current record.
+ */
+KCFERROR frames_write(KCF *kcf, const uint8_t *Data, size_t Size);
+
+/**
+ * \brief Writes the last frame of the file and all frames still being
+ * encoded. A file starting a solid block leaves only its own data in the
+ * window.
+ */
+KCFERROR frames_flush(KCF *kcf);
+
+/**
+ * \brief Writes the frame table of the file which has just been
+ * finished, if it has more than one frame.
+ */
+KCFERROR KCF_write_frame_table(KCF *kcf);
+
+/* Reading */
+
+struct member_map;
+
+/**
+ * \brief Parses the frame table of the file described by Map. Leaves
+ * Map without frames if it doesn't fit the file.
+ */
+void member_map_set_frames(struct member_map *Map, const uint8_t *Data,
+                           size_t DataSize, const uint8_t *Table,
+                           uint64_t TableSize);
+
+/**
+ * \brief Finds the frames of a file without frame table by reading
+ * their headers one by one.
+ */
+KCFERROR member_map_index_frames(IO *Stream, struct member_map *Map);
+
+/**
+ * \brief Unpacks Size bytes of the file from FileOffset on, decoding the
+ * frames the range touches.
+ */
+KCFERROR member_map_read_frames(IO *Stream, const struct member_map *Map,
+                                uint64_t FileOffset, void *Buffer,
+                                size_t Size);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) &&                             \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GF256_X86_DISPATCH
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#include <immintrin.h>
+#define GF256_AVX2_ALWAYS
+#endif
+
+#include "gf256.h"
+
+/* x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF256_POLY 0x1D
+
+uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+	uint8_t result = 0;
+
+	while (b) {
+		if (b & 1)
+			result ^= a;
+		a = (a << 1) ^ (a & 0x80 ? GF256_POLY : 0);
+		b >>= 1;
+	}
+
+	return result;
+}
+
+/* a^254, as the multiplicative group has 255 elements */
+uint8_t gf256_inv(uint8_t a)
+{
+	uint8_t result = 1;
+	int e          = 254;
+
+	while (e) {
+		if (e & 1)
+			result = gf256_mul(result, a);
+		a = gf256_mul(a, a);
+		e >>= 1;
+	}
+
+	return result;
+}
+
+static void mul_add_table(uint8_t *Dest, const uint8_t *Src, uint8_t Factor,
+                          size_t Size)
+{
+	uint8_t Table[256];
+	size_t i;
+
+	for (i = 0; i < 256; i++)
+		Table[i] = gf256_mul(Factor, (uint8_t)i);
+
+	for (i = 0; i < Size; i++)
+		Dest[i] ^= Table[Src[i]];
+}
+
+/* Products of Factor by all low and high nibbles, for PSHUFB */
+static void nibble_tables(uint8_t Factor, uint8_t *Low, uint8_t *High)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		Low[i]  = gf256_mul(Factor, (uint8_t)i);
+		High[i] = gf256_mul(Factor, (uint8_t)(i << 4));
+	}
+}
+
+#ifdef GF256_X86_DISPATCH
+__attribute__((target("ssse3")))
+static size_t mul_add_ssse3(uint8_t *Dest, const uint8_t *Src,
+                            uint8_t Factor, size_t Size)
+{
+	uint8_t Low[16], High[16];
+	__m128i TableLow, TableHigh, Mask, s, l, h;
+	size_t i;
+
+	nibble_tables(Factor, Low, High);
+	TableLow  = _mm_loadu_si128((const __m128i *)Low);
+	TableHigh = _mm_loadu_si128((const __m128i *)High);
+	Mask      = _mm_set1_epi8(0x0F);
+
+	for (i = 0; i + 16 <= Size; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(Src + i));
+		l = _mm_shuffle_epi8(TableLow, _mm_and_si128(s, Mask));
+		h = _mm_shuffle_epi8(TableHigh,
+		                     _mm_and_si128(_mm_srli_epi64(s, 4), Mask));
+		s = _mm_loadu_si128((const __m128i *)(Dest + i));
+		_mm_storeu_si128((__m128i *)(Dest + i),
+		                 _mm_xor_si128(s, _mm_xor_si128(l, h)));
+	}
+
+	return i;
+}
+#endif
+
+#if defined(GF256_X86_DISPATCH) || defined(GF256_AVX2_ALWAYS)
+#ifdef GF256_X86_DISPATCH
+__attribute__((target("avx2")))
+#endif
+static size_t mul_add_avx2(uint8_t *Dest, const uint8_t *Src,
+                           uint8_t Factor, size_t Size)
+{
+	uint8_t Low[16], High[16];
+	__m256i TableLow, TableHigh, Mask, s, l, h;
+	size_t i;
+
+	nibble_tables(Factor, Low, High);
+	TableLow  = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)Low));
+	TableHigh = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)High));
+	Mask      = _mm256_set1_epi8(0x0F);
+
+	for (i = 0; i + 32 <= Size; i += 32) {
+		s = _mm256_loadu_si256((const __m256i *)(Src + i));
+		l = _mm256_shuffle_epi8(TableLow, _mm256_and_si256(s, Mask));
+		h = _mm256_shuffle_epi8(
+		    TableHigh, _mm256_and_si256(_mm256_srli_epi64(s, 4), Mask));
+		s = _mm256_loadu_si256((const __m256i *)(Dest + i));
+		_mm256_storeu_si256((__m256i *)(Dest + i),
+		                    _mm256_xor_si256(s, _mm256_xor_si256(l, h)));
+	}
+
+	return i;
+}
+#endif
+
+void gf256_mul_add(uint8_t *Dest, const uint8_t *Src, uint8_t Factor,
+                   size_t Size)
+{
+	size_t Done = 0;
+
+	if (Factor == 0)
+		return;
+
+#if defined(GF256_X86_DISPATCH)
+	if (__builtin_cpu_supports("avx2"))
+		Done = mul_add_avx2(Dest, Src, Factor, Size);
+	else if (__builtin_cpu_supports("ssse3"))
+		Done = mul_add_ssse3(Dest, Src, Factor, Size);
+#elif defined(GF256_AVX2_ALWAYS)
+	Done = mul_add_avx2(Dest, Src, Factor, Size);
+#endif
+
+	if (Done < Size)
+		mul_add_table(Dest + Done, Src + Done, Factor, Size - Done);
+}
+
+static void swap_rows(uint8_t *Matrix, int Size, int a, int b)
+{
+	uint8_t Tmp;
+	int i;
+
+	for (i = 0; i < Size; i++) {
+		Tmp                  = Matrix[a * Size + i];
+		Matrix[a * Size + i] = Matrix[b * Size + i];
+		Matrix[b * Size + i] = Tmp;
+	}
+}
+
+/* Gauss-Jordan elimination next to an identity matrix */
+bool gf256_invert_matrix(uint8_t *Matrix, int Size)
+{
+	uint8_t *Inverse, Factor;
+	int Row, Col, Pivot, i;
+	bool result = false;
+
+	Inverse = calloc((size_t)Size * Size, 1);
+	if (!Inverse)
+		return false;
+	for (i = 0; i < Size; i++)
+		Inverse[i * Size + i] = 1;
+
+	for (Col = 0; Col < Size; Col++) {
+		for (Pivot = Col; Pivot < Size; Pivot++) {
+			if (Matrix[Pivot * Size + Col])
+				break;
+		}
+		if (Pivot == Size)
+			goto cleanup;
+
+		if (Pivot != Col) {
+			swap_rows(Matrix, Size, Col, Pivot);
+			swap_rows(Inverse, Size, Col, Pivot);
+		}
+
+		Factor = gf256_inv(Matrix[Col * Size + Col]);
+		for (i = 0; i < Size; i++) {
+			Matrix[Col * Size + i] =
+			    gf256_mul(Matrix[Col * Size + i], Factor);
+			Inverse[Col * Size + i] =
+			    gf256_mul(Inverse[Col * Size + i], Factor);
+		}
+
+		for (Row = 0; Row < Size; Row++) {
+			Factor = Matrix[Row * Size + Col];
+			if (Row == Col || !Factor)
+				continue;
+			for (i = 0; i < Size; i++) {
+				Matrix[Row * Size + i] ^=
+				    gf256_mul(Factor, Matrix[Col * Size + i]);
+				Inverse[Row * Size + i] ^=
+				    gf256_mul(Factor, Inverse[Col * Size + i]);
+			}
+		}
+	}
+
+	memcpy(Matrix, Inverse, (size_t)Size * Size);
+	result = true;
+
+cleanup:
+	free(Inverse);
+	return result;
+}
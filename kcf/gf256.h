@@ -0,0 +1,34 @@
+/**
+ * \file gf256.h
+ *
+ * Arithmetic in GF(2^8) with polynomial 0x11D for Reed-Solomon codes of
+ * recovery records.
+ */
+
+#pragma once
+#ifndef _GF256_H_
+#define _GF256_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a);
+
+/**
+ * \brief Dest[i] ^= Factor * Src[i] for Size bytes.
+ *
+ * Uses PSHUFB lookups of nibble products when SSSE3 or AVX2 is
+ * available.
+ */
+void gf256_mul_add(uint8_t *Dest, const uint8_t *Src, uint8_t Factor,
+                   size_t Size);
+
+/**
+ * \brief Inverts the Size x Size row-major Matrix in place. Returns false
+ * if the matrix is singular.
+ */
+bool gf256_invert_matrix(uint8_t *Matrix, int Size);
+
+#endif
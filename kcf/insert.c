@@ -1,25 +1,121 @@
 #include <kcf/archive.h>
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
 #include "kcf_impl.h"
 
+KCFERROR KCF_set_solid_block_size(KCF *kcf, uint64_t BlockSize)
+{
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	kcf->SolidBlockSize = BlockSize;
+	kcf->SolidBlockUsed = 0;
+	kcf->HasSolidBlock  = false;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_set_file_checksums(KCF *kcf, bool Enabled)
+{
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->PackerState == KCF_PKSTATE_FILE_DATA ||
+	    kcf->PackerState == KCF_PKSTATE_AFTER_FILE_DATA)
+		return KCF_ERROR_INVALID_STATE;
+
+	kcf->HasFileChecksums = Enabled;
+	return KCF_ERROR_OK;
+}
+
+uint32_t KCF_file_crc32(uint32_t CRC, const void *Data, size_t Size)
+{
+	return crc32c(CRC, Data, Size);
+}
+
+/* Marks the file as continuing the current solid block or starts a new one */
+static void solid_begin_file(KCF *kcf, struct KcfFileInfo *Info)
+{
+	Info->CompressionInfo = frames_compression_info(&kcf->Frames);
+
+	/* Compressed files of a block share the window of its data */
+	kcf->Frames.HasWindow = kcf->SolidBlockSize && kcf->Frames.Codec;
+	kcf->Frames.IsSolid   = false;
+
+	if (!kcf->SolidBlockSize) {
+		kcf->HasSolidBlock = false;
+		return;
+	}
+
+	if (kcf->HasSolidBlock && kcf->SolidBlockUsed < kcf->SolidBlockSize) {
+		Info->CompressionInfo |= KCF_COMPRESSION_SOLID;
+		kcf->Frames.IsSolid = kcf->Frames.HasWindow;
+		return;
+	}
+
+	kcf->HasSolidBlock  = true;
+	kcf->SolidBlockUsed = 0;
+}
+
+/* Header of the current file, its data goes right after it */
+static KCFERROR write_header(KCF *kcf)
+{
+	struct KcfFileInfo *Info = &kcf->CurrentFile;
+	struct KcfRecord Record  = {0};
+	KCFERROR Error;
+
+	/* Size and CRC32 of the data are backpatched by KCF_end_file() */
+	Record.HeadFlags = KCF_HAS_ADDED_DATA_CRC32;
+	if (kcf->HasFileChecksums && !kcf->VolumeSize) {
+		Info->HasFileCRC32 = true;
+		Info->FileCRC32    = 0;
+	}
+	if (Info->HasUnpackedSize8)
+		Record.HeadFlags |= KCF_HAS_ADDED_SIZE_8;
+	else
+		Record.HeadFlags |= KCF_HAS_ADDED_SIZE_4;
+
+	Error = file_info_to_record(Info, &Record);
+	if (!Error)
+		Error = KCF_write_record(kcf, &Record);
+	rec_clear(&Record);
+
+	kcf->FileOffset             = kcf->RecordOffset;
+	kcf->Dedup.IsHeaderDeferred = false;
+	return Error;
+}
+
 KCFERROR KCF_begin_file(KCF *kcf, struct KcfFileInfo *FileInfo)
 {
 	KCFERROR Error = KCF_ERROR_OK;
-	struct KcfRecord Record;
+	struct KcfFileInfo Info;
 
 	if (!kcf || !FileInfo)
 		return KCF_ERROR_INVALID_PARAMETER;
-	if (!kcf->IsWriting)
+	if (!KCF_PSTATE_IS_WRITING(kcf->ParserState))
 		return KCF_ERROR_INVALID_STATE;
 	if (kcf->PackerState != KCF_PKSTATE_IDLE &&
 	    kcf->PackerState != KCF_PKSTATE_FILE_HEADER)
 		return KCF_ERROR_INVALID_STATE;
 
+	Info = *FileInfo;
+	solid_begin_file(kcf, &Info);
+
 	file_info_clear(&kcf->CurrentFile);
-	file_info_copy(&kcf->CurrentFile, FileInfo);
+	if (!file_info_copy(&kcf->CurrentFile, &Info))
+		return KCF_ERROR_OUT_OF_MEMORY;
+	block_crcs_reset(&kcf->BlockCRCs, kcf->BlockCRCs.BlockSize);
+	frames_begin(&kcf->Frames);
 
-	file_info_to_record(FileInfo, &Record);
-	Error = KCF_write_record(kcf, &Record);
+	kcf->Dedup.DataSize = 0;
+	kcf->Dedup.DataCRC  = 0;
+	kcf->Dedup.IsLink   = false;
+
+	/* The data may turn out to be a copy, see KCF_insert_file_data() */
+	kcf->Dedup.IsHeaderDeferred = dedup_enabled(kcf);
+	if (!kcf->Dedup.IsHeaderDeferred)
+		Error = write_header(kcf);
 	if (Error)
 		return Error;
 
@@ -28,53 +124,429 @@ KCFERROR KCF_begin_file(KCF *kcf, struct KcfFileInfo *FileInfo)
 	return Error;
 }
 
-#define INSERT_FILE_BUFFER_SIZE 4096
+#define INSERT_FILE_BUFFER_SIZE 65536
 
-KCFERROR KCF_insert_file_data(KCF *kcf, IO *Input)
+/* Data of the current file, as is or cut into compressed frames */
+static KCFERROR insert_data(KCF *kcf, const uint8_t *Data, size_t Size)
+{
+	if (!block_crcs_update(&kcf->BlockCRCs, Data, Size))
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	/* The CRC serves file checksums as well */
+	if (kcf->Dedup.Enabled || kcf->HasFileChecksums) {
+		kcf->Dedup.DataCRC = crc32c(kcf->Dedup.DataCRC, Data, Size);
+		kcf->Dedup.DataSize += Size;
+	}
+
+	if (kcf->Frames.Codec)
+		return frames_write(kcf, Data, Size);
+	return KCF_write_added_data(kcf, (uint8_t *)Data, Size);
+}
+
+/*
+ * Writes the current file as a link if Input repeats an earlier file,
+ * returns `KCF_ERROR_FILE_NOT_FOUND` if it doesn't. Input is read twice,
+ * so unseekable input is never linked.
+ */
+static KCFERROR insert_link(KCF *kcf, IO *Input)
 {
 	uint8_t Buffer[INSERT_FILE_BUFFER_SIZE];
-	size_t BytesRead, BytesWritten;
-	int ret;
+	struct KcfFileInfo Info;
+	int64_t Start, BytesRead;
+	uint64_t Size = 0, Target;
+	uint32_t CRC  = 0;
 	KCFERROR Error;
 
-	if (!kcf)
+	Start = IO_tell(Input);
+	if (Start < 0)
+		return KCF_ERROR_FILE_NOT_FOUND;
+
+	for (;;) {
+		BytesRead = IO_read(Input, Buffer, INSERT_FILE_BUFFER_SIZE);
+		if (BytesRead < 0)
+			return KCF_ERROR_READ;
+		if (BytesRead == 0)
+			break;
+
+		CRC = crc32c(CRC, Buffer, BytesRead);
+		Size += BytesRead;
+	}
+	if (IO_seek(Input, Start, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+
+	Error = dedup_find(kcf, Size, CRC, NULL, Input, &Target);
+	if (Error)
+		return Error;
+
+	Info                  = kcf->CurrentFile;
+	Info.HasUnpackedSize  = true;
+	Info.HasUnpackedSize8 = Size > UINT32_MAX;
+	Info.UnpackedSize     = Size;
+	Error = KCF_write_link(kcf, &Info, Target, CRC);
+	if (!Error)
+		kcf->Dedup.IsLink = true;
+	return Error;
+}
+
+KCFERROR KCF_insert_file_data(KCF *kcf, IO *Input)
+{
+	uint8_t Buffer[INSERT_FILE_BUFFER_SIZE];
+	int64_t BytesRead;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!kcf || !Input)
 		return KCF_ERROR_INVALID_PARAMETER;
-	if (!kcf->IsWriting)
+	if (!KCF_PSTATE_IS_WRITING(kcf->ParserState))
 		return KCF_ERROR_INVALID_STATE;
 	if (kcf->PackerState != KCF_PKSTATE_FILE_DATA)
 		return KCF_ERROR_INVALID_STATE;
 
-	/* TODO compression */
-	do {
-		ret = IO_read(Input, Buffer, INSERT_FILE_BUFFER_SIZE);
-		if (ret < 0)
+	if (kcf->Dedup.IsHeaderDeferred) {
+		Error = insert_link(kcf, Input);
+		if (Error == KCF_ERROR_FILE_NOT_FOUND)
+			Error = write_header(kcf);
+		else if (!Error)
+			kcf->PackerState = KCF_PKSTATE_AFTER_FILE_DATA;
+		if (Error || kcf->Dedup.IsLink)
+			return Error;
+	}
+
+	for (;;) {
+		BytesRead = IO_read(Input, Buffer, INSERT_FILE_BUFFER_SIZE);
+		if (BytesRead < 0)
 			return KCF_ERROR_READ;
+		if (BytesRead == 0)
+			break;
 
-		Error = KCF_write_added_data(kcf, Buffer, BytesRead);
+		Error = insert_data(kcf, Buffer, BytesRead);
 		if (Error)
 			return Error;
-	} while (BytesRead > 0);
+	}
 
 	kcf->PackerState = KCF_PKSTATE_AFTER_FILE_DATA;
 
 	return Error;
 }
 
+/* FileCRC32 in the header, which is still to be backpatched */
+static KCFERROR set_file_crc(KCF *kcf)
+{
+	struct KcfRecord *Record = &kcf->LastRecord;
+
+	if (Record->HeadType != KCF_FILE_HEADER)
+		return KCF_ERROR_INVALID_STATE;
+
+	kcf->CurrentFile.FileCRC32 = kcf->Dedup.DataCRC;
+	free(Record->Data);
+	Record->Data     = NULL;
+	Record->DataSize = 0;
+	return file_info_to_record(&kcf->CurrentFile, Record);
+}
+
 KCFERROR KCF_end_file(KCF *kcf)
 {
 	KCFERROR Error = KCF_ERROR_OK;
 
 	if (!kcf)
 		return KCF_ERROR_INVALID_PARAMETER;
-	if (!kcf->IsWriting)
+	if (!KCF_PSTATE_IS_WRITING(kcf->ParserState))
 		return KCF_ERROR_INVALID_STATE;
 	if (kcf->PackerState != KCF_PKSTATE_AFTER_FILE_DATA)
 		return KCF_ERROR_INVALID_STATE;
 
-	Error = KCF_finish_added_data(kcf);
+	/* Links have no data and tables of their own */
+	if (kcf->Dedup.IsLink)
+		goto done;
+
+	/* The block is measured in file data, not in packed data */
+	if (kcf->Frames.Codec) {
+		Error = frames_flush(kcf);
+		kcf->SolidBlockUsed += kcf->Frames.UnpackedSize;
+	} else {
+		kcf->SolidBlockUsed += kcf->WrittenAddedData;
+	}
+	if (!Error && kcf->CurrentFile.HasFileCRC32 && kcf->HasFileChecksums)
+		Error = set_file_crc(kcf);
+	if (!Error)
+		Error = KCF_finish_added_data(kcf);
+	if (!Error)
+		Error = KCF_write_frame_table(kcf);
+	if (!Error)
+		Error = KCF_write_block_table(kcf);
+	if (Error)
+		return Error;
+
+	/* Nothing links to compressed solid files, they can't be read alone */
+	if (dedup_enabled(kcf) && !kcf->Frames.IsSolid &&
+	    !dedup_add(&kcf->Dedup, kcf->Dedup.DataSize, kcf->Dedup.DataCRC,
+	               kcf->FileOffset, kcf->FileOffset))
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+done:
+	kcf->Dedup.IsLink = false;
+	file_info_clear(&kcf->CurrentFile);
+	kcf->PackerState = KCF_PKSTATE_FILE_HEADER;
+	return Error;
+}
+
+/* Output is collected up to that size before it is written */
+#define BATCH_BUFFER_SIZE 4194304L
+
+struct batch_buffer {
+	uint8_t *Data;
+	size_t Used;
+	size_t Size;
+};
+
+static KCFERROR batch_flush(KCF *kcf, struct batch_buffer *Batch)
+{
+	if (Batch->Used == 0)
+		return KCF_ERROR_OK;
+
+	if (IO_write(kcf->Stream, Batch->Data, Batch->Used) < 0)
+		return KCF_ERROR_WRITE;
+
+	Batch->Used = 0;
+	return KCF_ERROR_OK;
+}
+
+/* Appends bytes to the batch, large payloads are written directly */
+static KCFERROR batch_append(KCF *kcf, struct batch_buffer *Batch,
+                             const void *Data, size_t Size)
+{
+	KCFERROR Error;
+
+	/* Data of an empty file may be NULL */
+	if (Size == 0)
+		return KCF_ERROR_OK;
+
+	if (Batch->Used + Size > Batch->Size) {
+		Error = batch_flush(kcf, Batch);
+		if (Error)
+			return Error;
+	}
+
+	if (Size > Batch->Size) {
+		if (IO_write(kcf->Stream, Data, Size) < 0)
+			return KCF_ERROR_WRITE;
+		return KCF_ERROR_OK;
+	}
+
+	memcpy(Batch->Data + Batch->Used, Data, Size);
+	Batch->Used += Size;
+	return KCF_ERROR_OK;
+}
+
+/* Compressed files go through the frames like any other file */
+static KCFERROR batch_add_compressed(KCF *kcf, struct batch_buffer *Batch,
+                                     struct KcfBatchEntry *Entry)
+{
+	struct KcfFileInfo Info = Entry->Info;
+	KCFERROR Error;
+
+	Info.HasUnpackedSize  = true;
+	Info.HasUnpackedSize8 = Entry->Size > UINT32_MAX;
+	Info.UnpackedSize     = Entry->Size;
+
+	Error = batch_flush(kcf, Batch);
+	if (!Error)
+		Error = KCF_begin_file(kcf, &Info);
+	if (!Error && kcf->Dedup.IsHeaderDeferred)
+		Error = write_header(kcf);
+	if (!Error)
+		Error = insert_data(kcf, Entry->Data, Entry->Size);
+	if (Error)
+		return Error;
+
+	kcf->PackerState = KCF_PKSTATE_AFTER_FILE_DATA;
+	return KCF_end_file(kcf);
+}
+
+/*
+ * Writes the entry as a link if it repeats an earlier file, returns
+ * `KCF_ERROR_FILE_NOT_FOUND` if it doesn't.
+ */
+static KCFERROR batch_add_link(KCF *kcf, struct batch_buffer *Batch,
+                               struct KcfBatchEntry *Entry, uint32_t CRC)
+{
+	struct KcfFileInfo Info = Entry->Info;
+	uint64_t Target;
+	KCFERROR Error;
+
+	if (!dedup_has(&kcf->Dedup, Entry->Size, CRC))
+		return KCF_ERROR_FILE_NOT_FOUND;
+
+	/* The earlier file may still be in the batch */
+	Error = batch_flush(kcf, Batch);
+	if (!Error)
+		Error = dedup_find(kcf, Entry->Size, CRC, Entry->Data, NULL,
+		                   &Target);
 	if (Error)
 		return Error;
 
+	Info.HasUnpackedSize  = true;
+	Info.HasUnpackedSize8 = Entry->Size > UINT32_MAX;
+	Info.UnpackedSize     = Entry->Size;
+	return KCF_write_link(kcf, &Info, Target, CRC);
+}
+
+static KCFERROR batch_add_file(KCF *kcf, struct batch_buffer *Batch,
+                               struct KcfBatchEntry *Entry)
+{
+	struct KcfFileInfo Info = Entry->Info;
+	struct KcfRecord Record = {0};
+	uint8_t Header[KCF_MAX_HEADER_SIZE + 65536];
+	uint64_t HeaderOffset = 0;
+	uint32_t CRC          = 0;
+	bool IsIndexed;
+	KCFERROR Error;
+
+	if (!Info.FileName || (!Entry->Data && Entry->Size > 0))
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	IsIndexed = dedup_enabled(kcf);
+	if (IsIndexed || kcf->HasFileChecksums)
+		CRC = crc32c(0, Entry->Data, Entry->Size);
+	if (IsIndexed) {
+		Error = batch_add_link(kcf, Batch, Entry, CRC);
+		if (Error != KCF_ERROR_FILE_NOT_FOUND)
+			return Error;
+	}
+
+	if (kcf->Frames.Codec)
+		return batch_add_compressed(kcf, Batch, Entry);
+
+	Info.HasUnpackedSize  = true;
+	Info.HasUnpackedSize8 = Entry->Size > UINT32_MAX;
+	Info.UnpackedSize     = Entry->Size;
+	if (kcf->HasFileChecksums) {
+		Info.HasFileCRC32 = true;
+		Info.FileCRC32    = CRC;
+	}
+	solid_begin_file(kcf, &Info);
+
+	Record.HeadFlags = KCF_HAS_ADDED_DATA_CRC32;
+	if (Info.HasUnpackedSize8)
+		Record.HeadFlags |= KCF_HAS_ADDED_SIZE_8;
+	else
+		Record.HeadFlags |= KCF_HAS_ADDED_SIZE_4;
+	Record.AddedSize = Entry->Size;
+	if (IsIndexed || kcf->HasFileChecksums)
+		Record.AddedDataCRC32 = CRC;
+	else if (Entry->Size > 0)
+		Record.AddedDataCRC32 = crc32c(0, Entry->Data, Entry->Size);
+
+	Error = file_info_to_record(&Info, &Record);
+	if (Error)
+		goto cleanup;
+
+	/* HeadSize is 16 bits wide */
+	if (Record.DataSize + rec_header_size(Record.HeadFlags) > 65535) {
+		Error = KCF_ERROR_INVALID_PARAMETER;
+		goto cleanup;
+	}
+
+	/* Records may have to be split between volumes */
+	if (kcf->VolumeSize) {
+		Error = batch_flush(kcf, Batch);
+		if (!Error)
+			Error = KCF_write_record(kcf, &Record);
+		if (!Error)
+			Error = KCF_write_added_data(kcf, (uint8_t *)Entry->Data,
+			                             Entry->Size);
+		if (!Error)
+			Error = KCF_finish_added_data(kcf);
+		goto written;
+	}
+
+	if (!rec_to_buffer(&Record, Header, sizeof(Header))) {
+		Error = KCF_ERROR_INVALID_PARAMETER;
+		goto cleanup;
+	}
+
+	/* The header lands in the batch as it is, or right after it */
+	if (IsIndexed) {
+		if (Batch->Used + Record.HeadSize > Batch->Size)
+			Error = batch_flush(kcf, Batch);
+		HeaderOffset    = IO_tell(kcf->Stream) + Batch->Used;
+		kcf->FileOffset = HeaderOffset;
+	}
+
+	if (!Error)
+		Error = batch_append(kcf, Batch, Header, Record.HeadSize);
+	if (!Error)
+		Error = batch_append(kcf, Batch, Entry->Data, Entry->Size);
+	if (!Error && IsIndexed &&
+	    !dedup_add(&kcf->Dedup, Entry->Size, CRC, HeaderOffset,
+	               HeaderOffset))
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+
+written:
+	if (!Error)
+		kcf->SolidBlockUsed += Entry->Size;
+
+	/* Tables are rare enough to be written on their own */
+	if (!Error && kcf->BlockCRCs.BlockSize &&
+	    Entry->Size > kcf->BlockCRCs.BlockSize) {
+		block_crcs_reset(&kcf->BlockCRCs, kcf->BlockCRCs.BlockSize);
+		Error = batch_flush(kcf, Batch);
+		if (!Error && !block_crcs_update(&kcf->BlockCRCs, Entry->Data,
+		                                 Entry->Size))
+			Error = KCF_ERROR_OUT_OF_MEMORY;
+		if (!Error)
+			Error = KCF_write_block_table(kcf);
+	}
+
+cleanup:
+	rec_clear(&Record);
+	return Error;
+}
+
+KCFERROR KCF_add_files_batch(KCF *kcf, struct KcfBatchEntry *Entries,
+                             size_t Count)
+{
+	struct batch_buffer Batch = {0};
+	size_t i, Total = 0;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!kcf || (!Entries && Count > 0))
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_WRITING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+	if (kcf->PackerState != KCF_PKSTATE_IDLE &&
+	    kcf->PackerState != KCF_PKSTATE_FILE_HEADER)
+		return KCF_ERROR_INVALID_STATE;
+
+	if (kcf->ParserState == KCF_PSTATE_WRITE_ADDED_DATA) {
+		Error = KCF_finish_added_data(kcf);
+		if (Error)
+			return Error;
+	}
+	if (kcf->ParserState != KCF_PSTATE_WRITE_RECORD &&
+	    kcf->ParserState != KCF_PSTATE_WRITING)
+		return KCF_ERROR_INVALID_STATE;
+
+	/* Small batches don't need the whole buffer */
+	for (i = 0; i < Count && Total < BATCH_BUFFER_SIZE; i++)
+		Total += KCF_MAX_HEADER_SIZE + 64 + Entries[i].Size;
+	Batch.Size = Total < BATCH_BUFFER_SIZE ? Total : BATCH_BUFFER_SIZE;
+	if (Batch.Size == 0)
+		return KCF_ERROR_OK;
+
+	Batch.Data = malloc(Batch.Size);
+	if (!Batch.Data)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0; i < Count; i++) {
+		Error = batch_add_file(kcf, &Batch, &Entries[i]);
+		if (Error)
+			goto cleanup;
+	}
+	Error = batch_flush(kcf, &Batch);
+
+cleanup:
+	free(Batch.Data);
+	kcf->ParserState = KCF_PSTATE_WRITE_RECORD;
 	kcf->PackerState = KCF_PKSTATE_FILE_HEADER;
 	return Error;
 }
@@ -8,6 +8,9 @@
 #include <stdarg.h>
 #include <stdint.h>
 
+#include "blocks.h"
+#include "dedup.h"
+#include "frames.h"
 #include "read.h"
 #include "record.h"
 #include "write.h"
@@ -63,7 +66,11 @@ struct kcf_st {
 	uint64_t RecordOffset;
 	uint64_t RecordEndOffset;
 
+	/* Header of the current file, or of the last one written */
+	uint64_t FileOffset;
+
 	IO *Stream;
+	IO *BaseStream;
 	struct KcfRecord LastRecord;
 
 	bool HasAddedDataCRC32 : 1;
@@ -71,9 +78,58 @@ struct kcf_st {
 	bool IsWriting         : 1;
 	bool IsWritable        : 1;
 	bool IsUnpacking       : 1;
+	bool IsRecovering      : 1;
+	bool HasResynced       : 1;
+	bool HasSolidBlock     : 1;
+	bool IsSolidChainValid : 1;
+	bool HasDeletedFiles   : 1;
+	bool DeletedChainValid : 1;
+	bool IsMultiVolume     : 1;
+	bool StopAtVolumeEnd   : 1;
+	bool HasRangeMap       : 1;
+	bool HasFileChecksums  : 1;
 
 	int  ParserState;
 
+	enum KcfAccessPattern AccessPattern;
+
+	/* Damaged places skipped in recovery mode */
+	KcfSkipCallback SkipCallback;
+	void *SkipContext;
+
+	/* Multi-volume archive */
+	KcfVolumeOpener VolumeOpener;
+	void *VolumeContext;
+	uint64_t VolumeSize;
+	uint64_t VolumeStart;
+	uint32_t VolumeNumber;
+
+	/* Solid block being written */
+	uint64_t SolidBlockSize;
+	uint64_t SolidBlockUsed;
+
+	/* Last data of the solid block being read */
+	struct solid_window SolidWindow;
+
+	/* Deleted files passed since the last file read, from this header */
+	uint64_t DeletedOffset;
+
+	/* Block checksums of the file being written */
+	struct block_crcs BlockCRCs;
+
+	/* Compression of the files being written */
+	struct frame_writer Frames;
+
+	/* Data of the files written so far */
+	struct dedup_index Dedup;
+
+	/* File of the last range read, for the next one */
+	struct member_map RangeMap;
+	uint64_t RangeMapOffset;
+
+	/* Files looked up by name so far, built by the first lookup */
+	struct member_index Members;
+
 	union {
 		enum KcfPackerState PackerState;
 		enum KcfUnpackerState UnpackerState;
@@ -1,6 +1,14 @@
 #include <kcf/archive.h>
 #include <kcf/errors.h>
 
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MARKER_SCAN_SSE2
+#endif
+
 #include "kcf_impl.h"
 
 #define MARKER_1 'K'
@@ -10,55 +18,266 @@
 #define MARKER_5 0x06
 #define MARKER_6 0x00
 
-KCFERROR KCF_find_marker(KCF *kcf)
+#define MARKER_SIZE 6
+
+#define MARKER_SCAN_BUFFER_SIZE 1048576L
+
+/* Bytes kept after a marker to check the archive header behind it */
+#define MARKER_SCAN_LOOKAHEAD (MARKER_SIZE + 64)
+
+static const uint8_t Marker[MARKER_SIZE] = {
+	MARKER_1, MARKER_2, MARKER_3, MARKER_4, MARKER_5, MARKER_6,
+};
+
+/*
+ * Returns the offset of the first complete marker in the buffer or -1.
+ * Candidates are positions where "KC" starts, so that text-heavy data
+ * full of 'K' doesn't fall into the slow path.
+ */
+static ptrdiff_t marker_search(const uint8_t *Buffer, size_t Size)
 {
-	uint8_t buf[6] = {0};
-	int ret;
+	size_t i = 0;
+	const uint8_t *p;
 
-	if (kcf->IsWriting || kcf->ReaderState != KCF_RDSTATE_MARKER)
-		return KCF_ERROR_INVALID_STATE;
+	if (Size < MARKER_SIZE)
+		return -1;
+
+#ifdef MARKER_SCAN_SSE2
+	{
+		const __m128i First  = _mm_set1_epi8(MARKER_1);
+		const __m128i Second = _mm_set1_epi8(MARKER_2);
+		__m128i a, b;
+		unsigned Mask, Bit;
+
+		for (; i + 16 + MARKER_SIZE <= Size; i += 16) {
+			a = _mm_loadu_si128((const __m128i *)(Buffer + i));
+			b = _mm_loadu_si128((const __m128i *)(Buffer + i + 1));
+			Mask = _mm_movemask_epi8(_mm_and_si128(
+			    _mm_cmpeq_epi8(a, First), _mm_cmpeq_epi8(b, Second)));
+
+			while (Mask) {
+#ifdef _MSC_VER
+				unsigned long Index;
+				_BitScanForward(&Index, Mask);
+				Bit = Index;
+#else
+				Bit = __builtin_ctz(Mask);
+#endif
+				if (memcmp(Buffer + i + Bit, Marker,
+				           MARKER_SIZE) == 0)
+					return i + Bit;
+				Mask &= Mask - 1;
+			}
+		}
+	}
+#endif
+
+	while (i + MARKER_SIZE <= Size) {
+		p = memchr(Buffer + i, MARKER_1, Size - MARKER_SIZE + 1 - i);
+		if (!p)
+			return -1;
+
+		i = p - Buffer;
+		if (memcmp(p, Marker, MARKER_SIZE) == 0)
+			return i;
+		i++;
+	}
+
+	return -1;
+}
+
+/* One byte at a time, for streams which can't go back */
+static KCFERROR find_marker_unseekable(KCF *kcf)
+{
+	uint8_t buf[MARKER_SIZE] = {0};
+	int64_t ret;
 
 	do {
-		if (buf[0] == MARKER_1 && buf[1] == MARKER_2 &&
-		    buf[2] == MARKER_3 && buf[3] == MARKER_4 &&
-		    buf[4] == MARKER_5 && buf[5] == MARKER_6)
-			goto ok;
-
-		buf[0] = buf[1];
-		buf[1] = buf[2];
-		buf[2] = buf[3];
-		buf[3] = buf[4];
-		buf[4] = buf[5];
-
-		ret = IO_read(kcf->Stream, &buf[5], 1);
+		if (memcmp(buf, Marker, MARKER_SIZE) == 0)
+			return KCF_ERROR_OK;
+
+		memmove(buf, buf + 1, MARKER_SIZE - 1);
+		ret = IO_read(kcf->Stream, &buf[MARKER_SIZE - 1], 1);
 	} while (ret > 0);
 
-	if (ret == -1)
+	if (ret < 0)
 		return KCF_ERROR_READ;
 
 	return KCF_ERROR_INVALID_FORMAT;
-ok:
-	kcf->ReaderState = KCF_RDSTATE_RECORD_HEADER;
+}
+
+static KCFERROR find_marker_chunked(KCF *kcf, int64_t Offset)
+{
+	uint8_t *Buffer;
+	size_t Carry = 0, Length;
+	int64_t n_read;
+	ptrdiff_t Found;
+	KCFERROR Error = KCF_ERROR_INVALID_FORMAT;
+
+	Buffer = malloc(MARKER_SCAN_BUFFER_SIZE);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	/* Offset is the position of Buffer[0] in the stream */
+	for (;;) {
+		n_read = IO_read(kcf->Stream, Buffer + Carry,
+		                 MARKER_SCAN_BUFFER_SIZE - Carry);
+		if (n_read < 0) {
+			Error = KCF_ERROR_READ;
+			break;
+		}
+		if (n_read == 0)
+			break;
+
+		Length = Carry + n_read;
+		Found  = marker_search(Buffer, Length);
+		if (Found >= 0) {
+			if (IO_seek(kcf->Stream, Offset + Found + MARKER_SIZE,
+			            IO_SEEK_SET) < 0)
+				Error = KCF_ERROR_READ;
+			else
+				Error = KCF_ERROR_OK;
+			break;
+		}
+
+		/* The marker may cross the end of the chunk */
+		Carry = Length < MARKER_SIZE - 1 ? Length : MARKER_SIZE - 1;
+		memmove(Buffer, Buffer + Length - Carry, Carry);
+		Offset += Length - Carry;
+	}
+
+	free(Buffer);
+	return Error;
+}
+
+static void check_archive_header(const uint8_t *Buffer, size_t Size,
+                                 struct KcfMarkerInfo *Info)
+{
+	struct KcfRecord Record = {0};
+	struct KcfArchiveHeader Header;
+
+	Info->HasValidHeader = false;
+	Info->ArchiveVersion = 0;
+
+	/* Archive header never has added data */
+	if (Size < KCF_MIN_HEADER_SIZE ||
+	    rec_header_size(Buffer[3]) != KCF_MIN_HEADER_SIZE)
+		return;
+
+	rec_decode_header(Buffer, &Record);
+	if (Record.HeadSize < 8 || Record.HeadSize > Size)
+		return;
+
+	Record.Data     = (uint8_t *)Buffer + KCF_MIN_HEADER_SIZE;
+	Record.DataSize = Record.HeadSize - KCF_MIN_HEADER_SIZE;
+	if (rec_to_archive_header(&Record, &Header) != KCF_ERROR_OK)
+		return;
+
+	Info->HasValidHeader = true;
+	Info->ArchiveVersion = Header.ArchiveVersion;
+}
+
+KCFERROR KCF_scan_all_markers(IO *Stream, KcfMarkerCallback Callback,
+                              void *Context)
+{
+	struct KcfMarkerInfo Info;
+	uint8_t *Buffer;
+	size_t Carry = 0, Length, Limit, Position;
+	int64_t n_read, Offset = 0;
+	ptrdiff_t Found;
+	bool Eof = false;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!Stream || !Callback)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	Buffer = malloc(MARKER_SCAN_BUFFER_SIZE);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	IO_advise(Stream, 0, 0, IO_ADVICE_SEQUENTIAL);
+
+	/* Offset is the position of Buffer[0] from the start of the scan */
+	while (!Eof) {
+		n_read = IO_read(Stream, Buffer + Carry,
+		                 MARKER_SCAN_BUFFER_SIZE - Carry);
+		if (n_read < 0) {
+			Error = KCF_ERROR_READ;
+			break;
+		}
+
+		Length = Carry + n_read;
+		Eof    = n_read == 0;
+
+		/* Markers starting past Limit are left for the next chunk
+		 * together with the header behind them */
+		if (Eof)
+			Limit = Length;
+		else if (Length > MARKER_SCAN_LOOKAHEAD)
+			Limit = Length - MARKER_SCAN_LOOKAHEAD;
+		else
+			Limit = 0;
+
+		Position = 0;
+		while (Position < Limit) {
+			size_t End = Limit + MARKER_SIZE - 1;
+
+			if (End > Length)
+				End = Length;
+			Found = marker_search(Buffer + Position,
+			                      End - Position);
+			if (Found < 0)
+				break;
+
+			Position += Found;
+			Info.Offset = Offset + Position;
+			check_archive_header(Buffer + Position + MARKER_SIZE,
+			                     Length - Position - MARKER_SIZE,
+			                     &Info);
+			if (!Callback(Context, &Info))
+				goto cleanup;
+			Position++;
+		}
+
+		Carry = Length - Limit;
+		memmove(Buffer, Buffer + Limit, Carry);
+		Offset += Limit;
+	}
+
+cleanup:
+	free(Buffer);
+	return Error;
+}
+
+KCFERROR KCF_find_marker(KCF *kcf)
+{
+	int64_t Offset;
+	KCFERROR Error;
+
+	if (kcf->ParserState != KCF_PSTATE_READ_MARKER)
+		return KCF_ERROR_INVALID_STATE;
+
+	Offset = IO_tell(kcf->Stream);
+	if (Offset >= 0)
+		Error = find_marker_chunked(kcf, Offset);
+	else
+		Error = find_marker_unseekable(kcf);
+
+	if (Error)
+		return Error;
+
+	kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
 	return KCF_ERROR_OK;
 }
 
 KCFERROR KCF_write_marker(KCF *kcf)
 {
-	uint8_t marker[6];
-	
-	if (!kcf->IsWriting || kcf->WriterState != KCF_WRSTATE_MARKER)
+	if (kcf->ParserState != KCF_PSTATE_WRITE_MARKER)
 		return KCF_ERROR_INVALID_STATE;
 
-	marker[0] = MARKER_1;
-	marker[1] = MARKER_2;
-	marker[2] = MARKER_3;
-	marker[3] = MARKER_4;
-	marker[4] = MARKER_5;
-	marker[5] = MARKER_6;
-
-	if (IO_write(kcf->Stream, marker, 6) < 0)
+	if (IO_write(kcf->Stream, Marker, MARKER_SIZE) < 0)
 		return KCF_ERROR_WRITE;
 
-	kcf->WriterState = KCF_WRSTATE_IDLE;
+	kcf->ParserState = KCF_PSTATE_WRITE_RECORD;
 	return KCF_ERROR_OK;
 }
@@ -0,0 +1,338 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kcf_impl.h"
+
+/*
+ * Random access to files: the map of the fragments of a file tells
+ * where any byte of it lies, so a range is read with a seek. Compressed
+ * files are read frame by frame, only the frames of the range, but for
+ * the first frame of a solid file, which depends on the files before it.
+ * Links get the map of the file they point at. Maps are built by a
+ * reader of their own on the same stream, the position of the archive's
+ * reader is restored afterwards. The map of the last file is kept for
+ * the next range of it. Files are looked up by name in an index of all
+ * of them built by the first lookup, so later ones don't go through the
+ * archive.
+ */
+
+/* Reader sharing the stream of kcf, kcf itself is left alone */
+static KCFERROR open_reader(KCF *kcf, KCF **Reader)
+{
+	KCFERROR Error;
+
+	Error = KCF_create(kcf->Stream, Reader);
+	if (Error)
+		return Error;
+
+	/* Jumps to headers and maps, the records read are read ahead */
+	(*Reader)->ParserState   = KCF_PSTATE_READ_RECORD_HEADER;
+	(*Reader)->UnpackerState = KCF_UPSTATE_FILE_HEADER;
+	(*Reader)->AccessPattern = KCF_ACCESS_RANDOM;
+	return KCF_ERROR_OK;
+}
+
+/* Reads the header at the position of Reader, following a link once */
+static KCFERROR read_header(KCF *Reader)
+{
+	uint64_t Target;
+	uint32_t CRC;
+	int Hops;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	for (Hops = 0; !Error; Hops++) {
+		file_info_clear(&Reader->CurrentFile);
+		rec_clear(&Reader->LastRecord);
+
+		Error = KCF_read_record(Reader, &Reader->LastRecord);
+		/* Data of deleted files stays for the links to them */
+		if (!Error && Reader->LastRecord.HeadType != KCF_FILE_HEADER &&
+		    Reader->LastRecord.HeadType != KCF_DELETED_FILE)
+			Error = KCF_ERROR_INVALID_PARAMETER;
+		if (!Error)
+			Error = record_to_file_info(&Reader->LastRecord,
+			                            &Reader->CurrentFile);
+		if (Error || !(Reader->CurrentFile.CompressionInfo &
+		               KCF_COMPRESSION_LINK))
+			break;
+
+		/* Links point at the data itself, never at another link */
+		if (Hops > 0)
+			return KCF_ERROR_INVALID_DATA;
+
+		Error = KCF_read_link(Reader, &Target, &CRC);
+		if (!Error && IO_seek(Reader->Stream, Target, IO_SEEK_SET) < 0)
+			Error = KCF_ERROR_READ;
+		Reader->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+	}
+
+	return Error;
+}
+
+KCFERROR KCF_load_range_map(KCF *kcf, uint64_t HeaderOffset)
+{
+	KCF *Reader;
+	KCFERROR Error;
+
+	if (kcf->HasRangeMap && kcf->RangeMapOffset == HeaderOffset)
+		return KCF_ERROR_OK;
+
+	member_map_clear(&kcf->RangeMap);
+	kcf->HasRangeMap = false;
+
+	if (IO_seek(kcf->Stream, HeaderOffset, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+
+	Error = open_reader(kcf, &Reader);
+	if (Error)
+		return Error;
+
+	Error = read_header(Reader);
+	if (!Error) {
+		Reader->UnpackerState = KCF_UPSTATE_FILE_DATA;
+		Error = KCF_read_member_map(Reader, &kcf->RangeMap);
+	}
+
+	file_info_clear(&Reader->CurrentFile);
+	rec_clear(&Reader->LastRecord);
+	KCF_close(Reader);
+
+	if (Error) {
+		member_map_clear(&kcf->RangeMap);
+		return Error;
+	}
+
+	kcf->HasRangeMap    = true;
+	kcf->RangeMapOffset = HeaderOffset;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_read_range_map(KCF *kcf, uint64_t Offset, void *Buffer,
+                            size_t Size)
+{
+	if (kcf->RangeMap.Codec)
+		return member_map_read_frames(kcf->Stream, &kcf->RangeMap,
+		                              Offset, Buffer, Size);
+	if (kcf->RangeMap.BlockCRCs)
+		return member_map_read_checked(kcf->Stream, &kcf->RangeMap,
+		                               Offset, Buffer, Size);
+
+	return member_map_read(kcf->Stream, &kcf->RangeMap, Offset, Buffer,
+	                       Size);
+}
+
+void member_index_clear(struct member_index *Index)
+{
+	size_t i;
+
+	for (i = 0; i < Index->Count; i++)
+		free(Index->Names[i].Name);
+	free(Index->Names);
+	memset(Index, 0, sizeof(*Index));
+}
+
+void member_index_remove(struct member_index *Index, uint64_t HeaderOffset)
+{
+	size_t i;
+
+	for (i = 0; i < Index->Count; i++) {
+		if (Index->Names[i].HeaderOffset != HeaderOffset)
+			continue;
+
+		free(Index->Names[i].Name);
+		Index->Count--;
+		memmove(Index->Names + i, Index->Names + i + 1,
+		        (Index->Count - i) * sizeof(*Index->Names));
+		return;
+	}
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	const struct member_name *x = a, *y = b;
+	int result;
+
+	result = strcmp(x->Name, y->Name);
+	if (result)
+		return result;
+
+	return (x->HeaderOffset > y->HeaderOffset) -
+	       (x->HeaderOffset < y->HeaderOffset);
+}
+
+/* Takes Name, which is freed if it can't be added */
+static bool add_name(struct member_index *Index, char *Name,
+                     uint64_t HeaderOffset)
+{
+	struct member_name *Names;
+	size_t Capacity;
+
+	if (Index->Count == Index->Capacity) {
+		Capacity = Index->Capacity ? Index->Capacity * 2 : 64;
+		Names    = realloc(Index->Names, Capacity * sizeof(*Names));
+		if (!Names) {
+			free(Name);
+			return false;
+		}
+		Index->Names    = Names;
+		Index->Capacity = Capacity;
+	}
+
+	Index->Names[Index->Count].Name         = Name;
+	Index->Names[Index->Count].HeaderOffset = HeaderOffset;
+	Index->Count++;
+	return true;
+}
+
+/* Notes the headers of all files going from the start of the archive */
+static KCFERROR build_index(KCF *kcf, struct member_index *Index)
+{
+	struct KcfFileInfo Info = {0};
+	KCF *Reader;
+	KCFERROR Error;
+
+	if (IO_seek(kcf->Stream, 0, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+
+	Error = KCF_create(kcf->Stream, &Reader);
+	if (Error)
+		return Error;
+
+	/* Headers only, the next one is read ahead past each file skipped */
+	Reader->AccessPattern = KCF_ACCESS_RANDOM;
+	Error = KCF_open_archive(Reader);
+	while (!Error) {
+		Error = KCF_get_current_file_info(Reader, &Info);
+		if (Error == KCF_ERROR_EOF) {
+			Error = KCF_ERROR_OK;
+			break;
+		}
+		if (Error)
+			break;
+
+		/* The name goes to the index */
+		if (!add_name(Index, Info.FileName, Reader->RecordOffset))
+			Error = KCF_ERROR_OUT_OF_MEMORY;
+		Info.FileName = NULL;
+		file_info_clear(&Info);
+
+		if (!Error)
+			Error = KCF_skip_file(Reader);
+	}
+
+	KCF_close(Reader);
+	if (Error) {
+		member_index_clear(Index);
+		return Error;
+	}
+
+	qsort(Index->Names, Index->Count, sizeof(*Index->Names),
+	      compare_names);
+	Index->IsBuilt = true;
+	return KCF_ERROR_OK;
+}
+
+/* The first file of that name if there are several */
+static KCFERROR find_header(KCF *kcf, const char *Name,
+                            uint64_t *HeaderOffset)
+{
+	struct member_index *Index = &kcf->Members;
+	size_t Low = 0, High, Middle;
+	KCFERROR Error;
+
+	if (!Index->IsBuilt && (Error = build_index(kcf, Index)))
+		return Error;
+
+	High = Index->Count;
+	while (Low < High) {
+		Middle = Low + (High - Low) / 2;
+		if (strcmp(Index->Names[Middle].Name, Name) < 0)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (Low == Index->Count || strcmp(Index->Names[Low].Name, Name) != 0)
+		return KCF_ERROR_FILE_NOT_FOUND;
+
+	*HeaderOffset = Index->Names[Low].HeaderOffset;
+	return KCF_ERROR_OK;
+}
+
+/* Random access works within one seekable volume */
+static KCFERROR check_reader(KCF *kcf, int64_t *Position)
+{
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+	if (kcf->IsMultiVolume)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	*Position = IO_tell(kcf->Stream);
+	if (*Position < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_find_member(KCF *kcf, const char *Name, uint64_t *HeaderOffset,
+                         uint64_t *Size)
+{
+	int64_t Position;
+	uint64_t Offset = 0;
+	KCFERROR Error;
+
+	if (!kcf || !Name || !HeaderOffset)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if ((Error = check_reader(kcf, &Position)))
+		return Error;
+
+	Error = find_header(kcf, Name, &Offset);
+	if (!Error)
+		Error = KCF_load_range_map(kcf, Offset);
+
+	if (IO_seek(kcf->Stream, Position, IO_SEEK_SET) < 0 && !Error)
+		Error = KCF_ERROR_READ;
+	if (Error)
+		return Error;
+
+	*HeaderOffset = Offset;
+	if (Size)
+		*Size = member_map_size(&kcf->RangeMap);
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_get_file_offset(KCF *kcf, uint64_t *HeaderOffset)
+{
+	if (!kcf || !HeaderOffset)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	/* The marker and the archive header come first */
+	if (!kcf->FileOffset)
+		return KCF_ERROR_INVALID_STATE;
+
+	*HeaderOffset = kcf->FileOffset;
+	return KCF_ERROR_OK;
+}
+
+KCFERROR KCF_read_member_range(KCF *kcf, uint64_t HeaderOffset,
+                               uint64_t Offset, void *Buffer, size_t Size)
+{
+	int64_t Position;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!kcf || (!Buffer && Size > 0))
+		return KCF_ERROR_INVALID_PARAMETER;
+	if ((Error = check_reader(kcf, &Position)))
+		return Error;
+
+	Error = KCF_load_range_map(kcf, HeaderOffset);
+	if (!Error)
+		Error = KCF_read_range_map(kcf, Offset, Buffer, Size);
+
+	if (IO_seek(kcf->Stream, Position, IO_SEEK_SET) < 0 && !Error)
+		Error = KCF_ERROR_READ;
+	return Error;
+}
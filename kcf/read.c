@@ -10,17 +10,21 @@
 #include "read.h"
 #include "record.h"
 
+/* How much of the added data is read ahead in random access mode */
+#define RANDOM_READAHEAD_SIZE 16777216L
+
+/* Enough for the longest possible record header */
+#define NEXT_RECORD_READAHEAD_SIZE 65536L
+
 /*
- * During the transition from stdio to OpenSSL's BIO, I have fixed
- * another potential bug when reading 8-bit added size field (instead
- * of 4-bit one field)
+ * Reads the common header with at most two reads: the first 6 bytes
+ * tell how long the rest is.
  */
 static KCFERROR read_record_header(KCF *kcf, struct KcfRecord *Record,
                                    size_t *HeaderSize)
 {
-	uint8_t buffer[18] = {0};
-	ptrdiff_t hdr_size = 0;
-	size_t n_read;
+	uint8_t Buffer[KCF_MAX_HEADER_SIZE];
+	size_t Size;
 	int64_t ret;
 
 	assert(kcf);
@@ -29,61 +33,82 @@ static KCFERROR read_record_header(KCF *kcf, struct KcfRecord *Record,
 	trace_kcf_msg("read_record_header begin");
 	trace_kcf_state(kcf);
 
-	if (IO_read(kcf->Stream, buffer, 6) < 0) {
+	ret = IO_read(kcf->Stream, Buffer, KCF_MIN_HEADER_SIZE);
+	if (ret < 0)
 		return trace_kcf_error(KCF_ERROR_READ);
-	}
-	
-	ReadU16LE(buffer, 6, &hdr_size, &Record->HeadCRC);
-	ReadU8(buffer, 6, &hdr_size, &Record->HeadType);
-	ReadU8(buffer, 6, &hdr_size, &Record->HeadFlags);
-	ReadU16LE(buffer, 6, &hdr_size, &Record->HeadSize);
-
-	trace_kcf_msg("read_record_header %04X %02X %02X %04X", Record->HeadCRC,
-	              Record->HeadType, Record->HeadFlags, Record->HeadSize);
-
-	Record->AddedSize = 0;
-
-	if ((Record->HeadFlags & KCF_HAS_ADDED_SIZE_4) != 0) {
-		if (IO_read(kcf->Stream, buffer + hdr_size, 4) < 0)
+	if (ret == 0)
+		return KCF_ERROR_EOF;
+	if (ret < KCF_MIN_HEADER_SIZE)
+		return trace_kcf_error(KCF_ERROR_PREMATURE_EOF);
+
+	Size = rec_header_size(Buffer[3]);
+	if (Size > KCF_MIN_HEADER_SIZE) {
+		ret = IO_read(kcf->Stream, Buffer + KCF_MIN_HEADER_SIZE,
+		              Size - KCF_MIN_HEADER_SIZE);
+		if (ret < 0)
 			return trace_kcf_error(KCF_ERROR_READ);
+		if (ret < (int64_t)(Size - KCF_MIN_HEADER_SIZE))
+			return trace_kcf_error(KCF_ERROR_PREMATURE_EOF);
 	}
 
-	if ((Record->HeadFlags & KCF_HAS_ADDED_SIZE_8) ==
-	    KCF_HAS_ADDED_SIZE_8) {
-		if (IO_read(kcf->Stream, buffer + hdr_size + 4, 4) < 0)
-			return trace_kcf_error(KCF_ERROR_READ);
-		ReadU64LE(buffer, 14, &hdr_size, &Record->AddedSize);
-	} else if ((Record->HeadFlags & KCF_HAS_ADDED_SIZE_8) ==
-	           KCF_HAS_ADDED_SIZE_4) {
-		ReadU32LE(buffer, 14, &hdr_size, &Record->AddedSizeLow);
-	}
-
-	if ((Record->HeadFlags & KCF_HAS_ADDED_DATA_CRC32)) {
-		if (IO_read(kcf->Stream, buffer + hdr_size, 4) < 0)
-			return trace_kcf_error(KCF_ERROR_READ);
-		ReadU32LE(buffer, 18, &hdr_size, &Record->AddedDataCRC32);
-		kcf->AddedDataCRC32 = Record->AddedDataCRC32;
-	} else {
-		kcf->AddedDataCRC32    = 0;
-		Record->AddedDataCRC32 = 0;
-	}
+	rec_decode_header(Buffer, Record);
+	kcf->AddedDataCRC32 = Record->AddedDataCRC32;
 
-	trace_kcf_msg("read_record_header %016llX %08X", Record->AddedSize,
+	trace_kcf_msg("read_record_header %04X %02X %02X %04X %016llX %08X",
+	              Record->HeadCRC, Record->HeadType, Record->HeadFlags,
+	              Record->HeadSize, Record->AddedSize,
 	              Record->AddedDataCRC32);
 
 	if (HeaderSize)
-		*HeaderSize = hdr_size;
+		*HeaderSize = Size;
 	kcf->ParserState = KCF_PSTATE_READ_RECORD_DATA;
 	trace_kcf_state(kcf);
 	trace_kcf_msg("read_record_header end");
 	return KCF_ERROR_OK;
 }
 
-KCFERROR KCF_read_record(KCF *kcf, struct KcfRecord *Record)
+static KCFERROR read_record(KCF *kcf, struct KcfRecord *Record)
 {
 	KCFERROR Error;
 	size_t HeaderSize;
 
+	kcf->AddedDataAlreadyRead = 0;
+	kcf->AvailableAddedData   = 0;
+	kcf->AddedDataCRC32       = 0;
+	kcf->ActualAddedDataCRC32 = 0;
+	Record->Data              = NULL;
+	Record->DataSize          = 0;
+
+	Error = read_record_header(kcf, Record, &HeaderSize);
+	if (Error)
+		return Error;
+	if (Record->HeadSize < HeaderSize)
+		return trace_kcf_error(KCF_ERROR_INVALID_DATA);
+	Record->DataSize = Record->HeadSize - HeaderSize;
+
+	Record->Data = malloc(Record->DataSize);
+	if (!Record->Data)
+		return trace_kcf_error(KCF_ERROR_OUT_OF_MEMORY);
+
+	if (IO_read(kcf->Stream, Record->Data, Record->DataSize) <
+	    (int64_t)Record->DataSize)
+		return trace_kcf_error(KCF_ERROR_PREMATURE_EOF);
+
+	return KCF_ERROR_OK;
+}
+
+void KCF_report_skipped(KCF *kcf, uint64_t Offset, uint64_t Size)
+{
+	if (kcf->SkipCallback)
+		kcf->SkipCallback(kcf->SkipContext, kcf->VolumeNumber, Offset,
+		                  Size);
+}
+
+KCFERROR KCF_read_record(KCF *kcf, struct KcfRecord *Record)
+{
+	uint64_t Skipped;
+	KCFERROR Error;
+
 	if (!kcf)
 		return KCF_ERROR_INVALID_PARAMETER;
 
@@ -98,61 +123,114 @@ KCFERROR KCF_read_record(KCF *kcf, struct KcfRecord *Record)
 	if (kcf->ParserState != KCF_PSTATE_READ_RECORD_HEADER)
 		return trace_kcf_error(KCF_ERROR_INVALID_STATE);
 
-	kcf->AddedDataAlreadyRead = 0;
-	kcf->AvailableAddedData   = 0;
-	kcf->AddedDataCRC32       = 0;
-	kcf->ActualAddedDataCRC32 = 0;
-	Error = read_record_header(kcf, Record, &HeaderSize);
-	if (Error)
-		return Error;
-	Record->DataSize = Record->HeadSize - HeaderSize;
+	kcf->HasResynced = false;
+	for (;;) {
+		kcf->RecordOffset = IO_tell(kcf->Stream);
+		Error = read_record(kcf, Record);
+		if (Error == KCF_ERROR_EOF && kcf->IsMultiVolume &&
+		    !(kcf->StopAtVolumeEnd &&
+		      kcf->UnpackerState == KCF_UPSTATE_FILE_HEADER)) {
+			Error = KCF_open_next_volume(kcf);
+			if (Error)
+				break;
+			continue;
+		}
+		if (!kcf->IsRecovering)
+			break;
 
-	Record->Data = malloc(Record->DataSize);
-	if (!Record->Data)
-		return trace_kcf_error(KCF_ERROR_OUT_OF_MEMORY);
+		if (Error == KCF_ERROR_OK && rec_validate(Record))
+			break;
+		if (Error != KCF_ERROR_OK && Error != KCF_ERROR_INVALID_DATA &&
+		    Error != KCF_ERROR_PREMATURE_EOF)
+			break;
 
-	if (IO_read(kcf->Stream, Record->Data, Record->DataSize) < 0)
-		return trace_kcf_error(KCF_ERROR_READ);
+		/* Damaged record, go to the next one which looks fine */
+		free(Record->Data);
+		Record->Data     = NULL;
+		Record->DataSize = 0;
+
+		if (IO_seek(kcf->Stream, kcf->RecordOffset + 1, IO_SEEK_SET) < 0)
+			return trace_kcf_error(KCF_ERROR_READ);
+		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+		Skipped          = 0;
+		Error            = KCF_resync(kcf, &Skipped);
+		if (Error == KCF_ERROR_OK || Error == KCF_ERROR_EOF)
+			KCF_report_skipped(kcf, kcf->RecordOffset, Skipped + 1);
+		if (Error == KCF_ERROR_EOF && kcf->IsMultiVolume)
+			Error = KCF_open_next_volume(kcf);
+		if (Error)
+			return Error;
+		kcf->HasResynced = true;
+	}
+
+	if (Error) {
+		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+		return Error;
+	}
 
 	trace_kcf_dump_buffer(Record->Data, Record->DataSize);
 
-	if (rec_has_added_size(Record))
+	if (rec_has_added_size(Record) && Record->AddedSize > 0)
 		kcf->ParserState = KCF_PSTATE_READ_ADDED_DATA;
 	else
 		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
 
 	kcf->AvailableAddedData = Record->AddedSize;
 
+	if (kcf->AccessPattern == KCF_ACCESS_RANDOM && Record->AddedSize > 0) {
+		int64_t Length = Record->AddedSize;
+
+		if (Length > RANDOM_READAHEAD_SIZE)
+			Length = RANDOM_READAHEAD_SIZE;
+		IO_advise(kcf->Stream, IO_tell(kcf->Stream), Length,
+		          IO_ADVICE_WILLNEED);
+	}
+
 	trace_kcf_state(kcf);
 	trace_kcf_msg("ReadRecord end");
 
 	return KCF_ERROR_OK;
 }
 
-static 
-int
-IO_skip(IO *x, size_t size)
+/*
+ * Returns 0 when size bytes are skipped, 1 if the stream ends before
+ * that and -1 on errors.
+ */
+static int IO_skip(IO *x, int64_t size)
 {
-	int ret = 0;
 	int64_t n_read, to_read, remaining;
 	uint8_t buffer[4096];
 
-	n_read = 0;
+	if (size < 0)
+		return -1;
+	if (size == 0)
+		return 0;
+
+	/* Don't drag skipped data through memory if we can jump over it.
+	 * Seeking past the end succeeds, so the last byte skipped is read
+	 * to tell a truncated archive, buffered streams have it anyway. */
+	if (IO_seek(x, size - 1, IO_SEEK_CUR) >= 0) {
+		n_read = IO_read(x, buffer, 1);
+		if (n_read < 0)
+			return -1;
+		return n_read == 1 ? 0 : 1;
+	}
+
 	remaining = size;
-	do
-	{
+	do {
 		to_read = 4096;
 		if (to_read > remaining)
 			to_read = remaining;
 
 		n_read = IO_read(x, buffer, to_read);
 		if (n_read < 0)
-			break;
+			return -1;
+		if (n_read == 0)
+			return 1;
 		remaining -= n_read;
-	}
-	while (remaining > 0);
+	} while (remaining > 0);
 
-	return ret;
+	return 0;
 }
 
 KCFERROR KCF_skip_record(KCF *kcf)
@@ -172,6 +250,10 @@ KCFERROR KCF_skip_record(KCF *kcf)
 		if (Error)
 			return Error;
 
+		/* Damaged sizes must not take the stream backwards */
+		if (Header.HeadSize < HeaderSize ||
+		    Header.AddedSize > UINT64_MAX - Header.HeadSize)
+			return trace_kcf_error(KCF_ERROR_INVALID_DATA);
 		DataSize = Header.HeadSize - HeaderSize + Header.AddedSize;
 	} else if (kcf->ParserState == KCF_PSTATE_READ_ADDED_DATA) {
 		DataSize = kcf->AvailableAddedData;
@@ -179,11 +261,24 @@ KCFERROR KCF_skip_record(KCF *kcf)
 		return trace_kcf_error(KCF_ERROR_INVALID_STATE);
 	}
 
-	if (!IO_skip(kcf->Stream, DataSize))
+	if (DataSize > INT64_MAX)
+		return trace_kcf_error(KCF_ERROR_INVALID_DATA);
+
+	switch (IO_skip(kcf->Stream, (int64_t)DataSize)) {
+	case 0:
+		break;
+	case 1:
+		return trace_kcf_error(KCF_ERROR_PREMATURE_EOF);
+	default:
 		return trace_kcf_error(KCF_ERROR_READ);
+	}
 
 	kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
 
+	if (kcf->AccessPattern == KCF_ACCESS_RANDOM)
+		IO_advise(kcf->Stream, IO_tell(kcf->Stream),
+		          NEXT_RECORD_READAHEAD_SIZE, IO_ADVICE_WILLNEED);
+
 	trace_kcf_state(kcf);
 	trace_kcf_msg("SkipRecord end");
 
@@ -221,7 +316,7 @@ KCFERROR KCF_read_added_data(KCF *kcf, void *Destination, size_t BufferSize,
 		*BytesRead = 0;
 
 	if (kcf->AvailableAddedData == 0) {
-		kcf->ReaderState = KCF_RDSTATE_RECORD_HEADER;
+		kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
 		trace_kcf_state(kcf);
 		trace_kcf_msg("ReadAddedData end");
 		return KCF_ERROR_OK;
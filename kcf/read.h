@@ -28,6 +28,60 @@ KCFERROR KCF_read_record(KCF *kcf, struct KcfRecord *record);
  */
 KCFERROR KCF_skip_record(KCF *kcf);
 
+/**
+ * \brief Scans forward from the current position for the next place
+ * which looks like a valid record header and stops there.
+ *
+ * Returns `KCF_ERROR_EOF` if the rest of the stream has no such place,
+ * SkippedBytes is the rest of the stream then.
+ */
+KCFERROR KCF_resync(KCF *kcf, uint64_t *SkippedBytes);
+
+/**
+ * \brief Tells the skip callback of kcf that Size bytes from Offset of
+ * the current volume have been skipped in recovery mode.
+ */
+void KCF_report_skipped(KCF *kcf, uint64_t Offset, uint64_t Size);
+
+/**
+ * \brief Full size of the record at Buffer (header and added data) if
+ * its header looks valid, 0 otherwise.
+ */
+uint64_t rec_plausible_size(const uint8_t *Buffer, size_t Size);
+
+/**
+ * \brief Goes on to the next volume of a multi-volume archive and reads
+ * its archive header.
+ *
+ * Returns `KCF_ERROR_EOF` if there is no next volume.
+ */
+KCFERROR KCF_open_next_volume(KCF *kcf);
+
+struct member_map;
+
+/**
+ * \brief Notes where the data fragments and the block checksum table of
+ * the current file are, skipping over them.
+ *
+ * The file header must have been read and none of its data. The stream
+ * is left at the record after the file.
+ */
+KCFERROR KCF_read_member_map(KCF *kcf, struct member_map *Map);
+
+/**
+ * \brief Makes RangeMap of kcf the map of the file whose header is at
+ * HeaderOffset of its stream, or of the file it links to.
+ *
+ * The stream is left anywhere.
+ */
+KCFERROR KCF_load_range_map(KCF *kcf, uint64_t HeaderOffset);
+
+/**
+ * \brief Reads Size bytes of the file of RangeMap from Offset on.
+ */
+KCFERROR KCF_read_range_map(KCF *kcf, uint64_t Offset, void *Buffer,
+                            size_t Size);
+
 bool KCF_is_added_data_available(KCF *kcf);
 KCFERROR KCF_read_added_data(KCF *kcf, void *Destination, size_t BufferSize,
                              size_t *BytesRead);
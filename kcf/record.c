@@ -98,7 +98,9 @@ bool rec_to_buffer(struct KcfRecord *Record, uint8_t *Buffer, size_t Size)
 		result = result && WriteU32LE(Buffer, Size, &Offset,
 		                              Record->AddedDataCRC32);
 
-	memcpy(Buffer + Offset, Record->Data, Record->DataSize);
+	/* Records without data may have no buffer at all */
+	if (result && Record->DataSize)
+		memcpy(Buffer + Offset, Record->Data, Record->DataSize);
 	return result;
 }
 
@@ -13,15 +13,25 @@
 
 #include <kcf/archive.h>
 
+#include "bytepack.h"
+
+#define KCF_HAS_CONTINUATION     0x01
 #define KCF_HAS_ADDED_DATA_CRC32 0x20
 #define KCF_HAS_ADDED_SIZE_4     0x80
 #define KCF_HAS_ADDED_SIZE_8     0xC0
 
 enum KcfRecordType {
-	KCF_MARKER         = '!',
-	KCF_ARCHIVE_HEADER = 'A',
-	KCF_FILE_HEADER    = 'F',
-	KCF_DATA_FRAGMENT  = 'D',
+	KCF_MARKER          = '!',
+	KCF_ARCHIVE_HEADER  = 'A',
+	KCF_FILE_HEADER     = 'F',
+	KCF_DATA_FRAGMENT   = 'D',
+	KCF_BLOCK_TABLE     = 'B',
+	KCF_FRAME_TABLE     = 'T',
+	KCF_LINK_RECORD     = 'L',
+	KCF_RECOVERY_RECORD = 'R',
+
+	/* File header of a deleted file, see KCF_delete_member() */
+	KCF_DELETED_FILE    = 'X',
 };
 
 struct KcfRecord {
@@ -50,8 +60,17 @@ struct KcfRecord {
 	size_t DataSize;
 };
 
+/* Common header: 6 bytes, added size of 4 or 8 bytes, added data CRC32 */
+#define KCF_MIN_HEADER_SIZE 6
+#define KCF_MAX_HEADER_SIZE 18
+
+/* ArchiveFlags */
+#define KCF_ARCHIVE_MULTIVOLUME 0x0001
+
 struct KcfArchiveHeader {
 	uint16_t ArchiveVersion;
+	uint16_t ArchiveFlags;
+	uint32_t VolumeNumber;
 };
 
 /* Record manipulation functions */
@@ -89,6 +108,64 @@ static inline bool rec_has_added_data_CRC(struct KcfRecord *record)
 	return !!(record->HeadFlags & KCF_HAS_ADDED_DATA_CRC32);
 }
 
+/**
+ * \brief Returns size of the common header described by the flags.
+ */
+static inline size_t rec_header_size(uint8_t Flags)
+{
+	size_t Size = KCF_MIN_HEADER_SIZE;
+
+	switch (Flags & KCF_HAS_ADDED_SIZE_8) {
+	case KCF_HAS_ADDED_SIZE_4:
+		Size += 4;
+		break;
+	case KCF_HAS_ADDED_SIZE_8:
+		Size += 8;
+		break;
+	}
+
+	if (Flags & KCF_HAS_ADDED_DATA_CRC32)
+		Size += 4;
+
+	return Size;
+}
+
+/**
+ * \brief Decodes the common header from Buffer into Record.
+ *
+ * Buffer must hold at least `rec_header_size(Buffer[3])` bytes. Data of
+ * the record is left untouched.
+ */
+static inline void rec_decode_header(const uint8_t *Buffer,
+                                     struct KcfRecord *Record)
+{
+	const uint8_t *Tail = Buffer + KCF_MIN_HEADER_SIZE;
+
+	Record->HeadCRC   = LoadU16LE(Buffer);
+	Record->HeadType  = Buffer[2];
+	Record->HeadFlags = Buffer[3];
+	Record->HeadSize  = LoadU16LE(Buffer + 4);
+
+	switch (Record->HeadFlags & KCF_HAS_ADDED_SIZE_8) {
+	case KCF_HAS_ADDED_SIZE_4:
+		Record->AddedSize = LoadU32LE(Tail);
+		Tail += 4;
+		break;
+	case KCF_HAS_ADDED_SIZE_8:
+		Record->AddedSize = LoadU64LE(Tail);
+		Tail += 8;
+		break;
+	default:
+		Record->AddedSize = 0;
+		break;
+	}
+
+	if (Record->HeadFlags & KCF_HAS_ADDED_DATA_CRC32)
+		Record->AddedDataCRC32 = LoadU32LE(Tail);
+	else
+		Record->AddedDataCRC32 = 0;
+}
+
 bool rec_has_added_size_8(struct KcfRecord *);
 bool rec_has_added_size_4(struct KcfRecord *);
 
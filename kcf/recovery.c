@@ -0,0 +1,699 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "gf256.h"
+#include "kcf_impl.h"
+
+/*
+ * Recovery record: Reed-Solomon parity over the archive before it, cut
+ * into blocks of BlockSize bytes. Block b belongs to stripe
+ * b % Stripes, so a long damaged run hits many stripes a little instead
+ * of one stripe a lot. Each stripe of up to RECOVERY_MAX_DATA_BLOCKS
+ * data blocks has ParityBlocks parity blocks, any ParityBlocks damaged
+ * blocks of a stripe can be rebuilt. The code is systematic with a
+ * Cauchy matrix, every square submatrix of which is invertible.
+ *
+ * Added data: parity blocks of stripe 0, stripe 1..., CRC32C of each
+ * data block, CRC32C of each parity block, CRC32C of both tables.
+ */
+
+#define RECOVERY_MAX_DATA_BLOCKS    128
+#define RECOVERY_DEFAULT_BLOCK_SIZE 65536
+#define RECOVERY_MIN_BLOCK_SIZE     512
+#define RECOVERY_MAX_BLOCK_SIZE     16777216L
+
+/* Parity of that many bytes is computed in one pass over the archive */
+#define RECOVERY_PASS_MEMORY 67108864L
+
+/* Archive is read in chunks of at least that size */
+#define RECOVERY_CHUNK_SIZE 1048576L
+
+/* BlockSize, ProtectedSize, Stripes, ParityBlocks */
+#define RECOVERY_DATA_SIZE   18
+#define RECOVERY_RECORD_SIZE (KCF_MAX_HEADER_SIZE + RECOVERY_DATA_SIZE)
+
+struct recovery_layout {
+	uint64_t ProtectedSize;
+	uint64_t Blocks;
+	uint32_t BlockSize;
+	uint32_t Stripes;
+	uint16_t ParityBlocks;
+
+	/* Data blocks in the largest stripe */
+	uint32_t StripeBlocks;
+};
+
+static void layout_init(struct recovery_layout *Layout, uint64_t ProtectedSize,
+                        uint32_t BlockSize, uint32_t Stripes,
+                        uint16_t ParityBlocks)
+{
+	Layout->ProtectedSize = ProtectedSize;
+	Layout->BlockSize     = BlockSize;
+	Layout->Blocks        = (ProtectedSize + BlockSize - 1) / BlockSize;
+	Layout->Stripes       = Stripes;
+	Layout->ParityBlocks  = ParityBlocks;
+	Layout->StripeBlocks  = (Layout->Blocks + Stripes - 1) / Stripes;
+}
+
+static uint64_t parity_count(const struct recovery_layout *Layout)
+{
+	return (uint64_t)Layout->Stripes * Layout->ParityBlocks;
+}
+
+/* Size of both CRC tables with their own CRC */
+static uint64_t tables_size(const struct recovery_layout *Layout)
+{
+	return 4 * (Layout->Blocks + parity_count(Layout)) + 4;
+}
+
+static uint64_t added_size(const struct recovery_layout *Layout)
+{
+	return parity_count(Layout) * Layout->BlockSize + tables_size(Layout);
+}
+
+/* Cauchy matrix of ParityBlocks rows by StripeBlocks columns */
+static uint8_t *make_coefficients(const struct recovery_layout *Layout)
+{
+	uint8_t *Coefficients;
+	uint32_t Row, Col, Columns = Layout->StripeBlocks;
+
+	Coefficients = malloc((size_t)Layout->ParityBlocks * Columns);
+	if (!Coefficients)
+		return NULL;
+
+	for (Row = 0; Row < Layout->ParityBlocks; Row++) {
+		for (Col = 0; Col < Columns; Col++)
+			Coefficients[Row * Columns + Col] =
+			    gf256_inv(Row ^ (Layout->ParityBlocks + Col));
+	}
+
+	return Coefficients;
+}
+
+/* Reads Count blocks from Block on, the end of the last one is zeroed */
+static bool read_blocks(IO *Stream, const struct recovery_layout *Layout,
+                        uint64_t Block, uint64_t Count, uint8_t *Buffer)
+{
+	uint64_t Offset = Block * Layout->BlockSize;
+	uint64_t Size   = Count * Layout->BlockSize;
+	int64_t n_read;
+
+	if (Offset + Size > Layout->ProtectedSize)
+		Size = Layout->ProtectedSize - Offset;
+
+	if (IO_seek(Stream, Offset, IO_SEEK_SET) < 0)
+		return false;
+
+	n_read = IO_read(Stream, Buffer, Size);
+	if (n_read < 0)
+		return false;
+
+	/* A truncated archive reads as zeroes, CRC tells it is damaged */
+	memset(Buffer + n_read, 0, Count * Layout->BlockSize - n_read);
+	return true;
+}
+
+static uint64_t chunk_blocks(const struct recovery_layout *Layout)
+{
+	uint64_t Count = RECOVERY_CHUNK_SIZE / Layout->BlockSize;
+
+	return Count ? Count : 1;
+}
+
+/*
+ * Adds the blocks of the archive to the parity of stripes from First
+ * to First + Count. The first pass computes CRCs of data blocks too.
+ */
+static KCFERROR parity_pass(KCF *kcf, const struct recovery_layout *Layout,
+                            const uint8_t *Coefficients, uint32_t First,
+                            uint32_t Count, uint8_t *Parity,
+                            uint32_t *DataCRCs)
+{
+	uint32_t BlockSize = Layout->BlockSize;
+	uint64_t Block, Chunk, i, Stripe, Index;
+	uint16_t j;
+	uint8_t *Buffer, *Data;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	Chunk  = chunk_blocks(Layout);
+	Buffer = malloc(Chunk * BlockSize);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	memset(Parity, 0, (size_t)Count * Layout->ParityBlocks * BlockSize);
+
+	for (Block = 0; Block < Layout->Blocks; Block += Chunk) {
+		if (Chunk > Layout->Blocks - Block)
+			Chunk = Layout->Blocks - Block;
+		if (!read_blocks(kcf->Stream, Layout, Block, Chunk, Buffer)) {
+			Error = KCF_ERROR_READ;
+			break;
+		}
+
+		for (i = 0; i < Chunk; i++) {
+			Data = Buffer + i * BlockSize;
+			if (First == 0)
+				DataCRCs[Block + i] = crc32c(0, Data, BlockSize);
+
+			Stripe = (Block + i) % Layout->Stripes;
+			Index  = (Block + i) / Layout->Stripes;
+			if (Stripe < First || Stripe >= First + Count)
+				continue;
+
+			for (j = 0; j < Layout->ParityBlocks; j++)
+				gf256_mul_add(
+				    Parity + ((Stripe - First) *
+				                  Layout->ParityBlocks + j) *
+				                 BlockSize,
+				    Data,
+				    Coefficients[j * Layout->StripeBlocks + Index],
+				    BlockSize);
+		}
+	}
+
+	free(Buffer);
+	return Error;
+}
+
+static void store_crcs(uint8_t *Buffer, const uint32_t *CRCs, uint64_t Count)
+{
+	uint64_t i;
+
+	for (i = 0; i < Count; i++)
+		StoreU32LE(Buffer + 4 * i, CRCs[i]);
+}
+
+KCFERROR KCF_add_recovery_record(KCF *kcf, unsigned Percent,
+                                 uint32_t BlockSize)
+{
+	struct recovery_layout Layout;
+	struct KcfRecord Record = {0};
+	uint8_t Data[RECOVERY_DATA_SIZE];
+	uint8_t *Coefficients = NULL, *Parity = NULL, *Tables = NULL;
+	uint32_t *CRCs = NULL;
+	uint32_t Stripes, First, Count, PassStripes;
+	uint64_t Blocks, ParityBlocks, i;
+	int64_t Protected, WritePosition;
+	ptrdiff_t Offset = 0;
+	KCFERROR Error;
+
+	if (!kcf || Percent < 1 || Percent > 100)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!BlockSize)
+		BlockSize = RECOVERY_DEFAULT_BLOCK_SIZE;
+	if (BlockSize < RECOVERY_MIN_BLOCK_SIZE ||
+	    BlockSize > RECOVERY_MAX_BLOCK_SIZE)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_WRITING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+
+	/* Records are split between volumes, blocks would be too */
+	if (kcf->VolumeSize)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	if (kcf->ParserState == KCF_PSTATE_WRITE_ADDED_DATA) {
+		Error = KCF_finish_added_data(kcf);
+		if (Error)
+			return Error;
+	}
+
+	Protected = IO_tell(kcf->Stream);
+	if (Protected < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+	if (Protected == 0)
+		return KCF_ERROR_INVALID_STATE;
+
+	Blocks  = ((uint64_t)Protected + BlockSize - 1) / BlockSize;
+	Stripes = (Blocks + RECOVERY_MAX_DATA_BLOCKS - 1) /
+	          RECOVERY_MAX_DATA_BLOCKS;
+	layout_init(&Layout, Protected, BlockSize, Stripes, 1);
+	Layout.ParityBlocks = (Layout.StripeBlocks * Percent + 99) / 100;
+	ParityBlocks        = parity_count(&Layout);
+
+	Coefficients = make_coefficients(&Layout);
+	CRCs         = malloc((Blocks + ParityBlocks) * sizeof(uint32_t));
+	Tables       = malloc(tables_size(&Layout));
+	if (!Coefficients || !CRCs || !Tables) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+
+	PassStripes = RECOVERY_PASS_MEMORY /
+	              ((uint64_t)Layout.ParityBlocks * BlockSize);
+	if (PassStripes == 0)
+		PassStripes = 1;
+	if (PassStripes > Stripes)
+		PassStripes = Stripes;
+
+	Parity = malloc((size_t)PassStripes * Layout.ParityBlocks * BlockSize);
+	if (!Parity) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+
+	WriteU32LE(Data, sizeof(Data), &Offset, BlockSize);
+	WriteU64LE(Data, sizeof(Data), &Offset, Protected);
+	WriteU32LE(Data, sizeof(Data), &Offset, Stripes);
+	WriteU16LE(Data, sizeof(Data), &Offset, Layout.ParityBlocks);
+
+	Record.HeadType  = KCF_RECOVERY_RECORD;
+	Record.HeadFlags = KCF_HAS_ADDED_SIZE_8 | KCF_HAS_ADDED_DATA_CRC32;
+	Record.AddedSize = added_size(&Layout);
+	Record.Data      = Data;
+	Record.DataSize  = sizeof(Data);
+
+	Error = KCF_write_record(kcf, &Record);
+	if (Error)
+		goto cleanup;
+
+	/* The archive is read back once per pass */
+	for (First = 0; First < Stripes; First += Count) {
+		Count = Stripes - First;
+		if (Count > PassStripes)
+			Count = PassStripes;
+
+		WritePosition = IO_tell(kcf->Stream);
+		Error = parity_pass(kcf, &Layout, Coefficients, First, Count,
+		                    Parity, CRCs);
+		if (Error)
+			goto cleanup;
+
+		if (IO_seek(kcf->Stream, WritePosition, IO_SEEK_SET) < 0) {
+			Error = KCF_ERROR_WRITE;
+			goto cleanup;
+		}
+
+		for (i = 0; i < (uint64_t)Count * Layout.ParityBlocks; i++)
+			CRCs[Blocks + First * Layout.ParityBlocks + i] =
+			    crc32c(0, Parity + i * BlockSize, BlockSize);
+
+		Error = KCF_write_added_data(
+		    kcf, Parity, (size_t)Count * Layout.ParityBlocks * BlockSize);
+		if (Error)
+			goto cleanup;
+	}
+
+	store_crcs(Tables, CRCs, Blocks + ParityBlocks);
+	StoreU32LE(Tables + 4 * (Blocks + ParityBlocks),
+	           crc32c(0, Tables, 4 * (Blocks + ParityBlocks)));
+
+	Error = KCF_write_added_data(kcf, Tables, tables_size(&Layout));
+	if (!Error)
+		Error = KCF_finish_added_data(kcf);
+
+cleanup:
+	free(Tables);
+	free(Parity);
+	free(CRCs);
+	free(Coefficients);
+	return Error;
+}
+
+/* Repair */
+
+/*
+ * Checks whether Buffer holds the header of a recovery record which
+ * protects exactly the Offset bytes before it.
+ */
+static bool is_recovery_record(const uint8_t *Buffer, uint64_t Offset,
+                               struct recovery_layout *Layout)
+{
+	struct KcfRecord Record;
+	uint32_t BlockSize, Stripes;
+	uint64_t Protected, Blocks;
+	uint16_t ParityBlocks;
+	const uint8_t *Data;
+
+	if (Buffer[2] != KCF_RECOVERY_RECORD ||
+	    Buffer[3] != (KCF_HAS_ADDED_SIZE_8 | KCF_HAS_ADDED_DATA_CRC32))
+		return false;
+
+	rec_decode_header(Buffer, &Record);
+	if (Record.HeadSize != RECOVERY_RECORD_SIZE)
+		return false;
+	if ((crc32c(0, Buffer + 2, RECOVERY_RECORD_SIZE - 2) & 0xFFFF) !=
+	    Record.HeadCRC)
+		return false;
+
+	Data         = Buffer + KCF_MAX_HEADER_SIZE;
+	BlockSize    = LoadU32LE(Data);
+	Protected    = LoadU64LE(Data + 4);
+	Stripes      = LoadU32LE(Data + 12);
+	ParityBlocks = LoadU16LE(Data + 16);
+
+	if (Protected != Offset || Protected == 0)
+		return false;
+	if (BlockSize < RECOVERY_MIN_BLOCK_SIZE ||
+	    BlockSize > RECOVERY_MAX_BLOCK_SIZE)
+		return false;
+
+	Blocks = (Protected + BlockSize - 1) / BlockSize;
+	if (Stripes != (Blocks + RECOVERY_MAX_DATA_BLOCKS - 1) /
+	                   RECOVERY_MAX_DATA_BLOCKS)
+		return false;
+
+	layout_init(Layout, Protected, BlockSize, Stripes, ParityBlocks);
+	if (ParityBlocks == 0 || ParityBlocks > Layout->StripeBlocks)
+		return false;
+
+	return Record.AddedSize == added_size(Layout);
+}
+
+/* The last recovery record of the stream, it covers the most */
+static KCFERROR find_recovery_record(IO *Stream,
+                                     struct recovery_layout *Layout,
+                                     uint64_t *RecordOffset)
+{
+	struct recovery_layout Found;
+	uint8_t *Buffer, *p;
+	size_t Carry = 0, Length, Limit, Position;
+	int64_t n_read;
+	uint64_t Offset = 0;
+	bool Eof        = false;
+	KCFERROR Error  = KCF_ERROR_INVALID_FORMAT;
+
+	Buffer = malloc(RECOVERY_CHUNK_SIZE + RECOVERY_RECORD_SIZE);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	if (IO_seek(Stream, 0, IO_SEEK_SET) < 0) {
+		free(Buffer);
+		return KCF_ERROR_READ;
+	}
+
+	/* Offset is the position of Buffer[0] in the stream */
+	while (!Eof) {
+		n_read = IO_read(Stream, Buffer + Carry, RECOVERY_CHUNK_SIZE);
+		if (n_read < 0) {
+			Error = KCF_ERROR_READ;
+			break;
+		}
+
+		Length = Carry + n_read;
+		Eof    = n_read == 0;
+		Limit  = Length >= RECOVERY_RECORD_SIZE
+		             ? Length - RECOVERY_RECORD_SIZE + 1
+		             : 0;
+
+		for (Position = 0; Position < Limit; Position++) {
+			p = memchr(Buffer + Position + 2, KCF_RECOVERY_RECORD,
+			           Limit - Position);
+			if (!p)
+				break;
+
+			Position = p - Buffer - 2;
+			if (Position < Limit &&
+			    is_recovery_record(Buffer + Position,
+			                       Offset + Position, &Found)) {
+				*Layout       = Found;
+				*RecordOffset = Offset + Position;
+				Error         = KCF_ERROR_OK;
+			}
+		}
+
+		Carry = Length - Limit;
+		memmove(Buffer, Buffer + Limit, Carry);
+		Offset += Limit;
+	}
+
+	free(Buffer);
+	return Error;
+}
+
+/* Reads the CRC tables and checks them */
+static KCFERROR read_tables(IO *Stream, const struct recovery_layout *Layout,
+                            uint64_t RecordOffset, uint32_t **CRCs)
+{
+	uint64_t Count = Layout->Blocks + parity_count(Layout), i;
+	uint8_t *Tables;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	Tables = malloc(tables_size(Layout));
+	*CRCs  = malloc(Count * sizeof(uint32_t));
+	if (!Tables || !*CRCs) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+
+	if (IO_seek(Stream,
+	            RecordOffset + RECOVERY_RECORD_SIZE +
+	                parity_count(Layout) * Layout->BlockSize,
+	            IO_SEEK_SET) < 0 ||
+	    IO_read(Stream, Tables, tables_size(Layout)) <
+	        (int64_t)tables_size(Layout)) {
+		Error = KCF_ERROR_PREMATURE_EOF;
+		goto cleanup;
+	}
+
+	/* Without trusted CRCs damaged blocks can't be told from good ones */
+	if (crc32c(0, Tables, 4 * Count) != LoadU32LE(Tables + 4 * Count)) {
+		Error = KCF_ERROR_INVALID_DATA;
+		goto cleanup;
+	}
+
+	for (i = 0; i < Count; i++)
+		(*CRCs)[i] = LoadU32LE(Tables + 4 * i);
+
+cleanup:
+	free(Tables);
+	if (Error) {
+		free(*CRCs);
+		*CRCs = NULL;
+	}
+	return Error;
+}
+
+struct repair_state {
+	IO *Stream;
+	struct recovery_layout Layout;
+	uint64_t RecordOffset;
+	uint8_t *Coefficients;
+	uint32_t *CRCs;
+	bool *Damaged;
+
+	/* ParityBlocks blocks each */
+	uint8_t *Syndromes;
+	uint8_t *Rebuilt;
+	uint8_t *Block;
+	uint8_t *Matrix;
+	uint32_t *Erased;
+	uint16_t *Selected;
+};
+
+static KCFERROR find_damaged_blocks(struct repair_state *State,
+                                    uint64_t *DamagedBlocks)
+{
+	const struct recovery_layout *Layout = &State->Layout;
+	uint64_t Block, Chunk, i;
+	uint8_t *Buffer;
+
+	Chunk  = chunk_blocks(Layout);
+	Buffer = malloc(Chunk * Layout->BlockSize);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	*DamagedBlocks = 0;
+	for (Block = 0; Block < Layout->Blocks; Block += Chunk) {
+		if (Chunk > Layout->Blocks - Block)
+			Chunk = Layout->Blocks - Block;
+		if (!read_blocks(State->Stream, Layout, Block, Chunk, Buffer)) {
+			free(Buffer);
+			return KCF_ERROR_READ;
+		}
+
+		for (i = 0; i < Chunk; i++) {
+			State->Damaged[Block + i] =
+			    crc32c(0, Buffer + i * Layout->BlockSize,
+			           Layout->BlockSize) != State->CRCs[Block + i];
+			if (State->Damaged[Block + i])
+				(*DamagedBlocks)++;
+		}
+	}
+
+	free(Buffer);
+	return KCF_ERROR_OK;
+}
+
+/* Reads parity block Index of Stripe into Buffer, false if it's damaged */
+static bool read_parity(struct repair_state *State, uint32_t Stripe,
+                        uint16_t Index, uint8_t *Buffer)
+{
+	const struct recovery_layout *Layout = &State->Layout;
+	uint64_t Number = (uint64_t)Stripe * Layout->ParityBlocks + Index;
+
+	if (IO_seek(State->Stream,
+	            State->RecordOffset + RECOVERY_RECORD_SIZE +
+	                Number * Layout->BlockSize,
+	            IO_SEEK_SET) < 0)
+		return false;
+	if (IO_read(State->Stream, Buffer, Layout->BlockSize) <
+	    (int64_t)Layout->BlockSize)
+		return false;
+
+	return crc32c(0, Buffer, Layout->BlockSize) ==
+	       State->CRCs[Layout->Blocks + Number];
+}
+
+/* Returns the number of blocks of the stripe which can't be rebuilt */
+static uint64_t repair_stripe(struct repair_state *State, uint32_t Stripe)
+{
+	const struct recovery_layout *Layout = &State->Layout;
+	uint32_t BlockSize = Layout->BlockSize, Columns = Layout->StripeBlocks;
+	uint32_t Erased = 0, Index, t, u;
+	uint16_t Selected = 0, j;
+	uint64_t Block, Offset, Size, Failed = 0;
+
+	for (Block = Stripe; Block < Layout->Blocks; Block += Layout->Stripes) {
+		if (State->Damaged[Block])
+			State->Erased[Erased++] = Block / Layout->Stripes;
+		if (Erased > Layout->ParityBlocks)
+			break;
+	}
+	if (Erased == 0)
+		return 0;
+	if (Erased > Layout->ParityBlocks)
+		return Erased;
+
+	/* Syndromes start as good parity blocks */
+	for (j = 0; j < Layout->ParityBlocks && Selected < Erased; j++) {
+		if (read_parity(State, Stripe, j,
+		                State->Syndromes + Selected * BlockSize))
+			State->Selected[Selected++] = j;
+	}
+	if (Selected < Erased)
+		return Erased;
+
+	/* Parity minus the good blocks is the erased blocks' share */
+	for (Block = Stripe, Index = 0; Block < Layout->Blocks;
+	     Block += Layout->Stripes, Index++) {
+		if (State->Damaged[Block])
+			continue;
+		if (!read_blocks(State->Stream, Layout, Block, 1, State->Block))
+			return Erased;
+		for (t = 0; t < Erased; t++)
+			gf256_mul_add(State->Syndromes + t * BlockSize,
+			              State->Block,
+			              State->Coefficients[State->Selected[t] *
+			                                      Columns +
+			                                  Index],
+			              BlockSize);
+	}
+
+	for (t = 0; t < Erased; t++) {
+		for (u = 0; u < Erased; u++)
+			State->Matrix[t * Erased + u] =
+			    State->Coefficients[State->Selected[t] * Columns +
+			                        State->Erased[u]];
+	}
+	if (!gf256_invert_matrix(State->Matrix, Erased))
+		return Erased;
+
+	for (u = 0; u < Erased; u++) {
+		uint8_t *Rebuilt = State->Rebuilt + u * BlockSize;
+
+		memset(Rebuilt, 0, BlockSize);
+		for (t = 0; t < Erased; t++)
+			gf256_mul_add(Rebuilt, State->Syndromes + t * BlockSize,
+			              State->Matrix[u * Erased + t], BlockSize);
+
+		Block = Stripe + (uint64_t)State->Erased[u] * Layout->Stripes;
+		if (crc32c(0, Rebuilt, BlockSize) != State->CRCs[Block]) {
+			Failed++;
+			continue;
+		}
+
+		Offset = Block * BlockSize;
+		Size   = BlockSize;
+		if (Offset + Size > Layout->ProtectedSize)
+			Size = Layout->ProtectedSize - Offset;
+		if (IO_seek(State->Stream, Offset, IO_SEEK_SET) < 0 ||
+		    IO_write(State->Stream, Rebuilt, Size) < (int64_t)Size) {
+			Failed++;
+			continue;
+		}
+		State->Damaged[Block] = false;
+	}
+
+	return Failed;
+}
+
+static void free_repair_state(struct repair_state *State)
+{
+	free(State->Coefficients);
+	free(State->CRCs);
+	free(State->Damaged);
+	free(State->Syndromes);
+	free(State->Rebuilt);
+	free(State->Block);
+	free(State->Matrix);
+	free(State->Erased);
+	free(State->Selected);
+}
+
+KCFERROR KCF_repair(IO *Stream, struct KcfRepairInfo *Info)
+{
+	struct repair_state State = {0};
+	struct recovery_layout *Layout = &State.Layout;
+	size_t ParitySize;
+	uint64_t Damaged, Failed = 0;
+	uint32_t Stripe;
+	KCFERROR Error;
+
+	if (!Stream)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (Info)
+		memset(Info, 0, sizeof(*Info));
+
+	State.Stream = Stream;
+	Error = find_recovery_record(Stream, Layout, &State.RecordOffset);
+	if (Error)
+		return Error;
+
+	Error = read_tables(Stream, Layout, State.RecordOffset, &State.CRCs);
+	if (Error)
+		return Error;
+
+	ParitySize         = (size_t)Layout->ParityBlocks * Layout->BlockSize;
+	State.Coefficients = make_coefficients(Layout);
+	State.Damaged      = calloc(Layout->Blocks, sizeof(bool));
+	State.Syndromes    = malloc(ParitySize);
+	State.Rebuilt      = malloc(ParitySize);
+	State.Block        = malloc(Layout->BlockSize);
+	State.Matrix       = malloc(Layout->ParityBlocks * Layout->ParityBlocks);
+	State.Erased   = malloc((Layout->ParityBlocks + 1) * sizeof(uint32_t));
+	State.Selected = malloc(Layout->ParityBlocks * sizeof(uint16_t));
+	if (!State.Coefficients || !State.Damaged || !State.Syndromes ||
+	    !State.Rebuilt || !State.Block || !State.Matrix || !State.Erased ||
+	    !State.Selected) {
+		Error = KCF_ERROR_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+
+	Error = find_damaged_blocks(&State, &Damaged);
+	if (Error)
+		goto cleanup;
+
+	for (Stripe = 0; Stripe < Layout->Stripes; Stripe++)
+		Failed += repair_stripe(&State, Stripe);
+
+	if (IO_flush(Stream) < 0) {
+		Error = KCF_ERROR_WRITE;
+		goto cleanup;
+	}
+
+	if (Info) {
+		Info->ProtectedSize  = Layout->ProtectedSize;
+		Info->DamagedBlocks  = Damaged;
+		Info->RepairedBlocks = Damaged - Failed;
+	}
+	if (Failed)
+		Error = KCF_ERROR_INVALID_DATA;
+
+cleanup:
+	free_repair_state(&State);
+	return Error;
+}
@@ -0,0 +1,218 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RESYNC_SSE2
+#endif
+
+#include "crc32c.h"
+#include "kcf_impl.h"
+
+/*
+ * Recovery after a damaged record: the stream is scanned for the next
+ * place which looks like a record header, i.e. has a known type, flags
+ * and size consistent with each other and a matching HeadCRC.
+ */
+
+/* A record header with its data is never longer than that */
+#define RESYNC_LOOKAHEAD   65536L
+#define RESYNC_BUFFER_SIZE (1048576L + RESYNC_LOOKAHEAD)
+
+/* Both the scalar and the SSE2 scan go by this table */
+static const uint8_t RecordTypes[] = {
+    KCF_ARCHIVE_HEADER, KCF_FILE_HEADER,  KCF_DATA_FRAGMENT,
+    KCF_BLOCK_TABLE,    KCF_FRAME_TABLE,  KCF_LINK_RECORD,
+    KCF_DELETED_FILE,   KCF_RECOVERY_RECORD,
+};
+
+#define RECORD_TYPE_COUNT (sizeof(RecordTypes) / sizeof(RecordTypes[0]))
+
+static bool is_record_type(uint8_t Type)
+{
+	return memchr(RecordTypes, Type, RECORD_TYPE_COUNT) != NULL;
+}
+
+/* Cheap checks first, CRC of every candidate would cost too much */
+static bool is_known_flags(uint8_t Flags)
+{
+	if (Flags & ~(KCF_HAS_ADDED_SIZE_8 | KCF_HAS_ADDED_DATA_CRC32 |
+	              KCF_HAS_CONTINUATION))
+		return false;
+
+	/* 0x40 alone is not a valid added size */
+	return (Flags & KCF_HAS_ADDED_SIZE_8) != 0x40;
+}
+
+/*
+ * Returns the full record size (header and added data) if the bytes
+ * look like a valid record header or 0 otherwise.
+ */
+uint64_t rec_plausible_size(const uint8_t *Buffer, size_t Size)
+{
+	struct KcfRecord Record;
+
+	if (Size < KCF_MIN_HEADER_SIZE)
+		return 0;
+	if (!is_record_type(Buffer[2]) || !is_known_flags(Buffer[3]))
+		return 0;
+	if (Size < rec_header_size(Buffer[3]))
+		return 0;
+
+	rec_decode_header(Buffer, &Record);
+
+	if (Record.HeadType == KCF_DATA_FRAGMENT &&
+	    !rec_has_added_size(&Record))
+		return 0;
+	if (Record.HeadSize < rec_header_size(Record.HeadFlags) ||
+	    Record.HeadSize > Size)
+		return 0;
+
+	/* HeadCRC covers everything from HeadType up to the end of data */
+	if ((crc32c(0, Buffer + 2, Record.HeadSize - 2) & 0xFFFF) !=
+	    Record.HeadCRC)
+		return 0;
+
+	return Record.HeadSize + Record.AddedSize;
+}
+
+/*
+ * Checks the candidate at Buffer[Position] and, when the record after
+ * it is inside the buffer as well, that one too. A chance CRC16 match
+ * is not that unlikely in a few terabytes of data.
+ */
+static bool check_candidate(const uint8_t *Buffer, size_t Length,
+                            size_t Position, bool Eof)
+{
+	uint64_t RecordSize, Next;
+
+	RecordSize = rec_plausible_size(Buffer + Position, Length - Position);
+	if (!RecordSize)
+		return false;
+
+	Next = Position + RecordSize;
+	if (Next + 6 > Length)
+		return !Eof || Next == Length;
+
+	return rec_plausible_size(Buffer + Next, Length - Next) != 0;
+}
+
+/* Returns the next position whose third byte is a record type or -1 */
+static ptrdiff_t next_candidate(const uint8_t *Buffer, size_t Position,
+                                size_t Limit)
+{
+#ifdef RESYNC_SSE2
+	__m128i Types[RECORD_TYPE_COUNT];
+	__m128i v, m;
+	unsigned Mask;
+	size_t i;
+
+	for (i = 0; i < RECORD_TYPE_COUNT; i++)
+		Types[i] = _mm_set1_epi8((char)RecordTypes[i]);
+
+	for (; Position + 16 <= Limit; Position += 16) {
+		v = _mm_loadu_si128((const __m128i *)(Buffer + Position + 2));
+		m = _mm_cmpeq_epi8(v, Types[0]);
+		for (i = 1; i < RECORD_TYPE_COUNT; i++)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, Types[i]));
+		Mask = _mm_movemask_epi8(m);
+		if (Mask) {
+#ifdef _MSC_VER
+			unsigned long Index;
+			_BitScanForward(&Index, Mask);
+			return Position + Index;
+#else
+			return Position + __builtin_ctz(Mask);
+#endif
+		}
+	}
+#endif
+
+	for (; Position < Limit; Position++) {
+		if (is_record_type(Buffer[Position + 2]))
+			return Position;
+	}
+
+	return -1;
+}
+
+KCFERROR KCF_resync(KCF *kcf, uint64_t *SkippedBytes)
+{
+	uint8_t *Buffer;
+	size_t Carry = 0, Length, Limit, Position;
+	int64_t n_read, Start, Offset;
+	ptrdiff_t Found;
+	bool Eof = false;
+	KCFERROR Error = KCF_ERROR_EOF;
+
+	if (!kcf)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (!KCF_PSTATE_IS_READING(kcf->ParserState))
+		return KCF_ERROR_INVALID_STATE;
+
+	Start = IO_tell(kcf->Stream);
+	if (Start < 0)
+		return KCF_ERROR_NOT_IMPLEMENTED;
+
+	Buffer = malloc(RESYNC_BUFFER_SIZE);
+	if (!Buffer)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	/* Offset is the position of Buffer[0] in the stream */
+	Offset = Start;
+	while (!Eof) {
+		n_read = IO_read(kcf->Stream, Buffer + Carry,
+		                 RESYNC_BUFFER_SIZE - Carry);
+		if (n_read < 0) {
+			Error = KCF_ERROR_READ;
+			break;
+		}
+
+		Length = Carry + n_read;
+		Eof    = n_read == 0;
+
+		/* Keep a whole record header in the buffer after a
+		 * candidate unless the stream has ended */
+		if (Eof)
+			Limit = Length > 6 ? Length - 6 + 1 : 0;
+		else if (Length > RESYNC_LOOKAHEAD)
+			Limit = Length - RESYNC_LOOKAHEAD;
+		else
+			Limit = 0;
+
+		Position = 0;
+		while ((Found = next_candidate(Buffer, Position, Limit)) >= 0) {
+			if (check_candidate(Buffer, Length, Found, Eof)) {
+				Offset += Found;
+				Error = KCF_ERROR_OK;
+				goto found;
+			}
+			Position = Found + 1;
+		}
+
+		Carry = Length - Limit;
+		memmove(Buffer, Buffer + Limit, Carry);
+		Offset += Limit;
+	}
+
+	free(Buffer);
+	if (Error == KCF_ERROR_EOF && SkippedBytes)
+		*SkippedBytes = Offset + Carry - Start;
+	return Error;
+
+found:
+	free(Buffer);
+	if (IO_seek(kcf->Stream, Offset, IO_SEEK_SET) < 0)
+		return KCF_ERROR_READ;
+
+	trace_kcf_msg("Resync: skipped %" PRId64 " bytes", Offset - Start);
+	if (SkippedBytes)
+		*SkippedBytes = Offset - Start;
+
+	kcf->AvailableAddedData = 0;
+	kcf->ParserState        = KCF_PSTATE_READ_RECORD_HEADER;
+	return KCF_ERROR_OK;
+}
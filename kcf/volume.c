@@ -0,0 +1,268 @@
+#include <kcf/archive.h>
+#include <kcf/errors.h>
+
+#include <io/thread.h>
+
+#include "kcf_impl.h"
+
+/*
+ * Multi-volume archives: every volume starts with the marker and an
+ * archive header carrying the volume number, so each of them can be
+ * opened on its own. A file crossing the end of a volume is continued
+ * with a data fragment at the start of the next one.
+ */
+
+/* Smaller volumes would be mostly headers */
+#define MIN_VOLUME_SIZE 4096
+
+#define MAX_EXTRACT_THREADS 64
+
+KCFERROR KCF_set_volumes(KCF *kcf, uint64_t VolumeSize,
+                         KcfVolumeOpener Opener, void *Context)
+{
+	if (!kcf || !Opener)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (VolumeSize && VolumeSize < MIN_VOLUME_SIZE)
+		return KCF_ERROR_INVALID_PARAMETER;
+	if (kcf->ParserState != KCF_PSTATE_NEUTRAL)
+		return KCF_ERROR_INVALID_STATE;
+
+	kcf->VolumeSize    = VolumeSize;
+	kcf->VolumeOpener  = Opener;
+	kcf->VolumeContext = Context;
+	kcf->IsMultiVolume = VolumeSize > 0;
+	return KCF_ERROR_OK;
+}
+
+/* Replaces the current stream with the one of the next volume */
+static KCFERROR switch_volume(KCF *kcf, bool ForWriting)
+{
+	IO *Next;
+	KCFERROR Error = KCF_ERROR_OK;
+
+	if (!kcf->VolumeOpener)
+		return ForWriting ? KCF_ERROR_WRITE : KCF_ERROR_EOF;
+
+	Next = kcf->VolumeOpener(kcf->VolumeContext, kcf->VolumeNumber + 1,
+	                         ForWriting);
+	if (!Next)
+		return ForWriting ? KCF_ERROR_WRITE : KCF_ERROR_EOF;
+
+	/* The first volume belongs to the caller, wrappers and the other
+	 * volumes to us */
+	if (kcf->Stream != kcf->BaseStream) {
+		if (IO_close(kcf->Stream) < 0)
+			Error = ForWriting ? KCF_ERROR_WRITE : KCF_ERROR_READ;
+	} else if (ForWriting && IO_flush(kcf->Stream) < 0) {
+		Error = KCF_ERROR_WRITE;
+	}
+
+	kcf->Stream = Next;
+	kcf->VolumeNumber++;
+	return Error;
+}
+
+KCFERROR KCF_next_volume(KCF *kcf)
+{
+	KCFERROR Error;
+
+	Error = switch_volume(kcf, true);
+	if (Error)
+		return Error;
+
+	kcf->ParserState = KCF_PSTATE_WRITE_MARKER;
+	Error = KCF_write_marker(kcf);
+	if (Error)
+		return Error;
+
+	return KCF_write_archive_header(kcf, 0);
+}
+
+KCFERROR KCF_open_next_volume(KCF *kcf)
+{
+	struct KcfRecord Record = {0};
+	struct KcfArchiveHeader Header;
+	bool HasResynced = kcf->HasResynced;
+	KCFERROR Error;
+
+	if (!kcf->IsMultiVolume)
+		return KCF_ERROR_EOF;
+
+	Error = switch_volume(kcf, false);
+	if (Error)
+		return Error;
+
+	kcf->ParserState = KCF_PSTATE_READ_MARKER;
+	Error = KCF_find_marker(kcf);
+	if (Error)
+		return Error;
+
+	Error = KCF_read_record(kcf, &Record);
+	kcf->HasResynced = HasResynced;
+	if (!Error)
+		Error = rec_to_archive_header(&Record, &Header);
+	rec_clear(&Record);
+	if (Error)
+		return Error;
+
+	/* A volume of another archive or one out of order */
+	if (!(Header.ArchiveFlags & KCF_ARCHIVE_MULTIVOLUME) ||
+	    Header.VolumeNumber != kcf->VolumeNumber)
+		return trace_kcf_error(KCF_ERROR_INVALID_FORMAT);
+
+	kcf->ParserState = KCF_PSTATE_READ_RECORD_HEADER;
+	return KCF_ERROR_OK;
+}
+
+/* Parallel extraction, volumes are handed out to threads one by one */
+
+struct volume_job {
+	IO *FirstVolume;
+	KcfVolumeOpener VolumeOpener;
+	void *VolumeContext;
+	KcfOutputOpener OutputOpener;
+	void *OutputContext;
+	int Threads;
+
+	/* Protected by Lock */
+	IO_MUTEX Lock;
+	uint32_t NextVolume;
+	bool NoMoreVolumes;
+	KCFERROR Error;
+};
+
+/* Extracts the files whose headers are in volume Number */
+static KCFERROR extract_volume(struct volume_job *Job, uint32_t Number,
+                               IO *Stream)
+{
+	struct KcfFileInfo Info = {0};
+	KCF *kcf;
+	IO *Output;
+	KCFERROR Error;
+	int Threads;
+
+	Error = KCF_create(Stream, &kcf);
+	if (Error)
+		return Error;
+
+	kcf->VolumeOpener    = Job->VolumeOpener;
+	kcf->VolumeContext   = Job->VolumeContext;
+	kcf->StopAtVolumeEnd = true;
+
+	Error = KCF_open_archive(kcf);
+	if (!Error && Number > 0 &&
+	    (!kcf->IsMultiVolume || kcf->VolumeNumber != Number))
+		Error = KCF_ERROR_INVALID_FORMAT;
+
+	/* One volume leaves the other threads to its frames */
+	Threads = kcf->IsMultiVolume ? 1 : Job->Threads;
+
+	/* A file which went on into the next volume was the last one */
+	while (!Error && kcf->VolumeNumber == Number) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error == KCF_ERROR_EOF) {
+			Error = KCF_ERROR_OK;
+			break;
+		}
+		if (Error)
+			break;
+
+		Output = Job->OutputOpener(Job->OutputContext, &Info);
+		if (!Output) {
+			Error = KCF_skip_file(kcf);
+		} else {
+			Error = KCF_extract_parallel(kcf, Output, Threads);
+			if (IO_close(Output) < 0 && !Error)
+				Error = KCF_ERROR_WRITE;
+		}
+		file_info_clear(&Info);
+	}
+
+	KCF_close(kcf);
+	return Error;
+}
+
+static void *volume_worker(void *Arg)
+{
+	struct volume_job *Job = Arg;
+	uint32_t Number;
+	IO *Stream;
+	KCFERROR Error;
+
+	for (;;) {
+		IO_mutex_lock(&Job->Lock);
+		if (Job->NoMoreVolumes || Job->Error) {
+			IO_mutex_unlock(&Job->Lock);
+			break;
+		}
+		Number = Job->NextVolume++;
+		IO_mutex_unlock(&Job->Lock);
+
+		if (Number == 0)
+			Stream = Job->FirstVolume;
+		else
+			Stream = Job->VolumeOpener(Job->VolumeContext, Number,
+			                           false);
+		if (!Stream) {
+			IO_mutex_lock(&Job->Lock);
+			Job->NoMoreVolumes = true;
+			IO_mutex_unlock(&Job->Lock);
+			break;
+		}
+
+		Error = extract_volume(Job, Number, Stream);
+		if (Number > 0)
+			IO_close(Stream);
+
+		if (Error) {
+			IO_mutex_lock(&Job->Lock);
+			if (!Job->Error)
+				Job->Error = Error;
+			IO_mutex_unlock(&Job->Lock);
+		}
+	}
+
+	return NULL;
+}
+
+KCFERROR KCF_extract_volumes_parallel(IO *FirstVolume,
+                                      KcfVolumeOpener VolumeOpener,
+                                      void *VolumeContext,
+                                      KcfOutputOpener OutputOpener,
+                                      void *OutputContext, int Threads)
+{
+	struct volume_job Job = {0};
+	IO_THREAD Workers[MAX_EXTRACT_THREADS];
+	int i, Started = 0;
+
+	if (!FirstVolume || !VolumeOpener || !OutputOpener)
+		return KCF_ERROR_INVALID_PARAMETER;
+
+	if (Threads < 1)
+		Threads = 1;
+	if (Threads > MAX_EXTRACT_THREADS)
+		Threads = MAX_EXTRACT_THREADS;
+
+	Job.FirstVolume   = FirstVolume;
+	Job.VolumeOpener  = VolumeOpener;
+	Job.VolumeContext = VolumeContext;
+	Job.OutputOpener  = OutputOpener;
+	Job.OutputContext = OutputContext;
+	Job.Threads       = Threads;
+	if (IO_mutex_init(&Job.Lock) < 0)
+		return KCF_ERROR_OUT_OF_MEMORY;
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < Threads; i++) {
+		if (IO_thread_create(&Workers[Started], volume_worker, &Job) < 0)
+			break;
+		Started++;
+	}
+	volume_worker(&Job);
+
+	for (i = 0; i < Started; i++)
+		IO_thread_join(&Workers[i], NULL);
+
+	IO_mutex_destroy(&Job.Lock);
+	return Job.Error;
+}
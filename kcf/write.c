@@ -6,9 +6,51 @@
 #include "crc32c.h"
 #include "kcf_impl.h"
 
+/* Bytes left in the current volume */
+static uint64_t volume_room(KCF *kcf)
+{
+	int64_t Position;
+
+	if (!kcf->VolumeSize)
+		return UINT64_MAX;
+
+	Position = IO_tell(kcf->Stream);
+	if (Position < 0)
+		return UINT64_MAX;
+	if ((uint64_t)Position >= kcf->VolumeSize)
+		return 0;
+
+	return kcf->VolumeSize - Position;
+}
+
+/*
+ * A record goes to the next volume if its header and at least one byte
+ * of its data don't fit. Records too large for any volume are written
+ * right after the volume header anyway.
+ */
+static bool volume_is_full(KCF *kcf, struct KcfRecord *Record)
+{
+	uint64_t Needed = Record->HeadSize;
+	int64_t Position;
+
+	if (!kcf->VolumeSize)
+		return false;
+
+	Position = IO_tell(kcf->Stream);
+	if (Position < 0 || (uint64_t)Position <= kcf->VolumeStart)
+		return false;
+
+	if (rec_has_added_size(Record))
+		Needed++;
+
+	return Needed > volume_room(kcf);
+}
+
 KCFERROR KCF_write_record(KCF *kcf, struct KcfRecord *Record)
 {
 	uint8_t *buffer;
+	int64_t ret;
+	KCFERROR Error;
 
 	trace_kcf_msg("WriteRecord begin");
 	trace_kcf_record(Record);
@@ -26,13 +68,22 @@ KCFERROR KCF_write_record(KCF *kcf, struct KcfRecord *Record)
 
 	/* Ensure that record CRC32 is valid */
 	rec_fix(Record);
+
+	if (volume_is_full(kcf, Record)) {
+		Error = KCF_next_volume(kcf);
+		if (Error)
+			return trace_kcf_error(Error);
+	}
+
 	buffer = malloc(Record->HeadSize);
 	if (!buffer)
 		return trace_kcf_error(KCF_ERROR_OUT_OF_MEMORY);
 
 	kcf->RecordOffset = IO_tell(kcf->Stream);
 	rec_to_buffer(Record, buffer, Record->HeadSize);
-	if (IO_write(kcf->Stream, buffer, Record->HeadSize) < 0)
+	ret = IO_write(kcf->Stream, buffer, Record->HeadSize);
+	free(buffer);
+	if (ret < 0)
 		return KCF_ERROR_WRITE;
 
 	/* Save all information for backpatching */
@@ -55,6 +106,8 @@ KCFERROR KCF_write_record_with_added_data(KCF *kcf, struct KcfRecord *Record,
                                           uint8_t *AddedData, size_t Size)
 {
 	uint8_t *buffer;
+	int64_t ret;
+	KCFERROR Error;
 
 	trace_kcf_msg("WriteRecordWithAddedData begin");
 	trace_kcf_state(kcf);
@@ -88,13 +141,25 @@ KCFERROR KCF_write_record_with_added_data(KCF *kcf, struct KcfRecord *Record,
 		Record->AddedDataCRC32 = 0;
 	}
 
+	/* The data may have to be split between volumes */
+	if (kcf->VolumeSize) {
+		Error = KCF_write_record(kcf, Record);
+		if (!Error && Size)
+			Error = KCF_write_added_data(kcf, AddedData, Size);
+		if (!Error && kcf->ParserState == KCF_PSTATE_WRITE_ADDED_DATA)
+			Error = KCF_finish_added_data(kcf);
+		return Error;
+	}
+
 	rec_fix(Record);
 	buffer = malloc(Record->HeadSize);
 	if (!buffer)
 		return trace_kcf_error(KCF_ERROR_OUT_OF_MEMORY);
 
 	rec_to_buffer(Record, buffer, Record->HeadSize);
-	if (IO_write(kcf->Stream, buffer, Record->HeadSize) < 0)
+	ret = IO_write(kcf->Stream, buffer, Record->HeadSize);
+	free(buffer);
+	if (ret < 0)
 		return KCF_ERROR_WRITE;
 	if (IO_write(kcf->Stream, AddedData, Size) < 0)
 		return KCF_ERROR_WRITE;
@@ -105,8 +170,81 @@ KCFERROR KCF_write_record_with_added_data(KCF *kcf, struct KcfRecord *Record,
 	return KCF_ERROR_OK;
 }
 
+/* Rewrites the header of the record being written with its final size */
+static KCFERROR patch_record(KCF *kcf)
+{
+	uint8_t *buffer;
+	int64_t ret;
+
+	kcf->RecordEndOffset = IO_tell(kcf->Stream);
+	if (IO_seek(kcf->Stream, kcf->RecordOffset, IO_SEEK_SET) < 0)
+		return trace_kcf_error(KCF_ERROR_WRITE);
+
+	kcf->LastRecord.AddedSize      = kcf->WrittenAddedData;
+	kcf->LastRecord.AddedDataCRC32 = kcf->AddedDataCRC32;
+	rec_fix(&kcf->LastRecord);
+	buffer = malloc(kcf->LastRecord.HeadSize);
+	if (!buffer)
+		return trace_kcf_error(KCF_ERROR_OUT_OF_MEMORY);
+	rec_to_buffer(&kcf->LastRecord, buffer, kcf->LastRecord.HeadSize);
+
+	ret = IO_write(kcf->Stream, buffer, kcf->LastRecord.HeadSize);
+	free(buffer);
+	if (ret < 0)
+		return KCF_ERROR_WRITE;
+	if (IO_seek(kcf->Stream, kcf->RecordEndOffset, IO_SEEK_SET) < 0)
+		return trace_kcf_error(KCF_ERROR_WRITE);
+
+	return KCF_ERROR_OK;
+}
+
+static void reset_added_data(KCF *kcf)
+{
+	rec_clear(&kcf->LastRecord);
+	kcf->RecordOffset         = 0;
+	kcf->RecordEndOffset      = 0;
+	kcf->WrittenAddedData     = 0;
+	kcf->AddedDataToBeWritten = 0;
+	kcf->AddedDataCRC32       = 0;
+	kcf->HasAddedDataCRC32    = false;
+	kcf->HasAddedSize         = false;
+	kcf->ParserState          = KCF_PSTATE_WRITE_RECORD;
+}
+
+/*
+ * Ends the record at the end of the volume with continuation flag and
+ * goes on with a data fragment in the next volume.
+ */
+static KCFERROR split_record(KCF *kcf)
+{
+	struct KcfRecord Fragment = {0};
+	KCFERROR Error;
+
+	Fragment.HeadType  = KCF_DATA_FRAGMENT;
+	Fragment.HeadFlags = kcf->LastRecord.HeadFlags &
+	                     (KCF_HAS_ADDED_SIZE_8 | KCF_HAS_ADDED_DATA_CRC32);
+	if (kcf->AddedDataToBeWritten > 0)
+		Fragment.AddedSize =
+		    kcf->AddedDataToBeWritten - kcf->WrittenAddedData;
+
+	kcf->LastRecord.HeadFlags |= KCF_HAS_CONTINUATION;
+	Error = patch_record(kcf);
+	if (Error)
+		return Error;
+	reset_added_data(kcf);
+
+	Error = KCF_next_volume(kcf);
+	if (Error)
+		return Error;
+
+	return KCF_write_record(kcf, &Fragment);
+}
+
 KCFERROR KCF_write_added_data(KCF *kcf, uint8_t *AddedData, size_t Size)
 {
+	uint64_t Chunk, Room;
+	KCFERROR Error;
+
 	trace_kcf_msg("WriteAddedData begin");
 	trace_kcf_state(kcf);
 
@@ -126,13 +264,27 @@ KCFERROR KCF_write_added_data(KCF *kcf, uint8_t *AddedData, size_t Size)
 			return KCF_ERROR_OK;
 	}
 
-	if (IO_write(kcf->Stream, AddedData, Size) < 0)
-		return KCF_ERROR_WRITE;
+	while (Size > 0) {
+		Room = volume_room(kcf);
+		if (Room == 0) {
+			Error = split_record(kcf);
+			if (Error)
+				return Error;
+			continue;
+		}
+
+		Chunk = Size < Room ? Size : Room;
+		if (IO_write(kcf->Stream, AddedData, Chunk) < 0)
+			return KCF_ERROR_WRITE;
+
+		kcf->WrittenAddedData += Chunk;
+		if (kcf->HasAddedDataCRC32)
+			kcf->AddedDataCRC32 =
+			    crc32c(kcf->AddedDataCRC32, AddedData, Chunk);
 
-	kcf->WrittenAddedData += Size;
-	if (kcf->HasAddedDataCRC32)
-		kcf->AddedDataCRC32 =
-		    crc32c(kcf->AddedDataCRC32, AddedData, Size);
+		AddedData += Chunk;
+		Size -= Chunk;
+	}
 
 	trace_kcf_state(kcf);
 	trace_kcf_msg("WriteAddedData end");
@@ -142,7 +294,7 @@ KCFERROR KCF_write_added_data(KCF *kcf, uint8_t *AddedData, size_t Size)
 
 KCFERROR KCF_finish_added_data(KCF *kcf)
 {
-	uint8_t *buffer;
+	KCFERROR Error;
 
 	trace_kcf_msg("FinishAddedData begin");
 	trace_kcf_state(kcf);
@@ -154,36 +306,13 @@ KCFERROR KCF_finish_added_data(KCF *kcf)
 
 	/* If data size is known and no CRC32 of added data is calculated, don't
 	 * backpatch */
-	if (kcf->AddedDataToBeWritten > 0 && !kcf->HasAddedDataCRC32) {
-		goto cleanup;
+	if (kcf->AddedDataToBeWritten == 0 || kcf->HasAddedDataCRC32) {
+		Error = patch_record(kcf);
+		if (Error)
+			return Error;
 	}
 
-	kcf->RecordEndOffset = IO_tell(kcf->Stream);
-	if (IO_seek(kcf->Stream, kcf->RecordOffset, IO_SEEK_SET) < 0)
-		return trace_kcf_error(KCF_ERROR_WRITE);
-
-	kcf->LastRecord.AddedSize      = kcf->WrittenAddedData;
-	kcf->LastRecord.AddedDataCRC32 = kcf->AddedDataCRC32;
-	rec_fix(&kcf->LastRecord);
-	buffer = malloc(kcf->LastRecord.HeadSize);
-	if (!buffer)
-		return trace_kcf_error(KCF_ERROR_OUT_OF_MEMORY);
-	rec_to_buffer(&kcf->LastRecord, buffer, kcf->LastRecord.HeadSize);
-
-	if (IO_write(kcf->Stream, buffer, kcf->LastRecord.HeadSize) < 0)
-		return KCF_ERROR_WRITE;
-	IO_seek(kcf->Stream, kcf->RecordEndOffset, IO_SEEK_SET);
-
-cleanup:
-	rec_clear(&kcf->LastRecord);
-	kcf->RecordOffset         = 0;
-	kcf->RecordEndOffset      = 0;
-	kcf->WrittenAddedData     = 0;
-	kcf->AddedDataToBeWritten = 0;
-	kcf->AddedDataCRC32       = 0;
-	kcf->HasAddedDataCRC32    = false;
-	kcf->HasAddedSize         = false;
-	kcf->ParserState          = KCF_PSTATE_WRITE_RECORD;
+	reset_added_data(kcf);
 
 	trace_kcf_state(kcf);
 	trace_kcf_msg("FinishAddedData end");
@@ -195,13 +324,25 @@ KCFERROR KCF_write_archive_header(KCF *kcf, int Reserved)
 {
 	KCFERROR Error;
 	struct KcfArchiveHeader ahdr;
-	struct KcfRecord Record;
+	struct KcfRecord Record = {0};
 
 	(void)Reserved;
+	ahdr_clear(&ahdr);
 	ahdr.ArchiveVersion = 1;
-	rec_from_archive_header(&ahdr, &Record);
+	if (kcf->VolumeSize) {
+		ahdr.ArchiveFlags |= KCF_ARCHIVE_MULTIVOLUME;
+		ahdr.VolumeNumber = kcf->VolumeNumber;
+	}
+
+	Error = rec_from_archive_header(&ahdr, &Record);
+	if (Error)
+		return Error;
 
 	Error = KCF_write_record(kcf, &Record);
 	rec_clear(&Record);
-	return Error;
+	if (Error)
+		return Error;
+
+	kcf->VolumeStart = IO_tell(kcf->Stream);
+	return KCF_ERROR_OK;
 }
@@ -58,4 +58,10 @@ KCFERROR KCF_finish_added_data(KCF *kcf);
 
 KCFERROR KCF_write_archive_header(KCF *kcf, int Reserved);
 
+/**
+ * \brief Closes the current volume and starts the next one with its
+ * marker and archive header.
+ */
+KCFERROR KCF_next_volume(KCF *kcf);
+
 #endif
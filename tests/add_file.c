@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "add_file.h"
+
+KCFERROR add_entry(KCF *kcf, const char *Name, const uint8_t *Data,
+                   size_t Size)
+{
+	struct KcfBatchEntry Entry;
+
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = (char *)Name;
+	Entry.Data          = Data;
+	Entry.Size          = Size;
+	return KCF_add_files_batch(kcf, &Entry, 1);
+}
+
+KCFERROR add_streamed(KCF *kcf, const char *Name, const uint8_t *Data,
+                      size_t Size, bool Finish)
+{
+	struct KcfFileInfo Info = {0};
+	FILE *Input;
+	IO *InputStream;
+	KCFERROR Error;
+
+	Input = tmpfile();
+	if (!Input)
+		return KCF_ERROR_WRITE;
+	if (fwrite(Data, 1, Size, Input) != Size) {
+		fclose(Input);
+		return KCF_ERROR_WRITE;
+	}
+	rewind(Input);
+
+	InputStream = IO_create_fp(Input, 1);
+	if (!InputStream) {
+		fclose(Input);
+		return KCF_ERROR_OUT_OF_MEMORY;
+	}
+
+	Info.FileType = KCF_FILE_REGULAR;
+	Info.FileName = (char *)Name;
+
+	Error = KCF_begin_file(kcf, &Info);
+	if (!Error)
+		Error = KCF_insert_file_data(kcf, InputStream);
+	if (!Error && Finish)
+		Error = KCF_end_file(kcf);
+	IO_close(InputStream);
+	return Error;
+}
@@ -0,0 +1,21 @@
+#ifndef ADD_FILE_H_
+#define ADD_FILE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kcf/archive.h>
+
+/* Adds Size bytes of Data as the regular file Name in one batch */
+KCFERROR add_entry(KCF *kcf, const char *Name, const uint8_t *Data,
+                   size_t Size);
+
+/*
+ * Adds Size bytes of Data as the regular file Name, streamed from a
+ * temporary file. The file is left unfinished if Finish is false.
+ */
+KCFERROR add_streamed(KCF *kcf, const char *Name, const uint8_t *Data,
+                      size_t Size, bool Finish);
+
+#endif
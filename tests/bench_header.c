@@ -0,0 +1,65 @@
+/*
+ * Microbenchmark of the record header decoder. Decodes a buffer of
+ * back-to-back headers of all layouts over and over and prints the
+ * time per header.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../kcf/record.h"
+
+#define HEADERS 4096
+#define ROUNDS  2000
+
+static const uint8_t Flags[] = {
+	0x00,
+	KCF_HAS_ADDED_SIZE_4,
+	KCF_HAS_ADDED_SIZE_4 | KCF_HAS_ADDED_DATA_CRC32,
+	KCF_HAS_ADDED_SIZE_8 | KCF_HAS_ADDED_DATA_CRC32,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	static uint8_t Buffer[HEADERS * KCF_MAX_HEADER_SIZE];
+	struct KcfRecord Record = {0};
+	size_t Offset, Size;
+	uint64_t Sum = 0;
+	double Start, Elapsed;
+	int i, j;
+
+	srand(1);
+	for (i = 0, Offset = 0; i < HEADERS; i++) {
+		Size = rec_header_size(Flags[i % 4]);
+		for (j = 0; j < (int)Size; j++)
+			Buffer[Offset + j] = rand();
+		Buffer[Offset + 2] = KCF_DATA_FRAGMENT;
+		Buffer[Offset + 3] = Flags[i % 4];
+		Offset += Size;
+	}
+
+	Start = now();
+	for (j = 0; j < ROUNDS; j++) {
+		for (i = 0, Offset = 0; i < HEADERS; i++) {
+			rec_decode_header(Buffer + Offset, &Record);
+			Sum += Record.AddedSize ^ Record.AddedDataCRC32;
+			Offset += rec_header_size(Record.HeadFlags);
+		}
+	}
+	Elapsed = now() - Start;
+
+	printf("%d headers: %.2f ns/header (checksum %llx)\n",
+	       HEADERS * ROUNDS, Elapsed * 1e9 / ((double)HEADERS * ROUNDS),
+	       (unsigned long long)Sum);
+
+	return 0;
+}
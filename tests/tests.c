@@ -4,10 +4,10 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "../archive.h"
-#include "../record.h"
+#include <kcf/archive.h>
 
-extern HKCF hKCF;
+extern KCF *ReadArchive;
+extern IO *ReadStream;
 
 bool test1(void);
 bool test2(void);
@@ -21,10 +21,42 @@ bool test9(void);
 bool test10(void);
 bool test11(void);
 bool test12(void);
+bool test13(void);
+bool test14(void);
+bool test15(void);
+bool test16(void);
+bool test17(void);
+bool test18(void);
+bool test19(void);
+bool test20(void);
+bool test21(void);
+bool test22(void);
+bool test23(void);
+bool test24(void);
+bool test25(void);
+bool test26(void);
+bool test27(void);
+bool test28(void);
+bool test29(void);
+bool test30(void);
+bool test31(void);
+bool test32(void);
+bool test33(void);
+bool test34(void);
+bool test35(void);
+bool test36(void);
+bool test37(void);
+bool test38(void);
+bool test39(void);
+bool test40(void);
+bool test41(void);
+bool test42(void);
+bool test43(void);
+bool test44(void);
 
 int main(void)
 {
-	plan_tests(12);
+	plan_tests(44);
 	ok(test1(), "file with valid marker");
 	ok(test2(), "file without valid marker");
 	ok(test3(), "read archive header record");
@@ -37,9 +69,43 @@ int main(void)
 	ok(test10(), "record to archive header (invalid by size)");
 	ok(test11(), "validate CRC of archive header");
 	ok(test12(), "record to file header (valid)");
+	ok(test13(), "marker crossing scan chunk boundary");
+	ok(test14(), "long file without marker");
+	ok(test15(), "scan for all archive markers");
+	ok(test16(), "resync after damaged records");
+	ok(test17(), "resync reaches end of damaged archive");
+	ok(test18(), "add files in one batch");
+	ok(test19(), "add files one by one");
+	ok(test20(), "solid blocks");
+	ok(test21(), "multi-volume archive");
+	ok(test22(), "parallel extraction of volumes");
+	ok(test23(), "repair from recovery record");
+	ok(test24(), "verify files by block checksums");
+	ok(test25(), "read ranges of stored files");
+	ok(test26(), "compressed frames");
+	ok(test27(), "parallel compression of frames");
+	ok(test28(), "parallel decompression of frames");
+	ok(test29(), "deduplication of identical files");
+	ok(test30(), "links to files added before");
+	ok(test31(), "files appended to existing archive");
+	ok(test32(), "deleted files and compaction");
+	ok(test33(), "update of changed files");
+	ok(test34(), "direct IO against buffered file");
+	ok(test35(), "skip of damaged and truncated records");
+	ok(test36(), "prefetch reads against plain reader");
+	ok(test37(), "asynchronous writing of archive");
+	ok(test38(), "delayed write error reported on close");
+	ok(test39(), "skipped places reported in recovery mode");
+	ok(test40(), "walk of directory tree in order of names");
+	ok(test41(), "walk of directory tree as files are found");
+	ok(test42(), "errors counted by walk_finish");
+	ok(test43(), "compressed solid blocks");
+	ok(test44(), "inputs given more than once");
 
-	if (hKCF)
-		CloseArchive(hKCF);
+	if (ReadArchive) {
+		KCF_close(ReadArchive);
+		IO_close(ReadStream);
+	}
 
 	return exit_status();
 }
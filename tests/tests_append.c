@@ -0,0 +1,228 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+#include "add_file.h"
+
+bool test31(void);
+
+#define FILE_SIZE 20000
+
+/* Larger than the tail looked through for the last record */
+#define BIG_SIZE 1500000
+
+struct expected_file {
+	const char *Name;
+	int Offset;
+	size_t Size;
+};
+
+static KCF *append(IO *Stream)
+{
+	KCF *kcf;
+	KCFERROR Error;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_append_archive(kcf);
+	if (Error) {
+		diag("Failed to open archive for appending: Error #%d", Error);
+		KCF_close(kcf);
+		return NULL;
+	}
+
+	return kcf;
+}
+
+/* New file with the first Size bytes of File */
+static FILE *copy_prefix(FILE *File, long Size)
+{
+	FILE *Copy;
+	char *Buffer;
+
+	Buffer = malloc(Size);
+	Copy   = tmpfile();
+
+	fflush(File);
+	fseek(File, 0, SEEK_SET);
+	if (fread(Buffer, 1, Size, File) != (size_t)Size ||
+	    fwrite(Buffer, 1, Size, Copy) != (size_t)Size) {
+		fclose(Copy);
+		Copy = NULL;
+	}
+
+	free(Buffer);
+	return Copy;
+}
+
+static bool check_archive(IO *Stream, const uint8_t *Data,
+                          const struct expected_file *Files, int Count)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t *Extracted;
+	FILE *File;
+	IO *Output;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	Extracted = malloc(BIG_SIZE + 1);
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+
+	for (i = 0; !Error && i < Count; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+		if (strcmp(Info.FileName, Files[i].Name) != 0) {
+			diag("%s: found %s", Files[i].Name, Info.FileName);
+			Error = KCF_ERROR_INVALID_DATA;
+		}
+		file_info_clear(&Info);
+		if (Error)
+			break;
+
+		File   = tmpfile();
+		Output = IO_create_fp(File, 0);
+		Error  = KCF_extract(kcf, Output);
+		IO_close(Output);
+
+		rewind(File);
+		if (!Error &&
+		    (fread(Extracted, 1, BIG_SIZE + 1, File) != Files[i].Size ||
+		     memcmp(Extracted, Data + Files[i].Offset, Files[i].Size)))
+			Error = KCF_ERROR_INVALID_DATA;
+		fclose(File);
+	}
+
+	if (!Error && KCF_get_current_file_info(kcf, &Info) != KCF_ERROR_EOF) {
+		diag("Extra file after %s", Files[Count - 1].Name);
+		Error = KCF_ERROR_INVALID_DATA;
+	}
+
+	if (Error)
+		diag("%s: Error #%d", i < Count ? Files[i].Name : "end", Error);
+
+	KCF_close(kcf);
+	free(Extracted);
+	return !Error;
+}
+
+bool test31(void)
+{
+	static const struct expected_file Files[] = {
+	    {"one", 0, FILE_SIZE},   {"two", 1, FILE_SIZE},
+	    {"big", 2, BIG_SIZE},    {"three", 3, FILE_SIZE},
+	    {"four", 4, FILE_SIZE},  {"five", 5, FILE_SIZE},
+	};
+	static const struct expected_file Repaired[] = {
+	    {"one", 0, FILE_SIZE},   {"two", 1, FILE_SIZE},
+	    {"big", 2, BIG_SIZE},    {"three", 3, FILE_SIZE},
+	    {"six", 6, FILE_SIZE},
+	};
+	uint8_t *Data;
+	FILE *File, *Cut = NULL, *Unfinished = NULL;
+	IO *Stream, *CutStream;
+	KCF *kcf;
+	KCFERROR Error;
+	long Size;
+	bool result = false;
+	int i;
+
+	Data = malloc(BIG_SIZE + 8);
+	for (i = 0; i < BIG_SIZE + 8; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 11);
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = add_entry(kcf, "one", Data, FILE_SIZE);
+	KCF_close(kcf);
+	if (Error) {
+		diag("Failed to write archive: Error #%d", Error);
+		goto cleanup;
+	}
+
+	/* The last record ends at the end of the stream */
+	if (!(kcf = append(Stream)))
+		goto cleanup;
+	Error = add_entry(kcf, "two", Data + 1, FILE_SIZE);
+	if (!Error)
+		Error = add_streamed(kcf, "big", Data + 2, BIG_SIZE, true);
+	KCF_close(kcf);
+
+	/* The last record is too large, headers are gone through */
+	if (!Error && !(kcf = append(Stream)))
+		goto cleanup;
+	if (!Error) {
+		Error = add_entry(kcf, "three", Data + 3, FILE_SIZE);
+		KCF_close(kcf);
+	}
+	if (!Error && !(kcf = append(Stream)))
+		goto cleanup;
+	if (!Error) {
+		Error = add_entry(kcf, "four", Data + 4, FILE_SIZE);
+		KCF_close(kcf);
+	}
+	if (Error) {
+		diag("Failed to append: Error #%d", Error);
+		goto cleanup;
+	}
+
+	/* Archive cut in the middle of the last file */
+	IO_flush(Stream);
+	Size = IO_seek(Stream, 0, IO_SEEK_END);
+	Cut  = copy_prefix(File, Size - 5000);
+
+	/* Header of the last file written, but not patched yet */
+	if (!(kcf = append(Stream)))
+		goto cleanup;
+	Error = add_streamed(kcf, "unfinished", Data + 5, FILE_SIZE, false);
+	IO_flush(Stream);
+	if (!Error)
+		Unfinished = copy_prefix(File, (long)IO_tell(Stream));
+	if (!Error)
+		Error = KCF_end_file(kcf);
+	KCF_close(kcf);
+	if (Error || !Cut || !Unfinished) {
+		diag("Failed to copy archive: Error #%d", Error);
+		goto cleanup;
+	}
+
+	/* Replaces the unfinished file of the original */
+	IO_close(Stream);
+	Stream = IO_create_fp(Unfinished, 0);
+	if (!(kcf = append(Stream)))
+		goto cleanup;
+	Error = add_entry(kcf, "five", Data + 5, FILE_SIZE);
+	KCF_close(kcf);
+	if (Error || !check_archive(Stream, Data, Files, 6))
+		goto cleanup;
+
+	CutStream = IO_create_fp(Cut, 0);
+	if ((kcf = append(CutStream))) {
+		Error = add_entry(kcf, "six", Data + 6, FILE_SIZE);
+		KCF_close(kcf);
+		result = !Error && check_archive(CutStream, Data, Repaired, 5);
+	}
+	IO_close(CutStream);
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	if (Cut)
+		fclose(Cut);
+	if (Unfinished)
+		fclose(Unfinished);
+	free(Data);
+	return result;
+}
@@ -0,0 +1,194 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+bool test24(void);
+
+#define BLOCK_SIZE 4096
+#define BIG_SIZE   300000
+#define BATCH_SIZE 10000
+
+/* Every thread reads its own copy of the archive in memory */
+struct archive_copy {
+	char *Data;
+	size_t Size;
+};
+
+static IO *open_copy(void *Context, uint32_t Number, bool ForWriting)
+{
+	struct archive_copy *Copy = Context;
+	FILE *File;
+
+	if (ForWriting || Number != 0)
+		return NULL;
+
+	File = fmemopen(Copy->Data, Copy->Size, "rb");
+	if (!File)
+		return NULL;
+
+	return IO_create_fp(File, 1);
+}
+
+static bool write_archive(FILE *File, const uint8_t *Data)
+{
+	struct KcfFileInfo Info = {0};
+	struct KcfBatchEntry Entries[2];
+	FILE *Input;
+	IO *Stream, *InputStream;
+	KCF *kcf;
+	KCFERROR Error;
+
+	Input = tmpfile();
+	fwrite(Data, 1, BIG_SIZE, Input);
+	rewind(Input);
+	InputStream = IO_create_fp(Input, 1);
+
+	Info.FileType        = KCF_FILE_REGULAR;
+	Info.FileName        = "big";
+	Info.HasUnpackedSize = true;
+	Info.UnpackedSize    = BIG_SIZE;
+
+	/* One file with a table, one without */
+	memset(Entries, 0, sizeof(Entries));
+	Entries[0].Info.FileType = KCF_FILE_REGULAR;
+	Entries[0].Info.FileName = "batched";
+	Entries[0].Data          = Data;
+	Entries[0].Size          = BATCH_SIZE;
+	Entries[1].Info.FileType = KCF_FILE_REGULAR;
+	Entries[1].Info.FileName = "small";
+	Entries[1].Data          = Data;
+	Entries[1].Size          = 1000;
+
+	Stream = IO_create_fp(File, 0);
+	KCF_create(Stream, &kcf);
+	Error = KCF_set_block_checksums(kcf, BLOCK_SIZE);
+	if (!Error)
+		Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_begin_file(kcf, &Info);
+	if (!Error)
+		Error = KCF_insert_file_data(kcf, InputStream);
+	if (!Error)
+		Error = KCF_end_file(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, Entries, 2);
+	KCF_close(kcf);
+	IO_close(Stream);
+	IO_close(InputStream);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+/* Verifies all files, Expected has the result for each of them */
+static bool verify_all(struct archive_copy *Copy, const KCFERROR *Expected)
+{
+	struct KcfFileInfo Info = {0};
+	KCF *kcf;
+	IO *Stream;
+	KCFERROR Error;
+	bool result = true;
+	int i;
+
+	Stream = open_copy(Copy, 0, false);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; i < 3 && !Error; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+
+		Error = KCF_verify_file(kcf, 4, open_copy, Copy);
+		if (Error != Expected[i]) {
+			diag("%s: Error #%d, expected #%d", Info.FileName, Error,
+			     Expected[i]);
+			result = false;
+		}
+		file_info_clear(&Info);
+		if (Error == KCF_ERROR_INVALID_DATA)
+			Error = KCF_ERROR_OK;
+	}
+	if (!Error && KCF_get_current_file_info(kcf, &Info) != KCF_ERROR_EOF) {
+		diag("Archive has more files than expected");
+		result = false;
+	}
+	KCF_close(kcf);
+	IO_close(Stream);
+
+	if (Error) {
+		diag("Failed to read archive: Error #%d", Error);
+		result = false;
+	}
+	return result;
+}
+
+/* Plain readers have to step over the tables */
+static int count_files(struct archive_copy *Copy)
+{
+	struct KcfFileInfo Info = {0};
+	KCF *kcf;
+	IO *Stream;
+	int Count = 0;
+
+	Stream = open_copy(Copy, 0, false);
+	KCF_create(Stream, &kcf);
+	if (KCF_open_archive(kcf) == KCF_ERROR_OK) {
+		while (KCF_get_current_file_info(kcf, &Info) == KCF_ERROR_OK) {
+			file_info_clear(&Info);
+			if (KCF_skip_file(kcf))
+				break;
+			Count++;
+		}
+	}
+	KCF_close(kcf);
+	IO_close(Stream);
+	return Count;
+}
+
+bool test24(void)
+{
+	const KCFERROR Good[]    = {KCF_ERROR_OK, KCF_ERROR_OK, KCF_ERROR_OK};
+	const KCFERROR Damaged[] = {KCF_ERROR_INVALID_DATA, KCF_ERROR_OK,
+	                            KCF_ERROR_OK};
+	struct archive_copy Copy = {0};
+	uint8_t *Data;
+	FILE *File;
+	bool result = false;
+	int i;
+
+	Data = malloc(BIG_SIZE);
+	for (i = 0; i < BIG_SIZE; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 11);
+
+	File = tmpfile();
+	if (!write_archive(File, Data))
+		goto cleanup;
+
+	fseek(File, 0, SEEK_END);
+	Copy.Size = ftell(File);
+	Copy.Data = malloc(Copy.Size);
+	rewind(File);
+	fread(Copy.Data, 1, Copy.Size, File);
+
+	if (count_files(&Copy) != 3) {
+		diag("Wrong number of files");
+		goto cleanup;
+	}
+	if (!verify_all(&Copy, Good))
+		goto cleanup;
+
+	/* Somewhere in the middle of the big file */
+	Copy.Data[BIG_SIZE / 2] ^= 0x10;
+	result = verify_all(&Copy, Damaged);
+
+cleanup:
+	fclose(File);
+	free(Copy.Data);
+	free(Data);
+	return result;
+}
@@ -0,0 +1,296 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+#include "add_file.h"
+
+bool test29(void);
+bool test30(void);
+
+#define FILE_SIZE 20000
+
+/*
+ * "one", "copy" and "streamed" have the same data, "other" the same size,
+ * "packed" and "repacked" are compressed.
+ */
+static bool write_archive(IO *Stream, const uint8_t *Data)
+{
+	KCF *kcf;
+	KCFERROR Error;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_deduplication(kcf, true);
+	if (!Error)
+		Error = add_entry(kcf, "one", Data, FILE_SIZE);
+	if (!Error)
+		Error = add_entry(kcf, "other", Data + 1, FILE_SIZE);
+	if (!Error)
+		Error = add_entry(kcf, "copy", Data, FILE_SIZE);
+	if (!Error)
+		Error = add_streamed(kcf, "streamed", Data, FILE_SIZE, true);
+	if (!Error)
+		Error = KCF_set_compression(kcf, KCF_METHOD_DEFLATE, -1, 0);
+	if (!Error)
+		Error = add_streamed(kcf, "packed", Data + 2, FILE_SIZE, true);
+	if (!Error)
+		Error = add_entry(kcf, "repacked", Data + 2, FILE_SIZE);
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+static const char *Names[] = {"one", "other", "copy", "streamed",
+                              "packed", "repacked"};
+static const int Offsets[] = {0, 1, 0, 0, 2, 2};
+static const bool Links[]  = {false, false, true, true, false, true};
+
+static bool check_file(KCF *kcf, int i, const uint8_t *Data)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t Extracted[FILE_SIZE + 1];
+	FILE *File;
+	IO *Output;
+	KCFERROR Error;
+	bool IsLink;
+
+	Error = KCF_get_current_file_info(kcf, &Info);
+	if (Error) {
+		diag("%s: Error #%d", Names[i], Error);
+		return false;
+	}
+	IsLink = !!(Info.CompressionInfo & KCF_COMPRESSION_LINK);
+	if (strcmp(Info.FileName, Names[i]) != 0 || IsLink != Links[i]) {
+		diag("%s: found %s, link %d", Names[i], Info.FileName, IsLink);
+		file_info_clear(&Info);
+		return false;
+	}
+	file_info_clear(&Info);
+
+	File   = tmpfile();
+	Output = IO_create_fp(File, 0);
+	Error  = KCF_extract(kcf, Output);
+	IO_close(Output);
+
+	rewind(File);
+	if (!Error && (fread(Extracted, 1, sizeof(Extracted), File) !=
+	                   FILE_SIZE ||
+	               memcmp(Extracted, Data + Offsets[i], FILE_SIZE) != 0))
+		Error = KCF_ERROR_INVALID_DATA;
+	fclose(File);
+
+	if (Error)
+		diag("%s: Error #%d", Names[i], Error);
+	return !Error;
+}
+
+bool test29(void)
+{
+	uint8_t *Data, Buffer[100];
+	uint64_t Header, Size;
+	FILE *File;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	long ArchiveSize;
+	bool result = false;
+	int i;
+
+	Data = malloc(FILE_SIZE + 2);
+	for (i = 0; i < FILE_SIZE + 2; i++)
+		Data[i] = (uint8_t)('a' + ((i * 2654435761u) >> 27) % 8);
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+	if (!write_archive(Stream, Data))
+		goto cleanup;
+
+	/* Three files stored, one of them compressed */
+	fseek(File, 0, SEEK_END);
+	ArchiveSize = ftell(File);
+	if (ArchiveSize >= 3 * FILE_SIZE) {
+		diag("Archive of %ld bytes has copies", ArchiveSize);
+		goto cleanup;
+	}
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (Error) {
+		diag("Failed to open archive: Error #%d", Error);
+		goto close;
+	}
+
+	for (i = 0; i < 6; i++)
+		if (!check_file(kcf, i, Data))
+			goto close;
+	if (KCF_skip_file(kcf) != KCF_ERROR_EOF) {
+		diag("Archive has more files than expected");
+		goto close;
+	}
+
+	/* Ranges of a link come from the file it points at */
+	Error = KCF_find_member(kcf, "repacked", &Header, &Size);
+	if (!Error)
+		Error = KCF_read_member_range(kcf, Header, 5000, Buffer,
+		                              sizeof(Buffer));
+	if (Error || Size != FILE_SIZE ||
+	    memcmp(Buffer, Data + 2 + 5000, sizeof(Buffer)) != 0) {
+		diag("repacked: Error #%d", Error);
+		goto close;
+	}
+
+	/* Verifying follows links too */
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_close(kcf);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; !Error && i < 6; i++)
+		Error = KCF_verify_file(kcf, 1, NULL, NULL);
+	if (Error) {
+		diag("Verifying file %d: Error #%d", i, Error);
+		goto close;
+	}
+
+	result = true;
+
+close:
+	KCF_close(kcf);
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	free(Data);
+	return result;
+}
+
+/* Writes "first" and its hard links "second" and "third", then "other" */
+static bool write_links(IO *Stream, const uint8_t *Data, uint64_t *First)
+{
+	struct KcfFileInfo Info = {0};
+	uint64_t Second, Unused;
+	KCF *kcf;
+	KCFERROR Error;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_deduplication(kcf, true);
+	if (!Error)
+		Error = add_streamed(kcf, "first", Data, FILE_SIZE, true);
+	if (!Error)
+		Error = KCF_get_file_offset(kcf, First);
+
+	/* A link to a link points at the data too */
+	Info.FileType = KCF_FILE_HARD_LINK;
+	Info.FileName = "second";
+	if (!Error)
+		Error = KCF_add_link(kcf, &Info, *First);
+	if (!Error)
+		Error = KCF_get_file_offset(kcf, &Second);
+	Info.FileName = "third";
+	if (!Error)
+		Error = KCF_add_link(kcf, &Info, Second);
+	if (!Error)
+		Error = add_entry(kcf, "other", Data + 1, FILE_SIZE);
+
+	if (!Error && KCF_add_link(kcf, &Info, *First + 1) !=
+	                  KCF_ERROR_FILE_NOT_FOUND) {
+		diag("Link to nowhere added");
+		Error = KCF_ERROR_UNKNOWN;
+	}
+	if (!Error && KCF_get_file_offset(kcf, &Unused))
+		Error = KCF_ERROR_UNKNOWN;
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+bool test30(void)
+{
+	static const char *LinkNames[] = {"first", "second", "third", "other"};
+	struct KcfFileInfo Info = {0};
+	uint8_t *Data, Extracted[FILE_SIZE + 1];
+	uint64_t First, Offset, Target;
+	FILE *File, *Output;
+	IO *Stream, *OutputStream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = false;
+	int i;
+
+	Data = malloc(FILE_SIZE + 1);
+	for (i = 0; i < FILE_SIZE + 1; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 13);
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+	if (!write_links(Stream, Data, &First))
+		goto cleanup;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+
+	for (i = 0; !Error && i < 4; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+		if (strcmp(Info.FileName, LinkNames[i]) != 0 ||
+		    (Info.FileType == KCF_FILE_HARD_LINK) != (i == 1 || i == 2)) {
+			diag("%s: found %s of type %c", LinkNames[i],
+			     Info.FileName, Info.FileType);
+			Error = KCF_ERROR_INVALID_DATA;
+		}
+		file_info_clear(&Info);
+
+		if (!Error && i == 0)
+			Error = KCF_get_file_offset(kcf, &Offset);
+		if (!Error && i == 0 && Offset != First)
+			Error = KCF_ERROR_INVALID_DATA;
+
+		if (!Error && i > 0 && i < 3) {
+			Error = KCF_get_link_target(kcf, &Target);
+			if (!Error && Target != First) {
+				diag("%s links to %d", LinkNames[i], (int)Target);
+				Error = KCF_ERROR_INVALID_DATA;
+			}
+		}
+		if (Error)
+			break;
+
+		/* Data of the links comes from the first file */
+		Output       = tmpfile();
+		OutputStream = IO_create_fp(Output, 0);
+		Error        = KCF_extract(kcf, OutputStream);
+		IO_close(OutputStream);
+		rewind(Output);
+		if (!Error && (fread(Extracted, 1, sizeof(Extracted), Output) !=
+		                   FILE_SIZE ||
+		               memcmp(Extracted, Data + (i == 3), FILE_SIZE)))
+			Error = KCF_ERROR_INVALID_DATA;
+		fclose(Output);
+	}
+
+	if (Error)
+		diag("File %d: Error #%d", i, Error);
+	else
+		result = KCF_skip_file(kcf) == KCF_ERROR_EOF;
+
+	KCF_close(kcf);
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	free(Data);
+	return result;
+}
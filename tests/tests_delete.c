@@ -0,0 +1,171 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+bool test32(void);
+
+#define FILE_SIZE 20000
+
+static const char *Names[] = {"one", "copy", "other", "last"};
+static const int Offsets[] = {0, 0, 1, 2};
+
+static bool write_archive(IO *Stream, const uint8_t *Data)
+{
+	struct KcfBatchEntry Entry;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_deduplication(kcf, true);
+
+	/* "copy" is a link to "one" */
+	for (i = 0; !Error && i < 4; i++) {
+		memset(&Entry, 0, sizeof(Entry));
+		Entry.Info.FileType = KCF_FILE_REGULAR;
+		Entry.Info.FileName = (char *)Names[i];
+		Entry.Data          = Data + Offsets[i];
+		Entry.Size          = FILE_SIZE;
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	}
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+/* Only "copy" and "last" are left */
+static bool check_archive(IO *Stream, const uint8_t *Data)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t Extracted[FILE_SIZE + 1];
+	FILE *File;
+	IO *Output;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+
+	for (i = 1; !Error && i < 4; i += 2) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (!Error && strcmp(Info.FileName, Names[i]) != 0) {
+			diag("%s: found %s", Names[i], Info.FileName);
+			Error = KCF_ERROR_INVALID_DATA;
+		}
+		file_info_clear(&Info);
+		if (Error)
+			break;
+
+		File   = tmpfile();
+		Output = IO_create_fp(File, 0);
+		Error  = KCF_extract(kcf, Output);
+		IO_close(Output);
+
+		rewind(File);
+		if (!Error && (fread(Extracted, 1, sizeof(Extracted), File) !=
+		                   FILE_SIZE ||
+		               memcmp(Extracted, Data + Offsets[i], FILE_SIZE)))
+			Error = KCF_ERROR_INVALID_DATA;
+		fclose(File);
+	}
+
+	if (!Error && KCF_get_current_file_info(kcf, &Info) != KCF_ERROR_EOF) {
+		diag("Deleted file found");
+		Error = KCF_ERROR_INVALID_DATA;
+	}
+	if (Error)
+		diag("%s: Error #%d", Names[i < 4 ? i : 3], Error);
+
+	KCF_close(kcf);
+	return !Error;
+}
+
+bool test32(void)
+{
+	struct KcfCompactInfo Info;
+	uint8_t *Data;
+	uint64_t One, Other, Unused;
+	FILE *File, *Compacted;
+	IO *Stream, *CompactedStream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = false;
+	int i;
+
+	Data = malloc(FILE_SIZE + 8);
+	for (i = 0; i < FILE_SIZE + 8; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 13);
+
+	File            = tmpfile();
+	Stream          = IO_create_fp(File, 0);
+	Compacted       = tmpfile();
+	CompactedStream = IO_create_fp(Compacted, 0);
+	if (!write_archive(Stream, Data))
+		goto cleanup;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = KCF_find_member(kcf, "one", &One, NULL);
+	if (!Error)
+		Error = KCF_find_member(kcf, "other", &Other, NULL);
+	if (!Error)
+		Error = KCF_delete_member(kcf, One);
+	if (!Error)
+		Error = KCF_delete_member(kcf, Other);
+	if (Error) {
+		diag("Failed to delete files: Error #%d", Error);
+		KCF_close(kcf);
+		goto cleanup;
+	}
+
+	if (KCF_delete_member(kcf, One) != KCF_ERROR_INVALID_PARAMETER ||
+	    KCF_find_member(kcf, "other", &Unused, NULL) !=
+	        KCF_ERROR_FILE_NOT_FOUND) {
+		diag("Deleted file found");
+		KCF_close(kcf);
+		goto cleanup;
+	}
+	KCF_close(kcf);
+
+	/* The link still gets the data of the deleted file */
+	if (!check_archive(Stream, Data))
+		goto cleanup;
+
+	Error = KCF_compact(Stream, CompactedStream, &Info);
+	if (Error) {
+		diag("Failed to compact: Error #%d", Error);
+		goto cleanup;
+	}
+	if (Info.Files != 2 || Info.DeletedFiles != 1 ||
+	    Info.RemovedBytes <= FILE_SIZE ||
+	    IO_seek(CompactedStream, 0, IO_SEEK_END) +
+	            (int64_t)Info.RemovedBytes !=
+	        IO_seek(Stream, 0, IO_SEEK_END)) {
+		diag("Compacted: %d files, %d deleted, %d bytes removed",
+		     (int)Info.Files, (int)Info.DeletedFiles,
+		     (int)Info.RemovedBytes);
+		goto cleanup;
+	}
+
+	result = check_archive(CompactedStream, Data);
+
+cleanup:
+	IO_close(CompactedStream);
+	IO_close(Stream);
+	fclose(Compacted);
+	fclose(File);
+	free(Data);
+	return result;
+}
@@ -0,0 +1,687 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+bool test26(void);
+bool test27(void);
+bool test28(void);
+bool test43(void);
+
+#define FRAME_SIZE 65536
+#define BIG_SIZE   300000
+#define SMALL_SIZE 1000
+
+static bool write_archive(IO *Stream, const uint8_t *Data)
+{
+	struct KcfFileInfo Info = {0};
+	struct KcfBatchEntry Entry;
+	FILE *Input;
+	IO *InputStream;
+	KCF *kcf;
+	KCFERROR Error;
+
+	Input = tmpfile();
+	fwrite(Data, 1, BIG_SIZE, Input);
+	rewind(Input);
+	InputStream = IO_create_fp(Input, 1);
+
+	Info.FileType        = KCF_FILE_REGULAR;
+	Info.FileName        = "big";
+	Info.HasUnpackedSize = true;
+	Info.UnpackedSize    = BIG_SIZE;
+
+	/* One frame only, so no frame table */
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = "small";
+	Entry.Data          = Data + 7;
+	Entry.Size          = SMALL_SIZE;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_compression(kcf, KCF_METHOD_DEFLATE, 6,
+		                            FRAME_SIZE);
+	if (!Error)
+		Error = KCF_begin_file(kcf, &Info);
+	if (!Error)
+		Error = KCF_insert_file_data(kcf, InputStream);
+	if (!Error)
+		Error = KCF_end_file(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	KCF_close(kcf);
+	IO_close(InputStream);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+/* Extracts the next file and compares it with Data */
+static KCFERROR extract_next(KCF *kcf, const uint8_t *Data, size_t Size)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t *Extracted;
+	FILE *File;
+	IO *Output;
+	KCFERROR Error;
+
+	Error = KCF_get_current_file_info(kcf, &Info);
+	if (Error)
+		return Error;
+	if (!(Info.CompressionInfo & KCF_COMPRESSION_METHOD_MASK))
+		diag("%s is not compressed", Info.FileName);
+	file_info_clear(&Info);
+
+	File   = tmpfile();
+	Output = IO_create_fp(File, 0);
+	Error  = KCF_extract(kcf, Output);
+	IO_close(Output);
+
+	Extracted = malloc(Size + 1);
+	rewind(File);
+	if (!Error && (fread(Extracted, 1, Size + 1, File) != Size ||
+	               memcmp(Extracted, Data, Size) != 0)) {
+		diag("Wrong contents extracted");
+		Error = KCF_ERROR_INVALID_DATA;
+	}
+	free(Extracted);
+	fclose(File);
+	return Error;
+}
+
+static bool check_range(KCF *kcf, uint64_t Header, const uint8_t *Data,
+                        uint64_t Offset, size_t Size)
+{
+	static uint8_t Buffer[BIG_SIZE];
+	KCFERROR Error;
+
+	Error = KCF_read_member_range(kcf, Header, Offset, Buffer, Size);
+	if (Error) {
+		diag("Range %d+%d: Error #%d", (int)Offset, (int)Size, Error);
+		return false;
+	}
+	if (memcmp(Buffer, Data + Offset, Size) != 0) {
+		diag("Range %d+%d: wrong contents", (int)Offset, (int)Size);
+		return false;
+	}
+
+	return true;
+}
+
+static bool check_archive(IO *Stream, const uint8_t *Data)
+{
+	uint64_t Big, Small, Size;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = false;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = extract_next(kcf, Data, BIG_SIZE);
+	if (Error) {
+		diag("big: Error #%d", Error);
+		goto close;
+	}
+
+	Error = KCF_find_member(kcf, "big", &Big, &Size);
+	if (Error || Size != BIG_SIZE) {
+		diag("big: Error #%d, size %d", Error, (int)Size);
+		goto close;
+	}
+	Error = KCF_find_member(kcf, "small", &Small, &Size);
+	if (Error || Size != SMALL_SIZE) {
+		diag("small: Error #%d, size %d", Error, (int)Size);
+		goto close;
+	}
+
+	if (!check_range(kcf, Big, Data, 70000, 1000) ||
+	    !check_range(kcf, Big, Data, FRAME_SIZE - 10, FRAME_SIZE + 20) ||
+	    !check_range(kcf, Big, Data, 2 * FRAME_SIZE, FRAME_SIZE) ||
+	    !check_range(kcf, Big, Data, BIG_SIZE - 3, 3) ||
+	    !check_range(kcf, Big, Data, 0, BIG_SIZE) ||
+	    !check_range(kcf, Small, Data + 7, 100, 200))
+		goto close;
+
+	/* Sequential reading goes on */
+	Error = KCF_verify_file(kcf, 1, NULL, NULL);
+	if (Error) {
+		diag("small: Error #%d", Error);
+		goto close;
+	}
+	result = KCF_skip_file(kcf) == KCF_ERROR_EOF;
+	if (!result)
+		diag("Archive has more files than expected");
+
+close:
+	KCF_close(kcf);
+	return result;
+}
+
+bool test26(void)
+{
+	uint8_t *Data, Byte;
+	FILE *File;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	long Size;
+	bool result = false;
+	int i;
+
+	/* Compressible, but not too much */
+	Data = malloc(BIG_SIZE);
+	for (i = 0; i < BIG_SIZE; i++)
+		Data[i] = (uint8_t)('a' + ((i * 2654435761u) >> 27) % 8);
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+	if (!write_archive(Stream, Data))
+		goto cleanup;
+
+	fseek(File, 0, SEEK_END);
+	Size = ftell(File);
+	if (Size >= BIG_SIZE) {
+		diag("Archive of %ld bytes is not compressed", Size);
+		goto cleanup;
+	}
+
+	if (!check_archive(Stream, Data))
+		goto cleanup;
+
+	/* Damaged frame in the middle of the big file */
+	fseek(File, Size / 3, SEEK_SET);
+	Byte = (uint8_t)fgetc(File);
+	fseek(File, -1, SEEK_CUR);
+	fputc(Byte ^ 0x20, File);
+	fflush(File);
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = extract_next(kcf, Data, BIG_SIZE);
+	if (Error == KCF_ERROR_INVALID_DATA)
+		Error = extract_next(kcf, Data + 7, SMALL_SIZE);
+	else
+		diag("Damaged file extracted: Error #%d", Error);
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to extract after damaged file: Error #%d", Error);
+	result = Error == KCF_ERROR_OK;
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	free(Data);
+	return result;
+}
+
+/* Writes Data as one compressed file with the given number of threads */
+static bool write_threaded(FILE *File, const uint8_t *Data, int Threads)
+{
+	struct KcfBatchEntry Entry;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = "big";
+	Entry.Data          = Data;
+	Entry.Size          = BIG_SIZE;
+
+	Stream = IO_create_fp(File, 0);
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_compression(kcf, KCF_METHOD_DEFLATE, 6,
+		                            FRAME_SIZE);
+	if (!Error)
+		Error = KCF_set_compression_threads(kcf, Threads);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	KCF_close(kcf);
+	IO_close(Stream);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+bool test27(void)
+{
+	uint8_t *Data, *Serial, *Parallel;
+	FILE *SerialFile, *ParallelFile;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	long Size;
+	bool result = false;
+	int i;
+
+	Data = malloc(BIG_SIZE);
+	for (i = 0; i < BIG_SIZE; i++)
+		Data[i] = (uint8_t)('a' + ((i * 2654435761u) >> 27) % 8);
+
+	SerialFile   = tmpfile();
+	ParallelFile = tmpfile();
+	Serial       = malloc(BIG_SIZE);
+	Parallel     = malloc(BIG_SIZE);
+	if (!write_threaded(SerialFile, Data, 1) ||
+	    !write_threaded(ParallelFile, Data, 4))
+		goto cleanup;
+
+	/* Frames come out in the same order whoever compresses them */
+	fseek(SerialFile, 0, SEEK_END);
+	Size = ftell(SerialFile);
+	fseek(ParallelFile, 0, SEEK_END);
+	if (Size > BIG_SIZE || ftell(ParallelFile) != Size) {
+		diag("Archives of %ld and %ld bytes", Size, ftell(ParallelFile));
+		goto cleanup;
+	}
+	rewind(SerialFile);
+	rewind(ParallelFile);
+	fread(Serial, 1, Size, SerialFile);
+	fread(Parallel, 1, Size, ParallelFile);
+	if (memcmp(Serial, Parallel, Size) != 0) {
+		diag("Archives differ");
+		goto cleanup;
+	}
+
+	rewind(ParallelFile);
+	Stream = IO_create_fp(ParallelFile, 0);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = extract_next(kcf, Data, BIG_SIZE);
+	KCF_close(kcf);
+	IO_close(Stream);
+
+	if (Error)
+		diag("Failed to extract: Error #%d", Error);
+	result = !Error;
+
+cleanup:
+	fclose(SerialFile);
+	fclose(ParallelFile);
+	free(Serial);
+	free(Parallel);
+	free(Data);
+	return result;
+}
+
+/* Extracts the next file after a prefix of the output with 4 threads */
+static KCFERROR extract_parallel(KCF *kcf, const uint8_t *Data, size_t Size)
+{
+	uint8_t *Extracted;
+	FILE *File;
+	IO *Output;
+	KCFERROR Error;
+
+	File   = tmpfile();
+	Output = IO_create_fp(File, 0);
+	IO_write(Output, "prefix", 6);
+	Error = KCF_extract_parallel(kcf, Output, 4);
+	if (!Error && IO_tell(Output) != (int64_t)(6 + Size)) {
+		diag("Output left at %d", (int)IO_tell(Output));
+		Error = KCF_ERROR_WRITE;
+	}
+	IO_close(Output);
+
+	Extracted = malloc(Size + 7);
+	rewind(File);
+	if (!Error && (fread(Extracted, 1, Size + 7, File) != Size + 6 ||
+	               memcmp(Extracted, "prefix", 6) != 0 ||
+	               memcmp(Extracted + 6, Data, Size) != 0)) {
+		diag("Wrong contents extracted");
+		Error = KCF_ERROR_INVALID_DATA;
+	}
+	free(Extracted);
+	fclose(File);
+	return Error;
+}
+
+bool test28(void)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t *Data, Byte;
+	FILE *File;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	long Size;
+	bool result = false;
+	int i;
+
+	Data = malloc(BIG_SIZE);
+	for (i = 0; i < BIG_SIZE; i++)
+		Data[i] = (uint8_t)('a' + ((i * 2654435761u) >> 27) % 8);
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+	if (!write_archive(Stream, Data))
+		goto cleanup;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = KCF_get_current_file_info(kcf, &Info);
+	file_info_clear(&Info);
+	if (!Error)
+		Error = extract_parallel(kcf, Data, BIG_SIZE);
+	if (!Error)
+		Error = extract_parallel(kcf, Data + 7, SMALL_SIZE);
+	KCF_close(kcf);
+	if (Error) {
+		diag("Failed to extract: Error #%d", Error);
+		goto cleanup;
+	}
+
+	/* Damaged frame in the middle of the big file */
+	fseek(File, 0, SEEK_END);
+	Size = ftell(File);
+	fseek(File, Size / 2, SEEK_SET);
+	Byte = (uint8_t)fgetc(File);
+	fseek(File, -1, SEEK_CUR);
+	fputc(Byte ^ 0x20, File);
+	fflush(File);
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = KCF_get_current_file_info(kcf, &Info);
+	file_info_clear(&Info);
+	if (!Error)
+		Error = KCF_verify_file(kcf, 4, NULL, NULL);
+	if (Error == KCF_ERROR_INVALID_DATA)
+		Error = extract_parallel(kcf, Data + 7, SMALL_SIZE);
+	else
+		diag("Damaged file verified: Error #%d", Error);
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to extract after damaged file: Error #%d", Error);
+	result = Error == KCF_ERROR_OK;
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	free(Data);
+	return result;
+}
+
+/* Files of the solid block: Data + Offset, "big" is streamed */
+#define SOLID_FILES 5
+#define SOLID_SIZE  20000
+
+static const struct {
+	const char *Name;
+	size_t Offset;
+	size_t Size;
+} SolidFiles[SOLID_FILES] = {
+    {"a", 0, SOLID_SIZE},
+    {"b", 3, SOLID_SIZE},
+    {"big", 0, BIG_SIZE},
+    {"c", BIG_SIZE - SOLID_SIZE + 5, SOLID_SIZE},
+    {"d", 9, SOLID_SIZE},
+};
+
+static bool write_solid(FILE *File, const uint8_t *Data, uint64_t BlockSize)
+{
+	struct KcfBatchEntry Entry;
+	struct KcfFileInfo Info = {0};
+	FILE *Input;
+	IO *Stream, *InputStream;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	Input = tmpfile();
+	fwrite(Data, 1, BIG_SIZE, Input);
+	rewind(Input);
+	InputStream = IO_create_fp(Input, 1);
+
+	Stream = IO_create_fp(File, 0);
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_compression(kcf, KCF_METHOD_DEFLATE, 6,
+		                            FRAME_SIZE);
+	if (!Error)
+		Error = KCF_set_solid_block_size(kcf, BlockSize);
+
+	for (i = 0; !Error && i < SOLID_FILES; i++) {
+		if (SolidFiles[i].Size == BIG_SIZE) {
+			Info.FileType = KCF_FILE_REGULAR;
+			Info.FileName = (char *)SolidFiles[i].Name;
+			Error         = KCF_begin_file(kcf, &Info);
+			if (!Error)
+				Error = KCF_insert_file_data(kcf, InputStream);
+			if (!Error)
+				Error = KCF_end_file(kcf);
+			continue;
+		}
+
+		memset(&Entry, 0, sizeof(Entry));
+		Entry.Info.FileType = KCF_FILE_REGULAR;
+		Entry.Info.FileName = (char *)SolidFiles[i].Name;
+		Entry.Data          = Data + SolidFiles[i].Offset;
+		Entry.Size          = SolidFiles[i].Size;
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	}
+	KCF_close(kcf);
+	IO_close(Stream);
+	IO_close(InputStream);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+/* Extracts the files not in Skipped in order, with Threads threads */
+static bool check_solid(IO *Stream, const uint8_t *Data, unsigned Skipped,
+                        int Threads)
+{
+	const uint8_t *File;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; !Error && i < SOLID_FILES; i++) {
+		if (Skipped & (1u << i))
+			continue;
+		File = Data + SolidFiles[i].Offset;
+		if (Threads > 1)
+			Error = extract_parallel(kcf, File, SolidFiles[i].Size);
+		else
+			Error = extract_next(kcf, File, SolidFiles[i].Size);
+	}
+	if (!Error && KCF_skip_file(kcf) != KCF_ERROR_EOF)
+		Error = KCF_ERROR_INVALID_DATA;
+	KCF_close(kcf);
+
+	if (Error)
+		diag("%s, %d threads: Error #%d",
+		     i > 0 ? SolidFiles[i - 1].Name : "start", Threads, Error);
+	return !Error;
+}
+
+/* Flags of the files and ranges of "big", whose first frame is solid */
+static bool check_solid_access(IO *Stream, const uint8_t *Data)
+{
+	static uint8_t Buffer[1000];
+	struct KcfFileInfo Info = {0};
+	uint64_t Header;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = true, Solid;
+	int i;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; !Error && i < SOLID_FILES; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		Solid = !!(Info.CompressionInfo & KCF_COMPRESSION_SOLID);
+		if (!Error && Solid != (i > 0)) {
+			diag("%s has wrong solid flag", Info.FileName);
+			result = false;
+		}
+		file_info_clear(&Info);
+		if (!Error)
+			Error = KCF_skip_file(kcf);
+	}
+
+	if (!Error)
+		Error = KCF_find_member(kcf, "big", &Header, NULL);
+	if (!Error)
+		Error = KCF_read_member_range(kcf, Header, FRAME_SIZE + 10,
+		                              Buffer, sizeof(Buffer));
+	if (!Error && memcmp(Buffer, Data + FRAME_SIZE + 10, sizeof(Buffer))) {
+		diag("Range of big: wrong contents");
+		result = false;
+	}
+	if (!Error && KCF_read_member_range(kcf, Header, 10, Buffer,
+	                                    sizeof(Buffer)) !=
+	                  KCF_ERROR_NOT_IMPLEMENTED) {
+		diag("First frame of big read without the files before");
+		result = false;
+	}
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to read big: Error #%d", Error);
+	return result && !Error;
+}
+
+/* A file skipped leaves the next one of its block without its data */
+static bool check_solid_skip(IO *Stream, const uint8_t *Data)
+{
+	KCF *kcf;
+	KCFERROR Error;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = KCF_skip_file(kcf);
+	if (!Error)
+		Error = extract_next(kcf, Data + SolidFiles[1].Offset,
+		                     SolidFiles[1].Size);
+	KCF_close(kcf);
+
+	if (Error != KCF_ERROR_INVALID_DATA)
+		diag("b extracted after a skipped: Error #%d", Error);
+	return Error == KCF_ERROR_INVALID_DATA;
+}
+
+/* Deletes files "b" and "d" in place */
+static bool delete_solid(IO *Stream)
+{
+	static const char *Names[] = {"b", "d"};
+	uint64_t Header;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; !Error && i < 2; i++) {
+		Error = KCF_find_member(kcf, Names[i], &Header, NULL);
+		if (!Error)
+			Error = KCF_delete_member(kcf, Header);
+	}
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to delete: Error #%d", Error);
+	return !Error;
+}
+
+bool test43(void)
+{
+	static const char *Words[] = {"frame ", "solid ", "block ", "file ",
+	                              "data ",  "the ",   "of ",    "window "};
+	struct KcfCompactInfo Info;
+	uint8_t *Data;
+	FILE *PlainFile, *File, *Copy;
+	IO *Stream = NULL, *CopyStream = NULL;
+	unsigned Deleted = 1u << 1 | 1u << 4;
+	size_t Length;
+	long PlainSize, Size;
+	bool result = false;
+	int i;
+
+	/* Text of a few words repeats over the files, not within a frame */
+	Data = malloc(BIG_SIZE + 64);
+	for (Length = 0, i = 0; Length < BIG_SIZE; i++) {
+		strcpy((char *)Data + Length,
+		       Words[((unsigned)i * 2654435761u) >> 29]);
+		Length += strlen((char *)Data + Length);
+	}
+
+	PlainFile = tmpfile();
+	File      = tmpfile();
+	Copy      = tmpfile();
+	if (!write_solid(PlainFile, Data, 0) ||
+	    !write_solid(File, Data, 1048576))
+		goto cleanup;
+
+	fseek(PlainFile, 0, SEEK_END);
+	PlainSize = ftell(PlainFile);
+	fseek(File, 0, SEEK_END);
+	Size = ftell(File);
+	if (Size >= PlainSize) {
+		diag("Solid archive of %ld bytes, %ld without", Size,
+		     PlainSize);
+		goto cleanup;
+	}
+
+	Stream = IO_create_fp(File, 0);
+	if (!check_solid(Stream, Data, 0, 1) ||
+	    !check_solid(Stream, Data, 0, 4) ||
+	    !check_solid_access(Stream, Data) ||
+	    !check_solid_skip(Stream, Data))
+		goto cleanup;
+
+	/* "big" needs "b", only "d" goes away */
+	if (!delete_solid(Stream) || !check_solid(Stream, Data, Deleted, 1) ||
+	    !check_solid(Stream, Data, Deleted, 4))
+		goto cleanup;
+
+	CopyStream = IO_create_fp(Copy, 0);
+	if (KCF_compact(Stream, CopyStream, &Info) != KCF_ERROR_OK ||
+	    Info.Files != 3 || Info.DeletedFiles != 1) {
+		diag("Compacted: %d files, %d deleted", (int)Info.Files,
+		     (int)Info.DeletedFiles);
+		goto cleanup;
+	}
+
+	result = check_solid(CopyStream, Data, Deleted, 1);
+
+cleanup:
+	if (CopyStream)
+		IO_close(CopyStream);
+	if (Stream)
+		IO_close(Stream);
+	fclose(Copy);
+	fclose(File);
+	fclose(PlainFile);
+	free(Data);
+	return result;
+}
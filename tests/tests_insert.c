@@ -0,0 +1,250 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+bool test18(void);
+bool test19(void);
+bool test20(void);
+
+static const char *Names[] = {"a.txt", "empty", "b/c.bin"};
+static const char *Contents[] = {"Hello, world!\r\n", "", "\x01\x02\x03"};
+
+#define FILES 3
+
+static IO *make_archive(void)
+{
+	FILE *File;
+
+	File = tmpfile();
+	if (!File)
+		return NULL;
+
+	return IO_create_fp(File, 1);
+}
+
+/* Reads back all files and compares them with Names and Contents */
+static bool check_archive(IO *Stream)
+{
+	struct KcfFileInfo Info = {0};
+	KCF *kcf;
+	KCFERROR Error;
+	IO *Output;
+	FILE *File;
+	char Buffer[64];
+	size_t Length;
+	int i;
+	bool result = true;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	if (KCF_create(Stream, &kcf) != KCF_ERROR_OK)
+		return false;
+
+	Error = KCF_open_archive(kcf);
+	if (Error) {
+		diag("Failed to open archive: Error #%d", Error);
+		KCF_close(kcf);
+		return false;
+	}
+
+	for (i = 0; i < FILES && result; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error) {
+			diag("File %d: Error #%d", i, Error);
+			result = false;
+			break;
+		}
+		if (strcmp(Info.FileName, Names[i]) != 0) {
+			diag("File %d is %s, should be %s", i, Info.FileName,
+			     Names[i]);
+			result = false;
+		}
+
+		File   = tmpfile();
+		Output = IO_create_fp(File, 1);
+		Error  = KCF_extract(kcf, Output);
+		if (Error) {
+			diag("File %d: extract failed: Error #%d", i, Error);
+			result = false;
+		}
+
+		rewind(File);
+		Length = fread(Buffer, 1, sizeof(Buffer), File);
+		if (Length != strlen(Contents[i]) ||
+		    memcmp(Buffer, Contents[i], Length) != 0) {
+			diag("File %d: wrong contents", i);
+			result = false;
+		}
+
+		IO_close(Output);
+		file_info_clear(&Info);
+	}
+
+	if (result && KCF_get_current_file_info(kcf, &Info) != KCF_ERROR_EOF) {
+		diag("Archive has more files than expected");
+		file_info_clear(&Info);
+		result = false;
+	}
+
+	KCF_close(kcf);
+	return result;
+}
+
+bool test18(void)
+{
+	struct KcfBatchEntry Entries[FILES];
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result;
+	int i;
+
+	Stream = make_archive();
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	memset(Entries, 0, sizeof(Entries));
+	for (i = 0; i < FILES; i++) {
+		Entries[i].Info.FileType = KCF_FILE_REGULAR;
+		Entries[i].Info.FileName = (char *)Names[i];
+		Entries[i].Data          = (const uint8_t *)Contents[i];
+		Entries[i].Size          = strlen(Contents[i]);
+	}
+
+	/* An empty file needs no data */
+	Entries[1].Data = NULL;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, Entries, FILES);
+	KCF_close(kcf);
+
+	if (Error) {
+		diag("Failed to write batch: Error #%d", Error);
+		IO_close(Stream);
+		return false;
+	}
+
+	result = check_archive(Stream);
+	IO_close(Stream);
+	return result;
+}
+
+bool test19(void)
+{
+	struct KcfFileInfo Info = {0};
+	IO *Stream, *Input;
+	FILE *File;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result;
+	int i;
+
+	Stream = make_archive();
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	for (i = 0; i < FILES && !Error; i++) {
+		File = tmpfile();
+		fputs(Contents[i], File);
+		rewind(File);
+		Input = IO_create_fp(File, 1);
+
+		Info.FileType = KCF_FILE_REGULAR;
+		Info.FileName = (char *)Names[i];
+
+		Error = KCF_begin_file(kcf, &Info);
+		if (!Error)
+			Error = KCF_insert_file_data(kcf, Input);
+		if (!Error)
+			Error = KCF_end_file(kcf);
+		IO_close(Input);
+	}
+	KCF_close(kcf);
+
+	if (Error) {
+		diag("Failed to write files: Error #%d", Error);
+		IO_close(Stream);
+		return false;
+	}
+
+	result = check_archive(Stream);
+	IO_close(Stream);
+	return result;
+}
+
+bool test20(void)
+{
+	/* Block of 4 bytes: "a.txt" fills one, "empty" starts another */
+	static const bool Solid[FILES] = {false, false, true};
+	struct KcfBatchEntry Entries[FILES];
+	struct KcfFileInfo Info = {0};
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = true;
+	int i;
+
+	Stream = make_archive();
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	memset(Entries, 0, sizeof(Entries));
+	for (i = 0; i < FILES; i++) {
+		Entries[i].Info.FileType = KCF_FILE_REGULAR;
+		Entries[i].Info.FileName = (char *)Names[i];
+		Entries[i].Data          = (const uint8_t *)Contents[i];
+		Entries[i].Size          = strlen(Contents[i]);
+	}
+
+	KCF_create(Stream, &kcf);
+	KCF_set_solid_block_size(kcf, 4);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, Entries, FILES);
+	KCF_close(kcf);
+
+	if (Error) {
+		diag("Failed to write batch: Error #%d", Error);
+		IO_close(Stream);
+		return false;
+	}
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; i < FILES && !Error; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+		if (!!(Info.CompressionInfo & KCF_COMPRESSION_SOLID) !=
+		    Solid[i]) {
+			diag("File %d has wrong solid flag", i);
+			result = false;
+		}
+		file_info_clear(&Info);
+		Error = KCF_skip_file(kcf);
+	}
+	KCF_close(kcf);
+
+	if (Error) {
+		diag("Failed to read archive: Error #%d", Error);
+		result = false;
+	}
+
+	result = result && check_archive(Stream);
+	IO_close(Stream);
+	return result;
+}
@@ -0,0 +1,439 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <io/io.h>
+#include <kcf/archive.h>
+#include "../io/io_local.h"
+
+bool test34(void);
+bool test36(void);
+bool test37(void);
+bool test38(void);
+
+#define PATTERN_SIZE 3000000L
+
+enum io_op_type { OP_WRITE, OP_READ, OP_SEEK };
+
+struct io_op {
+	enum io_op_type Type;
+	int64_t Offset;
+	int Whence;
+	int64_t Size;
+};
+
+static uint8_t *make_pattern(void)
+{
+	uint8_t *Data = malloc(PATTERN_SIZE);
+	long i;
+
+	if (Data)
+		for (i = 0; i < PATTERN_SIZE; i++)
+			Data[i] = (uint8_t)((i * 2654435761u) >> 13);
+	return Data;
+}
+
+/* Does the same to both streams, results have to be the same */
+static bool run_ops(IO *Tested, IO *Reference, const struct io_op *Ops,
+                    int Count, const uint8_t *Pattern)
+{
+	static uint8_t Read[PATTERN_SIZE], Expected[PATTERN_SIZE];
+	int64_t Result, ReferenceResult;
+	int i;
+
+	for (i = 0; i < Count; i++) {
+		switch (Ops[i].Type) {
+		case OP_WRITE:
+			Result = IO_write(Tested, Pattern + i, Ops[i].Size);
+			ReferenceResult =
+			    IO_write(Reference, Pattern + i, Ops[i].Size);
+			break;
+		case OP_READ:
+			Result = IO_read(Tested, Read, Ops[i].Size);
+			ReferenceResult =
+			    IO_read(Reference, Expected, Ops[i].Size);
+			if (Result > 0 && Result == ReferenceResult &&
+			    memcmp(Read, Expected, Result) != 0) {
+				diag("Operation %d: read other data", i);
+				return false;
+			}
+			break;
+		case OP_SEEK:
+			Result = IO_seek(Tested, Ops[i].Offset, Ops[i].Whence);
+			ReferenceResult =
+			    IO_seek(Reference, Ops[i].Offset, Ops[i].Whence);
+			break;
+		default:
+			diag("Operation %d: unknown type %d", i,
+			     (int)Ops[i].Type);
+			return false;
+		}
+
+		if (Result != ReferenceResult) {
+			diag("Operation %d: %d, expected %d", i, (int)Result,
+			     (int)ReferenceResult);
+			return false;
+		}
+		if (IO_tell(Tested) != IO_tell(Reference)) {
+			diag("Operation %d: at %d, expected %d", i,
+			     (int)IO_tell(Tested), (int)IO_tell(Reference));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool same_files(FILE *File, FILE *Reference)
+{
+	uint8_t Buffer[65536], Expected[65536];
+	size_t Size;
+
+	rewind(File);
+	rewind(Reference);
+	do {
+		Size = fread(Expected, 1, sizeof(Expected), Reference);
+		if (fread(Buffer, 1, sizeof(Buffer), File) != Size ||
+		    memcmp(Buffer, Expected, Size) != 0)
+			return false;
+	} while (Size > 0);
+
+	return true;
+}
+
+/* Written with O_DIRECT, read and backpatched without it */
+bool test34(void)
+{
+	static const struct io_op Ops[] = {
+	    {OP_WRITE, 0, 0, 100},
+	    {OP_WRITE, 0, 0, 5000},
+	    /* Backpatched while still in the buffer */
+	    {OP_SEEK, 10, IO_SEEK_SET, 0},
+	    {OP_WRITE, 0, 0, 20},
+	    /* Over the end of the buffer */
+	    {OP_SEEK, 0, IO_SEEK_END, 0},
+	    {OP_WRITE, 0, 0, 2097152L + 123},
+	    /* Backpatched after the buffer has been written */
+	    {OP_SEEK, 50, IO_SEEK_SET, 0},
+	    {OP_WRITE, 0, 0, 30},
+	    {OP_SEEK, 3000, IO_SEEK_SET, 0},
+	    {OP_READ, 0, 0, 4000},
+	    {OP_SEEK, -10, IO_SEEK_END, 0},
+	    {OP_READ, 0, 0, 100},
+	    /* Unaligned start past the end */
+	    {OP_SEEK, 5000, IO_SEEK_CUR, 0},
+	    {OP_WRITE, 0, 0, 10000},
+	    {OP_WRITE, 0, 0, 7},
+	    {OP_SEEK, 0, IO_SEEK_END, 0},
+	    {OP_SEEK, 0, IO_SEEK_SET, 0},
+	    {OP_READ, 0, 0, PATTERN_SIZE - 100},
+	    {OP_WRITE, 0, 0, 4096},
+	};
+	FILE *File, *ReferenceFile;
+	IO *Stream = NULL, *Reference = NULL;
+	uint8_t *Pattern;
+	bool result = false;
+
+	Pattern       = make_pattern();
+	File          = tmpfile();
+	ReferenceFile = tmpfile();
+	if (!Pattern || !File || !ReferenceFile)
+		goto cleanup;
+
+	Stream    = IO_create_fd_direct(fileno(File), 0);
+	Reference = IO_create_fd(fileno(ReferenceFile), 0);
+	if (!Stream || !Reference) {
+		diag("Failed to create streams");
+		goto cleanup;
+	}
+
+	result = run_ops(Stream, Reference, Ops,
+	                 (int)(sizeof(Ops) / sizeof(Ops[0])), Pattern);
+
+	/* The unaligned tail is written on close */
+	if (IO_close(Stream) < 0 || IO_close(Reference) < 0) {
+		diag("Failed to close streams");
+		result = false;
+	}
+	Stream    = NULL;
+	Reference = NULL;
+
+	if (result && !same_files(File, ReferenceFile)) {
+		diag("Files differ");
+		result = false;
+	}
+
+cleanup:
+	if (Stream)
+		IO_close(Stream);
+	if (Reference)
+		IO_close(Reference);
+	if (File)
+		fclose(File);
+	if (ReferenceFile)
+		fclose(ReferenceFile);
+	free(Pattern);
+	return result;
+}
+
+static FILE *pattern_file(const uint8_t *Pattern)
+{
+	FILE *File = tmpfile();
+
+	if (File && fwrite(Pattern, 1, PATTERN_SIZE, File) != PATTERN_SIZE) {
+		fclose(File);
+		return NULL;
+	}
+	return File;
+}
+
+/* Ring of 4 blocks of 4096 bytes, seeks in it and out of it */
+bool test36(void)
+{
+	static const struct io_op Ops[] = {
+	    {OP_READ, 0, 0, 1000},
+	    {OP_READ, 0, 0, 10000},
+	    {OP_SEEK, 2000, IO_SEEK_CUR, 0},
+	    {OP_READ, 0, 0, 100},
+	    {OP_SEEK, 12000, IO_SEEK_SET, 0},
+	    {OP_READ, 0, 0, 5000},
+	    /* Backwards */
+	    {OP_SEEK, 100, IO_SEEK_SET, 0},
+	    {OP_READ, 0, 0, 4096},
+	    {OP_SEEK, 0, IO_SEEK_CUR, 0},
+	    {OP_SEEK, 1, IO_SEEK_CUR, 0},
+	    {OP_READ, 0, 0, 1},
+	    /* Far past the ring */
+	    {OP_SEEK, 1000000, IO_SEEK_CUR, 0},
+	    {OP_READ, 0, 0, 100000},
+	    {OP_READ, 0, 0, 3},
+	    {OP_SEEK, -50, IO_SEEK_END, 0},
+	    {OP_READ, 0, 0, 4096},
+	    {OP_READ, 0, 0, 4096},
+	    {OP_SEEK, 0, IO_SEEK_SET, 0},
+	    {OP_READ, 0, 0, PATTERN_SIZE},
+	    {OP_READ, 0, 0, 1},
+	};
+	FILE *File, *ReferenceFile;
+	IO *Stream = NULL, *Reference = NULL;
+	uint8_t *Pattern;
+	bool result = false;
+	int Round;
+
+	Pattern       = make_pattern();
+	File          = Pattern ? pattern_file(Pattern) : NULL;
+	ReferenceFile = Pattern ? pattern_file(Pattern) : NULL;
+	if (!File || !ReferenceFile)
+		goto cleanup;
+
+	/* Seeks find the ring more or less filled, whatever the timing */
+	for (Round = 0; Round < 20; Round++) {
+		rewind(File);
+		rewind(ReferenceFile);
+		Stream = IO_create_prefetch(IO_create_fp(File, 0), 4096, 4, 1);
+		Reference = IO_create_fp(ReferenceFile, 0);
+		if (!Stream || !Reference) {
+			diag("Failed to create streams");
+			goto cleanup;
+		}
+
+		result = run_ops(Stream, Reference, Ops,
+		                 (int)(sizeof(Ops) / sizeof(Ops[0])), Pattern);
+
+		IO_close(Stream);
+		IO_close(Reference);
+		Stream    = NULL;
+		Reference = NULL;
+		if (!result)
+			break;
+	}
+
+cleanup:
+	if (Stream)
+		IO_close(Stream);
+	if (Reference)
+		IO_close(Reference);
+	if (File)
+		fclose(File);
+	if (ReferenceFile)
+		fclose(ReferenceFile);
+	free(Pattern);
+	return result;
+}
+
+/* Archive with a streamed file, its header is backpatched */
+static KCFERROR write_archive(IO *Stream, const uint8_t *Pattern,
+                              bool Async)
+{
+	struct KcfFileInfo Info = {0};
+	struct KcfBatchEntry Entry;
+	FILE *Input;
+	IO *InputStream;
+	KCF *kcf;
+	KCFERROR Error, CloseError;
+
+	Input = tmpfile();
+	fwrite(Pattern, 1, PATTERN_SIZE / 2, Input);
+	rewind(Input);
+	InputStream = IO_create_fp(Input, 1);
+
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = "small";
+	Entry.Data          = Pattern + 7;
+	Entry.Size          = 1000;
+
+	Info.FileType = KCF_FILE_REGULAR;
+	Info.FileName = "streamed";
+
+	KCF_create(Stream, &kcf);
+	Error = Async ? KCF_enable_async_writing(kcf, 65536) : KCF_ERROR_OK;
+	if (!Error)
+		Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	if (!Error)
+		Error = KCF_set_compression(kcf, KCF_METHOD_DEFLATE, 1, 65536);
+	if (!Error)
+		Error = KCF_begin_file(kcf, &Info);
+	if (!Error)
+		Error = KCF_insert_file_data(kcf, InputStream);
+	if (!Error)
+		Error = KCF_end_file(kcf);
+
+	CloseError = KCF_close(kcf);
+	IO_close(InputStream);
+	return Error ? Error : CloseError;
+}
+
+/* Written on a thread of its own, the archive has to be the same */
+bool test37(void)
+{
+	FILE *File, *ReferenceFile;
+	IO *Stream, *Reference;
+	uint8_t *Pattern;
+	KCFERROR Error;
+	bool result = false;
+
+	Pattern       = make_pattern();
+	File          = tmpfile();
+	ReferenceFile = tmpfile();
+	Stream        = IO_create_fp(File, 0);
+	Reference     = IO_create_fp(ReferenceFile, 0);
+
+	Error = write_archive(Stream, Pattern, true);
+	if (!Error)
+		Error = write_archive(Reference, Pattern, false);
+	IO_close(Stream);
+	IO_close(Reference);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	else if (!same_files(File, ReferenceFile))
+		diag("Archives differ");
+	else
+		result = true;
+
+	fclose(File);
+	fclose(ReferenceFile);
+	free(Pattern);
+	return result;
+}
+
+/* Stream which takes Room bytes more and fails after that */
+struct full_disk {
+	int64_t Position;
+	int64_t Room;
+};
+
+static int64_t full_read(IO *io, void *buffer, int64_t size)
+{
+	(void)io;
+	(void)buffer;
+	(void)size;
+	return 0;
+}
+
+static int64_t full_write(IO *io, const void *buffer, int64_t size)
+{
+	struct full_disk *Disk = io->ptr;
+
+	(void)buffer;
+	if (size > Disk->Room)
+		return -1;
+
+	Disk->Room -= size;
+	Disk->Position += size;
+	return size;
+}
+
+static int64_t full_seek(IO *io, int64_t offset, int whence)
+{
+	struct full_disk *Disk = io->ptr;
+
+	if (whence != IO_SEEK_SET)
+		return -1;
+
+	Disk->Position = offset;
+	return offset;
+}
+
+static int64_t full_tell(IO *io)
+{
+	return ((struct full_disk *)io->ptr)->Position;
+}
+
+static int full_flush(IO *io)
+{
+	(void)io;
+	return 0;
+}
+
+static const IO_METHOD FullDisk = {
+	0, full_read, full_write, full_seek, full_tell, full_flush,
+	NULL, NULL, NULL,
+};
+
+/* Buffered writes fail when the thread gets to them, on close */
+bool test38(void)
+{
+	struct KcfBatchEntry Entry;
+	struct full_disk Disk = {0, 10};
+	uint8_t Data[1000] = {0};
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = true;
+
+	Stream      = IO_create(&FullDisk);
+	Stream->ptr = &Disk;
+
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = "lost";
+	Entry.Data          = Data;
+	Entry.Size          = sizeof(Data);
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_enable_async_writing(kcf, 65536);
+	if (!Error)
+		Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	if (Error) {
+		diag("Failed before close: Error #%d", Error);
+		result = false;
+	}
+
+	Error = KCF_close(kcf);
+	if (Error != KCF_ERROR_WRITE) {
+		diag("KCF_close: Error #%d, expected #%d", Error,
+		     KCF_ERROR_WRITE);
+		result = false;
+	}
+
+	IO_close(Stream);
+	return result;
+}
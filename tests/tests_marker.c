@@ -4,56 +4,58 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "../archive.h"
-#include "../record.h"
+#include <kcf/archive.h>
+#include "../kcf/read.h"
 
 bool test1(void);
 bool test2(void);
 
-bool test1(void)
+static KCFERROR find_marker(const char *FileName)
 {
-	HKCF hKCF;
+	IO *Stream;
+	KCF *kcf;
 	KCFERROR Error;
-	bool result = true;
 
-	Error = CreateArchive("test0001.kcf", KCF_MODE_READ, &hKCF);
-	if (Error) {
-		diag("Failed to open file test0001.kcf: Error #%d", Error);
-		return false;
+	Stream = IO_open_cfile(FileName, "rb");
+	if (!Stream) {
+		diag("Failed to open file %s", FileName);
+		return KCF_ERROR_READ;
 	}
 
-	Error = ScanArchiveForMarker(hKCF);
-	if (Error != KCF_ERROR_OK) {
-		diag("Failed to read archive marker in valid file");
-		result = false;
-		goto cleanup;
+	Error = KCF_create(Stream, &kcf);
+	if (!Error) {
+		KCF_start_reading(kcf);
+		Error = KCF_find_marker(kcf);
+		KCF_close(kcf);
 	}
 
-cleanup:
-	CloseArchive(hKCF);
-	return result;
+	IO_close(Stream);
+	return Error;
 }
 
-bool test2(void)
+bool test1(void)
 {
-	HKCF hKCF;
 	KCFERROR Error;
-	bool result = true;
 
-	Error = CreateArchive("test0002.kcf", KCF_MODE_READ, &hKCF);
-	if (Error) {
-		diag("Error #%d", Error);
+	Error = find_marker("test0001.kcf");
+	if (Error != KCF_ERROR_OK) {
+		diag("Failed to read archive marker in valid file: Error #%d",
+		     Error);
 		return false;
 	}
 
-	Error = ScanArchiveForMarker(hKCF);
+	return true;
+}
+
+bool test2(void)
+{
+	KCFERROR Error;
+
+	Error = find_marker("test0002.kcf");
 	if (Error != KCF_ERROR_INVALID_FORMAT) {
-		diag("ScanArchiveForMarker returns bad value");
-		result = false;
-		goto cleanup;
+		diag("KCF_find_marker returns bad value: Error #%d", Error);
+		return false;
 	}
 
-cleanup:
-	CloseArchive(hKCF);
-	return result;
+	return true;
 }
@@ -0,0 +1,176 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+bool test25(void);
+
+#define BLOCK_SIZE 4096
+#define BIG_SIZE   100000
+#define PLAIN_SIZE 20000
+
+static bool write_archive(IO *Stream, const uint8_t *Data)
+{
+	struct KcfBatchEntry Entry;
+	KCF *kcf;
+	KCFERROR Error;
+
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = "big";
+	Entry.Data          = Data;
+	Entry.Size          = BIG_SIZE;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_block_checksums(kcf, BLOCK_SIZE);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+
+	/* The second one has no table */
+	Entry.Info.FileName = "plain";
+	Entry.Data          = Data + 1;
+	Entry.Size          = PLAIN_SIZE;
+	if (!Error)
+		Error = KCF_set_block_checksums(kcf, 0);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+
+	/* Another "big", lookups find the first one */
+	Entry.Info.FileName = "big";
+	Entry.Data          = Data + 2;
+	Entry.Size          = 100;
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+static bool check_range(KCF *kcf, uint64_t Header, const uint8_t *Data,
+                        uint64_t Offset, size_t Size)
+{
+	static uint8_t Buffer[BIG_SIZE];
+	KCFERROR Error;
+
+	Error = KCF_read_member_range(kcf, Header, Offset, Buffer, Size);
+	if (Error) {
+		diag("Range %d+%d: Error #%d", (int)Offset, (int)Size, Error);
+		return false;
+	}
+	if (memcmp(Buffer, Data + Offset, Size) != 0) {
+		diag("Range %d+%d: wrong contents", (int)Offset, (int)Size);
+		return false;
+	}
+
+	return true;
+}
+
+bool test25(void)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t *Data, Byte, Damaged[3 * BLOCK_SIZE];
+	uint64_t Big, Plain, Size, Unused;
+	FILE *File, *Extracted;
+	IO *Stream, *Output;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = false;
+	int i;
+
+	Data = malloc(BIG_SIZE);
+	for (i = 0; i < BIG_SIZE; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 9);
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+	if (!write_archive(Stream, Data))
+		goto cleanup;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	KCF_set_access_pattern(kcf, KCF_ACCESS_RANDOM);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = KCF_get_current_file_info(kcf, &Info);
+	file_info_clear(&Info);
+	if (Error) {
+		diag("Failed to open archive: Error #%d", Error);
+		goto close;
+	}
+
+	/* In the middle of reading the archive file by file */
+	Error = KCF_find_member(kcf, "big", &Big, &Size);
+	if (Error || Size != BIG_SIZE) {
+		diag("big: Error #%d, size %d", Error, (int)Size);
+		goto close;
+	}
+	Error = KCF_find_member(kcf, "plain", &Plain, NULL);
+	if (Error) {
+		diag("plain: Error #%d", Error);
+		goto close;
+	}
+	if (KCF_find_member(kcf, "none", &Unused, NULL) !=
+	    KCF_ERROR_FILE_NOT_FOUND) {
+		diag("Nonexistent file found");
+		goto close;
+	}
+	if (KCF_find_member(kcf, "big", &Unused, NULL) || Unused != Big) {
+		diag("big found at %d, then at %d", (int)Big, (int)Unused);
+		goto close;
+	}
+
+	if (!check_range(kcf, Big, Data, 5000, 10000) ||
+	    !check_range(kcf, Big, Data, BLOCK_SIZE, BLOCK_SIZE) ||
+	    !check_range(kcf, Big, Data, BIG_SIZE - 7, 7) ||
+	    !check_range(kcf, Plain, Data + 1, 123, 4567) ||
+	    !check_range(kcf, Big, Data, 0, BIG_SIZE))
+		goto close;
+
+	if (KCF_read_member_range(kcf, Big, BIG_SIZE - 1, &Byte, 2) !=
+	    KCF_ERROR_INVALID_PARAMETER) {
+		diag("Range past the end of file read");
+		goto close;
+	}
+
+	/* Sequential reading goes on */
+	Extracted = tmpfile();
+	Output    = IO_create_fp(Extracted, 1);
+	Error     = KCF_extract(kcf, Output);
+	IO_close(Output);
+	if (Error) {
+		diag("Failed to extract: Error #%d", Error);
+		goto close;
+	}
+
+	/* Damaged block in the middle of a range */
+	fseek(File, Big + 100 + 3 * BLOCK_SIZE, SEEK_SET);
+	Byte = (uint8_t)fgetc(File);
+	fseek(File, -1, SEEK_CUR);
+	fputc(Byte ^ 0x20, File);
+	fflush(File);
+
+	Error = KCF_read_member_range(kcf, Big, 2 * BLOCK_SIZE, Damaged,
+	                              sizeof(Damaged));
+	if (Error != KCF_ERROR_INVALID_DATA) {
+		diag("Damaged range read: Error #%d", Error);
+		goto close;
+	}
+
+	result = check_range(kcf, Big, Data, 0, BLOCK_SIZE);
+
+close:
+	KCF_close(kcf);
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	free(Data);
+	return result;
+}
@@ -4,124 +4,125 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "../archive.h"
-#include "../record.h"
+#include <kcf/archive.h>
+#include "../kcf/read.h"
 
-HKCF hKCF = NULL;
+/* Archive read by test4 to test7 one record after another */
+KCF *ReadArchive = NULL;
+IO *ReadStream   = NULL;
 
 bool test3(void);
 bool test4(void);
 bool test5(void);
 bool test6(void);
 bool test7(void);
+bool test35(void);
+
+static KCF *open_archive(const char *FileName, IO **Stream)
+{
+	KCF *kcf;
+
+	*Stream = IO_open_cfile(FileName, "rb");
+	if (!*Stream) {
+		diag("Failed to open file %s", FileName);
+		return NULL;
+	}
+
+	if (KCF_create(*Stream, &kcf)) {
+		IO_close(*Stream);
+		*Stream = NULL;
+		return NULL;
+	}
+
+	KCF_start_reading(kcf);
+	KCF_find_marker(kcf);
+	return kcf;
+}
 
 bool test3(void)
 {
-	HKCF hKCF;
+	struct KcfRecord Record = {0};
+	IO *Stream;
+	KCF *kcf;
 	KCFERROR Error;
-	struct KcfRecord Record;
+	bool result = true;
 
-	Error = CreateArchive("test0001.kcf", KCF_MODE_READ, &hKCF);
-	if (Error) {
-		diag("Failed to open file test0001.kcf: Error #%d", Error);	
+	kcf = open_archive("test0001.kcf", &Stream);
+	if (!kcf)
 		return false;
-	}
-
-	ScanArchiveForMarker(hKCF);
 
-	Error = ReadRecord(hKCF, &Record);
+	Error = KCF_read_record(kcf, &Record);
 	if (Error) {
-		diag("Failed to read record: Error #%d", Error);	
-		return 0;
+		diag("Failed to read record: Error #%d", Error);
+		result = false;
+		goto cleanup;
 	}
 
-	if (Record.Header.HeadCRC == 0xB7E9
-		&& Record.Header.HeadType == 0x41
-		&& Record.Header.HeadFlags == 0x00
-		&& Record.Header.HeadSize == 0x0008
-		&& Record.DataSize == 2
-		&& Record.Data[0] == 0x01
-		&& Record.Data[1] == 0x00)
-	{
-		// good;
-	}
-	else {
+	if (Record.HeadCRC != 0xB7E9 || Record.HeadType != 0x41 ||
+	    Record.HeadFlags != 0x00 || Record.HeadSize != 0x0008 ||
+	    Record.DataSize != 2 || Record.Data[0] != 0x01 ||
+	    Record.Data[1] != 0x00) {
 		diag("CRC=%04X,Type=%02X,Flags=%02X,Size=%04X",
-				Record.Header.HeadCRC,
-				Record.Header.HeadType,
-				Record.Header.HeadFlags,
-				Record.Header.HeadSize);
-		return false;
+		     Record.HeadCRC, Record.HeadType, Record.HeadFlags,
+		     Record.HeadSize);
+		result = false;
 	}
-	CloseArchive(hKCF);
-	free(Record.Data);
 
-	return true;
+cleanup:
+	KCF_close(kcf);
+	IO_close(Stream);
+	rec_clear(&Record);
+	return result;
 }
 
 bool test4(void)
 {
+	struct KcfRecord Record = {0};
 	KCFERROR Error;
-	struct KcfRecord Record;
+	bool result;
 
-	Error = CreateArchive("test0004.kcf", KCF_MODE_READ, &hKCF);
-	if (Error) {
-		diag("Failed to open file test0004.kcf: Error #%d", Error);	
+	ReadArchive = open_archive("test0004.kcf", &ReadStream);
+	if (!ReadArchive)
 		return false;
-	}
-
-	ScanArchiveForMarker(hKCF);
 
-	SkipRecord(hKCF);
+	KCF_skip_record(ReadArchive);
 
-	Error = ReadRecord(hKCF, &Record);
+	Error = KCF_read_record(ReadArchive, &Record);
 	if (Error) {
 		diag("Failed to read record: Error #%d", Error);
-		return true;
-	}
-
-	if (Record.Header.HeadCRC == 0x0000
-			&& Record.Header.HeadType == 0x30
-			&& Record.Header.HeadFlags == 0x00
-			&& Record.Header.HeadSize == 0x0010
-			&& Record.DataSize == 10)
-	{
-		// passed;
-	}
-	else {
 		return false;
 	}
 
-	return true;
+	result = Record.HeadCRC == 0x0000 && Record.HeadType == 0x30 &&
+	         Record.HeadFlags == 0x00 && Record.HeadSize == 0x0010 &&
+	         Record.DataSize == 10;
+
+	rec_clear(&Record);
+	return result;
 }
 
 bool test5(void)
 {
+	struct KcfRecord Record = {0};
 	KCFERROR Error;
-	struct KcfRecord Record;
-	bool result = true;
+	bool result;
+
+	if (!ReadArchive)
+		return false;
 
-	SkipRecord(hKCF);
-	Error = ReadRecord(hKCF, &Record);
-	diag("Error #%d (%s)", Error, GetKcfErrorString(Error));
+	KCF_skip_record(ReadArchive);
+	Error = KCF_read_record(ReadArchive, &Record);
 	if (Error) {
+		diag("Error #%d (%s)", Error, kcf_error_string(Error));
 		return false;
 	}
 
-	diag("%04X %02X %02X %04X",
-		Record.Header.HeadCRC,
-		Record.Header.HeadType,
-		Record.Header.HeadFlags,
-		Record.Header.HeadSize);
+	result = Record.HeadType == 0x32 && Record.AddedSize == 10;
+	if (!result)
+		diag("%04X %02X %02X %04X", Record.HeadCRC, Record.HeadType,
+		     Record.HeadFlags, Record.HeadSize);
 
-	if (Record.Header.HeadType == 0x32 && Record.Header.AddedSize == 10) {
-		result = true;
-	}
-	else {
-		result = false;
-	}
-
-	ClearRecord(&Record);
+	rec_clear(&Record);
 	return result;
 }
 
@@ -131,27 +132,96 @@ bool test6(void)
 	size_t n_read;
 	KCFERROR Error;
 
-	Error = ReadAddedData(hKCF, buf1, 12, &n_read);
-	if (Error) {
+	if (!ReadArchive)
+		return false;
+
+	Error = KCF_read_added_data(ReadArchive, buf1, 12, &n_read);
+	if (Error)
 		return false;
-	}
-	else if (n_read == 10 && memcmp(buf1, "0123456789", 10) == 0) {
-		return true;
-	}
 
-	return false;
+	return n_read == 10 && memcmp(buf1, "0123456789", 10) == 0;
 }
 
 bool test7(void)
 {
+	struct KcfRecord Record = {0};
 	KCFERROR Error;
-	struct KcfRecord Record;
 	bool result;
 
-	Error = ReadRecord(hKCF, &Record);
-	result = Error == KCF_ERROR_OK && Record.Header.HeadType == 0x33;
+	if (!ReadArchive)
+		return false;
+
+	Error  = KCF_read_record(ReadArchive, &Record);
+	result = Error == KCF_ERROR_OK && Record.HeadType == 0x33;
 
-	ClearRecord(&Record);
+	rec_clear(&Record);
 	return result;
 }
 
+/* Marker and archive header of version 1 */
+static const uint8_t Start[14] = {'K',  'C',  '!',  0x1A, 0x06, 0x00, 0xE9,
+                                  0xB7, 'A',  0x00, 0x08, 0x00, 1,    0};
+
+/* Skips the archive header and the record after it */
+static KCFERROR skip_second(const uint8_t *Record, size_t Size, size_t Added)
+{
+	uint8_t Data[16] = {0};
+	FILE *File;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+
+	File = tmpfile();
+	fwrite(Start, 1, sizeof(Start), File);
+	fwrite(Record, 1, Size, File);
+	fwrite(Data, 1, Added, File);
+	rewind(File);
+
+	Stream = IO_create_fp(File, 1);
+	KCF_create(Stream, &kcf);
+	KCF_start_reading(kcf);
+	Error = KCF_find_marker(kcf);
+	if (!Error)
+		Error = KCF_skip_record(kcf);
+	if (!Error)
+		Error = KCF_skip_record(kcf);
+
+	KCF_close(kcf);
+	IO_close(Stream);
+	return Error;
+}
+
+bool test35(void)
+{
+	/* 16 bytes of added data */
+	static const uint8_t Record[] = {0, 0, 'D', 0x80, 10, 0, 16, 0, 0, 0};
+	/* HeadSize shorter than the header itself */
+	static const uint8_t Short[] = {0, 0, 'D', 0x80, 6, 0, 16, 0, 0, 0};
+	/* Added size which wraps around */
+	static const uint8_t Huge[] = {0,    0,    'D',  0xC0, 14,   0,   0xFF,
+	                               0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+	KCFERROR Error;
+	bool result = true;
+
+	if ((Error = skip_second(Record, sizeof(Record), 16)) != KCF_ERROR_OK) {
+		diag("Whole record: Error #%d", Error);
+		result = false;
+	}
+	if ((Error = skip_second(Record, sizeof(Record), 15)) !=
+	    KCF_ERROR_PREMATURE_EOF) {
+		diag("Truncated record: Error #%d", Error);
+		result = false;
+	}
+	if ((Error = skip_second(Short, sizeof(Short), 16)) !=
+	    KCF_ERROR_INVALID_DATA) {
+		diag("Short header: Error #%d", Error);
+		result = false;
+	}
+	if ((Error = skip_second(Huge, sizeof(Huge), 16)) !=
+	    KCF_ERROR_INVALID_DATA) {
+		diag("Huge added size: Error #%d", Error);
+		result = false;
+	}
+
+	return result;
+}
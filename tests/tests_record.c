@@ -4,12 +4,13 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "../archive.h"
-#include "../record.h"
+#include <kcf/archive.h>
+#include "../kcf/record.h"
 
 bool test8(void);
 bool test9(void);
 bool test10(void);
+bool test12(void);
 
 bool test8(void)
 {
@@ -19,14 +20,14 @@ bool test8(void)
 	KCFERROR Error;
 
 	/* Mocking data */
-	Record.Header.HeadCRC = 0xB7E9;
-	Record.Header.HeadType = KCF_ARCHIVE_HEADER;
-	Record.Header.HeadFlags = 0x00;
-	Record.Header.HeadSize = 8;
-	Record.Data = Data;
-	Record.DataSize = 2;
-
-	Error = RecordToArchiveHeader(&Record, &Header);
+	Record.HeadCRC   = 0xB7E9;
+	Record.HeadType  = KCF_ARCHIVE_HEADER;
+	Record.HeadFlags = 0x00;
+	Record.HeadSize  = 8;
+	Record.Data      = Data;
+	Record.DataSize  = 2;
+
+	Error = rec_to_archive_header(&Record, &Header);
 	if (Error != KCF_ERROR_OK) {
 		diag("Failed to read KCF archive header: Error #%d", Error);
 		return false;
@@ -34,7 +35,7 @@ bool test8(void)
 
 	if (Header.ArchiveVersion != 1) {
 		diag("Invalid archive version, read %d, should be 1",
-				Header.ArchiveVersion);
+		     Header.ArchiveVersion);
 		return false;
 	}
 
@@ -49,14 +50,14 @@ bool test9(void)
 	KCFERROR Error;
 
 	/* Mocking data */
-	Record.Header.HeadCRC = 0x0000;
-	Record.Header.HeadType = 0x30;
-	Record.Header.HeadFlags = 0x00;
-	Record.Header.HeadSize = 8;
-	Record.Data = Data;
-	Record.DataSize = 2;
-
-	Error = RecordToArchiveHeader(&Record, &Header);
+	Record.HeadCRC   = 0x0000;
+	Record.HeadType  = 0x30;
+	Record.HeadFlags = 0x00;
+	Record.HeadSize  = 8;
+	Record.Data      = Data;
+	Record.DataSize  = 2;
+
+	Error = rec_to_archive_header(&Record, &Header);
 	if (Error != KCF_ERROR_INVALID_DATA) {
 		diag("Invalid header has been misrecognized as valid");
 		return false;
@@ -72,12 +73,12 @@ bool test10(void)
 	KCFERROR Error;
 
 	/* Mocking data */
-	Record.Header.HeadCRC = 0x0000;
-	Record.Header.HeadType = KCF_ARCHIVE_HEADER;
-	Record.Header.HeadFlags = 0x00;
-	Record.Header.HeadSize = 6;
+	Record.HeadCRC   = 0x0000;
+	Record.HeadType  = KCF_ARCHIVE_HEADER;
+	Record.HeadFlags = 0x00;
+	Record.HeadSize  = 6;
 
-	Error = RecordToArchiveHeader(&Record, &Header);
+	Error = rec_to_archive_header(&Record, &Header);
 	if (Error != KCF_ERROR_INVALID_DATA) {
 		diag("Invalid header has been misrecognized as valid");
 		return false;
@@ -86,8 +87,8 @@ bool test10(void)
 	return true;
 }
 
-static const uint8_t test12_data[] = {
-	0x04, 'F',
+static uint8_t test12_data[] = {
+	0x04, KCF_FILE_REGULAR,
 	0x0F, 0x00, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00,
 	0x09, 0x00,
@@ -97,41 +98,53 @@ static const uint8_t test12_data[] = {
 bool test12(void)
 {
 	struct KcfRecord Record = {0};
-	struct KcfFileHeader Header = {0};
+	struct KcfFileInfo Info = {0};
 	KCFERROR Error;
+	bool result = false;
 
 	/* Mocking data */
-	Record.Header.HeadCRC = 0x3E39;
-	Record.Header.HeadType = KCF_FILE_HEADER;
-	Record.Header.HeadFlags = 0x80;
-	Record.Header.HeadSize = sizeof(test12_data) + 10;
-	Record.Header.AddedSize = 15;
-	Record.Data = test12_data;
-	Record.DataSize = sizeof(test12_data);
-
-	Error = RecordToFileHeader(&Record, &Header);
+	Record.HeadType  = KCF_FILE_HEADER;
+	Record.HeadFlags = KCF_HAS_ADDED_SIZE_4;
+	Record.AddedSize = 15;
+	Record.Data      = test12_data;
+	Record.DataSize  = sizeof(test12_data);
+	rec_fix(&Record);
+
+	Error = record_to_file_info(&Record, &Info);
 	if (Error != KCF_ERROR_OK) {
 		diag("Failed to read KCF file header: Error #%d", Error);
 		return false;
 	}
-	
-	diag("FileFlags=%02X,UnpackedSize=%lld,FileType=%02X",
-		Header.FileFlags, Header.UnpackedSize, Header.FileType);
-	diag("CompressionInfo=%08X,FileNameSize=%d,FileName=%s",
-		Header.CompressionInfo, Header.FileNameSize, Header.FileName);
 
-	if (Header.FileFlags != 0x04)
-		return false;
-	if (Header.UnpackedSize != 15)
-		return false;
-	if (Header.FileType != KCF_REGULAR_FILE)
-		return false;
-	if (Header.CompressionInfo != 0)
-		return false;
-	if (Header.FileNameSize != 9)
-		return false;
-	if (strcmp(Header.FileName, "hello.txt") != 0)
-		return false;
+	if (!Info.HasUnpackedSize || Info.HasUnpackedSize8 ||
+	    Info.UnpackedSize != 15 || Info.FileType != KCF_FILE_REGULAR ||
+	    Info.CompressionInfo != 0 || strcmp(Info.FileName, "hello.txt"))
+		diag("UnpackedSize=%d,FileType=%02X,CompressionInfo=%08X,"
+		     "FileName=%s",
+		     (int)Info.UnpackedSize, Info.FileType,
+		     Info.CompressionInfo, Info.FileName);
+	else
+		result = true;
+	file_info_clear(&Info);
+
+	/* Cut inside the name, then inside CompressionInfo */
+	Record.DataSize = sizeof(test12_data) - 1;
+	rec_fix(&Record);
+	Error = record_to_file_info(&Record, &Info);
+	file_info_clear(&Info);
+	if (Error != KCF_ERROR_INVALID_DATA) {
+		diag("Truncated name: Error #%d", Error);
+		result = false;
+	}
 
-	return true;
+	Record.DataSize = 8;
+	rec_fix(&Record);
+	Error = record_to_file_info(&Record, &Info);
+	file_info_clear(&Info);
+	if (Error != KCF_ERROR_INVALID_DATA) {
+		diag("Truncated fields: Error #%d", Error);
+		result = false;
+	}
+
+	return result;
 }
@@ -0,0 +1,114 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+bool test23(void);
+
+#define FILES     40
+#define FILE_SIZE 3000
+
+static uint8_t *read_all(FILE *File, long *Size)
+{
+	uint8_t *Buffer;
+
+	fseek(File, 0, SEEK_END);
+	*Size = ftell(File);
+	rewind(File);
+
+	Buffer = malloc(*Size);
+	if (Buffer && fread(Buffer, 1, *Size, File) != (size_t)*Size) {
+		free(Buffer);
+		return NULL;
+	}
+
+	return Buffer;
+}
+
+static void damage(FILE *File, long Offset, long Length)
+{
+	fseek(File, Offset, SEEK_SET);
+	while (Length--)
+		fputc(0x55, File);
+	fflush(File);
+}
+
+bool test23(void)
+{
+	struct KcfBatchEntry Entries[FILES];
+	struct KcfRepairInfo Info;
+	char Names[FILES][16];
+	uint8_t *Data, *Original = NULL, *Repaired = NULL;
+	FILE *File;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	long Size, RepairedSize;
+	bool result = false;
+	int i;
+
+	Data = malloc(FILES * FILE_SIZE);
+	for (i = 0; i < FILES * FILE_SIZE; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 13);
+
+	memset(Entries, 0, sizeof(Entries));
+	for (i = 0; i < FILES; i++) {
+		sprintf(Names[i], "file%d", i);
+		Entries[i].Info.FileType = KCF_FILE_REGULAR;
+		Entries[i].Info.FileName = Names[i];
+		Entries[i].Data          = Data + i * FILE_SIZE;
+		Entries[i].Size          = FILE_SIZE;
+	}
+
+	File   = tmpfile();
+	Stream = IO_create_fp(File, 0);
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, Entries, FILES);
+	if (!Error)
+		Error = KCF_add_recovery_record(kcf, 10, 512);
+	KCF_close(kcf);
+	IO_flush(Stream);
+
+	if (Error) {
+		diag("Failed to write archive: Error #%d", Error);
+		goto cleanup;
+	}
+
+	Original = read_all(File, &Size);
+
+	/* A long run hits neighbouring blocks of different stripes */
+	damage(File, 40, 1);
+	damage(File, 10000, 1500);
+	damage(File, 100000, 100);
+
+	Error = KCF_repair(Stream, &Info);
+	if (Error) {
+		diag("Repair failed: Error #%d", Error);
+		goto cleanup;
+	}
+	if (Info.DamagedBlocks < 5 ||
+	    Info.RepairedBlocks != Info.DamagedBlocks) {
+		diag("%d blocks damaged, %d repaired", (int)Info.DamagedBlocks,
+		     (int)Info.RepairedBlocks);
+		goto cleanup;
+	}
+
+	Repaired = read_all(File, &RepairedSize);
+	result   = Original && Repaired && RepairedSize == Size &&
+	         memcmp(Original, Repaired, Size) == 0;
+	if (!result)
+		diag("Repaired archive differs from the original");
+
+cleanup:
+	IO_close(Stream);
+	fclose(File);
+	free(Repaired);
+	free(Original);
+	free(Data);
+	return result;
+}
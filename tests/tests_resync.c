@@ -0,0 +1,237 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+#include "../kcf/crc32c.h"
+#include "../kcf/kcf_impl.h"
+
+bool test16(void);
+bool test17(void);
+bool test39(void);
+
+static const uint8_t Marker[6] = {'K', 'C', '!', 0x1A, 0x06, 0x00};
+
+/* Archive header of version 1 */
+static const uint8_t Header[8] = {0xE9, 0xB7, 'A', 0x00, 0x08, 0x00, 1, 0};
+
+/* Marker and archive header, Garbage bytes, then the header again */
+static IO *make_stream(long Garbage, bool SecondHeader)
+{
+	FILE *File;
+	long i;
+
+	File = tmpfile();
+	if (!File)
+		return NULL;
+
+	fwrite(Marker, 1, sizeof(Marker), File);
+	fwrite(Header, 1, sizeof(Header), File);
+	for (i = 0; i < Garbage; i++)
+		fputc("xAFD"[i % 4], File);
+	if (SecondHeader)
+		fwrite(Header, 1, sizeof(Header), File);
+
+	rewind(File);
+	return IO_create_fp(File, 1);
+}
+
+static KCFERROR read_damaged(IO *Stream, struct KcfRecord *Record,
+                             int64_t *Offset)
+{
+	KCF *kcf;
+	KCFERROR Error;
+
+	Error = KCF_create(Stream, &kcf);
+	if (Error)
+		return Error;
+
+	KCF_set_recovery_mode(kcf, true);
+	Error = KCF_open_archive(kcf);
+	if (!Error)
+		Error = KCF_read_record(kcf, Record);
+	*Offset = kcf->RecordOffset;
+
+	KCF_close(kcf);
+	return Error;
+}
+
+bool test16(void)
+{
+	struct KcfRecord Record = {0};
+	long Garbage = 1048576L + 100;
+	int64_t Offset;
+	IO *Stream;
+	KCFERROR Error;
+	bool result = true;
+
+	Stream = make_stream(Garbage, true);
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	Error = read_damaged(Stream, &Record, &Offset);
+	if (Error != KCF_ERROR_OK) {
+		diag("Record not found: Error #%d", Error);
+		result = false;
+	} else if (Record.HeadType != KCF_ARCHIVE_HEADER) {
+		diag("Wrong record type %c", Record.HeadType);
+		result = false;
+	} else if (Offset != 6 + 8 + Garbage) {
+		diag("Record is at %lld, should be at %ld", (long long)Offset,
+		     6 + 8 + Garbage);
+		result = false;
+	}
+
+	rec_clear(&Record);
+	IO_close(Stream);
+	return result;
+}
+
+bool test17(void)
+{
+	struct KcfRecord Record = {0};
+	int64_t Offset;
+	IO *Stream;
+	KCFERROR Error;
+
+	Stream = make_stream(4096, false);
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	Error = read_damaged(Stream, &Record, &Offset);
+	rec_clear(&Record);
+	IO_close(Stream);
+
+	if (Error != KCF_ERROR_EOF) {
+		diag("Expected EOF, got Error #%d", Error);
+		return false;
+	}
+
+	return true;
+}
+
+struct skipped_place {
+	uint64_t Offset;
+	uint64_t Size;
+};
+
+struct skip_log {
+	struct skipped_place Places[4];
+	int Count;
+};
+
+static void log_skipped(void *Context, uint32_t Volume, uint64_t Offset,
+                        uint64_t Size)
+{
+	struct skip_log *Log = Context;
+
+	(void)Volume;
+	if (Log->Count < 4) {
+		Log->Places[Log->Count].Offset = Offset;
+		Log->Places[Log->Count].Size   = Size;
+	}
+	Log->Count++;
+}
+
+/*
+ * Garbage without A, F or D, so a scan for those alone would jump over
+ * the link record after it, then the archive header, then garbage again
+ * up to the end.
+ */
+static IO *make_link_stream(long Garbage)
+{
+	uint8_t Link[10] = {0, 0, 'L', 0x00, 10, 0, 1, 2, 3, 4};
+	uint32_t CRC;
+	FILE *File;
+	long i;
+
+	CRC     = crc32c(0, Link + 2, sizeof(Link) - 2) & 0xFFFF;
+	Link[0] = (uint8_t)CRC;
+	Link[1] = (uint8_t)(CRC >> 8);
+
+	File = tmpfile();
+	if (!File)
+		return NULL;
+
+	fwrite(Marker, 1, sizeof(Marker), File);
+	fwrite(Header, 1, sizeof(Header), File);
+	for (i = 0; i < Garbage; i++)
+		fputc("xyz"[i % 3], File);
+	fwrite(Link, 1, sizeof(Link), File);
+	fwrite(Header, 1, sizeof(Header), File);
+	for (i = 0; i < Garbage; i++)
+		fputc("xyz"[i % 3], File);
+
+	rewind(File);
+	return IO_create_fp(File, 1);
+}
+
+bool test39(void)
+{
+	static const char Types[] = {'L', 'A'};
+	struct KcfRecord Record  = {0};
+	struct skip_log Log      = {0};
+	long Garbage             = 4000;
+	uint64_t End;
+	IO *Stream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = false;
+	int i;
+
+	Stream = make_link_stream(Garbage);
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	KCF_create(Stream, &kcf);
+	KCF_set_recovery_mode(kcf, true);
+	KCF_set_skip_callback(kcf, log_skipped, &Log);
+	Error = KCF_open_archive(kcf);
+
+	for (i = 0; !Error && i < 2; i++) {
+		Error = KCF_read_record(kcf, &Record);
+		if (!Error && Record.HeadType != Types[i]) {
+			diag("Found record %c instead of %c", Record.HeadType,
+			     Types[i]);
+			Error = KCF_ERROR_INVALID_DATA;
+		}
+		rec_clear(&Record);
+	}
+	if (!Error)
+		Error = KCF_read_record(kcf, &Record);
+	rec_clear(&Record);
+
+	if (Error != KCF_ERROR_EOF) {
+		diag("Expected EOF, got Error #%d", Error);
+		goto cleanup;
+	}
+
+	End = 6 + 8 + Garbage + 10 + 8;
+	if (Log.Count != 2 || Log.Places[0].Offset != 6 + 8 ||
+	    Log.Places[0].Size != (uint64_t)Garbage ||
+	    Log.Places[1].Offset != End ||
+	    Log.Places[1].Size != (uint64_t)Garbage) {
+		diag("%d places reported, expected %d bytes at 14 and %lld",
+		     Log.Count, (int)Garbage, (long long)End);
+		for (i = 0; i < Log.Count && i < 4; i++)
+			diag("%lld bytes at %lld",
+			     (long long)Log.Places[i].Size,
+			     (long long)Log.Places[i].Offset);
+		goto cleanup;
+	}
+
+	result = true;
+
+cleanup:
+	KCF_close(kcf);
+	IO_close(Stream);
+	return result;
+}
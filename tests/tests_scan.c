@@ -0,0 +1,173 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+#include "../kcf/read.h"
+
+bool test13(void);
+bool test14(void);
+bool test15(void);
+
+static const uint8_t Marker[6] = {'K', 'C', '!', 0x1A, 0x06, 0x00};
+
+/* Archive header of version 1 */
+static const uint8_t Header[8] = {0xE9, 0xB7, 'A', 0x00, 0x08, 0x00, 1, 0};
+
+/* Fills file with lots of false candidates ("KC!" without the rest) */
+static IO *make_stream(long Size, long MarkerOffset)
+{
+	FILE *File;
+	long i;
+
+	File = tmpfile();
+	if (!File)
+		return NULL;
+
+	for (i = 0; i < Size; i++) {
+		if (MarkerOffset >= 0 && i == MarkerOffset) {
+			fwrite(Marker, 1, sizeof(Marker), File);
+			i += sizeof(Marker) - 1;
+			continue;
+		}
+		fputc("KC!\x1A"[i % 4], File);
+	}
+
+	rewind(File);
+	return IO_create_fp(File, 1);
+}
+
+static KCFERROR scan(IO *Stream)
+{
+	KCF *kcf;
+	KCFERROR Error;
+
+	Error = KCF_create(Stream, &kcf);
+	if (Error)
+		return Error;
+
+	KCF_start_reading(kcf);
+	Error = KCF_find_marker(kcf);
+	KCF_close(kcf);
+	return Error;
+}
+
+bool test13(void)
+{
+	/* Crosses the boundary of the first 1 MiB chunk */
+	long Offset = 1048576L - 3;
+	IO *Stream;
+	KCFERROR Error;
+	bool result = true;
+
+	Stream = make_stream(3 * 1048576L, Offset);
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	Error = scan(Stream);
+	if (Error != KCF_ERROR_OK) {
+		diag("Marker not found: Error #%d", Error);
+		result = false;
+	} else if (IO_tell(Stream) != Offset + 6) {
+		diag("Stream is at %lld, should be at %ld",
+		     (long long)IO_tell(Stream), Offset + 6);
+		result = false;
+	}
+
+	IO_close(Stream);
+	return result;
+}
+
+bool test14(void)
+{
+	IO *Stream;
+	KCFERROR Error;
+
+	Stream = make_stream(2 * 1048576L + 5, -1);
+	if (!Stream) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	Error = scan(Stream);
+	IO_close(Stream);
+	if (Error != KCF_ERROR_INVALID_FORMAT) {
+		diag("KCF_find_marker returns bad value: Error #%d", Error);
+		return false;
+	}
+
+	return true;
+}
+
+struct found_markers {
+	struct KcfMarkerInfo Info[4];
+	int Count;
+};
+
+static bool collect_marker(void *Context, const struct KcfMarkerInfo *Info)
+{
+	struct found_markers *Found = Context;
+
+	if (Found->Count < 4)
+		Found->Info[Found->Count] = *Info;
+	Found->Count++;
+	return true;
+}
+
+bool test15(void)
+{
+	/* Valid archive, damaged one, valid one crossing the chunk end */
+	long Offsets[3] = {100, 5000, 1048576L - 10};
+	bool Valid[3]   = {true, false, true};
+	struct found_markers Found = {0};
+	FILE *File;
+	IO *Stream;
+	KCFERROR Error;
+	bool result = true;
+	int i;
+
+	File = tmpfile();
+	if (!File) {
+		diag("Failed to create temporary file");
+		return false;
+	}
+
+	for (i = 0; i < 3; i++) {
+		fseek(File, Offsets[i], SEEK_SET);
+		fwrite(Marker, 1, sizeof(Marker), File);
+		fwrite(Header, 1, Valid[i] ? sizeof(Header) : 5, File);
+	}
+	fseek(File, 2 * 1048576L, SEEK_SET);
+	fputc(0, File);
+	rewind(File);
+
+	Stream = IO_create_fp(File, 1);
+	Error  = KCF_scan_all_markers(Stream, collect_marker, &Found);
+	IO_close(Stream);
+
+	if (Error) {
+		diag("KCF_scan_all_markers failed: Error #%d", Error);
+		return false;
+	}
+
+	if (Found.Count != 3) {
+		diag("Found %d markers, should be 3", Found.Count);
+		return false;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (Found.Info[i].Offset != (uint64_t)Offsets[i] ||
+		    Found.Info[i].HasValidHeader != Valid[i]) {
+			diag("Marker #%d: offset %llu, valid %d", i,
+			     (unsigned long long)Found.Info[i].Offset,
+			     Found.Info[i].HasValidHeader);
+			result = false;
+		}
+	}
+
+	return result;
+}
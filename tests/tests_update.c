@@ -0,0 +1,224 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kcf/archive.h>
+
+#include "add_file.h"
+
+bool test33(void);
+
+#define FILE_SIZE 20000
+#define BIG_SIZE  300000
+
+struct expected_file {
+	const char *Name;
+	int Offset;
+	size_t Size;
+};
+
+/*
+ * "copy" is a link to "a", "big" is compressed so its header gets its CRC
+ * when it is backpatched.
+ */
+static bool write_archive(IO *Stream, const uint8_t *Data)
+{
+	KCF *kcf;
+	KCFERROR Error;
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_set_deduplication(kcf, true);
+	if (!Error)
+		Error = KCF_set_file_checksums(kcf, true);
+	if (!Error)
+		Error = add_entry(kcf, "a", Data, FILE_SIZE);
+	if (!Error)
+		Error = add_entry(kcf, "copy", Data, FILE_SIZE);
+	if (!Error)
+		Error = add_entry(kcf, "b", Data + 1, FILE_SIZE);
+	if (!Error)
+		Error = KCF_set_compression(kcf, KCF_METHOD_DEFLATE, 6, 65536);
+	if (!Error)
+		Error = add_streamed(kcf, "big", Data + 2, BIG_SIZE, true);
+	KCF_close(kcf);
+
+	if (Error)
+		diag("Failed to write archive: Error #%d", Error);
+	return !Error;
+}
+
+/* Checks FileCRC32 of every file and notes where "a" and "b" are */
+static bool check_checksums(IO *Stream, const uint8_t *Data,
+                            const struct expected_file *Files, int Count,
+                            uint64_t *Offsets)
+{
+	struct KcfFileInfo Info = {0};
+	uint32_t CRC;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+
+	for (i = 0; !Error && i < Count; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+
+		CRC = KCF_file_crc32(0, Data + Files[i].Offset, Files[i].Size);
+		if (!Info.HasFileCRC32 || Info.FileCRC32 != CRC) {
+			diag("%s: FileCRC32 %08X, expected %08X", Info.FileName,
+			     Info.HasFileCRC32 ? Info.FileCRC32 : 0, CRC);
+			Error = KCF_ERROR_INVALID_DATA;
+		}
+		file_info_clear(&Info);
+
+		if (!Error)
+			Error = KCF_get_file_offset(kcf, &Offsets[i]);
+		if (!Error)
+			Error = KCF_skip_file(kcf);
+	}
+
+	if (Error)
+		diag("%s: Error #%d", i < Count ? Files[i].Name : "end", Error);
+	KCF_close(kcf);
+	return !Error;
+}
+
+static bool check_archive(IO *Stream, const uint8_t *Data,
+                          const struct expected_file *Files, int Count)
+{
+	struct KcfFileInfo Info = {0};
+	uint8_t *Extracted;
+	FILE *File;
+	IO *Output;
+	KCF *kcf;
+	KCFERROR Error;
+	int i;
+
+	Extracted = malloc(BIG_SIZE + 1);
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	Error = KCF_open_archive(kcf);
+
+	for (i = 0; !Error && i < Count; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+		if (strcmp(Info.FileName, Files[i].Name) != 0) {
+			diag("%s: found %s", Files[i].Name, Info.FileName);
+			Error = KCF_ERROR_INVALID_DATA;
+		}
+		file_info_clear(&Info);
+		if (Error)
+			break;
+
+		File   = tmpfile();
+		Output = IO_create_fp(File, 0);
+		Error  = KCF_extract(kcf, Output);
+		IO_close(Output);
+
+		rewind(File);
+		if (!Error &&
+		    (fread(Extracted, 1, BIG_SIZE + 1, File) != Files[i].Size ||
+		     memcmp(Extracted, Data + Files[i].Offset, Files[i].Size)))
+			Error = KCF_ERROR_INVALID_DATA;
+		fclose(File);
+	}
+
+	if (!Error && KCF_get_current_file_info(kcf, &Info) != KCF_ERROR_EOF) {
+		diag("Extra file after %s", Files[Count - 1].Name);
+		Error = KCF_ERROR_INVALID_DATA;
+	}
+
+	if (Error)
+		diag("%s: Error #%d", i < Count ? Files[i].Name : "end", Error);
+
+	KCF_close(kcf);
+	free(Extracted);
+	return !Error;
+}
+
+bool test33(void)
+{
+	static const struct expected_file Files[] = {
+	    {"a", 0, FILE_SIZE},
+	    {"copy", 0, FILE_SIZE},
+	    {"b", 1, FILE_SIZE},
+	    {"big", 2, BIG_SIZE},
+	};
+	static const struct expected_file Updated[] = {
+	    {"copy", 0, FILE_SIZE},
+	    {"big", 2, BIG_SIZE},
+	    {"a", 3, FILE_SIZE},
+	    {"b", 4, FILE_SIZE},
+	};
+	struct KcfCompactInfo Info;
+	uint64_t Offsets[4], Changed[2];
+	uint8_t *Data;
+	FILE *File, *Copy;
+	IO *Stream, *CopyStream;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = false;
+	int i;
+
+	Data = malloc(BIG_SIZE + 8);
+	for (i = 0; i < BIG_SIZE + 8; i++)
+		Data[i] = (uint8_t)((i * 2654435761u) >> 15);
+
+	File       = tmpfile();
+	Stream     = IO_create_fp(File, 0);
+	Copy       = tmpfile();
+	CopyStream = IO_create_fp(Copy, 0);
+	if (!write_archive(Stream, Data) ||
+	    !check_checksums(Stream, Data, Files, 4, Offsets))
+		goto cleanup;
+
+	/* "a" is left out, but "copy" still needs its data */
+	Changed[0] = Offsets[2];
+	Changed[1] = Offsets[0];
+	Error = KCF_compact_excluding(Stream, CopyStream, Changed, 2, &Info);
+	if (Error) {
+		diag("Failed to compact: Error #%d", Error);
+		goto cleanup;
+	}
+	if (Info.Files != 2 || Info.DeletedFiles != 1 ||
+	    Info.RemovedBytes <= FILE_SIZE) {
+		diag("Compacted: %d files, %d deleted, %d bytes removed",
+		     (int)Info.Files, (int)Info.DeletedFiles,
+		     (int)Info.RemovedBytes);
+		goto cleanup;
+	}
+
+	IO_seek(CopyStream, 0, IO_SEEK_SET);
+	KCF_create(CopyStream, &kcf);
+	Error = KCF_append_archive(kcf);
+	if (!Error)
+		Error = add_entry(kcf, "a", Data + 3, FILE_SIZE);
+	if (!Error)
+		Error = add_entry(kcf, "b", Data + 4, FILE_SIZE);
+	KCF_close(kcf);
+	if (Error) {
+		diag("Failed to append: Error #%d", Error);
+		goto cleanup;
+	}
+
+	result = check_archive(CopyStream, Data, Updated, 4) &&
+	         check_archive(Stream, Data, Files, 4);
+
+cleanup:
+	IO_close(CopyStream);
+	IO_close(Stream);
+	fclose(Copy);
+	fclose(File);
+	free(Data);
+	return result;
+}
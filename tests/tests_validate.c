@@ -4,35 +4,38 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "../archive.h"
-#include "../record.h"
+#include <kcf/archive.h>
+#include "../kcf/read.h"
+
+bool test11(void);
 
 bool test11(void)
 {
-	HKCF hKCF;
+	struct KcfRecord Record = {0};
+	IO *Stream;
+	KCF *kcf;
 	KCFERROR Error;
-	struct KcfRecord Record;
-	bool result = true;
+	bool result;
 
-	Error = CreateArchive("test0001.kcf", KCF_MODE_READ, &hKCF);
-	if (Error) {
-		diag("Failed to open file test0001.kcf: Error #%d", Error);	
+	Stream = IO_open_cfile("test0001.kcf", "rb");
+	if (!Stream) {
+		diag("Failed to open file test0001.kcf");
 		return false;
 	}
+	KCF_create(Stream, &kcf);
 
-	ScanArchiveForMarker(hKCF);
+	KCF_start_reading(kcf);
+	KCF_find_marker(kcf);
 
-	Error = ReadRecord(hKCF, &Record);
-	if (Error) {
-		diag("Failed to read record: Error #%d", Error);	
-		return false;
-	}
+	Error = KCF_read_record(kcf, &Record);
+	if (Error)
+		diag("Failed to read record: Error #%d", Error);
 
-	result = ValidateRecord(&Record);
+	result = !Error && rec_validate(&Record);
 
-	CloseArchive(hKCF);
-	ClearRecord(&Record);
+	KCF_close(kcf);
+	IO_close(Stream);
+	rec_clear(&Record);
 
 	return result;
 }
-
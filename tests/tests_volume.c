@@ -0,0 +1,326 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <io/thread.h>
+#include <kcf/archive.h>
+
+bool test21(void);
+bool test22(void);
+
+#define MAX_VOLUMES 16
+#define VOLUME_SIZE 4096
+#define DATA_SIZE   20000
+
+/* A large file crossing several volumes and a small one after it */
+static const char *Names[] = {"big", "small"};
+static const size_t Sizes[] = {DATA_SIZE, 3000};
+
+#define FILES 2
+
+/* Volumes 1 and further, the library closes our wrappers only */
+struct volumes {
+	FILE *Files[MAX_VOLUMES];
+	int Count;
+};
+
+static IO *open_volume(void *Context, uint32_t Number, bool ForWriting)
+{
+	struct volumes *Volumes = Context;
+
+	if (Number == 0 || Number >= MAX_VOLUMES)
+		return NULL;
+
+	if (ForWriting) {
+		if ((int)Number != Volumes->Count + 1)
+			return NULL;
+		Volumes->Files[Number] = tmpfile();
+		if (!Volumes->Files[Number])
+			return NULL;
+		Volumes->Count++;
+	} else {
+		if ((int)Number > Volumes->Count)
+			return NULL;
+		rewind(Volumes->Files[Number]);
+	}
+
+	return IO_create_fp(Volumes->Files[Number], 0);
+}
+
+static void close_volumes(struct volumes *Volumes)
+{
+	int i;
+
+	for (i = 1; i <= Volumes->Count; i++)
+		fclose(Volumes->Files[i]);
+}
+
+static bool check_volume_sizes(IO *First, struct volumes *Volumes)
+{
+	int i;
+
+	if (IO_seek(First, 0, IO_SEEK_END) > VOLUME_SIZE)
+		return false;
+
+	for (i = 1; i <= Volumes->Count; i++) {
+		fseek(Volumes->Files[i], 0, SEEK_END);
+		if (ftell(Volumes->Files[i]) > VOLUME_SIZE)
+			return false;
+	}
+
+	return true;
+}
+
+static uint8_t *make_data(void)
+{
+	uint8_t *Data;
+	int i;
+
+	Data = malloc(DATA_SIZE);
+	if (!Data)
+		return NULL;
+
+	for (i = 0; i < DATA_SIZE; i++)
+		Data[i] = (uint8_t)(i * 7 + i / 256);
+	return Data;
+}
+
+static bool check_contents(FILE *File, const uint8_t *Data, int Index)
+{
+	static uint8_t Buffer[DATA_SIZE + 1];
+
+	rewind(File);
+	return fread(Buffer, 1, sizeof(Buffer), File) == Sizes[Index] &&
+	       memcmp(Buffer, Data, Sizes[Index]) == 0;
+}
+
+/* Writes the files into Stream split into volumes */
+static bool write_archive(IO *Stream, struct volumes *Volumes,
+                          const uint8_t *Data)
+{
+	struct KcfFileInfo Info = {0};
+	struct KcfBatchEntry Entry;
+	FILE *File;
+	IO *Input;
+	KCF *kcf;
+	KCFERROR Error;
+
+	File = tmpfile();
+	fwrite(Data, 1, Sizes[0], File);
+	rewind(File);
+	Input = IO_create_fp(File, 1);
+
+	Info.FileType        = KCF_FILE_REGULAR;
+	Info.FileName        = (char *)Names[0];
+	Info.HasUnpackedSize = true;
+	Info.UnpackedSize    = Sizes[0];
+
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Info.FileType = KCF_FILE_REGULAR;
+	Entry.Info.FileName = (char *)Names[1];
+	Entry.Data          = Data;
+	Entry.Size          = Sizes[1];
+
+	KCF_create(Stream, &kcf);
+	Error = KCF_set_volumes(kcf, VOLUME_SIZE, open_volume, Volumes);
+	if (!Error)
+		Error = KCF_init_archive(kcf);
+	if (!Error)
+		Error = KCF_begin_file(kcf, &Info);
+	if (!Error)
+		Error = KCF_insert_file_data(kcf, Input);
+	if (!Error)
+		Error = KCF_end_file(kcf);
+	if (!Error)
+		Error = KCF_add_files_batch(kcf, &Entry, 1);
+	KCF_close(kcf);
+	IO_close(Input);
+
+	if (Error) {
+		diag("Failed to write archive: Error #%d", Error);
+		return false;
+	}
+
+	if (Volumes->Count < 4 || !check_volume_sizes(Stream, Volumes)) {
+		diag("Wrong volumes: %d", Volumes->Count);
+		return false;
+	}
+
+	return true;
+}
+
+bool test21(void)
+{
+	struct volumes Volumes;
+	struct KcfFileInfo Info = {0};
+	uint8_t *Data;
+	IO *Stream, *Extracted;
+	FILE *File;
+	KCF *kcf;
+	KCFERROR Error;
+	bool result = true;
+	int i;
+
+	memset(&Volumes, 0, sizeof(Volumes));
+	Data   = make_data();
+	Stream = IO_create_fp(tmpfile(), 1);
+
+	if (!write_archive(Stream, &Volumes, Data)) {
+		result = false;
+		goto cleanup;
+	}
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	KCF_create(Stream, &kcf);
+	KCF_set_volumes(kcf, 0, open_volume, &Volumes);
+	Error = KCF_open_archive(kcf);
+	for (i = 0; i < FILES && !Error; i++) {
+		Error = KCF_get_current_file_info(kcf, &Info);
+		if (Error)
+			break;
+		file_info_clear(&Info);
+
+		File      = tmpfile();
+		Extracted = IO_create_fp(File, 1);
+		Error     = KCF_extract(kcf, Extracted);
+		if (!Error && !check_contents(File, Data, i)) {
+			diag("File %d: wrong contents", i);
+			result = false;
+		}
+		IO_close(Extracted);
+	}
+	if (!Error && KCF_get_current_file_info(kcf, &Info) != KCF_ERROR_EOF) {
+		diag("Archive has more files than expected");
+		result = false;
+	}
+	KCF_close(kcf);
+
+	if (Error) {
+		diag("Failed to read archive: Error #%d", Error);
+		result = false;
+	}
+
+cleanup:
+	close_volumes(&Volumes);
+	IO_close(Stream);
+	free(Data);
+	return result;
+}
+
+/*
+ * Threads read the same volume at once (one extracts its files, another
+ * one follows a file into it), so each of them gets its own copy.
+ */
+struct memory_volumes {
+	char *Buffers[MAX_VOLUMES];
+	size_t Sizes[MAX_VOLUMES];
+	int Count;
+};
+
+static IO *open_memory_volume(void *Context, uint32_t Number,
+                              bool ForWriting)
+{
+	struct memory_volumes *Volumes = Context;
+	FILE *File;
+
+	if (ForWriting || Number == 0 || (int)Number > Volumes->Count)
+		return NULL;
+
+	File = fmemopen(Volumes->Buffers[Number], Volumes->Sizes[Number], "rb");
+	if (!File)
+		return NULL;
+
+	return IO_create_fp(File, 1);
+}
+
+struct outputs {
+	FILE *Files[FILES];
+	int Opened;
+	IO_MUTEX Lock;
+};
+
+static IO *open_output(void *Context, const struct KcfFileInfo *Info)
+{
+	struct outputs *Outputs = Context;
+	int i;
+
+	for (i = 0; i < FILES; i++) {
+		if (strcmp(Info->FileName, Names[i]) != 0)
+			continue;
+
+		IO_mutex_lock(&Outputs->Lock);
+		Outputs->Opened++;
+		IO_mutex_unlock(&Outputs->Lock);
+		return IO_create_fp(Outputs->Files[i], 0);
+	}
+
+	return NULL;
+}
+
+bool test22(void)
+{
+	struct volumes Volumes;
+	struct memory_volumes Memory;
+	struct outputs Outputs;
+	uint8_t *Data;
+	IO *Stream;
+	KCFERROR Error;
+	bool result = true;
+	int i;
+
+	memset(&Volumes, 0, sizeof(Volumes));
+	memset(&Memory, 0, sizeof(Memory));
+	memset(&Outputs, 0, sizeof(Outputs));
+	IO_mutex_init(&Outputs.Lock);
+	for (i = 0; i < FILES; i++)
+		Outputs.Files[i] = tmpfile();
+
+	Data   = make_data();
+	Stream = IO_create_fp(tmpfile(), 1);
+
+	if (!write_archive(Stream, &Volumes, Data)) {
+		result = false;
+		goto cleanup;
+	}
+
+	Memory.Count = Volumes.Count;
+	for (i = 1; i <= Volumes.Count; i++) {
+		fseek(Volumes.Files[i], 0, SEEK_END);
+		Memory.Sizes[i]   = ftell(Volumes.Files[i]);
+		Memory.Buffers[i] = malloc(Memory.Sizes[i]);
+		rewind(Volumes.Files[i]);
+		fread(Memory.Buffers[i], 1, Memory.Sizes[i], Volumes.Files[i]);
+	}
+
+	IO_seek(Stream, 0, IO_SEEK_SET);
+	Error = KCF_extract_volumes_parallel(Stream, open_memory_volume,
+	                                     &Memory, open_output, &Outputs, 4);
+	if (Error) {
+		diag("Failed to extract archive: Error #%d", Error);
+		result = false;
+	}
+	if (Outputs.Opened != FILES) {
+		diag("%d files extracted, should be %d", Outputs.Opened, FILES);
+		result = false;
+	}
+
+	for (i = 0; i < FILES && result; i++) {
+		if (!check_contents(Outputs.Files[i], Data, i)) {
+			diag("File %d: wrong contents", i);
+			result = false;
+		}
+	}
+
+cleanup:
+	for (i = 0; i < FILES; i++)
+		fclose(Outputs.Files[i]);
+	for (i = 1; i <= Memory.Count; i++)
+		free(Memory.Buffers[i]);
+	IO_mutex_destroy(&Outputs.Lock);
+	close_volumes(&Volumes);
+	IO_close(Stream);
+	free(Data);
+	return result;
+}
@@ -0,0 +1,382 @@
+#include "tap.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../cmd/kcf/walk.h"
+
+bool test40(void);
+bool test41(void);
+bool test42(void);
+bool test44(void);
+
+/* walk.c prints its errors under the name of the program */
+char *Program = "tests";
+
+/* More files than the walker keeps ahead of the caller */
+#define BIG_DIR_FILES 3000
+
+struct path_list {
+	char **Paths;
+	size_t Count;
+	size_t Capacity;
+};
+
+static bool add_path(struct path_list *List, const char *Path)
+{
+	char **Paths;
+
+	if (List->Count == List->Capacity) {
+		List->Capacity = List->Capacity ? 2 * List->Capacity : 64;
+		Paths = realloc(List->Paths, List->Capacity * sizeof(*Paths));
+		if (!Paths)
+			return false;
+		List->Paths = Paths;
+	}
+
+	List->Paths[List->Count] = strdup(Path);
+	return List->Paths[List->Count++] != NULL;
+}
+
+static void clear_paths(struct path_list *List)
+{
+	size_t i;
+
+	for (i = 0; i < List->Count; i++)
+		free(List->Paths[i]);
+	free(List->Paths);
+	memset(List, 0, sizeof(*List));
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Directory/Name in Path, false if it doesn't fit */
+static bool join(char *Path, size_t Size, const char *Directory,
+                 const char *Name)
+{
+	int Length = snprintf(Path, Size, "%s/%s", Directory, Name);
+
+	return Length >= 0 && (size_t)Length < Size;
+}
+
+static bool make_file(const char *Directory, const char *Name)
+{
+	char Path[512];
+	FILE *File;
+
+	if (!join(Path, sizeof(Path), Directory, Name))
+		return false;
+	File = fopen(Path, "wb");
+	if (!File)
+		return false;
+	fputs(Name, File);
+	return fclose(File) == 0;
+}
+
+static bool make_dir(const char *Directory, const char *Name)
+{
+	char Path[512];
+
+	return join(Path, sizeof(Path), Directory, Name) &&
+	       mkdir(Path, 0755) == 0;
+}
+
+/* Names are created out of order, "e" is empty */
+static bool make_tree(const char *Root)
+{
+	char Path[512], Name[32];
+	bool result;
+	int i;
+
+	result = make_file(Root, "b") && make_dir(Root, "c") &&
+	         make_file(Root, "a") && make_dir(Root, "e") &&
+	         make_dir(Root, "d");
+
+	snprintf(Path, sizeof(Path), "%s/c", Root);
+	result = result && make_file(Path, "z") && make_dir(Path, "x") &&
+	         make_file(Path, "y");
+
+	snprintf(Path, sizeof(Path), "%s/c/x", Root);
+	for (i = 0; result && i < BIG_DIR_FILES; i++) {
+		snprintf(Name, sizeof(Name), "f%d", (i * 7919) % BIG_DIR_FILES);
+		result = make_file(Path, Name);
+	}
+
+	snprintf(Path, sizeof(Path), "%s/d", Root);
+	for (i = 0; result && i < BIG_DIR_FILES; i++) {
+		snprintf(Name, sizeof(Name), "g%d", BIG_DIR_FILES - i);
+		result = make_file(Path, Name);
+	}
+
+	return result;
+}
+
+/* Everything under Directory by name, each directory before its contents */
+static bool list_tree(const char *Directory, struct path_list *List)
+{
+	struct path_list Names = {0};
+	struct dirent *de;
+	struct stat st;
+	char *Path;
+	bool result = true;
+	size_t i;
+	DIR *d;
+
+	d = opendir(Directory);
+	if (!d)
+		return false;
+	while (result && (de = readdir(d))) {
+		if (strcmp(de->d_name, ".") != 0 &&
+		    strcmp(de->d_name, "..") != 0)
+			result = add_path(&Names, de->d_name);
+	}
+	closedir(d);
+
+	if (Names.Count)
+		qsort(Names.Paths, Names.Count, sizeof(char *), compare_paths);
+
+	for (i = 0; result && i < Names.Count; i++) {
+		Path = malloc(strlen(Directory) + strlen(Names.Paths[i]) + 2);
+		if (!Path) {
+			result = false;
+			break;
+		}
+		sprintf(Path, "%s/%s", Directory, Names.Paths[i]);
+		result = add_path(List, Path) && stat(Path, &st) == 0;
+		if (result && S_ISDIR(st.st_mode))
+			result = list_tree(Path, List);
+		free(Path);
+	}
+
+	clear_paths(&Names);
+	return result;
+}
+
+/* Removes what list_tree() has found, contents before directories */
+static void remove_tree(const char *Root, struct path_list *List)
+{
+	size_t i;
+
+	for (i = List->Count; i > 0; i--)
+		remove(List->Paths[i - 1]);
+	rmdir(Root);
+}
+
+static bool walk_tree(const char *Root, int Threads, enum walk_order Order,
+                      struct path_list *List, int *Errors)
+{
+	struct walk_entry Entry;
+	struct walker *Walker;
+	bool result = true;
+
+	Walker = walk_start(Root, Threads, Order);
+	if (!Walker) {
+		diag("Failed to start walking %s", Root);
+		return false;
+	}
+
+	while (walk_next(Walker, &Entry)) {
+		result = result && add_path(List, Entry.Path);
+		free(Entry.Path);
+	}
+
+	*Errors = walk_finish(Walker);
+	return result;
+}
+
+static bool same_paths(const struct path_list *Found,
+                       const struct path_list *Expected)
+{
+	size_t i;
+
+	for (i = 0; i < Found->Count && i < Expected->Count; i++) {
+		if (strcmp(Found->Paths[i], Expected->Paths[i]) != 0) {
+			diag("Entry %d is %s, should be %s", (int)i,
+			     Found->Paths[i], Expected->Paths[i]);
+			return false;
+		}
+	}
+
+	if (Found->Count != Expected->Count) {
+		diag("%d entries found, should be %d", (int)Found->Count,
+		     (int)Expected->Count);
+		return false;
+	}
+
+	return true;
+}
+
+/* Walks a new tree in the given order with 1 and 8 threads */
+static bool check_order(enum walk_order Order)
+{
+	static const int Threads[] = {1, 8, 8};
+	struct path_list Expected = {0}, Found = {0};
+	char Root[] = "/tmp/kcf-walk-XXXXXX";
+	bool result;
+	int Errors = 0;
+	size_t i;
+
+	if (!mkdtemp(Root)) {
+		diag("Failed to create temporary directory");
+		return false;
+	}
+
+	result = make_tree(Root) && list_tree(Root, &Expected);
+	if (!result)
+		diag("Failed to create tree under %s", Root);
+
+	for (i = 0; result && i < sizeof(Threads) / sizeof(Threads[0]); i++) {
+		result = walk_tree(Root, Threads[i], Order, &Found, &Errors);
+		if (result && Errors) {
+			diag("%d errors with %d threads", Errors, Threads[i]);
+			result = false;
+		}
+
+		/* Found order differs from run to run */
+		if (result && Order == WALK_FOUND) {
+			qsort(Found.Paths, Found.Count, sizeof(char *),
+			      compare_paths);
+			qsort(Expected.Paths, Expected.Count, sizeof(char *),
+			      compare_paths);
+		}
+		result = result && same_paths(&Found, &Expected);
+		clear_paths(&Found);
+	}
+
+	remove_tree(Root, &Expected);
+	clear_paths(&Expected);
+	return result;
+}
+
+bool test40(void)
+{
+	return check_order(WALK_SORTED);
+}
+
+bool test41(void)
+{
+	return check_order(WALK_FOUND);
+}
+
+bool test42(void)
+{
+	static const enum walk_order Orders[] = {WALK_SORTED, WALK_FOUND};
+	struct path_list Found = {0};
+	char Root[] = "/tmp/kcf-walk-XXXXXX";
+	char Missing[sizeof(Root) + 16], File[sizeof(Root) + 16];
+	bool result = true;
+	int Errors  = 0;
+	size_t i;
+
+	if (!mkdtemp(Root)) {
+		diag("Failed to create temporary directory");
+		return false;
+	}
+	snprintf(Missing, sizeof(Missing), "%s/missing", Root);
+	snprintf(File, sizeof(File), "%s/file", Root);
+	if (!make_file(Root, "file")) {
+		diag("Failed to create %s", File);
+		rmdir(Root);
+		return false;
+	}
+
+	/* Neither can be listed, so each is one error and no entries */
+	for (i = 0; result && i < 2; i++) {
+		result = walk_tree(Missing, 4, Orders[i], &Found, &Errors) &&
+		         Errors == 1 && Found.Count == 0;
+		if (result)
+			result = walk_tree(File, 4, Orders[i], &Found,
+			                   &Errors) &&
+			         Errors == 1 && Found.Count == 0;
+		if (!result)
+			diag("Order %d: %d errors, %d entries", (int)Orders[i],
+			     Errors, (int)Found.Count);
+		clear_paths(&Found);
+	}
+
+	remove(File);
+	rmdir(Root);
+	return result;
+}
+
+/* Appends the entries under Path, and Path itself, to Entries */
+static bool add_input(const char *Path, struct walk_entry **Entries,
+                      size_t *Count, size_t Capacity)
+{
+	struct walk_entry Entry;
+	struct walker *Walker;
+	bool result = true;
+
+	if (!walk_stat(Path, &Entry) || *Count == Capacity)
+		return false;
+	Entry.Path = strdup(Path);
+	(*Entries)[(*Count)++] = Entry;
+	if (!Entry.Path || !Entry.IsDirectory)
+		return Entry.Path != NULL;
+
+	Walker = walk_start(Path, 4, WALK_FOUND);
+	if (!Walker)
+		return false;
+	while (walk_next(Walker, &Entry)) {
+		if (result && *Count < Capacity)
+			(*Entries)[(*Count)++] = Entry;
+		else
+			free(Entry.Path);
+		result = result && *Count < Capacity;
+	}
+	return walk_finish(Walker) == 0 && result;
+}
+
+bool test44(void)
+{
+	struct path_list Tree = {0}, Expected = {0}, Found = {0};
+	struct walk_entry *Entries;
+	char Root[] = "/tmp/kcf-walk-XXXXXX";
+	char Inputs[4][sizeof(Root) + 16];
+	size_t i, Count = 0, Capacity = 4 * BIG_DIR_FILES;
+	bool result;
+
+	if (!mkdtemp(Root)) {
+		diag("Failed to create temporary directory");
+		return false;
+	}
+	Entries = malloc(Capacity * sizeof(*Entries));
+
+	/* As in "kcf u a.kcf dir dir/c dir/a dir/a" */
+	snprintf(Inputs[0], sizeof(Inputs[0]), "%s", Root);
+	snprintf(Inputs[1], sizeof(Inputs[1]), "%s/c", Root);
+	snprintf(Inputs[2], sizeof(Inputs[2]), "%s/a", Root);
+	snprintf(Inputs[3], sizeof(Inputs[3]), "%s/a", Root);
+	result = Entries && make_tree(Root) && list_tree(Root, &Tree) &&
+	         list_tree(Root, &Expected) && add_path(&Expected, Root);
+	for (i = 0; result && i < 4; i++)
+		result = add_input(Inputs[i], &Entries, &Count, Capacity);
+	if (!result)
+		diag("Failed to walk tree under %s", Root);
+
+	if (result) {
+		Count = walk_unique(Entries, Count);
+		for (i = 0; result && i < Count; i++)
+			result = add_path(&Found, Entries[i].Path);
+		qsort(Expected.Paths, Expected.Count, sizeof(char *),
+		      compare_paths);
+		result = result && same_paths(&Found, &Expected);
+	}
+
+	for (i = 0; i < Count; i++)
+		free(Entries[i].Path);
+	free(Entries);
+	clear_paths(&Found);
+	clear_paths(&Expected);
+	remove_tree(Root, &Tree);
+	clear_paths(&Tree);
+	return result;
+}
@@ -1,10 +1,15 @@
 add_defines("_FILE_OFFSET_BITS=64")
 
+add_requires("zlib")
+
 target("io")
 	set_kind("static")
 	add_files("io/*.c")
 	add_headerfiles("include/(io/*.h)")
 	add_includedirs("include", {public = true})
+	if not is_plat("windows") then
+		add_syslinks("pthread", {public = true})
+	end
 
 target("kcflib")
 	set_kind("static")
@@ -12,6 +17,7 @@ target("kcflib")
 	add_headerfiles("include/(kcf/*.h)")
 	add_includedirs("include", {public = true})
 	add_deps("io")
+	add_packages("zlib", {public = true})
 
 target("kcf")
 	set_kind("binary")